@@ -28,255 +28,5630 @@
  */
 
 #include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <time.h>
+#ifdef CMD3_USDT
+#include <sys/sdt.h>
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "cmd3.h"
+#include "cmd3_rcu.h"
+
+struct cmd3_ctx;
+
+/* The hash tables are allocated through the allocator of the context being modified. */
+static __thread struct cmd3_ctx *cmd_hash_ctx;
+
+static void *cmdtree_mem_alloc(struct cmd3_ctx *ctx, size_t size);
+static void  cmdtree_mem_free(struct cmd3_ctx *ctx, void *ptr, size_t size);
+
+#define uthash_malloc(sz)		cmdtree_mem_alloc(cmd_hash_ctx, sz)
+#define uthash_free(ptr, sz)	cmdtree_mem_free(cmd_hash_ctx, ptr, sz)
+
 #include "uthash.h"
 
-#define CMD_NAME_MAX_LENGTH 	32		// Command tree 'name' attribute maximum size
-#define CMD_COMMENT_MAX_LENGTH 	80		// Command tree 'comment' attribute maximum size
+#define CMD_TERMINATING_CHAR_LEN 1
+
+#define CMD_ARGS_SMALL_SIZE 		512		// Handler argument strings copied on the stack, up to this size
+#define CMD_SCHEMA_SMALL_ARGS 		8		// Parsed handler arguments kept on the stack, up to this count
+#define CMD_OUT_STAGING_SIZE 		4096	// Sink output staging buffer size, kept on the stack
+#define CMD_CHAIN_CHUNK_SIZE 		4096	// Default output chain chunk size
+#define CMD_CHAIN_IOV_MAX 			64		// Chain chunks handed to a single writev()
+#define CMD_HELP_NAME_WIDTH 		20		// Help row name column width, longer names push the comment
+#define CMD_HELP_GAP 				2		// Help row spaces between the name and the comment
+#define CMD_STATS_BUCKETS 			32		// Latency histogram log2 buckets, in ns, the last one takes the rest
+#define CMD_STATS_TOP_DEFAULT 		10		// Cmds listed by the stats cmds, unless given
+#define CMD_SLOWLOG_LINE_SIZE 		128		// Slow log cmd line bytes kept, longer lines are cut off
+#define CMD_SLOWLOG_GET_DEFAULT 	10		// Slow log entries listed, unless given
+#define CMD_EXEC_TASKS_PER_THREAD 	4		// Parallel batch tasks per executor thread, the spare ones balance the load
+#define CMD_EXEC_RUN_MAX 			65536	// Independent script cmds handed to the executor at once
+#define CMD_CACHE_LINE_SIZE 		64
+#define CMD_BROADCAST_SMALL 		32		// Broadcast cmds resolved on the stack, up to this count
+#define CMD_PATH_SIZE 				256		// Broadcast header path bytes, longer paths are cut off
+
+#define CMD_ARENA_ALIGN 			16		// Arena allocation alignment and size class granularity
+#define CMD_ARENA_SMALL_MAX 		512		// Arena allocations above this size get a dedicated block
+#define CMD_ARENA_BLOCK_SIZE_MIN 	4096	// Arena minimal block size
+
+// Command tree node command functions, at most one of them is set
+struct cmdtree_handler
+{
+	cmdtree_cmdfunc	cmdfunc;		// Optional command function
+	cmdtree_cmdfunc_ud	cmdfunc_ud;		// Optional command function, with user data
+	cmdtree_cmdfunc_typed cmdfunc_typed;	// Optional command function, with parsed arguments
+	cmdtree_cmdfunc_out cmdfunc_out;		// Optional command function, streaming its output
+	const struct cmdtree_schema *schema;	// Optional argument schema, owned by the live node
+	int 				independent;	// The cmd may run concurrently with other cmds
+	int 				async;			// The cmd may block, cmdtree_exec_async() queues it
+	struct cmdtree 	   *node;			// The live node of the cmd, for tracing
+#ifdef CMD3_STATS
+	struct cmdtree_counters *stats;		// Dispatch counters, owned by the live node
+#endif
+};
+
+#ifdef CMD3_STATS
+// Cmd dispatch counters, updated with relaxed atomics by the concurrent callers
+struct cmdtree_counters
+{
+	uint64_t	calls;						// Calls
+	uint64_t	errors;						// Calls returning <= 0, or rejected by the argument schema
+	uint64_t	time_ns;					// Total call time
+	uint64_t	hist[CMD_STATS_BUCKETS];	// Calls per latency bucket, bucket i counts [2^i, 2^(i+1)) ns
+};
+#endif
+
+/*
+ * Slow log entry, guarded by a sequence number: a writer owns the entry while it is odd,
+ * readers copy the entry and drop the copy if the sequence number changed meanwhile.
+ */
+struct cmdtree_slowlog_entry
+{
+	uint64_t	seq;							// (id + 1) * 2 once written, odd while written, 0 if never used
+	uint64_t	time_us;						// Unix time the cmd started at
+	uint64_t	duration_us;					// Cmd duration
+	uint64_t	output_len;						// Cmd output length
+	uint32_t	line_len;						// Cmd line length, including the bytes cut off
+	char		line[CMD_SLOWLOG_LINE_SIZE];	// Cmd line, space separated and cut off
+};
+
+// Slow log, a fixed size ring of the latest cmds over the threshold, filled without locks
+struct cmdtree_slowlog
+{
+	uint64_t	threshold_ns;					// Cmds taking at least this long are logged
+	uint64_t	next;							// Next entry id
+	uint64_t	reset;							// Entries below this id were cleared
+	size_t		size;							// Number of entries
+	struct cmdtree_slowlog_entry entries[];
+};
+
+// Command tree node structure, the fields used by the lookup walk come first
+struct cmdtree
+{
+	char 		 		*name;			// Command tree name
+	uint32_t			 name_len;		// Command tree name length
+	struct cmdtree_level *level;	// Command tree children, as published to readers
+	struct cmdtree *child;			// Command tree child node pointer
+
+	struct cmdtree_handler *handler;	// Command tree optional command function and argument schema
+	char 		 		*comment;		// Command tree comment
+	uint32_t			 comment_len;	// Command tree comment length
+	struct cmd3_ctx *ctx;			// Command tree context the node belongs to
+	struct cmdtree *parent;			// Command tree parent node pointer
+
+	UT_hash_handle 		hh; 			// Makes this structure hashable
+};
+
+/* The lookup walk only touches the leading fields, they share the first cache line. */
+_Static_assert(offsetof(struct cmdtree, handler) <= CMD_CACHE_LINE_SIZE, "struct cmdtree lookup fields exceed a cache line");
+
+// A node allocation, the handler is kept past the node fields
+struct cmdtree_node_block
+{
+	struct cmdtree		   node;
+	struct cmdtree_handler handler;
+};
+
+/*
+ * Sorted index entry of a level or image child range.
+ * The leading name bytes are kept in the entry, most comparisons of a binary search
+ * are settled without touching the node or the name.
+ */
+struct cmdtree_key
+{
+	uint64_t	 prefix;		// The leading name bytes, big endian and zero padded
+	uint32_t	 index;			// The node index
+	uint32_t	 len;			// The name length
+	const char	*name;			// The name
+};
+
+#define CMD_KEY_PREFIX_LEN	sizeof(uint64_t)
+
+// Compiled schema argument, enum values are matched through their sorted keys
+struct cmdtree_schema_arg
+{
+	cmdtree_arg_schema_t spec;			// The argument description, as given on creation
+	uint32_t			 enum_count;	// Number of enum values
+	struct cmdtree_key	*enum_keys;		// Enum value keys sorted by name, indexed by enum_values position
+};
+
+// Compiled argument schema, a single allocation
+struct cmdtree_schema
+{
+	size_t				 size;			// The allocation size
+	int					 count;			// Number of arguments
+	int					 required;		// Number of leading non optional arguments
+	struct cmdtree_schema_arg args[];
+};
+
+// Output chain chunk
+struct cmdtree_chunk
+{
+	struct cmdtree_chunk *next;		// Next chunk in the chain or the pool
+	size_t				  len;		// Bytes held
+	char				  data[];	// Chunk data, with room for a terminating char past the chunk size
+};
+
+// Output chain, cmd output kept in chunks until it is written out
+struct cmdtree_chain
+{
+	size_t				  chunk_size;	// Chunk data capacity
+	size_t				  len;			// Bytes held, not yet consumed
+	size_t				  offset;		// Bytes of the head chunk already consumed
+	struct cmdtree_chunk *head;			// The first chunk holding output
+	struct cmdtree_chunk *tail;			// The last chunk, being filled
+	struct cmdtree_chunk *pool;			// Free chunks, reused by the following cmds
+};
+
+/*
+ * Cmd output, staged in a buffer and flushed to a sink, or written in place into a chain.
+ * Without a sink or a chain the buffer is the caller one, output past its size is truncated.
+ */
+struct cmdtree_out
+{
+	char				 *buf;		// Staging buffer, with room for a terminating char past size
+	size_t				  size;		// Staging buffer capacity
+	size_t				  used;		// Staged bytes
+	size_t				  total;	// Bytes output so far, staged or flushed
+	const cmdtree_sink_t *sink;		// The sink, NULL for a caller buffer
+	struct cmdtree_chain *chain;	// The chain, its tail chunk room is the staging buffer
+	int					  error;	// A sink write or a chunk allocation failed, further output is dropped
+	int					  called;	// A cmd function was called, the output is not a usage report
+	struct cmd3_ctx		 *ctx;		// The context of the cmd being called
+	struct cmdtree		 *cmd;		// The cmd being called, for tracing
+};
+
+/*
+ * Command tree level, the children of a node as seen by cmdtree_exec().
+ * A level is never modified once published, writers publish a modified copy
+ * and retire the previous one.
+ */
+struct cmdtree_level
+{
+	uint32_t			 count;		// Number of nodes
+	struct cmdtree_key	*sorted;	// Node keys sorted by name
+	struct cmdtree_help *help;		// Rendered help text, built on first use and released with the level
+	cmdtree_d			 nodes[];	// Nodes in creation order
+};
+
+// Rendered help text of a level, one row per node in creation order
+struct cmdtree_help
+{
+	size_t				 len;		// The text length
+	char				*text;		// The text, following the row offsets
+	size_t				 row_end[];	// Text offset past each row
+};
+
+// Frozen command tree image node, children are referenced as an index range
+struct cmdtree_image_node
+{
+	uint32_t			name;			// Name offset in the image string table
+	uint32_t			comment;		// Comment offset in the image string table
+	uint32_t			name_len;		// Name length
+	uint32_t			comment_len;	// Comment length
+	uint32_t			child_first;	// Index of the first child node
+	uint32_t			child_count;	// Number of child nodes
+	struct cmdtree_handler handler;		// Command tree optional command function and argument schema
+};
+
+// Frozen command tree image, a single read-only memory block
+struct cmdtree_image
+{
+	uint32_t					 node_count;	// Number of nodes, including the virtual root
+	struct cmdtree_image_node	*nodes;			// Nodes in breadth-first order, nodes[0] is the virtual root
+	struct cmdtree_key			*sorted;		// Per child range, the node keys sorted by name
+	char						*strings;		// String table, the names followed by the comments
+};
+
+// Command line arguments, as C strings or as length delimited tokens
+struct cmdtree_args
+{
+	int 					 argc;		// Number of arguments
+	const char 				**argv;		// The arguments as C strings, NULL when given as tokens
+	const cmdtree_token_t	*tokens;	// The arguments as tokens
+};
+
+// Bulk creation parent path, resolved once per distinct path
+struct cmdtree_bulk_path
+{
+	const char 			*path;			// The parent path, as given in the configurations
+	uint32_t			 count;			// Number of configurations with this parent path
+	uint32_t			 added;			// Number of nodes added under this parent path
+	int 				 resolved;		// The parent was resolved
+	cmdtree_d 			 parent;		// The resolved parent node
+
+	UT_hash_handle 		hh; 			// Makes this structure hashable
+};
+
+// Bulk creation level, the nodes added under one parent
+struct cmdtree_bulk_level
+{
+	cmdtree_d 			 parent;		// The level parent node, NULL for the root level
+	uint32_t			 added;			// Number of nodes added to the level
+	uint32_t			 filled;		// Number of nodes filled in the new level
+	struct cmdtree_level *level;		// The new level, published once all the new levels are built
+
+	UT_hash_handle 		hh; 			// Makes this structure hashable
+};
+
+// Arena block header, small allocations are carved from blocks and large ones get a dedicated block
+struct cmdtree_arena_block
+{
+	struct cmdtree_arena_block *next;	// Next block in the list
+	struct cmdtree_arena_block *prev;	// Previous block in the list (dedicated blocks only)
+	size_t 						size;	// Block usable size
+};
+
+// Arena allocator
+struct cmdtree_arena
+{
+	size_t 						 block_size;	// Size of the blocks small allocations are carved from
+	struct cmdtree_arena_block	*blocks;		// Small allocations blocks, the head is the current one
+	size_t 						 block_used;	// Bytes used from the current block
+	struct cmdtree_arena_block	*large;			// Dedicated blocks of large allocations
+	void 						*free_list[CMD_ARENA_SMALL_MAX / CMD_ARENA_ALIGN];	// Freed small allocations, per size class
+};
+
+#define CMD_ARENA_HDR_SIZE	((sizeof(struct cmdtree_arena_block) + CMD_ARENA_ALIGN - 1) & ~(size_t)(CMD_ARENA_ALIGN - 1))
+
+static void *cmdtree_heap_alloc(void *arg, size_t size);
+static void  cmdtree_heap_free(void *arg, void *ptr, size_t size);
+
+static const cmdtree_allocator_t cmd_heap_allocator = { cmdtree_heap_alloc, cmdtree_heap_free, NULL, NULL };
+
+// Command tree context, owning a whole command tree
+struct cmd3_ctx
+{
+	cmdtree_d 				 root;		// Command tree root node
+	cmdtree_allocator_t 	 allocator;	// Command tree allocator
+	struct cmdtree_image	*image;		// Frozen command tree image
+	void 					*user_data;	// Opaque user data, passed to cmdtree_cmdfunc_ud functions
+	int 					 exact_match;	// Cmd names are matched exactly, no unique prefix matching
+
+	struct cmdtree_level	*level;		// Command tree root level, as published to readers
+	pthread_mutex_t 		 lock;		// Serializes the writers
+	struct cmd3_rcu_list 	 retired;	// Objects retired by the writers, pending release
+	unsigned long 			 helps;		// Help texts cached by the levels
+	struct cmdtree_slowlog	*slowlog;	// Optional slow cmds log
+	struct cmdtree_executor *executor;	// Optional, runs the broadcast cmds concurrently
+	pthread_cond_t 			 async_cond;	// Signals the last pending async cmd done
+	size_t 					 async;		// Async cmds queued or running, protected by the lock
+};
+
+static struct cmd3_ctx cmd_default_ctx = { NULL, { cmdtree_heap_alloc, cmdtree_heap_free, NULL, NULL }, NULL, NULL, 0,
+										   NULL, PTHREAD_MUTEX_INITIALIZER, { NULL }, 0, NULL, NULL,
+										   PTHREAD_COND_INITIALIZER, 0 };
+
+/* Trace hooks, shared by all the contexts. */
+static const cmdtree_trace_t *cmd_trace;
+
+#ifdef CMD3_USDT
+static inline const char *cmdtree_trace_name(const struct cmdtree *cmd)
+{
+	return cmd ? cmd->name : NULL;
+}
+
+#define CMD_TRACEPOINT(probe, stage, cmd, bytes) 	DTRACE_PROBE3(cmd3, probe, (int)(stage), cmdtree_trace_name(cmd), (size_t)(bytes))
+#else
+#define CMD_TRACEPOINT(probe, stage, cmd, bytes)
+#endif
+
+/* Call the trace hook of a stage begin or end, the byte count is evaluated only when traced. */
+#define CMD_TRACE(hook, stage, cmd, bytes) 												\
+	do 																					\
+	{																					\
+		const cmdtree_trace_t *trace_ = __atomic_load_n(&cmd_trace, __ATOMIC_ACQUIRE);	\
+																						\
+		CMD_TRACEPOINT(stage_##hook, stage, cmd, bytes);								\
+		if(trace_ && trace_->hook)														\
+			cmdtree_trace_call(trace_->hook, trace_->arg, stage, cmd, bytes);			\
+	} while(0)
+
+static void cmdtree_trace_call(cmdtree_trace_hook hook, void *arg, cmdtree_trace_stage_t stage,
+							   const struct cmdtree *cmd, size_t bytes)
+{
+	cmdtree_trace_event_t event = { stage, (cmdtree_d)cmd, bytes };
+
+	hook(arg, &event);
+}
+
+static int   cmdtree_report_tree(const struct cmdtree_level *level, struct cmdtree_out *out);
+static int   cmdtree_report_ambiguous(const struct cmdtree_level *level, const char *name, size_t len,
+									  uint32_t first, uint32_t count, struct cmdtree_out *out);
+static cmdtree_d cmdtree_lookup(cmd3_ctx_d ctx, const char *cmd_base_name);
+static void  cmdtree_destroy_locked(cmdtree_d cmdtree);
+static int   cmdtree_image_exec(cmd3_ctx_d ctx, const struct cmdtree_image *image, const struct cmdtree_args *args, struct cmdtree_out *out);
+static int   cmdtree_broadcast(cmd3_ctx_d ctx, const struct cmdtree_level *level, const struct cmdtree_args *args, int pos,
+							   struct cmdtree_out *out);
+static int   cmdtree_image_broadcast(cmd3_ctx_d ctx, const struct cmdtree_image *image, const struct cmdtree_image_node *parent,
+									 const struct cmdtree_args *args, int pos, struct cmdtree_out *out);
+
+
+static void *cmdtree_heap_alloc(void *arg, size_t size)
+{
+	(void)arg;
+
+	return malloc(size);
+}
+
+static void cmdtree_heap_free(void *arg, void *ptr, size_t size)
+{
+	(void)arg;
+	(void)size;
+
+	free(ptr);
+}
+
+static void *cmdtree_mem_alloc(struct cmd3_ctx *ctx, size_t size)
+{
+	return ctx->allocator.alloc(ctx->allocator.arg, size);
+}
+
+static void cmdtree_mem_free(struct cmd3_ctx *ctx, void *ptr, size_t size)
+{
+	if(ctx->allocator.free)
+		ctx->allocator.free(ctx->allocator.arg, ptr, size);
+}
+
+static char *cmdtree_mem_strdup(struct cmd3_ctx *ctx, const char *string)
+{
+	size_t size = strlen(string) + CMD_TERMINATING_CHAR_LEN;
+	char *dup;
+
+	dup = cmdtree_mem_alloc(ctx, size);
+	if(dup)
+		memcpy(dup, string, size);
+
+	return dup;
+}
+
+static void cmdtree_mem_strfree(struct cmd3_ctx *ctx, char *string)
+{
+	if(string)
+		cmdtree_mem_free(ctx, string, strlen(string) + CMD_TERMINATING_CHAR_LEN);
+}
+
+static struct cmdtree_schema *cmdtree_schema_compile(struct cmd3_ctx *ctx, const cmdtree_arg_schema_t *args, int arg_count);
+
+static int cmdtree_handler_set(const struct cmdtree_handler *handler)
+{
+	return NULL != handler->cmdfunc || NULL != handler->cmdfunc_ud || NULL != handler->cmdfunc_typed ||
+		   NULL != handler->cmdfunc_out;
+}
+
+static void cmdtree_node_free(cmdtree_d cmdtree)
+{
+	struct cmd3_ctx *ctx = cmdtree->ctx;
+
+#ifdef CMD3_STATS
+	if(cmdtree->handler->stats)
+		cmdtree_mem_free(ctx, cmdtree->handler->stats, sizeof(struct cmdtree_counters));
+#endif
+	if(cmdtree->handler->schema)
+		cmdtree_mem_free(ctx, (void *)cmdtree->handler->schema, cmdtree->handler->schema->size);
+	cmdtree_mem_strfree(ctx, cmdtree->name);
+	cmdtree_mem_strfree(ctx, cmdtree->comment);
+	cmdtree_mem_free(ctx, cmdtree, sizeof(struct cmdtree_node_block));
+}
+
+static cmdtree_d cmdtree_node_alloc(struct cmd3_ctx *ctx, cmdtree_d parent, const cmdtree_config_t *config)
+{
+	struct cmdtree_node_block *block;
+	cmdtree_d cmdtree;
+
+	block = cmdtree_mem_alloc(ctx, sizeof(struct cmdtree_node_block));
+	if(NULL == block)
+	    return NULL;
+
+	memset(block, 0, sizeof(struct cmdtree_node_block));
+	cmdtree = &block->node;
+	cmdtree->handler = &block->handler;
+	cmdtree->ctx     = ctx;
+	cmdtree->parent  = parent;
+
+	cmdtree->name    = cmdtree_mem_strdup(ctx, config->name);
+	cmdtree->comment = cmdtree_mem_strdup(ctx, config->comment ? config->comment : "");
+	if(NULL == cmdtree->name || NULL == cmdtree->comment)
+	{
+		cmdtree_node_free(cmdtree);
+		return NULL;
+	}
+
+	cmdtree->name_len    = strlen(cmdtree->name);
+	cmdtree->comment_len = strlen(cmdtree->comment);
+
+	cmdtree->handler->cmdfunc       = config->cmdfunc;
+	cmdtree->handler->cmdfunc_ud    = config->cmdfunc_ud;
+	cmdtree->handler->cmdfunc_typed = config->cmdfunc_typed;
+	cmdtree->handler->cmdfunc_out   = config->cmdfunc_out;
+	cmdtree->handler->independent   = config->independent;
+	cmdtree->handler->async         = config->async;
+	cmdtree->handler->node          = cmdtree;
+
+	if(config->args && config->arg_count > 0)
+	{
+		cmdtree->handler->schema = cmdtree_schema_compile(ctx, config->args, config->arg_count);
+		if(NULL == cmdtree->handler->schema)
+		{
+			cmdtree_node_free(cmdtree);
+			return NULL;
+		}
+	}
+
+#ifdef CMD3_STATS
+	if(cmdtree_handler_set(cmdtree->handler))
+	{
+		cmdtree->handler->stats = cmdtree_mem_alloc(ctx, sizeof(struct cmdtree_counters));
+		if(NULL == cmdtree->handler->stats)
+		{
+			cmdtree_node_free(cmdtree);
+			return NULL;
+		}
+
+		memset(cmdtree->handler->stats, 0, sizeof(struct cmdtree_counters));
+	}
+#endif
+
+	return cmdtree;
+}
+
+static void cmdtree_node_release(void *arg, void *ptr)
+{
+	(void)arg;
+
+	cmdtree_node_free(ptr);
+}
+
+static size_t cmdtree_level_size(uint32_t count)
+{
+	return sizeof(struct cmdtree_level) + count * (sizeof(cmdtree_d) + sizeof(struct cmdtree_key));
+}
+
+static struct cmdtree_level *cmdtree_level_alloc(struct cmd3_ctx *ctx, uint32_t count)
+{
+	struct cmdtree_level *level;
+
+	level = cmdtree_mem_alloc(ctx, cmdtree_level_size(count));
+	if(NULL == level)
+		return NULL;
+
+	level->count  = count;
+	level->sorted = (struct cmdtree_key *)&level->nodes[count];
+	level->help   = NULL;
+
+	return level;
+}
+
+static void cmdtree_level_free(struct cmd3_ctx *ctx, struct cmdtree_level *level)
+{
+	if(NULL == level)
+		return;
+
+	/* The help text is built by readers, it is heap allocated rather than through the context allocator. */
+	if(level->help)
+	{
+		__atomic_fetch_sub(&ctx->helps, 1, __ATOMIC_RELAXED);
+		free(level->help);
+	}
+
+	cmdtree_mem_free(ctx, level, cmdtree_level_size(level->count));
+}
+
+static void cmdtree_level_release(void *arg, void *ptr)
+{
+	cmdtree_level_free(arg, ptr);
+}
+
+static uint64_t cmdtree_key_prefix(const char *name, size_t len)
+{
+	uint64_t prefix = 0;
+	size_t i;
+
+	for(i = 0; i < CMD_KEY_PREFIX_LEN; i++)
+	{
+		prefix = (prefix << 8) | (i < len ? (unsigned char)name[i] : 0);
+	}
+
+	return prefix;
+}
+
+static void cmdtree_key_set(struct cmdtree_key *key, const char *name, size_t len, uint32_t index)
+{
+	key->prefix = cmdtree_key_prefix(name, len);
+	key->index  = index;
+	key->len    = len;
+	key->name   = name;
+}
+
+/*
+ * The strcmp() order of the key name and the name, given with its length and key prefix.
+ * The name is length delimited, it needs no terminating char.
+ */
+static int cmdtree_key_cmp(const struct cmdtree_key *key, uint64_t prefix, const char *name, size_t len)
+{
+	int cmp;
+
+	if(key->prefix != prefix)
+		return key->prefix < prefix ? -1 : 1;
+
+	/* Equal prefixes with a name shorter than the prefix, both names end at the same place. */
+	if(key->len < CMD_KEY_PREFIX_LEN)
+		return 0;
+
+	cmp = memcmp(key->name + CMD_KEY_PREFIX_LEN, name + CMD_KEY_PREFIX_LEN,
+				 (key->len < len ? key->len : len) - CMD_KEY_PREFIX_LEN);
+	if(cmp)
+		return cmp;
+
+	return (key->len > len) - (key->len < len);
+}
+
+/* The strncmp() order of the key name and the length delimited name, with len as the limit. */
+static int cmdtree_key_ncmp(const struct cmdtree_key *key, uint64_t prefix, const char *name, size_t len)
+{
+	uint64_t mask = len < CMD_KEY_PREFIX_LEN ? ~(~(uint64_t)0 >> (8 * len)) : ~(uint64_t)0;
+	int cmp;
+
+	if((key->prefix & mask) != (prefix & mask))
+		return (key->prefix & mask) < (prefix & mask) ? -1 : 1;
+
+	if(len <= CMD_KEY_PREFIX_LEN || key->len < CMD_KEY_PREFIX_LEN)
+		return 0;
+
+	cmp = memcmp(key->name + CMD_KEY_PREFIX_LEN, name + CMD_KEY_PREFIX_LEN,
+				 (key->len < len ? key->len : len) - CMD_KEY_PREFIX_LEN);
+	if(cmp)
+		return cmp;
+
+	return key->len < len ? -1 : 0;
+}
+
+/* Key comparison by name, used to sort a level or an image child range. */
+static int cmdtree_key_sort_cmp(const void *a, const void *b)
+{
+	const struct cmdtree_key *key_a = a;
+	const struct cmdtree_key *key_b = b;
+
+	return cmdtree_key_cmp(key_a, key_b->prefix, key_b->name, key_b->len);
+}
+
+/* Position of the name in the sorted keys, the first key not lower than it. */
+static uint32_t cmdtree_key_lower_bound(const struct cmdtree_key *keys, uint32_t count,
+										const char *name, size_t len, uint64_t prefix)
+{
+	uint32_t low  = 0;
+	uint32_t high = count;
+
+	while(low < high)
+	{
+		uint32_t mid = low + (high - low) / 2;
+
+		if(cmdtree_key_cmp(&keys[mid], prefix, name, len) < 0)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return low;
+}
+
+/* Position of the first key past the ones prefixed by the name, starting from its lower bound. */
+static uint32_t cmdtree_key_prefix_end(const struct cmdtree_key *keys, uint32_t count,
+									   const char *name, size_t len, uint64_t prefix, uint32_t low)
+{
+	uint32_t high = count;
+
+	while(low < high)
+	{
+		uint32_t mid = low + (high - low) / 2;
+
+		if(cmdtree_key_ncmp(&keys[mid], prefix, name, len) <= 0)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return low;
+}
+
+/*
+ * Match a name in the sorted keys: an exact cmd name or, unless exact matching is requested,
+ * a prefix of a single cmd name. The range of the keys prefixed by the name is returned
+ * through first/count, reporting the candidates of an ambiguous prefix.
+ */
+static const struct cmdtree_key *cmdtree_key_match(const struct cmdtree_key *keys, uint32_t key_count,
+												   const char *name, size_t len, int exact,
+												   uint32_t *first, uint32_t *count)
+{
+	uint64_t prefix = cmdtree_key_prefix(name, len);
+	uint32_t pos;
+
+	pos = cmdtree_key_lower_bound(keys, key_count, name, len, prefix);
+	*first = pos;
+	*count = cmdtree_key_prefix_end(keys, key_count, name, len, prefix, pos) - pos;
+
+	if(0 == *count)
+		return NULL;
+
+	/* An exact match sorts first among the names it prefixes. */
+	if(keys[pos].len == len || (!exact && 1 == *count))
+		return &keys[pos];
+
+	return NULL;
+}
+
+/* The buffer holds a terminating char past the output, callers reject a zero size buffer. */
+static void cmdtree_out_init(struct cmdtree_out *out, char *buf, size_t buf_size, const cmdtree_sink_t *sink)
+{
+	out->buf   = buf;
+	out->size  = buf_size > CMD_TERMINATING_CHAR_LEN ? buf_size - CMD_TERMINATING_CHAR_LEN : 0;
+	out->used  = 0;
+	out->total = 0;
+	out->sink  = sink;
+	out->chain  = NULL;
+	out->error  = 0;
+	out->called = 0;
+	out->ctx    = NULL;
+	out->cmd    = NULL;
+}
+
+static struct cmdtree_chunk *cmdtree_chain_chunk(struct cmdtree_chain *chain)
+{
+	struct cmdtree_chunk *chunk = chain->pool;
+
+	if(chunk)
+		chain->pool = chunk->next;
+	else
+		chunk = malloc(sizeof(struct cmdtree_chunk) + chain->chunk_size + CMD_TERMINATING_CHAR_LEN);
+
+	if(NULL == chunk)
+		return NULL;
+
+	chunk->next = NULL;
+	chunk->len  = 0;
+
+	if(chain->tail)
+		chain->tail->next = chunk;
+	else
+		chain->head = chunk;
+	chain->tail = chunk;
+
+	return chunk;
+}
+
+/* Point the staging buffer at the chain tail room, a new chunk is appended if the tail is full (or not empty). */
+static int cmdtree_out_chain_room(struct cmdtree_out *out, size_t min_room)
+{
+	struct cmdtree_chain *chain = out->chain;
+	struct cmdtree_chunk *chunk = chain->tail;
+
+	if(NULL == chunk || chain->chunk_size - chunk->len < min_room)
+	{
+		chunk = cmdtree_chain_chunk(chain);
+		if(NULL == chunk)
+		{
+			out->error = 1;
+			out->size  = 0;
+			return CMD3_FAIL;
+		}
+	}
+
+	out->buf  = chunk->data + chunk->len;
+	out->size = chain->chunk_size - chunk->len;
+
+	return CMD3_SUCCESS;
+}
+
+static int cmdtree_out_init_chain(struct cmdtree_out *out, struct cmdtree_chain *chain)
+{
+	static char empty[CMD_TERMINATING_CHAR_LEN];
+
+	cmdtree_out_init(out, empty, sizeof(empty), NULL);
+	out->chain = chain;
+
+	return cmdtree_out_chain_room(out, 1);
+}
+
+/* Bytes output since the given total, as returned by the cmd functions and reports. */
+static int cmdtree_out_len(const struct cmdtree_out *out, size_t start)
+{
+	return out->total - start > INT_MAX ? INT_MAX : (int)(out->total - start);
+}
+
+/* Account for bytes written straight into the staging buffer, up to its capacity. */
+static void cmdtree_out_commit(struct cmdtree_out *out, int len)
+{
+	if(len <= 0)
+		return;
+
+	if((size_t)len > out->size - out->used)
+		len = out->size - out->used;
+
+	out->used  += len;
+	out->total += len;
+}
+
+static int cmdtree_out_flush(struct cmdtree_out *out)
+{
+	if(out->chain)
+	{
+		/* The staged bytes are in place, they are added to the tail chunk. */
+		if(out->used)
+		{
+			out->chain->tail->len += out->used;
+			out->chain->len       += out->used;
+			out->buf              += out->used;
+			out->size             -= out->used;
+			out->used              = 0;
+		}
+
+		if(0 == out->size && !out->error)
+			cmdtree_out_chain_room(out, 1);
+
+		return out->error ? CMD3_FAIL : CMD3_SUCCESS;
+	}
+
+	if(NULL == out->sink)
+		return CMD3_SUCCESS;
+
+	if(out->used && !out->error)
+	{
+		CMD_TRACE(begin, CMDTREE_TRACE_OUTPUT, out->cmd, out->used);
+		if(CMD3_SUCCESS != out->sink->write(out->sink->arg, out->buf, out->used))
+			out->error = 1;
+		CMD_TRACE(end, CMDTREE_TRACE_OUTPUT, out->cmd, out->used);
+	}
+
+	out->used = 0;
+
+	return out->error ? CMD3_FAIL : CMD3_SUCCESS;
+}
+
+int cmdtree_out_write(cmdtree_out_d out, const void *data, size_t len)
+{
+	if(out->error)
+		return CMD3_FAIL;
+
+	/* Chained output fills the chunks one after the other. */
+	while(out->chain && len > out->size - out->used)
+	{
+		size_t room = out->size - out->used;
+
+		memcpy(out->buf + out->used, data, room);
+		out->used  += room;
+		out->total += room;
+		data = (const char *)data + room;
+		len -= room;
+
+		if(CMD3_SUCCESS != cmdtree_out_flush(out))
+			return CMD3_FAIL;
+	}
+
+	if(out->sink && len > out->size - out->used)
+	{
+		/* Data larger than the staging room goes to the sink as is, along with the staged bytes. */
+		if(out->sink->writev)
+		{
+			struct iovec iov[2] = { { out->buf, out->used }, { (void *)data, len } };
+			int first = out->used ? 0 : 1;
+
+			CMD_TRACE(begin, CMDTREE_TRACE_OUTPUT, out->cmd, out->used + len);
+			if(CMD3_SUCCESS != out->sink->writev(out->sink->arg, &iov[first], 2 - first))
+				out->error = 1;
+			CMD_TRACE(end, CMDTREE_TRACE_OUTPUT, out->cmd, out->used + len);
+
+			out->used   = 0;
+			out->total += len;
+
+			return out->error ? CMD3_FAIL : CMD3_SUCCESS;
+		}
+
+		if(CMD3_SUCCESS != cmdtree_out_flush(out))
+			return CMD3_FAIL;
+
+		if(len > out->size)
+		{
+			CMD_TRACE(begin, CMDTREE_TRACE_OUTPUT, out->cmd, len);
+			if(CMD3_SUCCESS != out->sink->write(out->sink->arg, data, len))
+				out->error = 1;
+			CMD_TRACE(end, CMDTREE_TRACE_OUTPUT, out->cmd, len);
+
+			out->total += len;
+
+			return out->error ? CMD3_FAIL : CMD3_SUCCESS;
+		}
+	}
+
+	/* Without a sink, the data past the caller buffer is dropped. */
+	if(len > out->size - out->used)
+		len = out->size - out->used;
+
+	memcpy(out->buf + out->used, data, len);
+	out->used  += len;
+	out->total += len;
+
+	return CMD3_SUCCESS;
+}
+
+int cmdtree_out_printf(cmdtree_out_d out, const char *format, ...)
+{
+	va_list ap;
+	char *data;
+	int len;
+	int ret;
+
+	if(out->error)
+		return CMD3_FAIL;
+
+	va_start(ap, format);
+	len = vsnprintf(out->buf + out->used, out->size - out->used + CMD_TERMINATING_CHAR_LEN, format, ap);
+	va_end(ap);
+
+	if(len < 0)
+		return CMD3_FAIL;
+
+	if((size_t)len <= out->size - out->used || (NULL == out->sink && NULL == out->chain))
+	{
+		cmdtree_out_commit(out, len);
+		return CMD3_SUCCESS;
+	}
+
+	/* The formatted output did not fit the staging room, flush and format it again. */
+	if(CMD3_SUCCESS != cmdtree_out_flush(out))
+		return CMD3_FAIL;
+
+	if(out->chain && (size_t)len <= out->chain->chunk_size && CMD3_SUCCESS != cmdtree_out_chain_room(out, len))
+		return CMD3_FAIL;
+
+	if((size_t)len <= out->size)
+	{
+		va_start(ap, format);
+		vsnprintf(out->buf, out->size + CMD_TERMINATING_CHAR_LEN, format, ap);
+		va_end(ap);
+
+		cmdtree_out_commit(out, len);
+		return CMD3_SUCCESS;
+	}
+
+	data = malloc(len + CMD_TERMINATING_CHAR_LEN);
+	if(NULL == data)
+		return CMD3_FAIL;
+
+	va_start(ap, format);
+	vsnprintf(data, len + CMD_TERMINATING_CHAR_LEN, format, ap);
+	va_end(ap);
+
+	ret = cmdtree_out_write(out, data, len);
+	free(data);
+
+	return ret;
+}
+
+static size_t cmdtree_help_row_len(size_t name_len, size_t comment_len)
+{
+	return (name_len < CMD_HELP_NAME_WIDTH ? CMD_HELP_NAME_WIDTH : name_len) + CMD_HELP_GAP + comment_len + 1;
+}
+
+/*
+ * Output a help row, the name padded to its column, the comment and a new line.
+ * The row is copied in place when it fits the staging room, it is written piecewise otherwise.
+ */
+static void cmdtree_help_row(struct cmdtree_out *out, const char *name, size_t name_len, const char *comment, size_t comment_len)
+{
+	static const char spaces[CMD_HELP_NAME_WIDTH + CMD_HELP_GAP] = "                      ";
+	size_t pad = (name_len < CMD_HELP_NAME_WIDTH ? CMD_HELP_NAME_WIDTH - name_len : 0) + CMD_HELP_GAP;
+	size_t row_len = name_len + pad + comment_len + 1;
+	char *row;
+
+	if(out->error || row_len > out->size - out->used)
+	{
+		cmdtree_out_write(out, name, name_len);
+		cmdtree_out_write(out, spaces, pad);
+		cmdtree_out_write(out, comment, comment_len);
+		cmdtree_out_write(out, "\n", 1);
+		return;
+	}
+
+	row = out->buf + out->used;
+	memcpy(row, name, name_len);
+	row += name_len;
+	memset(row, ' ', pad);
+	row += pad;
+	memcpy(row, comment, comment_len);
+	row[comment_len] = '\n';
+
+	out->used  += row_len;
+	out->total += row_len;
+}
+
+static int cmdtree_sink_fd_write(void *arg, const char *data, size_t len)
+{
+	int fd = (int)(intptr_t)arg;
+
+	while(len)
+	{
+		ssize_t written = write(fd, data, len);
+
+		if(written < 0 && EINTR == errno)
+			continue;
+
+		if(written <= 0)
+			return CMD3_FAIL;
+
+		data += written;
+		len  -= written;
+	}
+
+	return CMD3_SUCCESS;
+}
+
+static int cmdtree_sink_fd_writev(void *arg, const struct iovec *iov, int iovcnt)
+{
+	int fd = (int)(intptr_t)arg;
+
+	while(iovcnt)
+	{
+		ssize_t written = writev(fd, iov, iovcnt);
+
+		if(written < 0 && EINTR == errno)
+			continue;
+
+		if(written < 0)
+			return CMD3_FAIL;
+
+		/* Skip the fragments written, a partially written one is completed by a plain write. */
+		for(; iovcnt && (size_t)written >= iov->iov_len; iov++, iovcnt--)
+			written -= iov->iov_len;
+
+		if(iovcnt && written)
+		{
+			if(CMD3_SUCCESS != cmdtree_sink_fd_write(arg, (const char *)iov->iov_base + written, iov->iov_len - written))
+				return CMD3_FAIL;
+
+			iov++;
+			iovcnt--;
+		}
+	}
+
+	return CMD3_SUCCESS;
+}
+
+void cmdtree_sink_fd_init(cmdtree_sink_t *sink, int fd)
+{
+	sink->write  = cmdtree_sink_fd_write;
+	sink->writev = cmdtree_sink_fd_writev;
+	sink->arg    = (void *)(intptr_t)fd;
+}
+
+cmdtree_chain_d cmdtree_chain_create(size_t chunk_size)
+{
+	struct cmdtree_chain *chain;
+
+	chain = calloc(1, sizeof(struct cmdtree_chain));
+	if(NULL == chain)
+		return NULL;
+
+	chain->chunk_size = chunk_size ? chunk_size : CMD_CHAIN_CHUNK_SIZE;
+
+	return chain;
+}
+
+static void cmdtree_chunks_free(struct cmdtree_chunk *chunk)
+{
+	while(chunk)
+	{
+		struct cmdtree_chunk *next = chunk->next;
+
+		free(chunk);
+		chunk = next;
+	}
+}
+
+void cmdtree_chain_destroy(cmdtree_chain_d chain)
+{
+	if(NULL == chain)
+		return;
+
+	cmdtree_chunks_free(chain->head);
+	cmdtree_chunks_free(chain->pool);
+	free(chain);
+}
+
+size_t cmdtree_chain_len(cmdtree_chain_d chain)
+{
+	return chain->len;
+}
+
+int cmdtree_chain_iov(cmdtree_chain_d chain, struct iovec *iov, int iov_max)
+{
+	struct cmdtree_chunk *chunk;
+	size_t offset = chain->offset;
+	int count = 0;
+
+	for(chunk = chain->head; chunk && count < iov_max; chunk = chunk->next)
+	{
+		if(chunk->len > offset)
+		{
+			iov[count].iov_base = chunk->data + offset;
+			iov[count].iov_len  = chunk->len - offset;
+			count++;
+		}
+
+		offset = 0;
+	}
+
+	return count;
+}
+
+void cmdtree_chain_consume(cmdtree_chain_d chain, size_t len)
+{
+	struct cmdtree_chunk *chunk;
+
+	if(len > chain->len)
+		len = chain->len;
+
+	chain->len -= len;
+	len += chain->offset;
+
+	/* Consumed chunks return to the pool, the tail one is kept for the next cmd once emptied. */
+	while((chunk = chain->head) && len >= chunk->len && chunk != chain->tail)
+	{
+		len -= chunk->len;
+		chain->head = chunk->next;
+		chunk->next = chain->pool;
+		chain->pool = chunk;
+	}
+
+	chain->offset = len;
+
+	if(0 == chain->len && chain->tail)
+	{
+		chain->tail->len = 0;
+		chain->offset    = 0;
+	}
+}
+
+int cmdtree_chain_flush(cmdtree_chain_d chain, int fd)
+{
+	struct iovec iov[CMD_CHAIN_IOV_MAX];
+
+	while(chain->len)
+	{
+		ssize_t written = writev(fd, iov, cmdtree_chain_iov(chain, iov, CMD_CHAIN_IOV_MAX));
+
+		if(written < 0 && EINTR == errno)
+			continue;
+
+		if(written < 0 && (EAGAIN == errno || EWOULDBLOCK == errno))
+			return CMD3_INCOMPLETE;
+
+		if(written <= 0)
+			return CMD3_FAIL;
+
+		cmdtree_chain_consume(chain, written);
+	}
+
+	return CMD3_SUCCESS;
+}
+
+/*
+ * Compile the argument schema into a single allocation, with sorted keys for the enum values.
+ * NULL on allocation failure or an invalid schema: an unnamed argument, a required argument
+ * following an optional one, an empty enum or an inverted int range.
+ */
+static struct cmdtree_schema *cmdtree_schema_compile(struct cmd3_ctx *ctx, const cmdtree_arg_schema_t *args, int arg_count)
+{
+	struct cmdtree_schema *schema;
+	struct cmdtree_key *keys;
+	size_t enum_total = 0;
+	size_t size;
+	int i;
+
+	for(i = 0; i < arg_count; i++)
+	{
+		if(NULL == args[i].name || (i > 0 && args[i - 1].optional && !args[i].optional))
+			return NULL;
+
+		if(CMDTREE_ARG_INT == args[i].type && args[i].min > args[i].max)
+			return NULL;
+
+		if(CMDTREE_ARG_ENUM == args[i].type)
+		{
+			size_t count = 0;
+
+			while(args[i].enum_values && args[i].enum_values[count])
+				count++;
+
+			if(0 == count)
+				return NULL;
+
+			enum_total += count;
+		}
+	}
+
+	size = sizeof(struct cmdtree_schema) + arg_count * sizeof(struct cmdtree_schema_arg) +
+		   enum_total * sizeof(struct cmdtree_key);
+
+	schema = cmdtree_mem_alloc(ctx, size);
+	if(NULL == schema)
+		return NULL;
+
+	memset(schema, 0, size);
+	schema->size  = size;
+	schema->count = arg_count;
+
+	keys = (struct cmdtree_key *)&schema->args[arg_count];
+
+	for(i = 0; i < arg_count; i++)
+	{
+		struct cmdtree_schema_arg *arg = &schema->args[i];
+
+		arg->spec = args[i];
+		if(!arg->spec.optional)
+			schema->required++;
+
+		if(CMDTREE_ARG_ENUM != arg->spec.type)
+			continue;
+
+		arg->enum_keys = keys;
+		for(; arg->spec.enum_values[arg->enum_count]; arg->enum_count++)
+		{
+			const char *value = arg->spec.enum_values[arg->enum_count];
+
+			cmdtree_key_set(&keys[arg->enum_count], value, strlen(value), arg->enum_count);
+		}
+
+		qsort(keys, arg->enum_count, sizeof(struct cmdtree_key), cmdtree_key_sort_cmp);
+		keys += arg->enum_count;
+	}
+
+	return schema;
+}
+
+static int cmdtree_schema_arg_parse(const struct cmdtree_schema_arg *arg, int exact, cmdtree_arg_t *value)
+{
+	switch(arg->spec.type)
+	{
+	case CMDTREE_ARG_INT:
+	{
+		char *end;
+
+		errno = 0;
+		value->value.i = strtoll(value->str, &end, 0);
+		if(errno || end == value->str || *end)
+			return CMD3_FAIL;
+
+		if((arg->spec.min || arg->spec.max) && (value->value.i < arg->spec.min || value->value.i > arg->spec.max))
+			return CMD3_FAIL;
+
+		return CMD3_SUCCESS;
+	}
+	case CMDTREE_ARG_ENUM:
+	{
+		const struct cmdtree_key *key;
+		uint32_t first;
+		uint32_t count;
+
+		key = cmdtree_key_match(arg->enum_keys, arg->enum_count, value->str, strlen(value->str), exact, &first, &count);
+		if(NULL == key)
+			return CMD3_FAIL;
+
+		value->value.e = key->index;
+		return CMD3_SUCCESS;
+	}
+	case CMDTREE_ARG_IPV4:
+		return 1 == inet_pton(AF_INET, value->str, value->value.ipv4) ? CMD3_SUCCESS : CMD3_FAIL;
+	case CMDTREE_ARG_IPV6:
+		return 1 == inet_pton(AF_INET6, value->str, value->value.ipv6) ? CMD3_SUCCESS : CMD3_FAIL;
+	case CMDTREE_ARG_STRING:
+	default:
+		return CMD3_SUCCESS;
+	}
+}
+
+/*
+ * Validate and parse the cmd arguments, argv[0] being the cmd name, into one value per schema argument.
+ * Returns 0 when the arguments are valid, else the length of the report output.
+ */
+static int cmdtree_schema_parse(const struct cmdtree_schema *schema, int exact, int argc, const char **argv,
+								cmdtree_arg_t *values, struct cmdtree_out *out)
+{
+	size_t start = out->total;
+	int i;
+
+	if(argc - 1 < schema->required)
+	{
+		cmdtree_out_printf(out, "Missing argument: %s\n", schema->args[argc - 1].spec.name);
+		return cmdtree_out_len(out, start);
+	}
+
+	if(argc - 1 > schema->count)
+	{
+		cmdtree_out_printf(out, "Unexpected argument: %s\n", argv[schema->count + 1]);
+		return cmdtree_out_len(out, start);
+	}
+
+	for(i = 0; i < schema->count; i++)
+	{
+		const struct cmdtree_schema_arg *arg = &schema->args[i];
+		cmdtree_arg_t *value = &values[i];
+
+		memset(value, 0, sizeof(cmdtree_arg_t));
+		if(i + 1 >= argc)
+			continue;
+
+		value->present = 1;
+		value->str     = argv[i + 1];
+
+		if(CMD3_SUCCESS == cmdtree_schema_arg_parse(arg, exact, value))
+			continue;
+
+		if(CMDTREE_ARG_INT == arg->spec.type && (arg->spec.min || arg->spec.max))
+			cmdtree_out_printf(out, "Invalid argument %s: %s, expected %lld..%lld\n",
+							   arg->spec.name, value->str, arg->spec.min, arg->spec.max);
+		else
+			cmdtree_out_printf(out, "Invalid argument %s: %s\n", arg->spec.name, value->str);
+
+		return cmdtree_out_len(out, start);
+	}
+
+	return 0;
+}
+
+static cmdtree_d cmdtree_level_match(const struct cmdtree_level *level, const char *name, size_t len, int exact,
+									 uint32_t *first, uint32_t *count)
+{
+	const struct cmdtree_key *key;
+
+	*first = 0;
+	*count = 0;
+
+	if(NULL == level)
+		return NULL;
+
+	key = cmdtree_key_match(level->sorted, level->count, name, len, exact, first, count);
+
+	return key ? level->nodes[key->index] : NULL;
+}
+
+/* Copy of the level with the node added, NULL on allocation failure. */
+static struct cmdtree_level *cmdtree_level_insert(struct cmd3_ctx *ctx, const struct cmdtree_level *level, cmdtree_d cmdtree)
+{
+	struct cmdtree_level *new_level;
+	uint32_t count = level ? level->count : 0;
+	uint32_t pos = 0;
+
+	new_level = cmdtree_level_alloc(ctx, count + 1);
+	if(NULL == new_level)
+		return NULL;
+
+	if(level)
+	{
+		pos = cmdtree_key_lower_bound(level->sorted, count, cmdtree->name, cmdtree->name_len,
+									  cmdtree_key_prefix(cmdtree->name, cmdtree->name_len));
+
+		memcpy(new_level->nodes, level->nodes, count * sizeof(cmdtree_d));
+		memcpy(new_level->sorted, level->sorted, pos * sizeof(struct cmdtree_key));
+		memcpy(&new_level->sorted[pos + 1], &level->sorted[pos], (count - pos) * sizeof(struct cmdtree_key));
+	}
+
+	new_level->nodes[count] = cmdtree;
+	cmdtree_key_set(&new_level->sorted[pos], cmdtree->name, cmdtree->name_len, count);
+
+	return new_level;
+}
+
+/* Copy of the level with the node removed, NULL on allocation failure or an empty level. */
+static struct cmdtree_level *cmdtree_level_remove(struct cmd3_ctx *ctx, const struct cmdtree_level *level, cmdtree_d cmdtree)
+{
+	struct cmdtree_level *new_level;
+	uint32_t index;
+	uint32_t i, j;
+
+	if(level->count <= 1)
+		return NULL;
+
+	for(index = 0; level->nodes[index] != cmdtree; index++)
+		;
+
+	new_level = cmdtree_level_alloc(ctx, level->count - 1);
+	if(NULL == new_level)
+		return NULL;
+
+	memcpy(new_level->nodes, level->nodes, index * sizeof(cmdtree_d));
+	memcpy(&new_level->nodes[index], &level->nodes[index + 1], (level->count - index - 1) * sizeof(cmdtree_d));
+
+	for(i = 0, j = 0; i < level->count; i++)
+	{
+		if(level->sorted[i].index != index)
+		{
+			new_level->sorted[j] = level->sorted[i];
+			if(level->sorted[i].index > index)
+				new_level->sorted[j].index--;
+			j++;
+		}
+	}
+
+	return new_level;
+}
+
+/* Publish a new level in place of the current one, which is retired. */
+static void cmdtree_level_publish(struct cmd3_ctx *ctx, struct cmdtree_level **level_ref, struct cmdtree_level *new_level)
+{
+	struct cmdtree_level *level = *level_ref;
+
+	__atomic_store_n(level_ref, new_level, __ATOMIC_SEQ_CST);
+
+	if(level)
+		cmd3_rcu_retire(&ctx->retired, level, cmdtree_level_release, ctx);
+}
+
+static int cmdtree_set_allocator_ctx(cmd3_ctx_d ctx, const cmdtree_allocator_t *allocator)
+{
+	int ret = CMD3_SUCCESS;
+
+	if(NULL == allocator)
+		allocator = &cmd_heap_allocator;
+
+	pthread_mutex_lock(&ctx->lock);
+
+	if(ctx->root || NULL == allocator->alloc)
+		ret = CMD3_FAIL;
+	else
+		ctx->allocator = *allocator;
+
+	pthread_mutex_unlock(&ctx->lock);
+
+	return ret;
+}
+
+int cmdtree_set_allocator(const cmdtree_allocator_t *allocator)
+{
+	return cmdtree_set_allocator_ctx(&cmd_default_ctx, allocator);
+}
+
+cmd3_ctx_d cmd3_ctx_create(const cmd3_ctx_config_t *config)
+{
+	cmd3_ctx_d ctx;
+
+	ctx = calloc(1, sizeof(struct cmd3_ctx));
+	if(NULL == ctx)
+		return NULL;
+
+	ctx->allocator = cmd_heap_allocator;
+	pthread_mutex_init(&ctx->lock, NULL);
+	pthread_cond_init(&ctx->async_cond, NULL);
+
+	if(config)
+	{
+		if(CMD3_SUCCESS != cmdtree_set_allocator_ctx(ctx, config->allocator))
+		{
+			pthread_cond_destroy(&ctx->async_cond);
+			pthread_mutex_destroy(&ctx->lock);
+			free(ctx);
+			return NULL;
+		}
+
+		ctx->user_data   = config->user_data;
+		ctx->exact_match = config->exact_match;
+	}
+
+	return ctx;
+}
+
+void cmd3_ctx_destroy(cmd3_ctx_d ctx)
+{
+	if(NULL == ctx)
+		return;
+
+	cmdtree_teardown_ctx(ctx);
+	pthread_cond_destroy(&ctx->async_cond);
+	pthread_mutex_destroy(&ctx->lock);
+	free(ctx);
+}
+
+void *cmd3_ctx_get_user_data(cmd3_ctx_d ctx)
+{
+	return ctx->user_data;
+}
+
+void cmd3_ctx_set_user_data(cmd3_ctx_d ctx, void *user_data)
+{
+	ctx->user_data = user_data;
+}
+
+static void cmdtree_free_level(cmdtree_d cmd_start)
+{
+	/* cmd_hash_ctx is set by the caller. */
+	cmdtree_d cmd_iterate;
+	cmdtree_d cmd_temp;
+
+	HASH_ITER(hh, cmd_start, cmd_iterate, cmd_temp)
+	{
+		cmdtree_free_level(cmd_iterate->child);
+		cmdtree_level_free(cmd_iterate->ctx, cmd_iterate->level);
+
+		HASH_DEL(cmd_start, cmd_iterate);
+		cmdtree_node_free(cmd_iterate);
+	}
+}
+
+/* Clear the subtree hash tables at once, the nodes remain reachable through their levels. */
+static void cmdtree_subtree_clear(cmdtree_d cmdtree)
+{
+	/* cmd_hash_ctx is set by the caller. */
+	struct cmdtree_level *level = cmdtree->level;
+	uint32_t i;
+
+	for(i = 0; level && i < level->count; i++)
+	{
+		cmdtree_subtree_clear(level->nodes[i]);
+	}
+
+	HASH_CLEAR(hh, cmdtree->child);
+}
+
+/* Free a detached subtree, walking it through its levels. */
+static void cmdtree_subtree_free(cmdtree_d cmdtree)
+{
+	struct cmdtree_level *level = cmdtree->level;
+	uint32_t i;
+
+	for(i = 0; level && i < level->count; i++)
+	{
+		cmdtree_subtree_free(level->nodes[i]);
+	}
+
+	cmdtree_level_free(cmdtree->ctx, level);
+	cmdtree_node_free(cmdtree);
+}
+
+static void cmdtree_subtree_release(void *arg, void *ptr)
+{
+	(void)arg;
+
+	cmdtree_subtree_free(ptr);
+}
+
+static void cmdtree_image_release(void *arg, void *ptr)
+{
+	(void)arg;
+
+	free(ptr);
+}
+
+/* Unpublish the frozen image, the caller holds the context lock. */
+static void cmdtree_image_retire(cmd3_ctx_d ctx)
+{
+	struct cmdtree_image *image = ctx->image;
+
+	if(NULL == image)
+		return;
+
+	__atomic_store_n(&ctx->image, NULL, __ATOMIC_SEQ_CST);
+	cmd3_rcu_retire(&ctx->retired, image, cmdtree_image_release, ctx);
+}
+
+/* Drop the help texts cached by the levels, they are not released along with the allocator. */
+static void cmdtree_help_drop(struct cmdtree_level *level)
+{
+	uint32_t i;
+
+	if(NULL == level)
+		return;
+
+	for(i = 0; i < level->count; i++)
+		cmdtree_help_drop(level->nodes[i]->level);
+
+	if(level->help)
+	{
+		free(level->help);
+		level->help = NULL;
+		level->nodes[0]->ctx->helps--;
+	}
+}
+
+void cmdtree_teardown_ctx(cmd3_ctx_d ctx)
+{
+	pthread_mutex_lock(&ctx->lock);
+
+	/* The async cmds queued on the context run to completion first. */
+	while(ctx->async)
+		pthread_cond_wait(&ctx->async_cond, &ctx->lock);
+
+	/* The tree is not expected to be in use while it is torn down. */
+	cmdtree_image_retire(ctx);
+	cmd3_rcu_reclaim(&ctx->retired, 1);
+
+	/* An allocator which can drop everything at once, saves the tree walk. */
+	if(ctx->allocator.release)
+	{
+		if(__atomic_load_n(&ctx->helps, __ATOMIC_RELAXED))
+			cmdtree_help_drop(ctx->level);
+
+		ctx->allocator.release(ctx->allocator.arg);
+	}
+	else
+	{
+		cmd_hash_ctx = ctx;
+		cmdtree_free_level(ctx->root);
+		cmdtree_level_free(ctx, ctx->level);
+	}
+
+	ctx->root  = NULL;
+	ctx->level = NULL;
+
+	free(ctx->slowlog);
+	ctx->slowlog  = NULL;
+	ctx->executor = NULL;
+
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+void cmdtree_teardown(void)
+{
+	cmdtree_teardown_ctx(&cmd_default_ctx);
+}
+
+static void *cmdtree_arena_alloc(void *arg, size_t size)
+{
+	struct cmdtree_arena *arena = arg;
+	struct cmdtree_arena_block *block;
+	size_t size_class;
+	void *ptr;
+
+	size = (size + CMD_ARENA_ALIGN - 1) & ~(size_t)(CMD_ARENA_ALIGN - 1);
+	if(0 == size)
+		size = CMD_ARENA_ALIGN;
+
+	if(size > CMD_ARENA_SMALL_MAX)
+	{
+		block = malloc(CMD_ARENA_HDR_SIZE + size);
+		if(NULL == block)
+			return NULL;
+
+		block->size = size;
+		block->prev = NULL;
+		block->next = arena->large;
+		if(arena->large)
+			arena->large->prev = block;
+		arena->large = block;
+
+		return (char *)block + CMD_ARENA_HDR_SIZE;
+	}
+
+	size_class = size / CMD_ARENA_ALIGN - 1;
+	if(arena->free_list[size_class])
+	{
+		ptr = arena->free_list[size_class];
+		arena->free_list[size_class] = *(void **)ptr;
+		return ptr;
+	}
+
+	if(NULL == arena->blocks || arena->block_used + size > arena->blocks->size)
+	{
+		block = malloc(CMD_ARENA_HDR_SIZE + arena->block_size);
+		if(NULL == block)
+			return NULL;
+
+		block->size = arena->block_size;
+		block->prev = NULL;
+		block->next = arena->blocks;
+		arena->blocks = block;
+		arena->block_used = 0;
+	}
+
+	ptr = (char *)arena->blocks + CMD_ARENA_HDR_SIZE + arena->block_used;
+	arena->block_used += size;
+
+	return ptr;
+}
+
+static void cmdtree_arena_free(void *arg, void *ptr, size_t size)
+{
+	struct cmdtree_arena *arena = arg;
+	struct cmdtree_arena_block *block;
+	size_t size_class;
+
+	if(NULL == ptr)
+		return;
+
+	size = (size + CMD_ARENA_ALIGN - 1) & ~(size_t)(CMD_ARENA_ALIGN - 1);
+	if(0 == size)
+		size = CMD_ARENA_ALIGN;
+
+	if(size > CMD_ARENA_SMALL_MAX)
+	{
+		block = (struct cmdtree_arena_block *)((char *)ptr - CMD_ARENA_HDR_SIZE);
+
+		if(block->prev)
+			block->prev->next = block->next;
+		else
+			arena->large = block->next;
+		if(block->next)
+			block->next->prev = block->prev;
+
+		free(block);
+		return;
+	}
+
+	/* Small allocations are kept for reuse by allocations of the same size class. */
+	size_class = size / CMD_ARENA_ALIGN - 1;
+	*(void **)ptr = arena->free_list[size_class];
+	arena->free_list[size_class] = ptr;
+}
+
+static void cmdtree_arena_release(void *arg)
+{
+	struct cmdtree_arena *arena = arg;
+	struct cmdtree_arena_block *block;
+
+	while((block = arena->blocks) != NULL)
+	{
+		arena->blocks = block->next;
+		free(block);
+	}
+
+	while((block = arena->large) != NULL)
+	{
+		arena->large = block->next;
+		free(block);
+	}
+
+	arena->block_used = 0;
+	memset(arena->free_list, 0, sizeof(arena->free_list));
+}
+
+cmdtree_arena_d cmdtree_arena_create(size_t block_size)
+{
+	struct cmdtree_arena *arena;
+
+	arena = calloc(1, sizeof(struct cmdtree_arena));
+	if(NULL == arena)
+		return NULL;
+
+	if(block_size < CMD_ARENA_BLOCK_SIZE_MIN)
+		block_size = CMD_ARENA_BLOCK_SIZE_MIN;
+
+	arena->block_size = (block_size + CMD_ARENA_ALIGN - 1) & ~(size_t)(CMD_ARENA_ALIGN - 1);
+
+	return arena;
+}
+
+void cmdtree_arena_destroy(cmdtree_arena_d arena)
+{
+	if(NULL == arena)
+		return;
+
+	cmdtree_arena_release(arena);
+	free(arena);
+}
+
+void cmdtree_arena_allocator(cmdtree_arena_d arena, cmdtree_allocator_t *allocator)
+{
+	allocator->alloc   = cmdtree_arena_alloc;
+	allocator->free    = cmdtree_arena_free;
+	allocator->release = cmdtree_arena_release;
+	allocator->arg     = arena;
+}
+
+
+
+/* Create the node under the given parent (NULL for the root level), the config parent name is not used. */
+static cmdtree_d cmdtree_create_under_locked(cmd3_ctx_d ctx, cmdtree_d cmd_parent, const cmdtree_config_t *config)
+{
+	cmdtree_d cmdtree;
+	struct cmdtree_level **level_ref;
+	struct cmdtree_level *level;
+
+	cmdtree_image_retire(ctx);
+
+	cmdtree = cmdtree_node_alloc(ctx, cmd_parent, config);
+	if(NULL == cmdtree)
+	    return NULL;
+
+	cmd_hash_ctx = ctx;
+
+	/* Readers see the new cmd once the updated level is published. */
+	level_ref = cmd_parent ? &cmd_parent->level : &ctx->level;
+	level = cmdtree_level_insert(ctx, *level_ref, cmdtree);
+	if(NULL == level)
+	{
+		cmdtree_node_free(cmdtree);
+		return NULL;
+	}
+
+	if(cmd_parent)
+		HASH_ADD_KEYPTR(hh, cmd_parent->child, cmdtree->name, cmdtree->name_len, cmdtree);
+	else
+		/* This is a root level cmd */
+		HASH_ADD_KEYPTR(hh, ctx->root, cmdtree->name, cmdtree->name_len, cmdtree);
+
+	cmdtree_level_publish(ctx, level_ref, level);
+
+	return cmdtree;
+}
+
+static cmdtree_d cmdtree_create_locked(cmd3_ctx_d ctx, cmdtree_config_t *config)
+{
+	cmdtree_d cmd_parent = NULL;
+
+	if(config->parent_name != NULL)
+	{	/* This is a sub cmd and a parent exist */
+
+		/* Look for the parent */
+		cmd_parent = cmdtree_lookup(ctx, config->parent_name);
+		if(NULL == cmd_parent)
+		{
+			printf("Unable to detect parent cmd %s.""\n", config->parent_name);
+			return NULL;
+		}
+	}
+
+	return cmdtree_create_under_locked(ctx, cmd_parent, config);
+}
+
+cmdtree_d cmdtree_create_ctx(cmd3_ctx_d ctx, cmdtree_config_t *config)
+{
+	cmdtree_d cmdtree;
+
+	pthread_mutex_lock(&ctx->lock);
+
+	cmdtree = cmdtree_create_locked(ctx, config);
+	cmd3_rcu_reclaim(&ctx->retired, 0);
+
+	pthread_mutex_unlock(&ctx->lock);
+
+	return cmdtree;
+}
+
+cmdtree_d cmdtree_create(cmdtree_config_t *config)
+{
+	return cmdtree_create_ctx(&cmd_default_ctx, config);
+}
+
+cmdtree_d cmdtree_create_under(cmdtree_d parent, const cmdtree_config_t *config)
+{
+	struct cmd3_ctx *ctx = parent ? parent->ctx : &cmd_default_ctx;
+	cmdtree_d cmdtree;
+
+	pthread_mutex_lock(&ctx->lock);
+
+	cmdtree = cmdtree_create_under_locked(ctx, parent, config);
+	cmd3_rcu_reclaim(&ctx->retired, 0);
+
+	pthread_mutex_unlock(&ctx->lock);
+
+	return cmdtree;
+}
+
+/* uthash has no presize API, expand the buckets once up front instead of on the way. */
+static void cmdtree_hash_presize(cmdtree_d head, uint32_t count)
+{
+	while(head && head->hh.tbl->num_buckets * HASH_BKT_CAPACITY_THRESH < count)
+	{
+		HASH_EXPAND_BUCKETS(head->hh.tbl);
+	}
+}
+
+/* Build the new level: the current nodes followed by the added ones, with merged sorted keys. */
+static int cmdtree_bulk_level_build(cmd3_ctx_d ctx, struct cmdtree_bulk_level *bulk_level)
+{
+	struct cmdtree_level *level = bulk_level->parent ? bulk_level->parent->level : ctx->level;
+	struct cmdtree_level *new_level = bulk_level->level;
+	struct cmdtree_key *keys;
+	uint32_t count = level ? level->count : 0;
+	uint32_t i, j, k;
+
+	keys = malloc(bulk_level->added * sizeof(struct cmdtree_key));
+	if(NULL == keys)
+		return CMD3_FAIL;
+
+	for(i = 0; i < bulk_level->added; i++)
+	{
+		cmdtree_d cmdtree = new_level->nodes[count + i];
+
+		cmdtree_key_set(&keys[i], cmdtree->name, cmdtree->name_len, count + i);
+	}
+
+	qsort(keys, bulk_level->added, sizeof(struct cmdtree_key), cmdtree_key_sort_cmp);
+
+	for(i = 0, j = 0, k = 0; i < count || j < bulk_level->added; k++)
+	{
+		if(j == bulk_level->added || (i < count && cmdtree_key_sort_cmp(&level->sorted[i], &keys[j]) <= 0))
+			new_level->sorted[k] = level->sorted[i++];
+		else
+			new_level->sorted[k] = keys[j++];
+	}
+
+	free(keys);
+
+	return CMD3_SUCCESS;
+}
+
+static void cmdtree_bulk_cleanup(struct cmdtree_bulk_path **paths, struct cmdtree_bulk_level **levels)
+{
+	struct cmdtree_bulk_path *path, *path_temp;
+	struct cmdtree_bulk_level *bulk_level, *level_temp;
+
+	HASH_ITER(hh, *paths, path, path_temp)
+	{
+		HASH_DEL(*paths, path);
+		free(path);
+	}
+
+	HASH_ITER(hh, *levels, bulk_level, level_temp)
+	{
+		HASH_DEL(*levels, bulk_level);
+		free(bulk_level);
+	}
+}
+
+static int cmdtree_create_bulk_locked(cmd3_ctx_d ctx, const cmdtree_config_t *configs, size_t count)
+{
+	struct cmdtree_bulk_path *paths = NULL;
+	struct cmdtree_bulk_level *levels = NULL;
+	struct cmdtree_bulk_path *path = NULL;
+	struct cmdtree_bulk_level *bulk_level, *level_temp;
+	cmdtree_d *cmdtrees;
+	uint32_t root_count = 0;
+	size_t created = 0;
+	size_t i;
+
+	cmdtrees = malloc(count * sizeof(cmdtree_d));
+	if(NULL == cmdtrees)
+		return CMD3_FAIL;
+
+	cmdtree_image_retire(ctx);
+
+	cmd_hash_ctx = ctx;
+
+	/* Count the configurations per distinct parent path, sizing the tables up front. */
+	for(i = 0; i < count; i++)
+	{
+		if(NULL == configs[i].parent_name)
+		{
+			root_count++;
+			continue;
+		}
+
+		HASH_FIND_STR(paths, configs[i].parent_name, path);
+		if(NULL == path)
+		{
+			path = calloc(1, sizeof(struct cmdtree_bulk_path));
+			if(NULL == path)
+				goto rollback;
+
+			path->path = configs[i].parent_name;
+			HASH_ADD_KEYPTR(hh, paths, path->path, strlen(path->path), path);
+		}
+		path->count++;
+	}
+
+	cmdtree_hash_presize(ctx->root, HASH_COUNT(ctx->root) + root_count);
+
+	/* Create the nodes, visible to the parent lookups of the following configurations only. */
+	for(created = 0; created < count; created++)
+	{
+		const cmdtree_config_t *config = &configs[created];
+		cmdtree_d cmd_parent = NULL;
+		cmdtree_d cmdtree;
+
+		if(config->parent_name != NULL)
+		{
+			HASH_FIND_STR(paths, config->parent_name, path);
+			if(!path->resolved)
+			{
+				path->parent = cmdtree_lookup(ctx, config->parent_name);
+				if(NULL == path->parent)
+				{
+					printf("Unable to detect parent cmd %s.""\n", config->parent_name);
+					goto rollback;
+				}
+
+				path->resolved = 1;
+			}
+			cmd_parent = path->parent;
+		}
+
+		HASH_FIND_PTR(levels, &cmd_parent, bulk_level);
+		if(NULL == bulk_level)
+		{
+			bulk_level = calloc(1, sizeof(struct cmdtree_bulk_level));
+			if(NULL == bulk_level)
+				goto rollback;
+
+			bulk_level->parent = cmd_parent;
+			HASH_ADD_PTR(levels, parent, bulk_level);
+		}
+
+		cmdtree = cmdtree_node_alloc(ctx, cmd_parent, config);
+		if(NULL == cmdtree)
+			goto rollback;
+
+		if(cmd_parent)
+		{
+			HASH_ADD_KEYPTR(hh, cmd_parent->child, cmdtree->name, cmdtree->name_len, cmdtree);
+			if(1 == ++path->added)
+				cmdtree_hash_presize(cmd_parent->child, HASH_COUNT(cmd_parent->child) + path->count);
+		}
+		else
+		{
+			HASH_ADD_KEYPTR(hh, ctx->root, cmdtree->name, cmdtree->name_len, cmdtree);
+		}
+
+		bulk_level->added++;
+		cmdtrees[created] = cmdtree;
+	}
+
+	/* Build every new level, nothing is published before all of them are built. */
+	HASH_ITER(hh, levels, bulk_level, level_temp)
+	{
+		struct cmdtree_level *level = bulk_level->parent ? bulk_level->parent->level : ctx->level;
+		uint32_t level_count = level ? level->count : 0;
+
+		bulk_level->level = cmdtree_level_alloc(ctx, level_count + bulk_level->added);
+		if(NULL == bulk_level->level)
+			goto rollback;
+
+		if(level)
+			memcpy(bulk_level->level->nodes, level->nodes, level_count * sizeof(cmdtree_d));
+
+		bulk_level->filled = level_count;
+	}
+
+	for(i = 0; i < count; i++)
+	{
+		cmdtree_d cmd_parent = cmdtrees[i]->parent;
+
+		HASH_FIND_PTR(levels, &cmd_parent, bulk_level);
+		bulk_level->level->nodes[bulk_level->filled++] = cmdtrees[i];
+	}
+
+	HASH_ITER(hh, levels, bulk_level, level_temp)
+	{
+		if(CMD3_SUCCESS != cmdtree_bulk_level_build(ctx, bulk_level))
+			goto rollback;
+	}
+
+	/* Readers see the new cmds once the updated levels are published. */
+	HASH_ITER(hh, levels, bulk_level, level_temp)
+	{
+		cmdtree_level_publish(ctx, bulk_level->parent ? &bulk_level->parent->level : &ctx->level, bulk_level->level);
+	}
+
+	cmdtree_bulk_cleanup(&paths, &levels);
+	free(cmdtrees);
+
+	return CMD3_SUCCESS;
+
+rollback:
+	HASH_ITER(hh, levels, bulk_level, level_temp)
+	{
+		if(bulk_level->level)
+			cmdtree_level_free(ctx, bulk_level->level);
+	}
+
+	/* The children are created after their parent, removing in reverse order leaves no dangling child. */
+	while(created > 0)
+	{
+		cmdtree_d cmdtree = cmdtrees[--created];
+		cmdtree_d *head_ref = cmdtree->parent ? &cmdtree->parent->child : &ctx->root;
+
+		HASH_DEL(*head_ref, cmdtree);
+		cmdtree_node_free(cmdtree);
+	}
+
+	cmdtree_bulk_cleanup(&paths, &levels);
+	free(cmdtrees);
+
+	return CMD3_FAIL;
+}
+
+int cmdtree_create_bulk_ctx(cmd3_ctx_d ctx, const cmdtree_config_t *configs, size_t count)
+{
+	int ret;
+
+	if(0 == count)
+		return CMD3_SUCCESS;
+
+	pthread_mutex_lock(&ctx->lock);
+
+	ret = cmdtree_create_bulk_locked(ctx, configs, count);
+	cmd3_rcu_reclaim(&ctx->retired, 0);
+
+	pthread_mutex_unlock(&ctx->lock);
+
+	return ret;
+}
+
+int cmdtree_create_bulk(const cmdtree_config_t *configs, size_t count)
+{
+	return cmdtree_create_bulk_ctx(&cmd_default_ctx, configs, count);
+}
+
+/*
+ * Position of the first delimiter (white space) at or after pos, or of the first non delimiter
+ * when delim is zero. SSE2 compares 16 chars at once against the delimiters.
+ */
+static size_t cmdtree_scan(const char *string, size_t len, size_t pos, int delim)
+{
+#if defined(__SSE2__)
+	const __m128i space   = _mm_set1_epi8(' ');
+	const __m128i tab     = _mm_set1_epi8('\t');
+	const __m128i newline = _mm_set1_epi8('\n');
+
+	for(; pos + sizeof(__m128i) <= len; pos += sizeof(__m128i))
+	{
+		__m128i chunk = _mm_loadu_si128((const __m128i *)(string + pos));
+		__m128i match = _mm_or_si128(_mm_cmpeq_epi8(chunk, space), _mm_cmpeq_epi8(chunk, tab));
+		unsigned mask = _mm_movemask_epi8(_mm_or_si128(match, _mm_cmpeq_epi8(chunk, newline)));
+
+		if(!delim)
+			mask = ~mask & 0xffff;
+
+		if(mask)
+			return pos + __builtin_ctz(mask);
+	}
+#endif
+
+	for(; pos < len; pos++)
+	{
+		if((' ' == string[pos] || '\t' == string[pos] || '\n' == string[pos]) == !!delim)
+			break;
+	}
+
+	return pos;
+}
+
+/* Split the tokens, the tokenize stage is traced by the public entry points only. */
+static int cmdtree_split(const char *string, size_t len, cmdtree_token_t *tokens, int max_tokens)
+{
+	size_t pos = 0;
+	int count = 0;
+
+	while((pos = cmdtree_scan(string, len, pos, 0)) < len)
+	{
+		size_t end = cmdtree_scan(string, len, pos, 1);
+
+		if(count < max_tokens)
+		{
+			tokens[count].str = string + pos;
+			tokens[count].len = end - pos;
+		}
+
+		count++;
+		pos = end;
+	}
+
+	return count;
+}
+
+void cmdtree_argv_init(cmdtree_argv_t *argv)
+{
+	argv->argc     = 0;
+	argv->capacity = CMDTREE_ARGV_SMALL;
+	argv->tokens   = argv->small;
+
+	argv->strings      = NULL;
+	argv->strings_size = 0;
+}
+
+int cmdtree_tokenize(const char *string, size_t len, cmdtree_token_t *tokens, int max_tokens)
+{
+	int count;
+
+	CMD_TRACE(begin, CMDTREE_TRACE_TOKENIZE, NULL, len);
+	count = cmdtree_split(string, len, tokens, max_tokens);
+	CMD_TRACE(end, CMDTREE_TRACE_TOKENIZE, NULL, len);
+
+	return count;
+}
+
+static int cmdtree_argv_split(cmdtree_argv_t *argv, const char *string, size_t len)
+{
+	int count;
+
+	count = cmdtree_split(string, len, argv->tokens, argv->capacity);
+	if(count > argv->capacity)
+	{
+		/* Grown to the line size, past vectors are not copied, the line is split again. */
+		int capacity = argv->capacity;
+		cmdtree_token_t *tokens;
+
+		while(capacity < count)
+			capacity *= 2;
+
+		tokens = malloc(capacity * sizeof(cmdtree_token_t));
+		if(NULL == tokens)
+		{
+			argv->argc = 0;
+			return CMD3_FAIL;
+		}
+
+		if(argv->tokens != argv->small)
+			free(argv->tokens);
+
+		argv->tokens   = tokens;
+		argv->capacity = capacity;
+
+		count = cmdtree_split(string, len, argv->tokens, argv->capacity);
+	}
+
+	argv->argc = count;
+
+	return CMD3_SUCCESS;
+}
+
+/* Add a token, growing the vector (and keeping its tokens) as needed. */
+static int cmdtree_argv_push(cmdtree_argv_t *argv, const char *str, size_t len)
+{
+	if(argv->argc == argv->capacity)
+	{
+		cmdtree_token_t *tokens;
+
+		tokens = malloc(2 * argv->capacity * sizeof(cmdtree_token_t));
+		if(NULL == tokens)
+			return CMD3_FAIL;
+
+		memcpy(tokens, argv->tokens, argv->argc * sizeof(cmdtree_token_t));
+		if(argv->tokens != argv->small)
+			free(argv->tokens);
+
+		argv->tokens    = tokens;
+		argv->capacity *= 2;
+	}
+
+	argv->tokens[argv->argc].str = str;
+	argv->tokens[argv->argc].len = len;
+	argv->argc++;
+
+	return CMD3_SUCCESS;
+}
+
+/* Quoting tokenizer char classes */
+enum
+{
+	CMD_QC_OTHER,
+	CMD_QC_DELIM,
+	CMD_QC_SQUOTE,
+	CMD_QC_DQUOTE,
+	CMD_QC_BSLASH,
+	CMD_QC_NEWLINE,
+	CMD_QC_COUNT
+};
+
+/* Quoting tokenizer states, the accepting ones come first */
+enum
+{
+	CMD_QS_GAP,			// Between tokens
+	CMD_QS_WORD,		// Within a token, out of quotes
+	CMD_QS_GAP_ESC,		// Backslash between tokens
+	CMD_QS_WORD_ESC,	// Backslash within a token
+	CMD_QS_SQUOTE,		// Within single quotes
+	CMD_QS_DQUOTE,		// Within double quotes
+	CMD_QS_DQUOTE_ESC,	// Backslash within double quotes
+	CMD_QS_COUNT
+};
+
+/* Quoting tokenizer actions, combined with the next state in a transition */
+#define CMD_QA_START		0x10	// A token starts
+#define CMD_QA_EMIT			0x20	// The char is part of the token
+#define CMD_QA_EMIT_BSLASH	0x40	// A kept backslash is part of the token, before the char
+#define CMD_QA_END			0x80	// The token ends
+#define CMD_QS_MASK			0x0f
+
+static const uint8_t cmd_quote_transitions[CMD_QS_COUNT][CMD_QC_COUNT] =
+{
+	[CMD_QS_GAP] = {
+		[CMD_QC_OTHER]   = CMD_QS_WORD | CMD_QA_START | CMD_QA_EMIT,
+		[CMD_QC_DELIM]   = CMD_QS_GAP,
+		[CMD_QC_SQUOTE]  = CMD_QS_SQUOTE | CMD_QA_START,
+		[CMD_QC_DQUOTE]  = CMD_QS_DQUOTE | CMD_QA_START,
+		[CMD_QC_BSLASH]  = CMD_QS_GAP_ESC,
+		[CMD_QC_NEWLINE] = CMD_QS_GAP,
+	},
+	[CMD_QS_WORD] = {
+		[CMD_QC_OTHER]   = CMD_QS_WORD | CMD_QA_EMIT,
+		[CMD_QC_DELIM]   = CMD_QS_GAP | CMD_QA_END,
+		[CMD_QC_SQUOTE]  = CMD_QS_SQUOTE,
+		[CMD_QC_DQUOTE]  = CMD_QS_DQUOTE,
+		[CMD_QC_BSLASH]  = CMD_QS_WORD_ESC,
+		[CMD_QC_NEWLINE] = CMD_QS_GAP | CMD_QA_END,
+	},
+	[CMD_QS_GAP_ESC] = {
+		[CMD_QC_OTHER]   = CMD_QS_WORD | CMD_QA_START | CMD_QA_EMIT,
+		[CMD_QC_DELIM]   = CMD_QS_WORD | CMD_QA_START | CMD_QA_EMIT,
+		[CMD_QC_SQUOTE]  = CMD_QS_WORD | CMD_QA_START | CMD_QA_EMIT,
+		[CMD_QC_DQUOTE]  = CMD_QS_WORD | CMD_QA_START | CMD_QA_EMIT,
+		[CMD_QC_BSLASH]  = CMD_QS_WORD | CMD_QA_START | CMD_QA_EMIT,
+		[CMD_QC_NEWLINE] = CMD_QS_GAP,
+	},
+	[CMD_QS_WORD_ESC] = {
+		[CMD_QC_OTHER]   = CMD_QS_WORD | CMD_QA_EMIT,
+		[CMD_QC_DELIM]   = CMD_QS_WORD | CMD_QA_EMIT,
+		[CMD_QC_SQUOTE]  = CMD_QS_WORD | CMD_QA_EMIT,
+		[CMD_QC_DQUOTE]  = CMD_QS_WORD | CMD_QA_EMIT,
+		[CMD_QC_BSLASH]  = CMD_QS_WORD | CMD_QA_EMIT,
+		[CMD_QC_NEWLINE] = CMD_QS_WORD,
+	},
+	[CMD_QS_SQUOTE] = {
+		[CMD_QC_OTHER]   = CMD_QS_SQUOTE | CMD_QA_EMIT,
+		[CMD_QC_DELIM]   = CMD_QS_SQUOTE | CMD_QA_EMIT,
+		[CMD_QC_SQUOTE]  = CMD_QS_WORD,
+		[CMD_QC_DQUOTE]  = CMD_QS_SQUOTE | CMD_QA_EMIT,
+		[CMD_QC_BSLASH]  = CMD_QS_SQUOTE | CMD_QA_EMIT,
+		[CMD_QC_NEWLINE] = CMD_QS_SQUOTE | CMD_QA_EMIT,
+	},
+	[CMD_QS_DQUOTE] = {
+		[CMD_QC_OTHER]   = CMD_QS_DQUOTE | CMD_QA_EMIT,
+		[CMD_QC_DELIM]   = CMD_QS_DQUOTE | CMD_QA_EMIT,
+		[CMD_QC_SQUOTE]  = CMD_QS_DQUOTE | CMD_QA_EMIT,
+		[CMD_QC_DQUOTE]  = CMD_QS_WORD,
+		[CMD_QC_BSLASH]  = CMD_QS_DQUOTE_ESC,
+		[CMD_QC_NEWLINE] = CMD_QS_DQUOTE | CMD_QA_EMIT,
+	},
+	[CMD_QS_DQUOTE_ESC] = {
+		[CMD_QC_OTHER]   = CMD_QS_DQUOTE | CMD_QA_EMIT_BSLASH | CMD_QA_EMIT,
+		[CMD_QC_DELIM]   = CMD_QS_DQUOTE | CMD_QA_EMIT_BSLASH | CMD_QA_EMIT,
+		[CMD_QC_SQUOTE]  = CMD_QS_DQUOTE | CMD_QA_EMIT_BSLASH | CMD_QA_EMIT,
+		[CMD_QC_DQUOTE]  = CMD_QS_DQUOTE | CMD_QA_EMIT,
+		[CMD_QC_BSLASH]  = CMD_QS_DQUOTE | CMD_QA_EMIT,
+		[CMD_QC_NEWLINE] = CMD_QS_DQUOTE,
+	},
+};
+
+static const uint8_t cmd_quote_classes[256] =
+{
+	[' ']  = CMD_QC_DELIM,
+	['\t'] = CMD_QC_DELIM,
+	['\''] = CMD_QC_SQUOTE,
+	['"']  = CMD_QC_DQUOTE,
+	['\\'] = CMD_QC_BSLASH,
+	['\n'] = CMD_QC_NEWLINE,
+};
+
+int cmdtree_argv_tokenize(cmdtree_argv_t *argv, const char *string, size_t len)
+{
+	int ret;
+
+	CMD_TRACE(begin, CMDTREE_TRACE_TOKENIZE, NULL, len);
+	ret = cmdtree_argv_split(argv, string, len);
+	CMD_TRACE(end, CMDTREE_TRACE_TOKENIZE, NULL, len);
+
+	return ret;
+}
+
+/*
+ * Quoting tokenizer progress, a cmd continued on the following lines resumes where the
+ * previous line ended instead of splitting the whole cmd again. Zeroed for a new cmd.
+ */
+struct cmdtree_quote_scan
+{
+	size_t		scanned;	// The string length split so far
+	size_t		token;		// The open token offset in the vector buffer
+	size_t		used;		// The vector buffer length used so far
+	uint8_t		state;		// The tokenizer state past the scanned length
+};
+
+static int cmdtree_argv_split_quoted(cmdtree_argv_t *argv, const char *string, size_t len, struct cmdtree_quote_scan *scan)
+{
+	uint8_t state = scan->state;
+	char *out;
+	char *token;
+	size_t i;
+
+	if(0 == scan->scanned)
+	{
+		/* Lines without quotes or escapes need no unescaping, they are split in place. */
+		if(NULL == memchr(string, '\'', len) && NULL == memchr(string, '"', len) && NULL == memchr(string, '\\', len))
+			return cmdtree_argv_split(argv, string, len);
+
+		argv->argc  = 0;
+		state       = CMD_QS_GAP;
+		scan->used  = 0;
+		scan->token = 0;
+	}
+
+	/* The unescaped tokens never exceed the string, plus a terminating char for the last token. */
+	if(argv->strings_size < len + CMD_TERMINATING_CHAR_LEN)
+	{
+		size_t size = len + CMD_TERMINATING_CHAR_LEN;
+		char *strings;
+		int j;
+
+		/* Continued cmds grow the buffer geometrically, the tokens so far move along. */
+		if(scan->scanned && size < 2 * argv->strings_size)
+			size = 2 * argv->strings_size;
+
+		strings = malloc(size);
+		if(NULL == strings)
+			goto fail;
+
+		if(scan->used)
+			memcpy(strings, argv->strings, scan->used);
+		for(j = 0; j < argv->argc; j++)
+			argv->tokens[j].str = strings + (argv->tokens[j].str - argv->strings);
+
+		free(argv->strings);
+		argv->strings      = strings;
+		argv->strings_size = size;
+	}
+
+	out   = argv->strings + scan->used;
+	token = argv->strings + scan->token;
+
+	for(i = scan->scanned; i < len; i++)
+	{
+		uint8_t transition = cmd_quote_transitions[state][cmd_quote_classes[(unsigned char)string[i]]];
+
+		if(transition & CMD_QA_START)
+			token = out;
+		if(transition & CMD_QA_EMIT_BSLASH)
+			*out++ = '\\';
+		if(transition & CMD_QA_EMIT)
+			*out++ = string[i];
+		if(transition & CMD_QA_END)
+		{
+			*out++ = '\0';
+			if(CMD3_SUCCESS != cmdtree_argv_push(argv, token, out - token - CMD_TERMINATING_CHAR_LEN))
+				goto fail;
+		}
+
+		state = transition & CMD_QS_MASK;
+	}
+
+	if(CMD_QS_WORD == state)
+	{
+		*out++ = '\0';
+		if(CMD3_SUCCESS != cmdtree_argv_push(argv, token, out - token - CMD_TERMINATING_CHAR_LEN))
+			goto fail;
+	}
+	else if(CMD_QS_GAP != state)
+	{
+		/* The tokens so far are kept, the following line resumes the split. */
+		scan->scanned = len;
+		scan->token   = token - argv->strings;
+		scan->used    = out - argv->strings;
+		scan->state   = state;
+		return CMD3_INCOMPLETE;
+	}
+
+	return CMD3_SUCCESS;
+
+fail:
+	argv->argc = 0;
+	return CMD3_FAIL;
+}
+
+/* The error of a cmd left open at the end of the script. */
+static const char *cmdtree_quote_scan_error(const struct cmdtree_quote_scan *scan)
+{
+	if(CMD_QS_GAP_ESC == scan->state || CMD_QS_WORD_ESC == scan->state)
+		return "Unterminated escape/continuation";
+
+	return "Unterminated quote";
+}
+
+/* Split a cmd, resuming the split of its previous lines when continued. */
+static int cmdtree_argv_tokenize_scan(cmdtree_argv_t *argv, const char *string, size_t len, struct cmdtree_quote_scan *scan)
+{
+	int ret;
+
+	CMD_TRACE(begin, CMDTREE_TRACE_TOKENIZE, NULL, len);
+	ret = cmdtree_argv_split_quoted(argv, string, len, scan);
+	CMD_TRACE(end, CMDTREE_TRACE_TOKENIZE, NULL, len);
+
+	return ret;
+}
+
+int cmdtree_argv_tokenize_quoted(cmdtree_argv_t *argv, const char *string, size_t len)
+{
+	struct cmdtree_quote_scan scan;
+	int ret;
+
+	memset(&scan, 0, sizeof(scan));
+
+	ret = cmdtree_argv_tokenize_scan(argv, string, len, &scan);
+	if(CMD3_INCOMPLETE == ret)
+		argv->argc = 0;
+
+	return ret;
+}
+
+void cmdtree_argv_release(cmdtree_argv_t *argv)
+{
+	if(argv->tokens != argv->small)
+		free(argv->tokens);
+
+	free(argv->strings);
+
+	cmdtree_argv_init(argv);
+}
+
+/* String to Vector convert */
+void cmdtree_stov(const char *string, int *arg_count, const char **arg_vec)
+{
+	/*
+	 * Split the cmd string using white space delimiters, ending up with an argv/argc format.
+	 */
+	const char **ap;
+	size_t len = 0;
+
+	CMD_TRACE(begin, CMDTREE_TRACE_TOKENIZE, NULL, (len = strlen(string)));
+
+	*arg_count = 0;
+
+	for (ap = arg_vec; (*ap = strsep((char **)&string, " \t")) != NULL;)
+	{
+		if (**ap != '\0')
+		{
+			(*arg_count)++;
+		   if (++ap >= &arg_vec[CMD_TREE_MAX_DEPTH])
+			   break;
+		}
+	}
+
+	CMD_TRACE(end, CMDTREE_TRACE_TOKENIZE, NULL, len);
+}
+
+static cmdtree_d cmdtree_lookup(cmd3_ctx_d ctx, const char *cmd_base_name)
+{
+	cmdtree_d cmd = NULL;
+
+	/*
+	 * Split the cmd string using white space delimiters, the string itself is left untouched.
+	 */
+	cmdtree_token_t tokens[CMD_TREE_MAX_DEPTH];
+	const cmdtree_token_t *token = tokens;
+	int   token_count;
+
+	token_count = cmdtree_split(cmd_base_name, strlen(cmd_base_name), tokens, CMD_TREE_MAX_DEPTH);
+	if(token_count > CMD_TREE_MAX_DEPTH)
+		token_count = CMD_TREE_MAX_DEPTH;
+
+	if (token_count > 0)
+	{
+		cmdtree_d cmd_base;
+
+		cmd_base = ctx->root;
+		do
+		{
+			HASH_FIND(hh, cmd_base, token->str, token->len, cmd);
+			if(cmd)
+			{
+				token_count--;
+				token++;
+
+				cmd_base = cmd->child;
+			}
+		} while (cmd_base && token_count && cmd);
+	}
+
+	return cmd;
+}
+
+void cmdtree_destroy(cmdtree_d cmdtree)
+{
+	struct cmd3_ctx *ctx = cmdtree->ctx;
+
+	pthread_mutex_lock(&ctx->lock);
+
+	cmdtree_destroy_locked(cmdtree);
+	cmd3_rcu_reclaim(&ctx->retired, 0);
+
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+static void cmdtree_destroy_locked(cmdtree_d cmdtree)
+{
+	struct cmd3_ctx *ctx = cmdtree->ctx;
+	cmdtree_d *head_ref;
+	struct cmdtree_level **level_ref;
+	struct cmdtree_level *level;
+
+	/*
+	 * The cmd entry should not be deleted in these cases:
+	 * - The entry has a child. (the child sub-tree needs to be deleted first)
+	 */
+	if(cmdtree->child)
+	{
+		return;
+	}
+
+	/* Readers stop seeing the cmd once the updated level is published. */
+	level_ref = cmdtree->parent ? &cmdtree->parent->level : &ctx->level;
+	level = cmdtree_level_remove(ctx, *level_ref, cmdtree);
+	if(NULL == level && (*level_ref)->count > 1)
+	{
+		return;
+	}
+
+	cmdtree_image_retire(ctx);
+	cmdtree_level_publish(ctx, level_ref, level);
+
+	cmd_hash_ctx = ctx;
+
+	/*
+	 * The hash table head is the context root for a root level cmd, or the parent "first child".
+	 * It is updated in place, as deleting the head entry moves the head to the next entry.
+	 */
+	head_ref = cmdtree->parent ? &cmdtree->parent->child : &ctx->root;
+
+	HASH_DEL(*head_ref, cmdtree);
+	cmd3_rcu_retire(&ctx->retired, cmdtree, cmdtree_node_release, ctx);
+}
+
+static int cmdtree_destroy_subtree_locked(cmdtree_d cmdtree)
+{
+	struct cmd3_ctx *ctx = cmdtree->ctx;
+	cmdtree_d *head_ref;
+	struct cmdtree_level **level_ref;
+	struct cmdtree_level *level;
+
+	/* Readers stop seeing the subtree once the updated level is published. */
+	level_ref = cmdtree->parent ? &cmdtree->parent->level : &ctx->level;
+	level = cmdtree_level_remove(ctx, *level_ref, cmdtree);
+	if(NULL == level && (*level_ref)->count > 1)
+	{
+		return CMD3_FAIL;
+	}
+
+	cmdtree_image_retire(ctx);
+	cmdtree_level_publish(ctx, level_ref, level);
+
+	cmd_hash_ctx = ctx;
+
+	head_ref = cmdtree->parent ? &cmdtree->parent->child : &ctx->root;
+	HASH_DEL(*head_ref, cmdtree);
+
+	/* The hash tables are writer only, the nodes and levels are released once no reader may use them. */
+	cmdtree_subtree_clear(cmdtree);
+	cmd3_rcu_retire(&ctx->retired, cmdtree, cmdtree_subtree_release, ctx);
+
+	return CMD3_SUCCESS;
+}
+
+int cmdtree_destroy_subtree(cmdtree_d cmdtree)
+{
+	struct cmd3_ctx *ctx = cmdtree->ctx;
+	int ret;
+
+	pthread_mutex_lock(&ctx->lock);
+
+	ret = cmdtree_destroy_subtree_locked(cmdtree);
+	cmd3_rcu_reclaim(&ctx->retired, 0);
+
+	pthread_mutex_unlock(&ctx->lock);
+
+	return ret;
+}
+
+cmdtree_d new_cmdtree_create(const char cmdname[], const char cmdcomment[], cmdtree_cmdfunc cmdfunc, const char parent_name[])
+{
+    cmdtree_config_t cmd_cfg;
+
+    memset(&cmd_cfg, 0, sizeof(cmd_cfg));
+
+    cmd_cfg.name        = cmdname;
+    cmd_cfg.cmdfunc     = cmdfunc;
+    cmd_cfg.comment     = cmdcomment;
+    cmd_cfg.parent_name = parent_name;
+    cmdtree_d cmdtree = cmdtree_create(&cmd_cfg);
+
+    return cmdtree;
+}
+
+cmdtree_d cmdtree_get_root_ctx(cmd3_ctx_d ctx)
+{
+	return ctx->root;
+}
+
+cmdtree_d cmdtree_get_root(void)
+{
+	return cmdtree_get_root_ctx(&cmd_default_ctx);
+}
+
+#ifdef CMD3_STATS
+static void cmdtree_stats_record(struct cmdtree_counters *stats, const struct timespec *start, int failed)
+{
+	struct timespec end;
+	uint64_t ns;
+	int bucket;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	ns = (uint64_t)(end.tv_sec - start->tv_sec) * 1000000000ULL + end.tv_nsec - start->tv_nsec;
+
+	bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+	if(bucket >= CMD_STATS_BUCKETS)
+		bucket = CMD_STATS_BUCKETS - 1;
+
+	__atomic_fetch_add(&stats->calls, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&stats->time_ns, ns, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&stats->hist[bucket], 1, __ATOMIC_RELAXED);
+	if(failed)
+		__atomic_fetch_add(&stats->errors, 1, __ATOMIC_RELAXED);
+}
+#endif
+
+/* The handler arguments length, for tracing. */
+static size_t cmdtree_argv_len(int argc, const char **argv)
+{
+	size_t total = 0;
+	int i;
+
+	for(i = 0; i < argc; i++)
+		total += strlen(argv[i]);
+
+	return total;
+}
+
+/*
+ * Call the node command function, the user data is passed to cmdtree_cmdfunc_ud/typed functions only.
+ * With a schema the arguments are parsed first, invalid arguments are reported instead of calling it.
+ */
+static int cmdtree_call(cmd3_ctx_d ctx, const struct cmdtree_handler *handler,
+						int argc, const char **argv, struct cmdtree_out *out)
+{
+	cmdtree_arg_t values_small[CMD_SCHEMA_SMALL_ARGS];
+	cmdtree_arg_t *values = values_small;
+	int arg_count = 0;
+	int ret;
+#ifdef CMD3_STATS
+	struct timespec call_start;
+
+	if(handler->stats)
+		clock_gettime(CLOCK_MONOTONIC, &call_start);
+#endif
+
+	out->ctx = ctx;
+	out->cmd = handler->node;
+
+	CMD_TRACE(begin, CMDTREE_TRACE_HANDLER, handler->node, cmdtree_argv_len(argc, argv));
+
+	if(handler->schema)
+	{
+		arg_count = handler->schema->count;
+		if(arg_count > CMD_SCHEMA_SMALL_ARGS)
+		{
+			values = malloc(arg_count * sizeof(cmdtree_arg_t));
+			if(NULL == values)
+			{
+				size_t start = out->total;
+
+				/* Reported and accounted as a failed call. */
+				values = values_small;
+				cmdtree_out_printf(out, "Out of memory parsing the arguments\n");
+				ret = cmdtree_out_len(out, start);
+				goto out;
+			}
+		}
+
+		ret = cmdtree_schema_parse(handler->schema, ctx->exact_match, argc, argv, values, out);
+		if(ret)
+			goto out;
+	}
+
+	out->called = 1;
+
+	if(handler->cmdfunc_out)
+	{
+		size_t start = out->total;
+
+		ret = handler->cmdfunc_out(ctx->user_data, argc, argv, out);
+		if(CMD3_SUCCESS == ret)
+			ret = cmdtree_out_len(out, start);
+	}
+	else
+	{
+		/* Buffer based cmd functions write straight into the (flushed) staging buffer, a whole chunk when chained. */
+		char *buf;
+		size_t buf_size;
+
+		cmdtree_out_flush(out);
+		if(out->chain && !out->error)
+			cmdtree_out_chain_room(out, out->chain->chunk_size);
+
+		buf      = out->buf + out->used;
+		buf_size = out->size - out->used + CMD_TERMINATING_CHAR_LEN;
+
+		if(handler->cmdfunc_typed)
+			ret = handler->cmdfunc_typed(ctx->user_data, arg_count ? values : NULL, arg_count, buf, buf_size);
+		else if(handler->cmdfunc_ud)
+			ret = handler->cmdfunc_ud(ctx->user_data, argc, argv, buf, buf_size);
+		else
+			ret = handler->cmdfunc(argc, argv, buf, buf_size);
+
+		cmdtree_out_commit(out, ret);
+	}
+
+out:
+	CMD_TRACE(end, CMDTREE_TRACE_HANDLER, handler->node, ret > 0 ? ret : 0);
+#ifdef CMD3_STATS
+	/* An argument report is counted as a failed call. */
+	if(handler->stats)
+		cmdtree_stats_record(handler->stats, &call_start, ret <= 0 || !out->called);
+#endif
+	if(values != values_small)
+		free(values);
+
+	return ret;
+}
+
+static const char *cmdtree_args_get(const struct cmdtree_args *args, int i, size_t *len)
+{
+	if(args->argv)
+	{
+		*len = strlen(args->argv[i]);
+		return args->argv[i];
+	}
+
+	*len = args->tokens[i].len;
+	return args->tokens[i].str;
+}
+
+/* A "*" argument stands for every child of its level. */
+static inline int cmdtree_args_wildcard(const char *name, size_t len)
+{
+	return 1 == len && '*' == name[0];
+}
+
+/* The cmd tokens length, for tracing. */
+static size_t cmdtree_args_len(const struct cmdtree_args *args)
+{
+	size_t total = 0;
+	size_t len;
+	int i;
+
+	for(i = 0; i < args->argc; i++)
+	{
+		cmdtree_args_get(args, i, &len);
+		total += len;
+	}
+
+	return total;
+}
+
+/*
+ * Call the cmd handler with the arguments from the cmd name on.
+ * Tokens are copied as C strings for the handler, a small vector is kept on the stack.
+ */
+static int cmdtree_args_call(cmd3_ctx_d ctx, const struct cmdtree_handler *handler,
+							 const struct cmdtree_args *args, int first, struct cmdtree_out *out)
+{
+	const char *argv_small[CMD_TREE_MAX_DEPTH];
+	char strings_small[CMD_ARGS_SMALL_SIZE];
+	const char **argv = argv_small;
+	char *strings = strings_small;
+	int argc = args->argc - first;
+	size_t strings_size = 0;
+	int ret;
+	int i;
+
+	if(args->argv)
+		return cmdtree_call(ctx, handler, argc, args->argv + first, out);
+
+	for(i = first; i < args->argc; i++)
+		strings_size += args->tokens[i].len + CMD_TERMINATING_CHAR_LEN;
+
+	if(argc > CMD_TREE_MAX_DEPTH || strings_size > sizeof(strings_small))
+	{
+		argv = malloc(argc * sizeof(const char *) + strings_size);
+		if(NULL == argv)
+			return 0;
+
+		strings = (char *)&argv[argc];
+	}
+
+	for(i = 0; i < argc; i++)
+	{
+		const cmdtree_token_t *token = &args->tokens[first + i];
+
+		memcpy(strings, token->str, token->len);
+		strings[token->len] = '\0';
+		argv[i] = strings;
+		strings += token->len + CMD_TERMINATING_CHAR_LEN;
+	}
+
+	ret = cmdtree_call(ctx, handler, argc, argv, out);
+
+	if(argv != argv_small)
+		free(argv);
+
+	return ret;
+}
+
+/* Log a slow cmd, an entry still owned by a (wrapped around) writer is not waited for, the cmd is dropped. */
+static void cmdtree_slowlog_record(struct cmdtree_slowlog *slowlog, const struct cmdtree_args *args,
+								   uint64_t duration_ns, size_t output_len)
+{
+	uint64_t id = __atomic_fetch_add(&slowlog->next, 1, __ATOMIC_RELAXED);
+	struct cmdtree_slowlog_entry *entry = &slowlog->entries[id % slowlog->size];
+	uint64_t seq = __atomic_load_n(&entry->seq, __ATOMIC_RELAXED);
+	struct timespec now;
+	size_t line_len = 0;
+	size_t len;
+	int i;
+
+	/* The entry is claimed from an older id only, a writer overtaken by a newer id leaves its entry alone. */
+	if((seq & 1) || seq >= (id + 1) * 2 ||
+	   !__atomic_compare_exchange_n(&entry->seq, &seq, seq | 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	entry->time_us     = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000 - duration_ns / 1000;
+	entry->duration_us = duration_ns / 1000;
+	entry->output_len  = output_len;
+
+	for(i = 0; i < args->argc; i++)
+	{
+		const char *name = cmdtree_args_get(args, i, &len);
+
+		if(i)
+		{
+			if(line_len < CMD_SLOWLOG_LINE_SIZE)
+				entry->line[line_len] = ' ';
+			line_len++;
+		}
+
+		if(line_len < CMD_SLOWLOG_LINE_SIZE)
+			memcpy(entry->line + line_len, name, len < CMD_SLOWLOG_LINE_SIZE - line_len ? len : CMD_SLOWLOG_LINE_SIZE - line_len);
+		line_len += len;
+	}
+
+	entry->line_len = line_len > UINT32_MAX ? UINT32_MAX : line_len;
+
+	__atomic_store_n(&entry->seq, (id + 1) * 2, __ATOMIC_RELEASE);
+}
+
+static int cmdtree_exec_walk(cmd3_ctx_d ctx, const struct cmdtree_args *args, struct cmdtree_out *out)
+{
+	const struct cmdtree_image *image;
+	const struct cmdtree_level *level;
+	int ret = 0;
+
+	out->cmd = NULL;
+
+	/* Readers take no lock, the levels and image seen are kept alive until the section is left. */
+	cmd3_rcu_read_lock();
+
+	image = __atomic_load_n(&ctx->image, __ATOMIC_ACQUIRE);
+	level = __atomic_load_n(&ctx->level, __ATOMIC_ACQUIRE);
+
+	if(image)
+	{
+		ret = cmdtree_image_exec(ctx, image, args, out);
+	}
+	else if(0 == args->argc)
+	{
+		CMD_TRACE(begin, CMDTREE_TRACE_REPORT, NULL, 0);
+		ret = cmdtree_report_tree(level, out);
+		CMD_TRACE(end, CMDTREE_TRACE_REPORT, NULL, ret);
+	}
+	else
+	{
+		cmdtree_d cmd_tree = NULL;
+		uint32_t match_first;
+		uint32_t match_count;
+		const char *name;
+		size_t len;
+		int broadcast = 0;
+		int pos = 0;
+
+		CMD_TRACE(begin, CMDTREE_TRACE_LOOKUP, NULL, cmdtree_args_len(args));
+
+		do
+		{
+			name = cmdtree_args_get(args, pos, &len);
+
+			/*
+			 * A "*" broadcasts over the children of its level, unless a child is named so.
+			 * A junction running a cmd of its own takes it as an argument instead.
+			 */
+			if(level && level->count && cmdtree_args_wildcard(name, len) &&
+			   NULL == cmdtree_level_match(level, name, len, 1, &match_first, &match_count))
+			{
+				broadcast = NULL == cmd_tree || !cmdtree_handler_set(cmd_tree->handler);
+				break;
+			}
+
+			cmd_tree = cmdtree_level_match(level, name, len, ctx->exact_match, &match_first, &match_count);
+			if(cmd_tree)
+			{
+				pos++;
+
+				level = __atomic_load_n(&cmd_tree->level, __ATOMIC_ACQUIRE);
+			}
+		} while (level && pos < args->argc && cmd_tree);
+
+		CMD_TRACE(end, CMDTREE_TRACE_LOOKUP, cmd_tree, cmdtree_args_len(args));
+		out->cmd = cmd_tree;
+
+		if(broadcast)
+		{
+			ret = cmdtree_broadcast(ctx, level, args, pos, out);
+		}
+		else if(cmd_tree && cmdtree_handler_set(cmd_tree->handler))
+		{
+			ret = cmdtree_args_call(ctx, cmd_tree->handler, args, pos - 1, out);
+		}
+		else if(NULL == cmd_tree || level)
+		{
+			CMD_TRACE(begin, CMDTREE_TRACE_REPORT, cmd_tree, 0);
+			if(cmd_tree)
+				ret = cmdtree_report_tree(level, out);
+			else if(match_count > 1)
+				ret = cmdtree_report_ambiguous(level, name, len, match_first, match_count, out);
+			else
+				ret = cmdtree_report_tree(level, out);
+			CMD_TRACE(end, CMDTREE_TRACE_REPORT, cmd_tree, ret);
+		}
+	}
+
+	cmd3_rcu_read_unlock();
+
+	return ret;
+}
+
+/* Run the cmd, timing it for the slow log when there is one. */
+static int cmdtree_exec_args(cmd3_ctx_d ctx, const struct cmdtree_args *args, struct cmdtree_out *out)
+{
+	struct cmdtree_slowlog *slowlog = __atomic_load_n(&ctx->slowlog, __ATOMIC_ACQUIRE);
+	struct timespec start;
+	struct timespec end;
+	size_t total = out->total;
+	uint64_t duration_ns;
+	int ret;
+
+	if(NULL == slowlog)
+		return cmdtree_exec_walk(ctx, args, out);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ret = cmdtree_exec_walk(ctx, args, out);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	duration_ns = (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec;
+	if(duration_ns >= slowlog->threshold_ns)
+		cmdtree_slowlog_record(slowlog, args, duration_ns, out->total - total);
+
+	return ret;
+}
+
+static int cmdtree_exec_buf(cmd3_ctx_d ctx, const struct cmdtree_args *args, char *buf, size_t buf_size)
+{
+	struct cmdtree_out out;
+	int ret;
+
+	/* No room for even the terminating char, nothing is run or written. */
+	if(0 == buf_size)
+		return 0;
+
+	cmdtree_out_init(&out, buf, buf_size, NULL);
+
+	ret = cmdtree_exec_args(ctx, args, &out);
+	if(ret <= 0)
+	{
+		out.used = 0;
+		cmdtree_out_printf(&out, "Missing parameter or unsupported command.\n");
+		ret = out.used;
+	}
+
+	buf[out.used] = '\0';
+
+	return ret + CMD_TERMINATING_CHAR_LEN;
+}
+
+static int cmdtree_exec_sink_args(cmd3_ctx_d ctx, const struct cmdtree_args *args, const cmdtree_sink_t *sink)
+{
+	char staging[CMD_OUT_STAGING_SIZE];
+	struct cmdtree_out out;
+	int ret;
+
+	cmdtree_out_init(&out, staging, sizeof(staging), sink);
+
+	ret = cmdtree_exec_args(ctx, args, &out);
+	if(ret <= 0 && 0 == out.total)
+	{
+		cmdtree_out_printf(&out, "Missing parameter or unsupported command.\n");
+	}
+
+	return cmdtree_out_flush(&out);
+}
+
+static int cmdtree_exec_chain_args(cmd3_ctx_d ctx, const struct cmdtree_args *args, cmdtree_chain_d chain)
+{
+	struct cmdtree_out out;
+	int ret;
+
+	if(CMD3_SUCCESS != cmdtree_out_init_chain(&out, chain))
+		return CMD3_FAIL;
+
+	ret = cmdtree_exec_args(ctx, args, &out);
+	if(ret <= 0 && 0 == out.total)
+	{
+		cmdtree_out_printf(&out, "Missing parameter or unsupported command.\n");
+	}
+
+	return cmdtree_out_flush(&out);
+}
+
+int cmdtree_exec_ctx(cmd3_ctx_d ctx, int argc, const char **argv, char *buf, size_t buf_size)
+{
+	struct cmdtree_args args = { argc, argv, NULL };
+
+	return cmdtree_exec_buf(ctx, &args, buf, buf_size);
+}
+
+int cmdtree_exec(int argc, const char **argv, char *buf, size_t buf_size)
+{
+	return cmdtree_exec_ctx(&cmd_default_ctx, argc, argv, buf, buf_size);
+}
+
+int cmdtree_exec_tokens_ctx(cmd3_ctx_d ctx, int argc, const cmdtree_token_t *tokens, char *buf, size_t buf_size)
+{
+	struct cmdtree_args args = { argc, NULL, tokens };
+
+	return cmdtree_exec_buf(ctx, &args, buf, buf_size);
+}
+
+int cmdtree_exec_tokens(int argc, const cmdtree_token_t *tokens, char *buf, size_t buf_size)
+{
+	return cmdtree_exec_tokens_ctx(&cmd_default_ctx, argc, tokens, buf, buf_size);
+}
+
+int cmdtree_exec_sink_ctx(cmd3_ctx_d ctx, int argc, const char **argv, const cmdtree_sink_t *sink)
+{
+	struct cmdtree_args args = { argc, argv, NULL };
+
+	return cmdtree_exec_sink_args(ctx, &args, sink);
+}
+
+int cmdtree_exec_sink(int argc, const char **argv, const cmdtree_sink_t *sink)
+{
+	return cmdtree_exec_sink_ctx(&cmd_default_ctx, argc, argv, sink);
+}
+
+int cmdtree_exec_tokens_sink_ctx(cmd3_ctx_d ctx, int argc, const cmdtree_token_t *tokens, const cmdtree_sink_t *sink)
+{
+	struct cmdtree_args args = { argc, NULL, tokens };
+
+	return cmdtree_exec_sink_args(ctx, &args, sink);
+}
+
+int cmdtree_exec_tokens_sink(int argc, const cmdtree_token_t *tokens, const cmdtree_sink_t *sink)
+{
+	return cmdtree_exec_tokens_sink_ctx(&cmd_default_ctx, argc, tokens, sink);
+}
+
+int cmdtree_exec_chain_ctx(cmd3_ctx_d ctx, int argc, const char **argv, cmdtree_chain_d chain)
+{
+	struct cmdtree_args args = { argc, argv, NULL };
+
+	return cmdtree_exec_chain_args(ctx, &args, chain);
+}
+
+int cmdtree_exec_chain(int argc, const char **argv, cmdtree_chain_d chain)
+{
+	return cmdtree_exec_chain_ctx(&cmd_default_ctx, argc, argv, chain);
+}
+
+int cmdtree_exec_tokens_chain_ctx(cmd3_ctx_d ctx, int argc, const cmdtree_token_t *tokens, cmdtree_chain_d chain)
+{
+	struct cmdtree_args args = { argc, NULL, tokens };
+
+	return cmdtree_exec_chain_args(ctx, &args, chain);
+}
+
+int cmdtree_exec_tokens_chain(int argc, const cmdtree_token_t *tokens, cmdtree_chain_d chain)
+{
+	return cmdtree_exec_tokens_chain_ctx(&cmd_default_ctx, argc, tokens, chain);
+}
+
+/* Run a batch cmd, its output follows the output of the previous cmds. */
+static int cmdtree_batch_exec(cmd3_ctx_d ctx, const struct cmdtree_args *args, struct cmdtree_out *out,
+							  cmdtree_batch_result_t *result)
+{
+	size_t start = out->total;
+	int status;
+	int ret;
+
+	out->called = 0;
+
+	ret = cmdtree_exec_args(ctx, args, out);
+	if(ret <= 0 && out->total == start)
+	{
+		cmdtree_out_printf(out, "Missing parameter or unsupported command.\n");
+	}
+
+	/* A usage report (unknown, ambiguous or partial cmd) fails the cmd as well. */
+	status = (ret > 0 && (out->called || 0 == args->argc)) ? CMD3_SUCCESS : CMD3_FAIL;
+
+	if(result)
+	{
+		result->status = status;
+		result->offset = start;
+		result->len    = out->total - start;
+	}
+
+	return status;
+}
+
+/* Tokenize the script cmd starting at line, setting line_end past its last line.
+ * Blank and comment lines end at their own newline, yielding no tokens. */
+static int cmdtree_script_next(cmdtree_argv_t *argv, const char *line, const char *end, const char **line_end,
+							   struct cmdtree_quote_scan *scan)
+{
+	const char *cmd_end = memchr(line, '\n', end - line);
+	const char *first = line;
+	int status;
+
+	cmd_end = cmd_end ? cmd_end : end;
+	memset(scan, 0, sizeof(*scan));
+
+	/* Checked on the raw line, the quotes and escapes of a comment do not continue it. */
+	while(first < cmd_end && (' ' == *first || '\t' == *first))
+		first++;
+
+	if(first == cmd_end || '#' == *first)
+	{
+		argv->argc = 0;
+		*line_end  = cmd_end;
+		return CMD3_SUCCESS;
+	}
+
+	/* A quote left open continues the cmd on the following lines, each one split once. */
+	while(CMD3_INCOMPLETE == (status = cmdtree_argv_tokenize_scan(argv, line, cmd_end - line, scan)) && cmd_end < end)
+	{
+		cmd_end = memchr(cmd_end + 1, '\n', end - cmd_end - 1);
+		cmd_end = cmd_end ? cmd_end : end;
+	}
+
+	*line_end = cmd_end;
+
+	return status;
+}
+
+int cmdtree_exec_batch_ctx(cmd3_ctx_d ctx, const char *script, size_t len, int flags, const cmdtree_sink_t *sink,
+						   cmdtree_batch_result_t *results, size_t max_results)
+{
+	char staging[CMD_OUT_STAGING_SIZE];
+	struct cmdtree_quote_scan scan;
+	struct cmdtree_out out;
+	cmdtree_argv_t argv;
+	const char *end = script + len;
+	const char *line = script;
+	size_t count = 0;
+	int ret = CMD3_SUCCESS;
+
+	/* The cmds share the tokens vector and the output staging buffer. */
+	cmdtree_out_init(&out, staging, sizeof(staging), sink);
+	cmdtree_argv_init(&argv);
+
+	while(line < end)
+	{
+		const char *line_end;
+		cmdtree_batch_result_t *result = (results && count < max_results) ? &results[count] : NULL;
+		struct cmdtree_args args;
+		int status;
+
+		status = cmdtree_script_next(&argv, line, end, &line_end, &scan);
+
+		if(CMD3_FAIL == status)
+		{
+			ret = CMD3_FAIL;
+			break;
+		}
+
+		if(CMD3_INCOMPLETE == status)
+		{
+			if(result)
+			{
+				result->status = CMD3_FAIL;
+				result->offset = out.total;
+			}
+
+			cmdtree_out_printf(&out, "%s: %.*s\n", cmdtree_quote_scan_error(&scan), (int)(line_end - line), line);
+
+			if(result)
+				result->len = out.total - result->offset;
+
+			count++;
+			break;
+		}
+
+		line = line_end + (line_end < end);
+
+		/* Blank and comment lines are skipped. */
+		if(0 == argv.argc)
+			continue;
+
+		args.argc   = argv.argc;
+		args.argv   = NULL;
+		args.tokens = argv.tokens;
+
+		status = cmdtree_batch_exec(ctx, &args, &out, result);
+		count++;
+
+		if(out.error || (CMD3_FAIL == status && (flags & CMDTREE_BATCH_STOP_ON_FAIL)))
+			break;
+	}
+
+	cmdtree_argv_release(&argv);
+
+	if(CMD3_SUCCESS != cmdtree_out_flush(&out))
+		ret = CMD3_FAIL;
+
+	return CMD3_SUCCESS == ret ? (int)count : CMD3_FAIL;
+}
+
+int cmdtree_exec_batch(const char *script, size_t len, int flags, const cmdtree_sink_t *sink,
+					   cmdtree_batch_result_t *results, size_t max_results)
+{
+	return cmdtree_exec_batch_ctx(&cmd_default_ctx, script, len, flags, sink, results, max_results);
+}
+
+int cmdtree_exec_batch_argv_ctx(cmd3_ctx_d ctx, const cmdtree_cmdline_t *cmds, size_t cmd_count, int flags,
+								const cmdtree_sink_t *sink, cmdtree_batch_result_t *results)
+{
+	char staging[CMD_OUT_STAGING_SIZE];
+	struct cmdtree_out out;
+	size_t count = 0;
+
+	cmdtree_out_init(&out, staging, sizeof(staging), sink);
+
+	while(count < cmd_count)
+	{
+		struct cmdtree_args args = { cmds[count].argc, cmds[count].argv, NULL };
+		int status;
+
+		status = cmdtree_batch_exec(ctx, &args, &out, results ? &results[count] : NULL);
+		count++;
+
+		if(out.error || (CMD3_FAIL == status && (flags & CMDTREE_BATCH_STOP_ON_FAIL)))
+			break;
+	}
+
+	if(CMD3_SUCCESS != cmdtree_out_flush(&out))
+		return CMD3_FAIL;
+
+	return (int)count;
+}
+
+int cmdtree_exec_batch_argv(const cmdtree_cmdline_t *cmds, size_t cmd_count, int flags,
+							const cmdtree_sink_t *sink, cmdtree_batch_result_t *results)
+{
+	return cmdtree_exec_batch_argv_ctx(&cmd_default_ctx, cmds, cmd_count, flags, sink, results);
+}
+
+int cmdtree_complete_ctx(cmd3_ctx_d ctx, int argc, const char **argv, cmdtree_complete_cb complete_cb, void *arg)
+{
+	const struct cmdtree_level *level;
+	cmdtree_d cmd_tree = NULL;
+	uint32_t match_first = 0;
+	uint32_t match_count = 0;
+	uint32_t i;
+
+	if(argc <= 0)
+		return 0;
+
+	cmd3_rcu_read_lock();
+
+	level = __atomic_load_n(&ctx->level, __ATOMIC_ACQUIRE);
+
+	/* Resolve the preceding (complete) tokens, the last token is the one to complete. */
+	for(; level && argc > 1; argc--, argv++)
+	{
+		cmd_tree = cmdtree_level_match(level, *argv, strlen(*argv), ctx->exact_match, &match_first, &match_count);
+
+		level = cmd_tree ? __atomic_load_n(&cmd_tree->level, __ATOMIC_ACQUIRE) : NULL;
+	}
+
+	match_count = 0;
+	if(level)
+	{
+		cmdtree_level_match(level, *argv, strlen(*argv), 0, &match_first, &match_count);
+
+		for(i = match_first; i < match_first + match_count; i++)
+			complete_cb(arg, level->sorted[i].name);
+	}
+	else if(cmd_tree && cmd_tree->handler->schema)
+	{
+		/* Past a cmd with a schema, the remaining tokens are its arguments, enum values get completed. */
+		const struct cmdtree_schema_arg *schema_arg = NULL;
+		const char *last = argv[argc - 1];
+
+		if(argc - 1 < cmd_tree->handler->schema->count)
+			schema_arg = &cmd_tree->handler->schema->args[argc - 1];
+
+		if(schema_arg && CMDTREE_ARG_ENUM == schema_arg->spec.type)
+		{
+			cmdtree_key_match(schema_arg->enum_keys, schema_arg->enum_count, last, strlen(last), 0,
+							  &match_first, &match_count);
+
+			for(i = match_first; i < match_first + match_count; i++)
+				complete_cb(arg, schema_arg->enum_keys[i].name);
+		}
+	}
+
+	cmd3_rcu_read_unlock();
+
+	return match_count;
+}
+
+int cmdtree_complete(int argc, const char **argv, cmdtree_complete_cb complete_cb, void *arg)
+{
+	return cmdtree_complete_ctx(&cmd_default_ctx, argc, argv, complete_cb, arg);
+}
+
+
+static int cmdtree_report_ambiguous(const struct cmdtree_level *level, const char *name, size_t len,
+									uint32_t first, uint32_t count, struct cmdtree_out *out)
+{
+	size_t start = out->total;
+	uint32_t i;
+
+	cmdtree_out_printf(out, "Ambiguous command: %.*s\n", (int)len, name);
+
+	for(i = first; i < first + count; i++)
+	{
+		cmdtree_d cmd = level->nodes[level->sorted[i].index];
+
+		cmdtree_help_row(out, cmd->name, cmd->name_len, cmd->comment, cmd->comment_len);
+	}
+
+	return cmdtree_out_len(out, start);
+}
+
+/*
+ * The level help text, rendered on first use. Concurrent readers may render it at once,
+ * the first one published is kept. NULL on allocation failure.
+ */
+static const struct cmdtree_help *cmdtree_level_help(const struct cmdtree_level *level)
+{
+	struct cmdtree_level *help_level = (struct cmdtree_level *)level;
+	struct cmdtree_help *help;
+	struct cmdtree_help *published = NULL;
+	struct cmdtree_out out;
+	size_t len = 0;
+	uint32_t i;
+
+	help = __atomic_load_n(&help_level->help, __ATOMIC_ACQUIRE);
+	if(help || 0 == level->count)
+		return help;
+
+	for(i = 0; i < level->count; i++)
+		len += cmdtree_help_row_len(level->nodes[i]->name_len, level->nodes[i]->comment_len);
+
+	help = malloc(sizeof(struct cmdtree_help) + level->count * sizeof(size_t) + len + CMD_TERMINATING_CHAR_LEN);
+	if(NULL == help)
+		return NULL;
+
+	help->len  = len;
+	help->text = (char *)&help->row_end[level->count];
+
+	cmdtree_out_init(&out, help->text, len + CMD_TERMINATING_CHAR_LEN, NULL);
+	for(i = 0; i < level->count; i++)
+	{
+		cmdtree_help_row(&out, level->nodes[i]->name, level->nodes[i]->name_len,
+						 level->nodes[i]->comment, level->nodes[i]->comment_len);
+		help->row_end[i] = out.used;
+	}
+
+	if(!__atomic_compare_exchange_n(&help_level->help, &published, help, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	{
+		free(help);
+		return published;
+	}
+
+	__atomic_fetch_add(&level->nodes[0]->ctx->helps, 1, __ATOMIC_RELAXED);
+
+	return help;
+}
+
+/*
+ * Output the level help rows from the first one given, as long as they fit the limit.
+ * The first row is output even if it does not fit, truncated by the output.
+ * Returns the row past the last one output.
+ */
+static uint32_t cmdtree_report_rows(const struct cmdtree_level *level, uint32_t first, size_t limit, struct cmdtree_out *out)
+{
+	const struct cmdtree_help *help = cmdtree_level_help(level);
+	uint32_t i;
+
+	if(help)
+	{
+		size_t row_start = first ? help->row_end[first - 1] : 0;
+
+		/* The rows which fit are copied at once. */
+		for(i = first; i < level->count && (i == first || help->row_end[i] - row_start <= limit); i++)
+			;
+
+		if(i > first)
+			cmdtree_out_write(out, help->text + row_start, help->row_end[i - 1] - row_start);
+
+		return i;
+	}
+
+	for(i = first; i < level->count; i++)
+	{
+		size_t row_len = cmdtree_help_row_len(level->nodes[i]->name_len, level->nodes[i]->comment_len);
+
+		if(row_len > limit && i > first)
+			break;
+
+		cmdtree_help_row(out, level->nodes[i]->name, level->nodes[i]->name_len,
+						 level->nodes[i]->comment, level->nodes[i]->comment_len);
+		limit -= row_len < limit ? row_len : limit;
+	}
+
+	return i;
+}
+
+static int cmdtree_report_tree(const struct cmdtree_level *level, struct cmdtree_out *out)
+{
+	size_t start = out->total;
+
+	if(level)
+		cmdtree_report_rows(level, 0, SIZE_MAX, out);
+
+	return cmdtree_out_len(out, start);
+}
+
+static void cmdtree_image_count(cmdtree_d cmd_start, uint32_t *node_count, size_t *names_size, size_t *comments_size)
+{
+	cmdtree_d cmd_iterate;
+	cmdtree_d cmd_temp;
+
+	HASH_ITER(hh, cmd_start, cmd_iterate, cmd_temp)
+	{
+		(*node_count)++;
+		*names_size    += cmd_iterate->name_len + CMD_TERMINATING_CHAR_LEN;
+		*comments_size += cmd_iterate->comment_len + CMD_TERMINATING_CHAR_LEN;
+
+		cmdtree_image_count(cmd_iterate->child, node_count, names_size, comments_size);
+	}
+}
+
+static int cmdtree_freeze_locked(cmd3_ctx_d ctx)
+{
+	struct cmdtree_image *image;
+	cmdtree_d *live;
+	uint32_t node_count = 1;
+	uint32_t filled = 1;
+	uint32_t i;
+	size_t names_size = 0;
+	size_t comments_size = 0;
+	size_t names_used = 0;
+	size_t comments_used;
+	size_t nodes_offset;
+	size_t sorted_offset;
+	size_t strings_offset;
+
+	cmdtree_image_retire(ctx);
+	cmdtree_image_count(ctx->root, &node_count, &names_size, &comments_size);
+
+	/* The image header, nodes, sorted keys and string table share a single block. */
+	nodes_offset   = (sizeof(struct cmdtree_image) + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+	sorted_offset  = nodes_offset + node_count * sizeof(struct cmdtree_image_node);
+	strings_offset = sorted_offset + node_count * sizeof(struct cmdtree_key);
+
+	image = calloc(1, strings_offset + names_size + comments_size);
+	live  = calloc(node_count, sizeof(cmdtree_d));
+	if(NULL == image || NULL == live)
+	{
+		free(image);
+		free(live);
+		return CMD3_FAIL;
+	}
+
+	image->node_count = node_count;
+	image->nodes      = (struct cmdtree_image_node *)((char *)image + nodes_offset);
+	image->sorted     = (struct cmdtree_key *)((char *)image + sorted_offset);
+	image->strings    = (char *)image + strings_offset;
+
+	/* The names are packed together, the comments are only read by the reports. */
+	comments_used = names_size;
+
+	/* Breadth-first walk, the image nodes array is used as the walk queue. */
+	for(i = 0; i < filled; i++)
+	{
+		struct cmdtree_image_node *node = &image->nodes[i];
+		cmdtree_d cmd_iterate;
+		cmdtree_d cmd_temp;
+
+		node->child_first = filled;
+
+		HASH_ITER(hh, (0 == i) ? ctx->root : live[i]->child, cmd_iterate, cmd_temp)
+		{
+			struct cmdtree_image_node *child_node = &image->nodes[filled];
+			size_t len;
+
+			live[filled] = cmd_iterate;
+
+			len = cmd_iterate->name_len + CMD_TERMINATING_CHAR_LEN;
+			memcpy(image->strings + names_used, cmd_iterate->name, len);
+			child_node->name = names_used;
+			names_used += len;
+
+			len = cmd_iterate->comment_len + CMD_TERMINATING_CHAR_LEN;
+			memcpy(image->strings + comments_used, cmd_iterate->comment, len);
+			child_node->comment = comments_used;
+			comments_used += len;
+
+			child_node->name_len    = cmd_iterate->name_len;
+			child_node->comment_len = cmd_iterate->comment_len;
+
+			/* The schema stays owned by the live node, any tree change retires the image first. */
+			child_node->handler = *cmd_iterate->handler;
+
+			cmdtree_key_set(&image->sorted[filled], image->strings + child_node->name, cmd_iterate->name_len, filled);
+			filled++;
+		}
+
+		node->child_count = filled - node->child_first;
+
+		qsort(&image->sorted[node->child_first], node->child_count, sizeof(struct cmdtree_key), cmdtree_key_sort_cmp);
+	}
+
+	free(live);
+
+	__atomic_store_n(&ctx->image, image, __ATOMIC_SEQ_CST);
+
+	return CMD3_SUCCESS;
+}
+
+int cmdtree_freeze_ctx(cmd3_ctx_d ctx)
+{
+	int ret;
+
+	pthread_mutex_lock(&ctx->lock);
+
+	ret = cmdtree_freeze_locked(ctx);
+	cmd3_rcu_reclaim(&ctx->retired, 0);
+
+	pthread_mutex_unlock(&ctx->lock);
+
+	return ret;
+}
+
+int cmdtree_freeze(void)
+{
+	return cmdtree_freeze_ctx(&cmd_default_ctx);
+}
+
+void cmdtree_thaw_ctx(cmd3_ctx_d ctx)
+{
+	pthread_mutex_lock(&ctx->lock);
+
+	cmdtree_image_retire(ctx);
+	cmd3_rcu_reclaim(&ctx->retired, 0);
+
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+void cmdtree_thaw(void)
+{
+	cmdtree_thaw_ctx(&cmd_default_ctx);
+}
+
+/* Image flavor of cmdtree_level_match(), the candidates range is relative to the parent children. */
+static const struct cmdtree_image_node *cmdtree_image_match(const struct cmdtree_image *image,
+															const struct cmdtree_image_node *parent,
+															const char *name, size_t len, int exact,
+															uint32_t *first, uint32_t *count)
+{
+	const struct cmdtree_key *key;
+
+	key = cmdtree_key_match(&image->sorted[parent->child_first], parent->child_count, name, len, exact, first, count);
+
+	return key ? &image->nodes[key->index] : NULL;
+}
+
+/* Output the image help rows of the parent children, the same way cmdtree_report_rows() does. */
+static uint32_t cmdtree_image_report_rows(const struct cmdtree_image *image, const struct cmdtree_image_node *parent,
+										  uint32_t first, size_t limit, struct cmdtree_out *out)
+{
+	uint32_t i;
+
+	for(i = first; i < parent->child_count; i++)
+	{
+		const struct cmdtree_image_node *node = &image->nodes[parent->child_first + i];
+		size_t row_len = cmdtree_help_row_len(node->name_len, node->comment_len);
+
+		if(row_len > limit && i > first)
+			break;
+
+		cmdtree_help_row(out, image->strings + node->name, node->name_len, image->strings + node->comment, node->comment_len);
+		limit -= row_len < limit ? row_len : limit;
+	}
+
+	return i;
+}
+
+static int cmdtree_image_report(const struct cmdtree_image *image, const struct cmdtree_image_node *parent, struct cmdtree_out *out)
+{
+	size_t start = out->total;
+
+	cmdtree_image_report_rows(image, parent, 0, SIZE_MAX, out);
+
+	return cmdtree_out_len(out, start);
+}
+
+static int cmdtree_image_report_ambiguous(const struct cmdtree_image *image, const struct cmdtree_image_node *parent,
+										  const char *name, size_t len, uint32_t first, uint32_t count, struct cmdtree_out *out)
+{
+	size_t start = out->total;
+	uint32_t i;
+
+	cmdtree_out_printf(out, "Ambiguous command: %.*s\n", (int)len, name);
+
+	for(i = first; i < first + count; i++)
+	{
+		const struct cmdtree_image_node *node = &image->nodes[image->sorted[parent->child_first + i].index];
+
+		cmdtree_help_row(out, image->strings + node->name, node->name_len, image->strings + node->comment, node->comment_len);
+	}
+
+	return cmdtree_out_len(out, start);
+}
+
+static int cmdtree_image_exec(cmd3_ctx_d ctx, const struct cmdtree_image *image, const struct cmdtree_args *args, struct cmdtree_out *out)
+{
+	const struct cmdtree_image_node *level = &image->nodes[0];
+	const struct cmdtree_image_node *cmd_tree = NULL;
+	uint32_t match_first;
+	uint32_t match_count;
+	const char *name;
+	size_t len;
+	int broadcast = 0;
+	int pos = 0;
+
+	int ret;
+
+	if(0 == args->argc)
+	{
+		CMD_TRACE(begin, CMDTREE_TRACE_REPORT, NULL, 0);
+		ret = cmdtree_image_report(image, level, out);
+		CMD_TRACE(end, CMDTREE_TRACE_REPORT, NULL, ret);
+
+		return ret;
+	}
+
+	CMD_TRACE(begin, CMDTREE_TRACE_LOOKUP, NULL, cmdtree_args_len(args));
+
+	/* Walk the levels the same way the live tree walk does. */
+	do
+	{
+		name = cmdtree_args_get(args, pos, &len);
+		if(level->child_count && cmdtree_args_wildcard(name, len) &&
+		   NULL == cmdtree_image_match(image, level, name, len, 1, &match_first, &match_count))
+		{
+			broadcast = NULL == cmd_tree || !cmdtree_handler_set(&cmd_tree->handler);
+			break;
+		}
+
+		cmd_tree = cmdtree_image_match(image, level, name, len, ctx->exact_match, &match_first, &match_count);
+		if(cmd_tree)
+		{
+			pos++;
+
+			level = cmd_tree;
+		}
+	} while (level->child_count && pos < args->argc && cmd_tree);
+
+	out->cmd = cmd_tree ? cmd_tree->handler.node : NULL;
+	CMD_TRACE(end, CMDTREE_TRACE_LOOKUP, out->cmd, cmdtree_args_len(args));
+
+	if(broadcast)
+		return cmdtree_image_broadcast(ctx, image, level, args, pos, out);
+
+	if(cmd_tree && cmdtree_handler_set(&cmd_tree->handler))
+		return cmdtree_args_call(ctx, &cmd_tree->handler, args, pos - 1, out);
+
+	if(cmd_tree && 0 == cmd_tree->child_count)
+		return 0;
+
+	CMD_TRACE(begin, CMDTREE_TRACE_REPORT, out->cmd, 0);
+	if(cmd_tree)
+		ret = cmdtree_image_report(image, cmd_tree, out);
+	else if(match_count > 1)
+		ret = cmdtree_image_report_ambiguous(image, level, name, len, match_first, match_count, out);
+	else
+		ret = cmdtree_image_report(image, level, out);
+	CMD_TRACE(end, CMDTREE_TRACE_REPORT, out->cmd, ret);
+
+	return ret;
+}
+
+int cmdtree_help_ctx(cmd3_ctx_d ctx, int argc, const char **argv, size_t *cursor, char *buf, size_t buf_size)
+{
+	const struct cmdtree_image *image;
+	const struct cmdtree_level *level;
+	struct cmdtree_out out;
+	uint32_t first = *cursor > UINT32_MAX ? UINT32_MAX : *cursor;
+	uint32_t next = first;
+	uint32_t count = 0;
+	uint32_t match_first;
+	uint32_t match_count;
+	int ret = CMD3_FAIL;
+	int i;
+
+	if(0 == buf_size)
+		return CMD3_FAIL;
+
+	cmdtree_out_init(&out, buf, buf_size, NULL);
+
+	cmd3_rcu_read_lock();
+
+	image = __atomic_load_n(&ctx->image, __ATOMIC_ACQUIRE);
+	level = __atomic_load_n(&ctx->level, __ATOMIC_ACQUIRE);
+
+	/* Every token resolves a junction, the same way cmdtree_exec() matches them. */
+	if(image)
+	{
+		const struct cmdtree_image_node *node = &image->nodes[0];
+
+		for(i = 0; i < argc && node; i++)
+			node = cmdtree_image_match(image, node, argv[i], strlen(argv[i]), ctx->exact_match, &match_first, &match_count);
+
+		if(node && (0 == argc || node->child_count))
+		{
+			count = node->child_count;
+			if(first < count)
+				next = cmdtree_image_report_rows(image, node, first, out.size, &out);
+			ret = CMD3_SUCCESS;
+		}
+	}
+	else
+	{
+		for(i = 0; i < argc && level; i++)
+		{
+			cmdtree_d cmd_tree = cmdtree_level_match(level, argv[i], strlen(argv[i]), ctx->exact_match, &match_first, &match_count);
+
+			level = cmd_tree ? __atomic_load_n(&cmd_tree->level, __ATOMIC_ACQUIRE) : NULL;
+		}
+
+		if(level || 0 == argc)
+		{
+			count = level ? level->count : 0;
+			if(first < count)
+				next = cmdtree_report_rows(level, first, out.size, &out);
+			ret = CMD3_SUCCESS;
+		}
+	}
+
+	cmd3_rcu_read_unlock();
+
+	buf[out.used] = '\0';
+
+	if(CMD3_SUCCESS != ret)
+		return ret;
+
+	*cursor = next;
+
+	return next < count ? CMD3_INCOMPLETE : CMD3_SUCCESS;
+}
+
+int cmdtree_help(int argc, const char **argv, size_t *cursor, char *buf, size_t buf_size)
+{
+	return cmdtree_help_ctx(&cmd_default_ctx, argc, argv, cursor, buf, buf_size);
+}
+
+/*
+ * The handler cmdtree_exec() would call for the arguments, NULL for a usage report.
+ * Called in a read side section, the handler is valid until it is left.
+ */
+static const struct cmdtree_handler *cmdtree_args_handler(cmd3_ctx_d ctx, const struct cmdtree_args *args)
+{
+	const struct cmdtree_image *image = __atomic_load_n(&ctx->image, __ATOMIC_ACQUIRE);
+	const struct cmdtree_level *level = __atomic_load_n(&ctx->level, __ATOMIC_ACQUIRE);
+	const struct cmdtree_handler *handler = NULL;
+	uint32_t match_first;
+	uint32_t match_count;
+	const char *name;
+	size_t len;
+	int pos = 0;
+
+	if(args->argc <= 0)
+		return NULL;
+
+	/* Walk the levels the same way cmdtree_exec() does. */
+	if(image)
+	{
+		const struct cmdtree_image_node *node = &image->nodes[0];
+		const struct cmdtree_image_node *cmd_tree;
+
+		do
+		{
+			name = cmdtree_args_get(args, pos, &len);
+			cmd_tree = cmdtree_image_match(image, node, name, len, ctx->exact_match, &match_first, &match_count);
+			if(cmd_tree)
+			{
+				pos++;
+
+				node = cmd_tree;
+			}
+		} while (node->child_count && pos < args->argc && cmd_tree);
+
+		if(cmd_tree)
+			handler = &cmd_tree->handler;
+	}
+	else
+	{
+		cmdtree_d cmd_tree;
+
+		do
+		{
+			name = cmdtree_args_get(args, pos, &len);
+			cmd_tree = cmdtree_level_match(level, name, len, ctx->exact_match, &match_first, &match_count);
+			if(cmd_tree)
+			{
+				pos++;
+
+				level = __atomic_load_n(&cmd_tree->level, __ATOMIC_ACQUIRE);
+			}
+		} while (level && pos < args->argc && cmd_tree);
+
+		if(cmd_tree)
+			handler = cmd_tree->handler;
+	}
+
+	return handler && cmdtree_handler_set(handler) ? handler : NULL;
+}
+
+/* Report whether the cmd exec would call may run concurrently with other cmds. */
+static int cmdtree_args_independent(cmd3_ctx_d ctx, const struct cmdtree_args *args)
+{
+	const struct cmdtree_handler *handler;
+	int independent;
+
+	cmd3_rcu_read_lock();
+
+	handler = cmdtree_args_handler(ctx, args);
+	independent = handler && handler->independent;
+
+	cmd3_rcu_read_unlock();
+
+	return independent;
+}
+
+int cmdtree_tokens_independent_ctx(cmd3_ctx_d ctx, int argc, const cmdtree_token_t *tokens)
+{
+	struct cmdtree_args args = { argc, NULL, tokens };
+
+	return cmdtree_args_independent(ctx, &args);
+}
+
+int cmdtree_tokens_independent(int argc, const cmdtree_token_t *tokens)
+{
+	return cmdtree_tokens_independent_ctx(&cmd_default_ctx, argc, tokens);
+}
+
+// Async cmd, queued along with a copy of its arguments, in a single allocation
+struct cmdtree_job
+{
+	struct cmdtree_job 	   *next;		// Next queued job
+	cmd3_ctx_d 				ctx;		// The context to run the cmd in
+	const cmdtree_sink_t   *sink;		// The cmd output sink
+	cmdtree_done_cb 		done_cb;	// The completion callback
+	void 				   *arg;		// The completion callback argument
+	int 					argc;		// The number of arguments
+	const char 			   *argv[];		// The arguments, followed by their strings
+};
+
+// Async cmds worker pool
+struct cmdtree_pool
+{
+	pthread_mutex_t 	 lock;			// Protects the queue
+	pthread_cond_t 		 cond;			// Signals a queued job, or the pool stop
+	struct cmdtree_job  *head;			// The first queued job
+	struct cmdtree_job **tail;			// The next pointer of the last queued job
+	size_t 				 queued;		// The number of queued jobs
+	size_t 				 queue_max;		// The maximal number of queued jobs
+	int 				 stop;			// Non zero once the pool is destroyed
+	int 				 workers;		// The number of started workers
+	pthread_t 			 threads[];		// The workers
+};
+
+/* Account for an async cmd of the context done, or not queued after all; the context may go once it is signaled. */
+static void cmdtree_async_done(cmd3_ctx_d ctx)
+{
+	pthread_mutex_lock(&ctx->lock);
+	if(0 == --ctx->async)
+		pthread_cond_broadcast(&ctx->async_cond);
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+/* Run a cmd to its sink, returning its batch status (a failed flush fails it as well). */
+static int cmdtree_async_run(cmd3_ctx_d ctx, const struct cmdtree_args *args, const cmdtree_sink_t *sink)
+{
+	char staging[CMD_OUT_STAGING_SIZE];
+	struct cmdtree_out out;
+	int status;
+
+	cmdtree_out_init(&out, staging, sizeof(staging), sink);
+
+	status = cmdtree_batch_exec(ctx, args, &out, NULL);
+
+	if(CMD3_SUCCESS != cmdtree_out_flush(&out))
+		status = CMD3_FAIL;
+
+	return status;
+}
+
+static void *cmdtree_pool_worker(void *arg)
+{
+	struct cmdtree_pool *pool = arg;
+	struct cmdtree_job *job;
+	int status;
+
+	pthread_mutex_lock(&pool->lock);
+
+	for(;;)
+	{
+		while(NULL == pool->head && !pool->stop)
+			pthread_cond_wait(&pool->cond, &pool->lock);
+
+		/* The queued jobs still run once the pool is stopped. */
+		job = pool->head;
+		if(NULL == job)
+			break;
+
+		pool->head = job->next;
+		if(NULL == pool->head)
+			pool->tail = &pool->head;
+		pool->queued--;
+
+		pthread_mutex_unlock(&pool->lock);
+
+		{
+			struct cmdtree_args args = { job->argc, job->argv, NULL };
+
+			status = cmdtree_async_run(job->ctx, &args, job->sink);
+		}
+
+		job->done_cb(job->arg, status);
+		cmdtree_async_done(job->ctx);
+		free(job);
+
+		pthread_mutex_lock(&pool->lock);
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+cmdtree_pool_d cmdtree_pool_create(int workers, size_t queue_max)
+{
+	struct cmdtree_pool *pool;
+
+	if(workers <= 0 || 0 == queue_max)
+		return NULL;
+
+	pool = calloc(1, sizeof(*pool) + workers * sizeof(pool->threads[0]));
+	if(NULL == pool)
+		return NULL;
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+	pool->tail      = &pool->head;
+	pool->queue_max = queue_max;
+
+	for(pool->workers = 0; pool->workers < workers; pool->workers++)
+	{
+		if(pthread_create(&pool->threads[pool->workers], NULL, cmdtree_pool_worker, pool))
+		{
+			cmdtree_pool_destroy(pool);
+			return NULL;
+		}
+	}
+
+	return pool;
+}
+
+int cmdtree_pool_destroy(cmdtree_pool_d pool)
+{
+	pthread_t self = pthread_self();
+	int i;
+
+	if(NULL == pool)
+		return CMD3_SUCCESS;
+
+	/* A worker, e.g. running a done callback, would wait for itself. */
+	for(i = 0; i < pool->workers; i++)
+	{
+		if(pthread_equal(self, pool->threads[i]))
+			return CMD3_FAIL;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	for(i = 0; i < pool->workers; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+
+	return CMD3_SUCCESS;
+}
+
+/* Copy the arguments, terminated, right after the job vector. */
+static struct cmdtree_job *cmdtree_job_alloc(const struct cmdtree_args *args)
+{
+	struct cmdtree_job *job;
+	const char *arg;
+	size_t len = cmdtree_args_len(args) + args->argc * CMD_TERMINATING_CHAR_LEN;
+	char *str;
+	int i;
+
+	job = malloc(sizeof(*job) + args->argc * sizeof(job->argv[0]) + len);
+	if(NULL == job)
+		return NULL;
+
+	job->argc = args->argc;
+
+	str = (char *)&job->argv[args->argc];
+	for(i = 0; i < args->argc; i++)
+	{
+		arg = cmdtree_args_get(args, i, &len);
+		memcpy(str, arg, len);
+		str[len] = '\0';
+		job->argv[i] = str;
+		str += len + CMD_TERMINATING_CHAR_LEN;
+	}
+
+	return job;
+}
+
+static int cmdtree_exec_async_args(cmd3_ctx_d ctx, cmdtree_pool_d pool, const struct cmdtree_args *args,
+								   const cmdtree_sink_t *sink, cmdtree_done_cb done_cb, void *arg)
+{
+	const struct cmdtree_handler *handler;
+	struct cmdtree_job *job;
+	int async;
+
+	if(NULL == pool || NULL == sink || NULL == done_cb)
+		return CMD3_FAIL;
+
+	cmd3_rcu_read_lock();
+
+	handler = cmdtree_args_handler(ctx, args);
+	async = handler && handler->async;
+
+	cmd3_rcu_read_unlock();
+
+	/* Fast cmds and usage reports are not worth a thread switch. */
+	if(!async)
+	{
+		done_cb(arg, cmdtree_async_run(ctx, args, sink));
+		return CMD3_SUCCESS;
+	}
+
+	job = cmdtree_job_alloc(args);
+	if(NULL == job)
+		return CMD3_FAIL;
+
+	job->next    = NULL;
+	job->ctx     = ctx;
+	job->sink    = sink;
+	job->done_cb = done_cb;
+	job->arg     = arg;
+
+	/* Counted before it is queued, a worker may be done with it right away. */
+	pthread_mutex_lock(&ctx->lock);
+	ctx->async++;
+	pthread_mutex_unlock(&ctx->lock);
+
+	pthread_mutex_lock(&pool->lock);
+
+	if(pool->stop || pool->queued >= pool->queue_max)
+	{
+		pthread_mutex_unlock(&pool->lock);
+		cmdtree_async_done(ctx);
+		free(job);
+		return CMD3_FAIL;
+	}
+
+	*pool->tail = job;
+	pool->tail  = &job->next;
+	pool->queued++;
+
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	return CMD3_INCOMPLETE;
+}
+
+int cmdtree_exec_async_ctx(cmd3_ctx_d ctx, cmdtree_pool_d pool, int argc, const char **argv,
+						   const cmdtree_sink_t *sink, cmdtree_done_cb done_cb, void *arg)
+{
+	struct cmdtree_args args = { argc, argv, NULL };
+
+	return cmdtree_exec_async_args(ctx, pool, &args, sink, done_cb, arg);
+}
+
+int cmdtree_exec_async(cmdtree_pool_d pool, int argc, const char **argv, const cmdtree_sink_t *sink,
+					   cmdtree_done_cb done_cb, void *arg)
+{
+	return cmdtree_exec_async_ctx(&cmd_default_ctx, pool, argc, argv, sink, done_cb, arg);
+}
+
+int cmdtree_exec_tokens_async_ctx(cmd3_ctx_d ctx, cmdtree_pool_d pool, int argc, const cmdtree_token_t *tokens,
+								  const cmdtree_sink_t *sink, cmdtree_done_cb done_cb, void *arg)
+{
+	struct cmdtree_args args = { argc, NULL, tokens };
+
+	return cmdtree_exec_async_args(ctx, pool, &args, sink, done_cb, arg);
+}
+
+int cmdtree_exec_tokens_async(cmdtree_pool_d pool, int argc, const cmdtree_token_t *tokens, const cmdtree_sink_t *sink,
+							  cmdtree_done_cb done_cb, void *arg)
+{
+	return cmdtree_exec_tokens_async_ctx(&cmd_default_ctx, pool, argc, tokens, sink, done_cb, arg);
+}
+
+// Broadcast cmd, the rest of the cmd line resolved under a child of the wildcard level
+struct cmdtree_broadcast
+{
+	const struct cmdtree_handler *handler;	// The cmd handler
+	cmdtree_d 					  child;	// The wildcard child, named by the output header
+	int 						  first;	// The cmd name argument, the wildcard itself when the child is the cmd
+};
+
+static int cmdtree_broadcast_call(cmd3_ctx_d ctx, const struct cmdtree_broadcast *call, const struct cmdtree_args *args,
+								  int pos, struct cmdtree_out *out);
+
+// Parallel batch task, consecutive cmds whose output is held in order in a chain
+struct cmdtree_exec_task
+{
+	size_t 				  first;	// The first cmd
+	size_t 				  count;	// The number of cmds
+	size_t 				  ran;		// The number of cmds run, a failed one ends the task when stopping on failure
+	struct cmdtree_chain *chain;	// The task output, reused from run to run
+	int 				  error;	// A chunk allocation failed, the output is partial
+	int 				  done;		// The task is complete, set under the executor lock
+};
+
+// Executor thread task indexes, packed as head << 32 | tail, the owner takes from the head and thieves from the tail
+struct cmdtree_exec_deque
+{
+	uint64_t 	range;
+	char 		pad[CMD_CACHE_LINE_SIZE - sizeof(uint64_t)];	// A deque per cache line
+};
+
+// Independent script cmd, tokenized again by the thread running it
+struct cmdtree_exec_span
+{
+	const char 	*line;
+	size_t 		 len;
+};
+
+// Executor run, consecutive independent cmds of a batch
+struct cmdtree_exec_run
+{
+	cmd3_ctx_d 						 ctx;
+	const cmdtree_cmdline_t 		*cmds;			// The argument vectors, or
+	const struct cmdtree_exec_span 	*spans;			// the script cmds, or
+	const struct cmdtree_broadcast 	*calls;			// the broadcast cmds, of the args line
+	const struct cmdtree_args 		*args;			// The broadcast cmd line
+	int 							 pos;			// The broadcast wildcard argument
+	cmdtree_batch_result_t 			*results;		// Optional, the outcome of the first cmd on
+	size_t 							 max_results;	// The results array size
+	int 							 flags;			// The batch flags
+	size_t 							 stop;			// The first failed cmd when stopping on failure, past the cmds otherwise
+};
+
+// Executor thread
+struct cmdtree_exec_thread
+{
+	struct cmdtree_executor *executor;
+	int 					 self;		// The thread deque
+	pthread_t 				 thread;
+};
+
+// Parallel batch executor, its threads and the caller run the tasks, each from its own deque first
+struct cmdtree_executor
+{
+	pthread_mutex_t 			 batch_lock;	// Serializes the batches
+	pthread_mutex_t 			 lock;			// Protects the run posting and the task completion
+	pthread_cond_t 				 work_cond;		// Signals a posted run, or the executor stop
+	pthread_cond_t 				 done_cond;		// Signals a complete task, or the last thread leaving the run
+	struct cmdtree_exec_run 	*run;			// The run being executed
+	unsigned 					 generation;	// Bumped for each posted run
+	int 						 busy;			// Threads still in the run
+	int 						 stop;			// Non zero once the executor is destroyed
+	int 						 started;		// Started threads
+	int 						 threads;		// Threads, the caller being the first
+	int 						 task_max;		// The tasks capacity
+	struct cmdtree_exec_deque 	*deques;		// A deque per thread
+	struct cmdtree_exec_task 	*tasks;			// The run tasks
+	struct cmdtree_exec_thread 	 thread[];		// The executor threads, past the caller
+};
+
+/* Take a task, the owner from the head (in cmd order) and a thief from the tail. */
+static int cmdtree_exec_deque_take(struct cmdtree_exec_deque *deque, int steal, uint32_t *task)
+{
+	uint64_t range = __atomic_load_n(&deque->range, __ATOMIC_ACQUIRE);
+	uint64_t next;
+	uint32_t head;
+	uint32_t tail;
+
+	do
+	{
+		head = range >> 32;
+		tail = (uint32_t)range;
+		if(head >= tail)
+			return 0;
+
+		*task = steal ? tail - 1 : head;
+		next  = steal ? range - 1 : range + ((uint64_t)1 << 32);
+	} while(!__atomic_compare_exchange_n(&deque->range, &range, next, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+	return 1;
+}
+
+static void cmdtree_exec_task_run(struct cmdtree_executor *executor, struct cmdtree_exec_run *run,
+								  struct cmdtree_exec_task *task, cmdtree_argv_t *argv)
+{
+	struct cmdtree_out out;
+	size_t stop;
+	size_t i;
+
+	task->ran   = 0;
+	task->error = CMD3_SUCCESS != cmdtree_out_init_chain(&out, task->chain);
+
+	for(i = task->first; i < task->first + task->count && !out.error; i++)
+	{
+		struct cmdtree_args args = { 0, NULL, NULL };
+		int status;
+
+		/* Cmds past a failed one are not run, their output would be dropped. */
+		stop = __atomic_load_n(&run->stop, __ATOMIC_RELAXED);
+		if(i > stop)
+			break;
+
+		if(run->calls)
+		{
+			cmdtree_broadcast_call(run->ctx, &run->calls[i], run->args, run->pos, &out);
+			task->ran++;
+			continue;
+		}
+
+		if(run->cmds)
+		{
+			args.argc = run->cmds[i].argc;
+			args.argv = run->cmds[i].argv;
+		}
+		else
+		{
+			if(CMD3_SUCCESS != cmdtree_argv_tokenize_quoted(argv, run->spans[i].line, run->spans[i].len))
+			{
+				out.error = 1;
+				break;
+			}
+
+			args.argc   = argv->argc;
+			args.tokens = argv->tokens;
+		}
+
+		status = cmdtree_batch_exec(run->ctx, &args, &out, (run->results && i < run->max_results) ? &run->results[i] : NULL);
+		task->ran++;
+
+		if(CMD3_FAIL == status && (run->flags & CMDTREE_BATCH_STOP_ON_FAIL))
+		{
+			while(i < stop && !__atomic_compare_exchange_n(&run->stop, &stop, i, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				;
+			break;
+		}
+	}
+
+	if(CMD3_SUCCESS != cmdtree_out_flush(&out))
+		task->error = 1;
+
+	pthread_mutex_lock(&executor->lock);
+	__atomic_store_n(&task->done, 1, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&executor->done_cond);
+	pthread_mutex_unlock(&executor->lock);
+}
+
+/* Run a task of the own deque, or one stolen from the others. */
+static int cmdtree_exec_next(struct cmdtree_executor *executor, struct cmdtree_exec_run *run, int self, cmdtree_argv_t *argv)
+{
+	uint32_t task = 0;
+	int i;
+
+	if(!cmdtree_exec_deque_take(&executor->deques[self], 0, &task))
+	{
+		for(i = 1; i < executor->threads; i++)
+		{
+			if(cmdtree_exec_deque_take(&executor->deques[(self + i) % executor->threads], 1, &task))
+				break;
+		}
+
+		if(i == executor->threads)
+			return 0;
+	}
+
+	cmdtree_exec_task_run(executor, run, &executor->tasks[task], argv);
+
+	return 1;
+}
+
+static void *cmdtree_exec_thread_run(void *arg)
+{
+	struct cmdtree_exec_thread *thread = arg;
+	struct cmdtree_executor *executor = thread->executor;
+	struct cmdtree_exec_run *run;
+	cmdtree_argv_t argv;
+	unsigned generation = 0;	/* The one at create time, a run may be posted before the thread gets here. */
+
+	cmdtree_argv_init(&argv);
+
+	pthread_mutex_lock(&executor->lock);
+
+	for(;;)
+	{
+		while(generation == executor->generation && !executor->stop)
+			pthread_cond_wait(&executor->work_cond, &executor->lock);
+
+		if(executor->stop)
+			break;
+
+		generation = executor->generation;
+		run = executor->run;
+
+		pthread_mutex_unlock(&executor->lock);
+
+		while(cmdtree_exec_next(executor, run, thread->self, &argv))
+			;
+
+		pthread_mutex_lock(&executor->lock);
+		if(0 == --executor->busy)
+			pthread_cond_broadcast(&executor->done_cond);
+	}
+
+	pthread_mutex_unlock(&executor->lock);
+
+	cmdtree_argv_release(&argv);
+
+	return NULL;
+}
+
+cmdtree_executor_d cmdtree_executor_create(int threads)
+{
+	struct cmdtree_executor *executor;
+	int i;
+
+	if(threads < 0)
+		return NULL;
+
+	executor = calloc(1, sizeof(*executor) + threads * sizeof(executor->thread[0]));
+	if(NULL == executor)
+		return NULL;
+
+	pthread_mutex_init(&executor->batch_lock, NULL);
+	pthread_mutex_init(&executor->lock, NULL);
+	pthread_cond_init(&executor->work_cond, NULL);
+	pthread_cond_init(&executor->done_cond, NULL);
+	executor->threads  = threads + 1;
+	executor->task_max = executor->threads * CMD_EXEC_TASKS_PER_THREAD;
+
+	executor->deques = calloc(executor->threads, sizeof(executor->deques[0]));
+	executor->tasks  = calloc(executor->task_max, sizeof(executor->tasks[0]));
+	if(NULL == executor->deques || NULL == executor->tasks)
+	{
+		cmdtree_executor_destroy(executor);
+		return NULL;
+	}
+
+	for(i = 0; i < executor->task_max; i++)
+	{
+		executor->tasks[i].chain = cmdtree_chain_create(0);
+		if(NULL == executor->tasks[i].chain)
+		{
+			cmdtree_executor_destroy(executor);
+			return NULL;
+		}
+	}
+
+	for(executor->started = 0; executor->started < threads; executor->started++)
+	{
+		struct cmdtree_exec_thread *thread = &executor->thread[executor->started];
+
+		thread->executor = executor;
+		thread->self     = executor->started + 1;
+		if(pthread_create(&thread->thread, NULL, cmdtree_exec_thread_run, thread))
+		{
+			cmdtree_executor_destroy(executor);
+			return NULL;
+		}
+	}
+
+	return executor;
+}
+
+void cmdtree_executor_destroy(cmdtree_executor_d executor)
+{
+	int i;
+
+	if(NULL == executor)
+		return;
+
+	pthread_mutex_lock(&executor->lock);
+	executor->stop = 1;
+	pthread_cond_broadcast(&executor->work_cond);
+	pthread_mutex_unlock(&executor->lock);
+
+	for(i = 0; i < executor->started; i++)
+		pthread_join(executor->thread[i].thread, NULL);
+
+	for(i = 0; executor->tasks && i < executor->task_max; i++)
+		cmdtree_chain_destroy(executor->tasks[i].chain);
+
+	free(executor->tasks);
+	free(executor->deques);
+	pthread_cond_destroy(&executor->done_cond);
+	pthread_cond_destroy(&executor->work_cond);
+	pthread_mutex_destroy(&executor->lock);
+	pthread_mutex_destroy(&executor->batch_lock);
+	free(executor);
+}
+
+/* Append a task output to the batch output, locating its cmds outcome in the batch output stream. */
+static void cmdtree_exec_task_emit(struct cmdtree_exec_run *run, struct cmdtree_exec_task *task, struct cmdtree_out *out)
+{
+	struct iovec iov[CMD_CHAIN_IOV_MAX];
+	size_t base = out->total;
+	size_t len;
+	size_t i;
+	int count;
+
+	for(i = task->first; i < task->first + task->ran && run->results && i < run->max_results; i++)
+		run->results[i].offset += base;
+
+	while((count = cmdtree_chain_iov(task->chain, iov, CMD_CHAIN_IOV_MAX)) > 0)
+	{
+		for(i = 0, len = 0; i < (size_t)count; i++)
+		{
+			cmdtree_out_write(out, iov[i].iov_base, iov[i].iov_len);
+			len += iov[i].iov_len;
+		}
+
+		cmdtree_chain_consume(task->chain, len);
+	}
+}
+
+/*
+ * Execute consecutive independent cmds, split into tasks of consecutive cmds spread over the executor deques.
+ * The caller runs its own tasks, then appends the tasks output in cmd order as they complete.
+ * Returns CMD3_SUCCESS once all the cmds are run, CMD3_INCOMPLETE when stopped on a failed cmd
+ * and CMD3_FAIL on chunk allocation failure; ran is the number of cmds whose output is appended.
+ */
+static int cmdtree_exec_run(struct cmdtree_executor *executor, struct cmdtree_exec_run *run, size_t cmd_count,
+							struct cmdtree_out *out, cmdtree_argv_t *argv, size_t *ran)
+{
+	size_t task_count = cmd_count < (size_t)executor->task_max ? cmd_count : (size_t)executor->task_max;
+	int ret = CMD3_SUCCESS;
+	size_t emitted = 0;
+	size_t i;
+	int t;
+
+	*ran = 0;
+	if(0 == cmd_count)
+		return CMD3_SUCCESS;
+
+	run->stop = cmd_count;
+
+	for(i = 0; i < task_count; i++)
+	{
+		struct cmdtree_exec_task *task = &executor->tasks[i];
+
+		task->first = cmd_count * i / task_count;
+		task->count = cmd_count * (i + 1) / task_count - task->first;
+		task->done  = 0;
+	}
+
+	for(t = 0; t < executor->threads; t++)
+	{
+		uint64_t head = task_count * t / executor->threads;
+		uint64_t tail = task_count * (t + 1) / executor->threads;
+
+		__atomic_store_n(&executor->deques[t].range, head << 32 | tail, __ATOMIC_RELAXED);
+	}
+
+	/* A single task is not worth waking the threads. */
+	if(task_count > 1)
+	{
+		pthread_mutex_lock(&executor->lock);
+		executor->run  = run;
+		executor->busy = executor->started;
+		executor->generation++;
+		pthread_cond_broadcast(&executor->work_cond);
+		pthread_mutex_unlock(&executor->lock);
+	}
+
+	/* The output of the tasks complete in order is appended between the tasks the caller runs. */
+	for(;;)
+	{
+		int more = cmdtree_exec_next(executor, run, 0, argv);
+
+		for(; emitted < task_count; emitted++)
+		{
+			struct cmdtree_exec_task *task = &executor->tasks[emitted];
+
+			if(more && !__atomic_load_n(&task->done, __ATOMIC_ACQUIRE))
+				break;
+
+			if(!more)
+			{
+				pthread_mutex_lock(&executor->lock);
+				while(!task->done)
+					pthread_cond_wait(&executor->done_cond, &executor->lock);
+				pthread_mutex_unlock(&executor->lock);
+			}
+
+			/* The output following a failed cmd is dropped. */
+			if(CMD3_SUCCESS != ret)
+			{
+				cmdtree_chain_consume(task->chain, cmdtree_chain_len(task->chain));
+				continue;
+			}
+
+			cmdtree_exec_task_emit(run, task, out);
+			*ran += task->ran;
+
+			if(task->error)
+				ret = CMD3_FAIL;
+			else if(task->ran < task->count)
+				ret = CMD3_INCOMPLETE;
+		}
+
+		if(!more)
+			break;
+	}
+
+	if(task_count > 1)
+	{
+		pthread_mutex_lock(&executor->lock);
+		while(executor->busy)
+			pthread_cond_wait(&executor->done_cond, &executor->lock);
+		executor->run = NULL;
+		pthread_mutex_unlock(&executor->lock);
+	}
+
+	return ret;
+}
+
+int cmdtree_exec_batch_argv_parallel_ctx(cmd3_ctx_d ctx, cmdtree_executor_d executor, const cmdtree_cmdline_t *cmds,
+										 size_t cmd_count, int flags, const cmdtree_sink_t *sink,
+										 cmdtree_batch_result_t *results)
+{
+	char staging[CMD_OUT_STAGING_SIZE];
+	struct cmdtree_out out;
+	cmdtree_argv_t argv;
+	size_t count = 0;
+	int ret = CMD3_SUCCESS;
+
+	pthread_mutex_lock(&executor->batch_lock);
+
+	cmdtree_out_init(&out, staging, sizeof(staging), sink);
+	cmdtree_argv_init(&argv);
+
+	while(count < cmd_count && !out.error)
+	{
+		struct cmdtree_args args = { cmds[count].argc, cmds[count].argv, NULL };
+		struct cmdtree_exec_run run;
+		size_t run_count;
+		size_t ran;
+		int status;
+
+		/* Consecutive independent cmds are run by the executor, the others in place. */
+		for(run_count = 0; count + run_count < cmd_count; run_count++)
+		{
+			struct cmdtree_args run_args = { cmds[count + run_count].argc, cmds[count + run_count].argv, NULL };
+
+			if(!cmdtree_args_independent(ctx, &run_args))
+				break;
+		}
+
+		if(run_count < 2)
+		{
+			status = cmdtree_batch_exec(ctx, &args, &out, results ? &results[count] : NULL);
+			count++;
+
+			if(CMD3_FAIL == status && (flags & CMDTREE_BATCH_STOP_ON_FAIL))
+				break;
+
+			continue;
+		}
+
+		run.ctx         = ctx;
+		run.cmds        = &cmds[count];
+		run.spans       = NULL;
+		run.calls       = NULL;
+		run.results     = results ? &results[count] : NULL;
+		run.max_results = run_count;
+		run.flags       = flags;
+
+		status = cmdtree_exec_run(executor, &run, run_count, &out, &argv, &ran);
+		count += ran;
+
+		if(CMD3_SUCCESS != status)
+		{
+			ret = status;
+			break;
+		}
+	}
+
+	cmdtree_argv_release(&argv);
+
+	if(CMD3_SUCCESS != cmdtree_out_flush(&out))
+		ret = CMD3_FAIL;
+
+	pthread_mutex_unlock(&executor->batch_lock);
+
+	return CMD3_FAIL == ret ? CMD3_FAIL : (int)count;
+}
+
+int cmdtree_exec_batch_argv_parallel(cmdtree_executor_d executor, const cmdtree_cmdline_t *cmds, size_t cmd_count,
+									 int flags, const cmdtree_sink_t *sink, cmdtree_batch_result_t *results)
+{
+	return cmdtree_exec_batch_argv_parallel_ctx(&cmd_default_ctx, executor, cmds, cmd_count, flags, sink, results);
+}
+
+/* Execute the independent script cmds collected so far, and restart the collection. */
+static int cmdtree_exec_spans(struct cmdtree_executor *executor, struct cmdtree_exec_run *run, size_t *span_count,
+							  struct cmdtree_out *out, cmdtree_argv_t *argv, cmdtree_batch_result_t *results,
+							  size_t max_results, size_t *count)
+{
+	size_t ran;
+	int ret;
+
+	run->results     = (results && *count < max_results) ? &results[*count] : NULL;
+	run->max_results = (results && *count < max_results) ? max_results - *count : 0;
+
+	ret = cmdtree_exec_run(executor, run, *span_count, out, argv, &ran);
+	*count += ran;
+	*span_count = 0;
+
+	return ret;
+}
+
+int cmdtree_exec_batch_parallel_ctx(cmd3_ctx_d ctx, cmdtree_executor_d executor, const char *script, size_t len,
+									int flags, const cmdtree_sink_t *sink, cmdtree_batch_result_t *results,
+									size_t max_results)
+{
+	char staging[CMD_OUT_STAGING_SIZE];
+	struct cmdtree_out out;
+	struct cmdtree_exec_run run;
+	struct cmdtree_exec_span *spans = NULL;
+	size_t span_count = 0;
+	size_t span_max = 0;
+	struct cmdtree_quote_scan scan;
+	cmdtree_argv_t argv;
+	cmdtree_argv_t run_argv;
+	const char *end = script + len;
+	const char *line = script;
+	size_t count = 0;
+	int ret = CMD3_SUCCESS;
+
+	pthread_mutex_lock(&executor->batch_lock);
+
+	cmdtree_out_init(&out, staging, sizeof(staging), sink);
+	cmdtree_argv_init(&argv);
+	cmdtree_argv_init(&run_argv);
+
+	run.ctx   = ctx;
+	run.cmds  = NULL;
+	run.calls = NULL;
+	run.flags = flags;
+
+	while(line < end && CMD3_SUCCESS == ret && !out.error)
+	{
+		const char *line_end;
+		const char *cmd_line = line;
+		cmdtree_batch_result_t *result;
+		struct cmdtree_args args;
+		int status;
+
+		status = cmdtree_script_next(&argv, line, end, &line_end, &scan);
+
+		if(CMD3_FAIL == status)
+		{
+			ret = CMD3_FAIL;
+			break;
+		}
+
+		line = line_end + (line_end < end);
+
+		/* Blank and comment lines are skipped. */
+		if(CMD3_SUCCESS == status && 0 == argv.argc)
+			continue;
+
+		args.argc   = argv.argc;
+		args.argv   = NULL;
+		args.tokens = argv.tokens;
+
+		/* Independent cmds are collected, to be handed to the executor at once. */
+		if(CMD3_SUCCESS == status && cmdtree_args_independent(ctx, &args))
+		{
+			if(span_count == span_max)
+			{
+				size_t new_max = span_max ? span_max * 2 : 64;
+				struct cmdtree_exec_span *new_spans = realloc(spans, new_max * sizeof(spans[0]));
+
+				if(NULL == new_spans)
+				{
+					ret = CMD3_FAIL;
+					break;
+				}
+
+				spans    = new_spans;
+				span_max = new_max;
+				run.spans = spans;
+			}
+
+			spans[span_count].line = cmd_line;
+			spans[span_count].len  = line_end - cmd_line;
+			span_count++;
+
+			if(CMD_EXEC_RUN_MAX == span_count)
+				ret = cmdtree_exec_spans(executor, &run, &span_count, &out, &run_argv, results, max_results, &count);
+
+			continue;
+		}
+
+		ret = cmdtree_exec_spans(executor, &run, &span_count, &out, &run_argv, results, max_results, &count);
+		if(CMD3_SUCCESS != ret)
+			break;
+
+		result = (results && count < max_results) ? &results[count] : NULL;
+
+		if(CMD3_INCOMPLETE == status)
+		{
+			if(result)
+			{
+				result->status = CMD3_FAIL;
+				result->offset = out.total;
+			}
+
+			cmdtree_out_printf(&out, "%s: %.*s\n", cmdtree_quote_scan_error(&scan), (int)(line_end - cmd_line), cmd_line);
+
+			if(result)
+				result->len = out.total - result->offset;
+
+			count++;
+			break;
+		}
+
+		status = cmdtree_batch_exec(ctx, &args, &out, result);
+		count++;
+
+		if(CMD3_FAIL == status && (flags & CMDTREE_BATCH_STOP_ON_FAIL))
+			break;
+	}
+
+	if(CMD3_SUCCESS == ret && !out.error)
+		ret = cmdtree_exec_spans(executor, &run, &span_count, &out, &run_argv, results, max_results, &count);
+
+	free(spans);
+	cmdtree_argv_release(&run_argv);
+	cmdtree_argv_release(&argv);
+
+	if(CMD3_SUCCESS != cmdtree_out_flush(&out))
+		ret = CMD3_FAIL;
+
+	pthread_mutex_unlock(&executor->batch_lock);
+
+	return CMD3_FAIL == ret ? CMD3_FAIL : (int)count;
+}
+
+int cmdtree_exec_batch_parallel(cmdtree_executor_d executor, const char *script, size_t len, int flags,
+								const cmdtree_sink_t *sink, cmdtree_batch_result_t *results, size_t max_results)
+{
+	return cmdtree_exec_batch_parallel_ctx(&cmd_default_ctx, executor, script, len, flags, sink, results, max_results);
+}
+
+/* Output a broadcast cmd, preceded by the path of its wildcard child. */
+static int cmdtree_broadcast_call(cmd3_ctx_d ctx, const struct cmdtree_broadcast *call, const struct cmdtree_args *args,
+								  int pos, struct cmdtree_out *out)
+{
+	const char *argv_small[CMD_TREE_MAX_DEPTH];
+	cmdtree_token_t tokens_small[CMD_TREE_MAX_DEPTH];
+	const char **argv = argv_small;
+	cmdtree_token_t *tokens = tokens_small;
+	void *heap = NULL;
+	struct cmdtree_args call_args;
+	char path[CMD_PATH_SIZE];
+	int argc = args->argc - call->first;
+	int ret = 0;
+
+	cmdtree_path(call->child, path, sizeof(path));
+	cmdtree_out_printf(out, "%s:\n", path);
+
+	if(call->first != pos)
+	{
+		ret = cmdtree_args_call(ctx, call->handler, args, call->first, out);
+	}
+	else
+	{
+		/* The child is the cmd, its function is given the child name rather than the wildcard. */
+		call_args.argc   = argc;
+		call_args.argv   = NULL;
+		call_args.tokens = NULL;
+
+		/* Long cmd lines take their copy from the heap. */
+		if(argc > CMD_TREE_MAX_DEPTH)
+		{
+			heap   = malloc(argc * (args->argv ? sizeof(argv[0]) : sizeof(tokens[0])));
+			argv   = heap;
+			tokens = heap;
+		}
+
+		if(argv)
+		{
+			if(args->argv)
+			{
+				memcpy(argv, args->argv + call->first, argc * sizeof(argv[0]));
+				argv[0] = call->child->name;
+				call_args.argv = argv;
+			}
+			else
+			{
+				memcpy(tokens, args->tokens + call->first, argc * sizeof(tokens[0]));
+				tokens[0].str = call->child->name;
+				tokens[0].len = call->child->name_len;
+				call_args.tokens = tokens;
+			}
+
+			ret = cmdtree_args_call(ctx, call->handler, &call_args, 0, out);
+		}
+
+		free(heap);
+	}
+
+	/* A failed cmd is reported under its child header. */
+	if(ret <= 0)
+		cmdtree_out_printf(out, "Missing parameter or unsupported command.\n");
+
+	return ret;
+}
+
+/*
+ * Run the broadcast cmds in child name order, on the context executor when it is free
+ * and all of them are independent. The output of each one follows the output of the previous ones.
+ */
+static int cmdtree_broadcast_run(cmd3_ctx_d ctx, const struct cmdtree_broadcast *calls, size_t count,
+								 const struct cmdtree_args *args, int pos, struct cmdtree_out *out)
+{
+	struct cmdtree_executor *executor = __atomic_load_n(&ctx->executor, __ATOMIC_ACQUIRE);
+	size_t start = out->total;
+	int parallel = executor && count > 1;
+	size_t ran;
+	size_t i;
+
+	for(i = 0; i < count && parallel; i++)
+		parallel = calls[i].handler->independent;
+
+	/* A broadcast from within a batch (or another broadcast) of the executor is run in place. */
+	if(parallel && 0 == pthread_mutex_trylock(&executor->batch_lock))
+	{
+		struct cmdtree_exec_run run;
+
+		memset(&run, 0, sizeof(run));
+		run.ctx   = ctx;
+		run.calls = calls;
+		run.args  = args;
+		run.pos   = pos;
+
+		cmdtree_exec_run(executor, &run, count, out, NULL, &ran);
+		out->called = 1;
+
+		pthread_mutex_unlock(&executor->batch_lock);
+	}
+	else
+	{
+		for(i = 0; i < count; i++)
+			cmdtree_broadcast_call(ctx, &calls[i], args, pos, out);
+	}
 
-#define CMD_TERMINATING_CHAR_LEN 1
+	return count ? cmdtree_out_len(out, start) : 0;
+}
 
-// Command tree node structure
-struct cmdtree
+/* Resolve the rest of the cmd line under each child of the level, the children with no such cmd are skipped. */
+static int cmdtree_broadcast(cmd3_ctx_d ctx, const struct cmdtree_level *level, const struct cmdtree_args *args, int pos,
+							 struct cmdtree_out *out)
 {
-	char 		 		name[CMD_NAME_MAX_LENGTH];			// Command tree name
-	char 		 		comment[CMD_COMMENT_MAX_LENGTH];	// Command tree comment
-	cmdtree_cmdfunc	cmdfunc;		// Command tree optional command function
+	struct cmdtree_broadcast calls_small[CMD_BROADCAST_SMALL];
+	struct cmdtree_broadcast *calls = calls_small;
+	uint32_t match_first;
+	uint32_t match_count;
+	size_t count = 0;
+	const char *name;
+	size_t len;
+	uint32_t i;
+	int ret;
 
-	struct cmdtree *parent;			// Command tree parent node pointer
-	struct cmdtree *child;			// Command tree child node pointer
+	if(level->count > CMD_BROADCAST_SMALL)
+	{
+		calls = malloc(level->count * sizeof(calls[0]));
+		if(NULL == calls)
+			return 0;
+	}
 
-	UT_hash_handle 		hh; 			// Makes this structure hashable
-};
+	for(i = 0; i < level->count; i++)
+	{
+		cmdtree_d child = level->nodes[level->sorted[i].index];
+		const struct cmdtree_level *child_level = __atomic_load_n(&child->level, __ATOMIC_ACQUIRE);
+		cmdtree_d cmd_tree = child;
+		int child_pos = pos + 1;
 
-static cmdtree_d cmd_root = NULL;	// Command tree root node
+		/* Walk the levels the same way cmdtree_exec() does. */
+		while(child_level && child_pos < args->argc && cmd_tree)
+		{
+			name = cmdtree_args_get(args, child_pos, &len);
+			cmd_tree = cmdtree_level_match(child_level, name, len, ctx->exact_match, &match_first, &match_count);
+			if(cmd_tree)
+			{
+				child_pos++;
 
-static int   cmdtree_report_tree(cmdtree_d cmd_start, char *buf);
-static cmdtree_d cmdtree_lookup(const char *cmd_base_name);
+				child_level = __atomic_load_n(&cmd_tree->level, __ATOMIC_ACQUIRE);
+			}
+		}
 
+		if(cmd_tree && cmdtree_handler_set(cmd_tree->handler))
+		{
+			calls[count].handler = cmd_tree->handler;
+			calls[count].child   = child;
+			calls[count].first   = child_pos - 1;
+			count++;
+		}
+	}
 
+	ret = cmdtree_broadcast_run(ctx, calls, count, args, pos, out);
 
-cmdtree_d cmdtree_create(cmdtree_config_t *config)
-{
-	cmdtree_d cmdtree;
+	if(calls != calls_small)
+		free(calls);
 
-	cmdtree = calloc(1, sizeof(struct cmdtree));
-	if(NULL == cmdtree)
-	    return NULL;
+	return ret;
+}
 
-	strncpy(cmdtree->name, config->name, CMD_NAME_MAX_LENGTH-1);
-	strncpy(cmdtree->comment, config->comment, CMD_COMMENT_MAX_LENGTH-1);
-	cmdtree->cmdfunc = config->cmdfunc;
+/* Image flavor of cmdtree_broadcast(). */
+static int cmdtree_image_broadcast(cmd3_ctx_d ctx, const struct cmdtree_image *image, const struct cmdtree_image_node *parent,
+								   const struct cmdtree_args *args, int pos, struct cmdtree_out *out)
+{
+	struct cmdtree_broadcast calls_small[CMD_BROADCAST_SMALL];
+	struct cmdtree_broadcast *calls = calls_small;
+	uint32_t match_first;
+	uint32_t match_count;
+	size_t count = 0;
+	const char *name;
+	size_t len;
+	uint32_t i;
+	int ret;
 
-	if(config->parent_name == NULL)
+	if(parent->child_count > CMD_BROADCAST_SMALL)
 	{
-		/* This is a root level cmd */
-		cmdtree->parent = NULL;
-
-		HASH_ADD_STR(cmd_root, name, cmdtree);
+		calls = malloc(parent->child_count * sizeof(calls[0]));
+		if(NULL == calls)
+			return 0;
 	}
-	else
-	{	/* This is a sub cmd and a parent exist */
-		cmdtree_d cmd_parent = NULL;
-		char parent_name[1024];
 
-		strncpy(parent_name, config->parent_name, sizeof(parent_name)-1);
-		parent_name[sizeof(parent_name)-1] = '\0';
+	for(i = 0; i < parent->child_count; i++)
+	{
+		const struct cmdtree_image_node *child = &image->nodes[image->sorted[parent->child_first + i].index];
+		const struct cmdtree_image_node *level = child;
+		const struct cmdtree_image_node *cmd_tree = child;
+		int child_pos = pos + 1;
 
-		/* Look for the parent */
-		cmd_parent = cmdtree_lookup(parent_name);
-		if(cmd_parent)
+		while(level->child_count && child_pos < args->argc && cmd_tree)
 		{
-			HASH_ADD_STR(cmd_parent->child, name, cmdtree);
+			name = cmdtree_args_get(args, child_pos, &len);
+			cmd_tree = cmdtree_image_match(image, level, name, len, ctx->exact_match, &match_first, &match_count);
+			if(cmd_tree)
+			{
+				child_pos++;
 
-			cmdtree->parent   = cmd_parent;
+				level = cmd_tree;
+			}
 		}
-		else
+
+		if(cmd_tree && cmdtree_handler_set(&cmd_tree->handler))
 		{
-			printf("Unable to detect parent cmd %s.""\n", parent_name);
-			free(cmdtree);
-			cmdtree = NULL;
+			calls[count].handler = &cmd_tree->handler;
+			calls[count].child   = child->handler.node;
+			calls[count].first   = child_pos - 1;
+			count++;
 		}
 	}
 
-	return cmdtree;
+	ret = cmdtree_broadcast_run(ctx, calls, count, args, pos, out);
+
+	if(calls != calls_small)
+		free(calls);
+
+	return ret;
 }
 
-/* String to Vector convert */
-void cmdtree_stov(const char *string, int *arg_count, const char **arg_vec)
+void cmdtree_broadcast_executor_set_ctx(cmd3_ctx_d ctx, cmdtree_executor_d executor)
 {
-	/*
-	 * Split the cmd string using white space delimiters, ending up with an argv/argc format.
-	 */
-	const char **ap;
+	__atomic_store_n(&ctx->executor, executor, __ATOMIC_RELEASE);
+}
 
-	*arg_count = 0;
+void cmdtree_broadcast_executor_set(cmdtree_executor_d executor)
+{
+	cmdtree_broadcast_executor_set_ctx(&cmd_default_ctx, executor);
+}
 
-	for (ap = arg_vec; (*ap = strsep((char **)&string, " \t")) != NULL;)
+#ifdef CMD3_STATS
+// Stats report row, a snapshot of a cmd counters
+struct cmdtree_stats_row
+{
+	const struct cmdtree *cmdtree;
+	cmdtree_stats_t		  stats;
+};
+
+// Stats report rows, grown as the tree is walked
+struct cmdtree_stats_rows
+{
+	struct cmdtree_stats_row *rows;
+	size_t					  count;
+	size_t					  size;
+};
+
+static void cmdtree_stats_snapshot(const struct cmdtree_counters *counters, cmdtree_stats_t *stats)
+{
+	uint64_t hist[CMD_STATS_BUCKETS];
+	uint64_t total = 0;
+	uint64_t seen = 0;
+	int i;
+
+	stats->calls   = __atomic_load_n(&counters->calls, __ATOMIC_RELAXED);
+	stats->errors  = __atomic_load_n(&counters->errors, __ATOMIC_RELAXED);
+	stats->time_ns = __atomic_load_n(&counters->time_ns, __ATOMIC_RELAXED);
+	stats->p99_ns  = 0;
+
+	for(i = 0; i < CMD_STATS_BUCKETS; i++)
 	{
-		if (**ap != '\0')
+		hist[i] = __atomic_load_n(&counters->hist[i], __ATOMIC_RELAXED);
+		total  += hist[i];
+	}
+
+	/* The upper bound of the bucket reaching 99% of the calls. */
+	for(i = 0; i < CMD_STATS_BUCKETS && total; i++)
+	{
+		seen += hist[i];
+		if(seen >= total - total / 100)
 		{
-			(*arg_count)++;
-		   if (++ap >= &arg_vec[CMD_TREE_MAX_DEPTH])
-			   break;
+			stats->p99_ns = 1ULL << (i + 1);
+			break;
 		}
 	}
 }
 
-static cmdtree_d cmdtree_lookup(const char *cmd_base_name)
+static int cmdtree_stats_collect(const struct cmdtree_level *level, struct cmdtree_stats_rows *rows)
 {
-	cmdtree_d cmd = NULL;
-
-	/*
-	 * Split the cmd string using white space delimiters, ending up with an argv/argc format.
-	 */;
-	const char *arg_vdata[CMD_TREE_MAX_DEPTH];
-	const char **arg_vec = arg_vdata;
-	int   arg_count = 0;
+	uint32_t i;
 
-	cmdtree_stov(cmd_base_name, &arg_count, arg_vec);
+	if(NULL == level)
+		return CMD3_SUCCESS;
 
-	if (arg_count > 0)
+	for(i = 0; i < level->count; i++)
 	{
-		cmdtree_d cmd_base;
+		const struct cmdtree *cmdtree = level->nodes[i];
+		const struct cmdtree_counters *counters = cmdtree->handler->stats;
 
-		cmd_base = cmd_root;
-		do
+		if(counters && __atomic_load_n(&counters->calls, __ATOMIC_RELAXED))
 		{
-			HASH_FIND_STR(cmd_base, *arg_vec, cmd);
-			if(cmd)
+			if(rows->count == rows->size)
 			{
-				arg_count--;
-				arg_vec++;
+				size_t size = rows->size ? rows->size * 2 : 64;
+				struct cmdtree_stats_row *grown = realloc(rows->rows, size * sizeof(struct cmdtree_stats_row));
 
-				cmd_base = cmd->child;
+				if(NULL == grown)
+					return CMD3_FAIL;
+
+				rows->rows = grown;
+				rows->size = size;
 			}
-		} while (cmd_base && arg_count && cmd);
+
+			rows->rows[rows->count].cmdtree = cmdtree;
+			cmdtree_stats_snapshot(counters, &rows->rows[rows->count].stats);
+			rows->count++;
+		}
+
+		if(CMD3_SUCCESS != cmdtree_stats_collect(__atomic_load_n(&cmdtree->level, __ATOMIC_ACQUIRE), rows))
+			return CMD3_FAIL;
 	}
 
-	return cmd;
+	return CMD3_SUCCESS;
 }
 
-void cmdtree_destroy(cmdtree_d cmdtree)
+static int cmdtree_stats_cmp_u64(unsigned long long a, unsigned long long b)
 {
-	cmdtree_d cmdtree_head = NULL;
+	return a < b ? 1 : (a > b ? -1 : 0);
+}
 
-	/*
-	 * The cmd entry should not be deleted in these cases:
-	 * - The entry has a child. (the child sub-tree needs to be deleted first)
-	 */
-	if(cmdtree->child)
+static int cmdtree_stats_cmp_calls(const void *a, const void *b)
+{
+	return cmdtree_stats_cmp_u64(((const struct cmdtree_stats_row *)a)->stats.calls,
+								 ((const struct cmdtree_stats_row *)b)->stats.calls);
+}
+
+static int cmdtree_stats_cmp_time(const void *a, const void *b)
+{
+	return cmdtree_stats_cmp_u64(((const struct cmdtree_stats_row *)a)->stats.time_ns,
+								 ((const struct cmdtree_stats_row *)b)->stats.time_ns);
+}
+
+static int cmdtree_stats_cmp_p99(const void *a, const void *b)
+{
+	return cmdtree_stats_cmp_u64(((const struct cmdtree_stats_row *)a)->stats.p99_ns,
+								 ((const struct cmdtree_stats_row *)b)->stats.p99_ns);
+}
+
+/* Write the cmd path, from the root level cmd on, returns its length. */
+static size_t cmdtree_stats_path(const struct cmdtree *cmdtree, struct cmdtree_out *out)
+{
+	size_t len = 0;
+
+	if(cmdtree->parent)
 	{
-		return;
+		len = cmdtree_stats_path(cmdtree->parent, out) + 1;
+		cmdtree_out_write(out, " ", 1);
+	}
+
+	cmdtree_out_write(out, cmdtree->name, cmdtree->name_len);
+
+	return len + cmdtree->name_len;
+}
+
+/* List the top cmds (all of them up to the optional count argument) in the given order. */
+static int cmdtree_stats_report(struct cmdtree_out *out, int argc, const char **argv,
+								int (*cmp)(const void *, const void *))
+{
+	struct cmdtree_stats_rows rows = { NULL, 0, 0 };
+	size_t top = argc > 1 ? strtoull(argv[1], NULL, 0) : CMD_STATS_TOP_DEFAULT;
+	size_t i;
+
+	if(CMD3_SUCCESS != cmdtree_stats_collect(__atomic_load_n(&out->ctx->level, __ATOMIC_ACQUIRE), &rows))
+	{
+		free(rows.rows);
+		return CMD3_FAIL;
 	}
 
-	if (NULL == cmdtree->parent)
+	qsort(rows.rows, rows.count, sizeof(struct cmdtree_stats_row), cmp);
+
+	cmdtree_out_printf(out, "%-32s %12s %10s %14s %12s\n", "Command", "Calls", "Errors", "Total(us)", "p99(ns)");
+
+	for(i = 0; i < rows.count && i < top; i++)
 	{
-		/* In case this is a root level cmd, cmd_root is the hash table head. */
-		cmdtree_head = cmd_root;
+		const cmdtree_stats_t *stats = &rows.rows[i].stats;
+		size_t len = cmdtree_stats_path(rows.rows[i].cmdtree, out);
 
-		if(1 == HASH_COUNT(cmdtree_head))
-		{
-			cmd_root = NULL;
-		}
+		cmdtree_out_printf(out, "%*s %12llu %10llu %14llu %12llu\n", len < 32 ? (int)(32 - len) : 0, "",
+						   stats->calls, stats->errors, stats->time_ns / 1000, stats->p99_ns);
 	}
-	else
+
+	free(rows.rows);
+
+	return cmdtree_out_flush(out);
+}
+
+static int cmdtree_stats_calls(void *user_data, int argc, const char **argv, cmdtree_out_d out)
+{
+	(void)user_data;
+
+	return cmdtree_stats_report(out, argc, argv, cmdtree_stats_cmp_calls);
+}
+
+static int cmdtree_stats_time(void *user_data, int argc, const char **argv, cmdtree_out_d out)
+{
+	(void)user_data;
+
+	return cmdtree_stats_report(out, argc, argv, cmdtree_stats_cmp_time);
+}
+
+static int cmdtree_stats_p99(void *user_data, int argc, const char **argv, cmdtree_out_d out)
+{
+	(void)user_data;
+
+	return cmdtree_stats_report(out, argc, argv, cmdtree_stats_cmp_p99);
+}
+
+static void cmdtree_stats_clear(const struct cmdtree_level *level)
+{
+	uint32_t i;
+	int j;
+
+	if(NULL == level)
+		return;
+
+	for(i = 0; i < level->count; i++)
 	{
-		/* Lookup for the hash table (head): The parent "first child" points to the head. */
-		cmdtree_head = cmdtree->parent->child;
+		struct cmdtree_counters *counters = level->nodes[i]->handler->stats;
 
-		if(1 == HASH_COUNT(cmdtree_head))
+		if(counters)
 		{
-			cmdtree->parent->child = NULL;
+			__atomic_store_n(&counters->calls, 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&counters->errors, 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&counters->time_ns, 0, __ATOMIC_RELAXED);
+			for(j = 0; j < CMD_STATS_BUCKETS; j++)
+				__atomic_store_n(&counters->hist[j], 0, __ATOMIC_RELAXED);
 		}
+
+		cmdtree_stats_clear(__atomic_load_n(&level->nodes[i]->level, __ATOMIC_ACQUIRE));
 	}
+}
+
+static int cmdtree_stats_reset(void *user_data, int argc, const char **argv, cmdtree_out_d out)
+{
+	(void)user_data;
+	(void)argc;
+	(void)argv;
+
+	cmdtree_stats_clear(__atomic_load_n(&out->ctx->level, __ATOMIC_ACQUIRE));
 
-	HASH_DEL(cmdtree_head, cmdtree);
-	free(cmdtree);
+	return cmdtree_out_printf(out, "Cmd stats cleared.\n");
 }
 
-cmdtree_d new_cmdtree_create(const char cmdname[], const char cmdcomment[], cmdtree_cmdfunc cmdfunc, const char parent_name[])
+int cmdtree_stats_create_ctx(cmd3_ctx_d ctx)
 {
-    cmdtree_config_t cmd_cfg;
+	static const cmdtree_arg_schema_t top_args[] =
+	{
+		{ "count", CMDTREE_ARG_INT, 1, 1, INT_MAX, NULL },
+	};
+	static const struct
+	{
+		const char 		   *name;
+		const char 		   *comment;
+		cmdtree_cmdfunc_out cmdfunc_out;
+		int 				report;		// Read only, takes the optional count argument
+	} cmds[] =
+	{
+		{ "calls", "Top cmds by calls [count]",       cmdtree_stats_calls, 1 },
+		{ "time",  "Top cmds by total time [count]",  cmdtree_stats_time,  1 },
+		{ "p99",   "Top cmds by p99 latency [count]", cmdtree_stats_p99,   1 },
+		{ "reset", "Clear the cmd stats",             cmdtree_stats_reset, 0 },
+	};
+	cmdtree_config_t config;
+	cmdtree_d stats;
+	size_t i;
+	int ret = CMD3_SUCCESS;
 
-    memset(&cmd_cfg, 0, sizeof(cmd_cfg));
+	pthread_mutex_lock(&ctx->lock);
 
-    cmd_cfg.name        = cmdname;
-    cmd_cfg.cmdfunc     = cmdfunc;
-    cmd_cfg.comment     = cmdcomment;
-    cmd_cfg.parent_name = parent_name;
-    cmdtree_d cmdtree = cmdtree_create(&cmd_cfg);
+	memset(&config, 0, sizeof(config));
+	config.name    = "stats";
+	config.comment = "Cmd dispatch stats";
 
-    return cmdtree;
+	stats = cmdtree_create_under_locked(ctx, NULL, &config);
+	if(NULL == stats)
+		ret = CMD3_FAIL;
+
+	for(i = 0; i < sizeof(cmds) / sizeof(cmds[0]) && CMD3_SUCCESS == ret; i++)
+	{
+		config.name        = cmds[i].name;
+		config.comment     = cmds[i].comment;
+		config.cmdfunc_out = cmds[i].cmdfunc_out;
+		config.args        = cmds[i].report ? top_args : NULL;
+		config.arg_count   = cmds[i].report ? 1 : 0;
+		config.independent = cmds[i].report;
+
+		if(NULL == cmdtree_create_under_locked(ctx, stats, &config))
+			ret = CMD3_FAIL;
+	}
+
+	/* The cmds created so far go along with their parent. */
+	if(CMD3_SUCCESS != ret && stats)
+		cmdtree_destroy_subtree_locked(stats);
+
+	cmd3_rcu_reclaim(&ctx->retired, 0);
+
+	pthread_mutex_unlock(&ctx->lock);
+
+	return ret;
 }
 
-cmdtree_d cmdtree_get_root(void)
+int cmdtree_stats_get(cmdtree_d cmdtree, cmdtree_stats_t *stats)
+{
+	if(NULL == cmdtree->handler->stats)
+		return CMD3_FAIL;
+
+	cmdtree_stats_snapshot(cmdtree->handler->stats, stats);
+
+	return CMD3_SUCCESS;
+}
+#else
+int cmdtree_stats_create_ctx(cmd3_ctx_d ctx)
 {
-	return cmd_root;
+	(void)ctx;
+
+	return CMD3_FAIL;
 }
 
-int cmdtree_exec(int argc, const char **argv, char *buf, size_t buf_size)
+int cmdtree_stats_get(cmdtree_d cmdtree, cmdtree_stats_t *stats)
 {
-	cmdtree_d cmd;
-	int ret = 0;
+	(void)cmdtree;
+	(void)stats;
+
+	return CMD3_FAIL;
+}
+#endif
+
+int cmdtree_stats_create(void)
+{
+	return cmdtree_stats_create_ctx(&cmd_default_ctx);
+}
+
+void cmdtree_trace_set(const cmdtree_trace_t *trace)
+{
+	__atomic_store_n(&cmd_trace, trace, __ATOMIC_RELEASE);
+}
+
+size_t cmdtree_path(cmdtree_d cmdtree, char *buf, size_t buf_size)
+{
+	const struct cmdtree *node;
+	size_t path_len = cmdtree->name_len;
+	size_t pos;
+	size_t end;
+	size_t i;
 
-	cmd = cmdtree_get_root();
+	for(node = cmdtree->parent; node; node = node->parent)
+		path_len += node->name_len + 1;
 
-	if(0 == argc)
+	if(0 == buf_size)
+		return path_len;
+
+	/* The path is filled from its end, the part past the buffer is cut off. */
+	end = path_len < buf_size ? path_len : buf_size - CMD_TERMINATING_CHAR_LEN;
+	buf[end] = '\0';
+
+	pos = path_len;
+	for(node = cmdtree; node; node = node->parent)
 	{
-		ret = cmdtree_report_tree(cmd, buf);
+		pos -= node->name_len;
+		for(i = 0; i < node->name_len && pos + i < end; i++)
+			buf[pos + i] = node->name[i];
+
+		if(node->parent && --pos < end)
+			buf[pos] = ' ';
 	}
-	else
-	{
-		cmdtree_d cmd_tree;
 
-		do
-		{
-			HASH_FIND_STR(cmd, *argv, cmd_tree);
-			if(cmd_tree)
-			{
-				argc--;
-				argv++;
+	return path_len;
+}
 
-				cmd = cmd_tree->child;
-			}
-		} while (cmd && argc && cmd_tree);
+/* Copy a slow log entry, CMD3_FAIL if it does not hold the given id (overwritten, being written or unused). */
+static int cmdtree_slowlog_read(struct cmdtree_slowlog *slowlog, uint64_t id, struct cmdtree_slowlog_entry *copy)
+{
+	struct cmdtree_slowlog_entry *entry = &slowlog->entries[id % slowlog->size];
+	uint64_t seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE);
 
-		if(cmd_tree)
-		{
-			if(NULL != cmd_tree->cmdfunc)
-				ret = cmd_tree->cmdfunc(++argc, --argv, buf, buf_size);
-			else if(cmd_tree->child)
-				ret = cmdtree_report_tree(cmd_tree->child, buf);
-		}
-		else
-		{
-			ret = cmdtree_report_tree(cmd, buf);
-		}
-	}
+	if(seq != (id + 1) * 2)
+		return CMD3_FAIL;
 
-	if(ret <= 0)
+	memcpy(copy, entry, sizeof(struct cmdtree_slowlog_entry));
+
+	/* A release read-modify-write keeps the copy before the check, as a fence would. */
+	return seq == __atomic_fetch_add(&entry->seq, 0, __ATOMIC_ACQ_REL) ? CMD3_SUCCESS : CMD3_FAIL;
+}
+
+/* The id of the oldest entry not cleared nor overwritten. */
+static uint64_t cmdtree_slowlog_first(const struct cmdtree_slowlog *slowlog, uint64_t next)
+{
+	uint64_t first = __atomic_load_n(&slowlog->reset, __ATOMIC_RELAXED);
+
+	if(next > slowlog->size && next - slowlog->size > first)
+		first = next - slowlog->size;
+
+	return first;
+}
+
+static int cmdtree_slowlog_get(void *user_data, int argc, const char **argv, cmdtree_out_d out)
+{
+	struct cmdtree_slowlog *slowlog = __atomic_load_n(&out->ctx->slowlog, __ATOMIC_ACQUIRE);
+	struct cmdtree_slowlog_entry entry;
+	size_t count = argc > 1 ? strtoull(argv[1], NULL, 0) : CMD_SLOWLOG_GET_DEFAULT;
+	size_t listed = 0;
+	uint64_t first;
+	uint64_t next;
+	uint64_t id;
+
+	(void)user_data;
+
+	if(NULL == slowlog)
+		return cmdtree_out_printf(out, "Slow log is not enabled.\n");
+
+	next  = __atomic_load_n(&slowlog->next, __ATOMIC_RELAXED);
+	first = cmdtree_slowlog_first(slowlog, next);
+
+	/* The latest entries first. */
+	for(id = next; id > first && listed < count; id--)
 	{
-		ret = sprintf(buf,"Missing parameter or unsupported command.\n");
+		size_t len;
+
+		if(CMD3_SUCCESS != cmdtree_slowlog_read(slowlog, id - 1, &entry))
+			continue;
+
+		len = entry.line_len < CMD_SLOWLOG_LINE_SIZE ? entry.line_len : CMD_SLOWLOG_LINE_SIZE;
+
+		cmdtree_out_printf(out, "%llu %llu.%06llu %lluus %llub %.*s",
+						   (unsigned long long)(id - 1),
+						   (unsigned long long)(entry.time_us / 1000000), (unsigned long long)(entry.time_us % 1000000),
+						   (unsigned long long)entry.duration_us, (unsigned long long)entry.output_len,
+						   (int)len, entry.line);
+		if(entry.line_len > len)
+			cmdtree_out_printf(out, "... (%u more bytes)", (unsigned)(entry.line_len - len));
+		cmdtree_out_write(out, "\n", 1);
+
+		listed++;
 	}
 
-	return ret + CMD_TERMINATING_CHAR_LEN;
+	if(0 == listed)
+		cmdtree_out_printf(out, "Slow log is empty.\n");
+
+	return cmdtree_out_flush(out);
 }
 
+static int cmdtree_slowlog_len(void *user_data, int argc, const char **argv, cmdtree_out_d out)
+{
+	struct cmdtree_slowlog *slowlog = __atomic_load_n(&out->ctx->slowlog, __ATOMIC_ACQUIRE);
+	struct cmdtree_slowlog_entry entry;
+	uint64_t next;
+	uint64_t id;
+	size_t len = 0;
+
+	(void)user_data;
+	(void)argc;
+	(void)argv;
+
+	if(NULL == slowlog)
+		return cmdtree_out_printf(out, "Slow log is not enabled.\n");
+
+	next = __atomic_load_n(&slowlog->next, __ATOMIC_RELAXED);
+	for(id = cmdtree_slowlog_first(slowlog, next); id < next; id++)
+		len += CMD3_SUCCESS == cmdtree_slowlog_read(slowlog, id, &entry);
 
-static int cmdtree_report_tree(cmdtree_d cmd_start, char *buf)
+	return cmdtree_out_printf(out, "%zu\n", len);
+}
+
+static int cmdtree_slowlog_reset(void *user_data, int argc, const char **argv, cmdtree_out_d out)
 {
-	cmdtree_d cmd_iterate;
-	cmdtree_d cmd_temp;
-	int buf_len;
-	char *buf_base = buf;
+	struct cmdtree_slowlog *slowlog = __atomic_load_n(&out->ctx->slowlog, __ATOMIC_ACQUIRE);
 
-	HASH_ITER(hh, cmd_start, cmd_iterate, cmd_temp)
+	(void)user_data;
+	(void)argc;
+	(void)argv;
+
+	if(NULL == slowlog)
+		return cmdtree_out_printf(out, "Slow log is not enabled.\n");
+
+	__atomic_store_n(&slowlog->reset, __atomic_load_n(&slowlog->next, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+
+	return cmdtree_out_printf(out, "Slow log cleared.\n");
+}
+
+int cmdtree_slowlog_create_ctx(cmd3_ctx_d ctx, unsigned long long threshold_us, size_t max_len)
+{
+	static const cmdtree_arg_schema_t get_args[] =
+	{
+		{ "count", CMDTREE_ARG_INT, 1, 1, INT_MAX, NULL },
+	};
+	static const struct
+	{
+		const char 		   *name;
+		const char 		   *comment;
+		cmdtree_cmdfunc_out cmdfunc_out;
+		int 				get;		// Takes the optional count argument
+	} cmds[] =
+	{
+		{ "get",   "List the latest slow cmds [count]", cmdtree_slowlog_get,   1 },
+		{ "len",   "Number of slow cmds logged",        cmdtree_slowlog_len,   0 },
+		{ "reset", "Clear the slow log",                cmdtree_slowlog_reset, 0 },
+	};
+	struct cmdtree_slowlog *slowlog;
+	cmdtree_config_t config;
+	cmdtree_d parent;
+	size_t i;
+	int ret = CMD3_SUCCESS;
+
+	if(0 == max_len)
+		return CMD3_FAIL;
+
+	slowlog = calloc(1, sizeof(struct cmdtree_slowlog) + max_len * sizeof(struct cmdtree_slowlog_entry));
+	if(NULL == slowlog)
+		return CMD3_FAIL;
+
+	/* Past the nanosecond range no cmd is logged. */
+	slowlog->threshold_ns = threshold_us > UINT64_MAX / 1000 ? UINT64_MAX : threshold_us * 1000;
+	slowlog->size         = max_len;
+
+	pthread_mutex_lock(&ctx->lock);
+
+	if(ctx->slowlog)
+	{
+		pthread_mutex_unlock(&ctx->lock);
+		free(slowlog);
+		return CMD3_FAIL;
+	}
+
+	memset(&config, 0, sizeof(config));
+	config.name    = "slowlog";
+	config.comment = "Slow cmds log";
+
+	parent = cmdtree_create_under_locked(ctx, NULL, &config);
+	if(NULL == parent)
+		ret = CMD3_FAIL;
+
+	for(i = 0; i < sizeof(cmds) / sizeof(cmds[0]) && CMD3_SUCCESS == ret; i++)
+	{
+		config.name        = cmds[i].name;
+		config.comment     = cmds[i].comment;
+		config.cmdfunc_out = cmds[i].cmdfunc_out;
+		config.args        = cmds[i].get ? get_args : NULL;
+		config.arg_count   = cmds[i].get ? 1 : 0;
+
+		if(NULL == cmdtree_create_under_locked(ctx, parent, &config))
+			ret = CMD3_FAIL;
+	}
+
+	if(CMD3_SUCCESS == ret)
 	{
-		buf += sprintf(buf, "%-20s  %s\n", cmd_iterate->name, cmd_iterate->comment);
+		/* Published with the cmds, from now on every cmd is timed. */
+		__atomic_store_n(&ctx->slowlog, slowlog, __ATOMIC_RELEASE);
 	}
+	else
+	{
+		/* The cmds created so far go along with their parent. */
+		if(parent)
+			cmdtree_destroy_subtree_locked(parent);
+		free(slowlog);
+	}
+
+	cmd3_rcu_reclaim(&ctx->retired, 0);
 
-	buf_len = buf - buf_base;
-	return buf_len;
+	pthread_mutex_unlock(&ctx->lock);
+
+	return ret;
+}
+
+int cmdtree_slowlog_create(unsigned long long threshold_us, size_t max_len)
+{
+	return cmdtree_slowlog_create_ctx(&cmd_default_ctx, threshold_us, max_len);
 }
@@ -30,6 +30,8 @@
 #ifndef CMD3_H_
 #define CMD3_H_
 
+#include <sys/uio.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -38,12 +40,103 @@ extern "C" {
 
 #define CMD3_SUCCESS			0
 #define CMD3_FAIL			-1
+#define CMD3_INCOMPLETE		1
 
 #define CMD_TREE_MAX_DEPTH 			32
 
 typedef struct cmdtree *cmdtree_d;
 
+typedef struct cmd3_ctx *cmd3_ctx_d;
+
 typedef int (*cmdtree_cmdfunc)(int argc, const char **argv, char *buf, size_t buf_size);
+typedef int (*cmdtree_cmdfunc_ud)(void *user_data, int argc, const char **argv, char *buf, size_t buf_size);
+
+typedef enum cmdtree_arg_type
+{
+	CMDTREE_ARG_STRING = 0,		// Any token
+	CMDTREE_ARG_INT,			// A decimal, hex (0x) or octal (0) integer, in [min, max] unless both are 0
+	CMDTREE_ARG_ENUM,			// One of enum_values, or a unique prefix of one unless exact matching is configured
+	CMDTREE_ARG_IPV4,			// A dotted decimal IPv4 address
+	CMDTREE_ARG_IPV6,			// A textual IPv6 address
+} cmdtree_arg_type_t;
+
+// Argument description, the strings are referenced and must outlive the cmdtree entry
+typedef struct cmdtree_arg_schema
+{
+	const char 			*name;				// The argument name, used in reports
+	cmdtree_arg_type_t	 type;				// The argument type
+	int 				 optional;			// Non zero for an optional argument, optional arguments come last
+
+	long long 			 min;				// CMDTREE_ARG_INT range
+	long long 			 max;
+
+	const char * const	*enum_values;		// CMDTREE_ARG_ENUM values, NULL terminated
+} cmdtree_arg_schema_t;
+
+// Parsed argument, as passed to cmdtree_cmdfunc_typed functions
+typedef struct cmdtree_arg
+{
+	int 				 present;			// Zero for an omitted optional argument
+	const char 			*str;				// The argument token
+	union
+	{
+		long long 		 i;					// CMDTREE_ARG_INT value
+		int 			 e;					// CMDTREE_ARG_ENUM index in enum_values
+		unsigned char 	 ipv4[4];			// CMDTREE_ARG_IPV4 address, network order
+		unsigned char 	 ipv6[16];			// CMDTREE_ARG_IPV6 address, network order
+	} value;
+} cmdtree_arg_t;
+
+typedef int (*cmdtree_cmdfunc_typed)(void *user_data, const cmdtree_arg_t *args, int arg_count, char *buf, size_t buf_size);
+
+typedef struct cmdtree_out *cmdtree_out_d;
+
+typedef int (*cmdtree_cmdfunc_out)(void *user_data, int argc, const char **argv, cmdtree_out_d out);
+
+// Output sink, the cmd output is streamed to it through a staging buffer
+typedef struct cmdtree_sink
+{
+	int   (*write)(void *arg, const char *data, size_t len);				// Mandatory, writes all the data, CMD3_FAIL on failure
+	int   (*writev)(void *arg, const struct iovec *iov, int iovcnt);		// Optional, writes all the fragments at once
+
+	void 	*arg;															// Opaque argument passed to the functions
+} cmdtree_sink_t;
+
+typedef struct cmdtree_chain *cmdtree_chain_d;
+
+typedef struct cmdtree_pool *cmdtree_pool_d;
+
+typedef struct cmdtree_executor *cmdtree_executor_d;
+
+// Async cmd completion, status is CMD3_SUCCESS, or CMD3_FAIL for a failed, unknown or partial cmd
+// Called inline or from a pool worker, see cmdtree_exec_async() for the calls it must not make
+typedef void (*cmdtree_done_cb)(void *arg, int status);
+
+#define CMDTREE_BATCH_STOP_ON_FAIL 	0x1		// Batch flag, no cmd is run past a failed one
+
+// Batch cmd outcome, locating its output in the batch output stream
+typedef struct cmdtree_batch_result
+{
+	int 		 status;		// CMD3_SUCCESS, or CMD3_FAIL for a failed, unknown or partial cmd
+	size_t 		 offset;		// Offset of the cmd output in the batch output
+	size_t 		 len;			// Length of the cmd output
+} cmdtree_batch_result_t;
+
+// Cmd dispatch counters snapshot (see cmdtree_stats_get())
+typedef struct cmdtree_stats
+{
+	unsigned long long 	calls;		// Calls
+	unsigned long long 	errors;		// Failed calls, returning <= 0 or given invalid arguments
+	unsigned long long 	time_ns;	// Total call time
+	unsigned long long 	p99_ns;		// 99th percentile call time, as its log2 latency bucket upper bound
+} cmdtree_stats_t;
+
+// Batch cmd, given as an argument vector
+typedef struct cmdtree_cmdline
+{
+	int 		  argc;
+	const char	**argv;
+} cmdtree_cmdline_t;
 
 typedef struct cmdtree_config
 {
@@ -52,28 +145,188 @@ typedef struct cmdtree_config
 	cmdtree_cmdfunc	 cmdfunc;
 
 	const char 		*parent_name;
+
+	cmdtree_cmdfunc_ud cmdfunc_ud;	// Optional, used instead of cmdfunc, receives the context user data
+
+	const cmdtree_arg_schema_t *args;		// Optional argument schema, validated and parsed before dispatch
+	int 				 arg_count;			// Number of arguments in the schema
+	cmdtree_cmdfunc_typed cmdfunc_typed;	// Optional, used instead of cmdfunc, receives the parsed arguments
+
+	cmdtree_cmdfunc_out cmdfunc_out;		// Optional, used instead of cmdfunc, streams its output (see cmdtree_out_write())
+
+	int 				 independent;		// Non zero if the cmd may run concurrently with, and out of order of, other cmds
+	int 				 async;				// Non zero if the cmd may block, cmdtree_exec_async() runs it on a worker pool
 } cmdtree_config_t;
 
+typedef struct cmdtree_allocator
+{
+	void *(*alloc)(void *arg, size_t size);				// Mandatory allocation function
+	void  (*free)(void *arg, void *ptr, size_t size);	// Optional free function, size is the allocated size
+	void  (*release)(void *arg);						// Optional release of all allocations at once
+
+	void 	*arg;										// Opaque argument passed to the functions
+} cmdtree_allocator_t;
+
+typedef struct cmdtree_arena *cmdtree_arena_d;
+
+typedef void (*cmdtree_complete_cb)(void *arg, const char *name);
+
+// Traced cmd processing stages, stages may nest (e.g. output written by a cmd function)
+typedef enum cmdtree_trace_stage
+{
+	CMDTREE_TRACE_TOKENIZE = 0,	// Splitting a cmd line, bytes is the line length
+	CMDTREE_TRACE_LOOKUP,		// Resolving the cmd, bytes is the cmd tokens length, the end event carries the cmd found
+	CMDTREE_TRACE_HANDLER,		// Running the cmd function, bytes is the arguments length on begin, the output length on end
+	CMDTREE_TRACE_REPORT,		// Rendering a usage report (cmd list), bytes is the report length on end
+	CMDTREE_TRACE_OUTPUT,		// Writing output to a sink, bytes is the length written
+} cmdtree_trace_stage_t;
+
+typedef struct cmdtree_trace_event
+{
+	cmdtree_trace_stage_t stage;
+	cmdtree_d 		 	  cmd;		// The cmd (see cmdtree_path()), NULL when not resolved (yet)
+	size_t 				  bytes;	// Stage byte count
+} cmdtree_trace_event_t;
+
+typedef void (*cmdtree_trace_hook)(void *arg, const cmdtree_trace_event_t *event);
+
+// Trace hooks, called on each stage begin and end
+typedef struct cmdtree_trace
+{
+	cmdtree_trace_hook	 begin;		// Optional
+	cmdtree_trace_hook	 end;		// Optional
+
+	void 				*arg;		// Opaque argument passed to the hooks
+} cmdtree_trace_t;
+
+typedef struct cmdtree_token
+{
+	const char 	*str;		// The token start, not terminated
+	size_t 		 len;		// The token length
+} cmdtree_token_t;
+
+#define CMDTREE_ARGV_SMALL 			32
+
+// Growable token vector, reusable across lines, small lines use the embedded tokens (not to be copied)
+typedef struct cmdtree_argv
+{
+	int 			 argc;							// Number of tokens
+	int 			 capacity;						// Number of tokens the vector holds
+	cmdtree_token_t *tokens;						// The tokens, the embedded ones or a heap vector
+	cmdtree_token_t  small[CMDTREE_ARGV_SMALL];		// Embedded tokens, used while they suffice
+
+	char 			*strings;						// Unescaped tokens of quoted lines
+	size_t 			 strings_size;					// Size of the unescaped tokens buffer
+} cmdtree_argv_t;
+
+typedef struct cmd3_ctx_config
+{
+	const cmdtree_allocator_t *allocator;	// The context tree allocator, NULL for the default heap allocator
+	void 		*user_data;					// Opaque user data, passed to cmdtree_cmdfunc_ud functions
+	int 		 exact_match;				// Non zero disables the unique prefix (abbreviated) cmd matching
+} cmd3_ctx_config_t;
+
+
+/*********************************************************************************//**
+ * @note	Create a command tree context, owning an independent command tree.
+ * 			The cmdtree_*() functions without a context operate on a default context.
+ *
+ * @param [in]  config - The context configuration, NULL for the defaults.
+ *
+ * @return
+ *  - On success, the context descriptor.
+ *  - On failure, returns NULL.
+ *************************************************************************************/
+cmd3_ctx_d 	  cmd3_ctx_create(const cmd3_ctx_config_t *config);
+
+
+/*********************************************************************************//**
+ * @note	Destroy the command tree context, including its whole command tree.
+ * 			Waits for the async cmds queued on it, see cmdtree_teardown().
+ *
+ * @param [in]  ctx - The context descriptor.
+ *
+ * @return
+ *  - N/A
+ *************************************************************************************/
+void 		  cmd3_ctx_destroy(cmd3_ctx_d ctx);
+
+
+/*********************************************************************************//**
+ * @note	Get/Set the context user data, passed to cmdtree_cmdfunc_ud functions.
+ *
+ * @param [in]  ctx 	  - The context descriptor.
+ * 		  [in]	user_data - The opaque user data.
+ *
+ * @return
+ *  - The context user data (get).
+ *************************************************************************************/
+void 		 *cmd3_ctx_get_user_data(cmd3_ctx_d ctx);
+void 		  cmd3_ctx_set_user_data(cmd3_ctx_d ctx, void *user_data);
+
 
 /*********************************************************************************//**
  * @note	Create a command tree entry,
  * 			representing a a tree junction or a command node (tree leaf).
  *
- * @param [in]  config - The configuration structure,
+ * @param [in]  ctx    - The context descriptor (cmdtree_create_ctx() only).
+ * 		  [in]  config - The configuration structure,
  * 						 describing the location of the entry in the tree,
  * 						 its name, comment and an optional command func.
  *
  * @return
  *  - On success, pointer to the cmdtree descriptor.
  *  - On failure, exit with process panic.
+ *
+ * 	With an argument schema (config->args), the arguments following the cmd are validated
+ * 	and parsed by cmdtree_exec(), bad input is reported without calling the cmd function.
+ * 	The parsed arguments are passed to config->cmdfunc_typed, the other cmd functions
+ * 	still receive the argument strings. Enum values are completed by cmdtree_complete().
+ *
+ * 	A cmd named "*" is matched as is by cmdtree_exec(), it disables the broadcast over its level.
  *************************************************************************************/
 cmdtree_d cmdtree_create(cmdtree_config_t *config);
+cmdtree_d cmdtree_create_ctx(cmd3_ctx_d ctx, cmdtree_config_t *config);
+
+
+/*********************************************************************************//**
+ * @note	Create a command tree entry under a parent entry, given by its descriptor.
+ * 			The parent path is not resolved, config->parent_name is not used.
+ * 			The entry belongs to the parent context.
+ *
+ * @param [in]  parent - The parent cmdtree descriptor,
+ * 						 CMDTREE_NO_PARENT for a root cmd of the default context.
+ * 		  [in]  config - The configuration structure, its name, comment and an optional command func.
+ *
+ * @return
+ *  - On success, pointer to the cmdtree descriptor.
+ *  - On failure, returns NULL.
+ *************************************************************************************/
+cmdtree_d cmdtree_create_under(cmdtree_d parent, const cmdtree_config_t *config);
+
+
+/*********************************************************************************//**
+ * @note	Create a set of command tree entries at once, all or none of them.
+ * 			Each distinct parent path is resolved once and each affected level is rebuilt once.
+ * 			An entry may have a parent created earlier in the same set.
+ *
+ * @param [in]  ctx     - The context descriptor (cmdtree_create_bulk_ctx() only).
+ * 		  [in]  configs - The configuration structures, as given to cmdtree_create().
+ * 		  [in]  count   - The number of configuration structures.
+ *
+ * @return
+ *  - CMD3_SUCCESS on success.
+ *  - CMD3_FAIL on an unknown parent or memory allocation failure, no entry is created.
+ *************************************************************************************/
+int 		  cmdtree_create_bulk(const cmdtree_config_t *configs, size_t count);
+int 		  cmdtree_create_bulk_ctx(cmd3_ctx_d ctx, const cmdtree_config_t *configs, size_t count);
 
 
 /*********************************************************************************//**
  * @note	Destroy the command tree entry.
  * 			Entries with a child (subtree root) are not deleted.
  * 			Entries should be destroyed in the reverse order of creation.
+ * 			The entry memory is released once no running cmdtree_exec() may still use it.
  *
  * @param [in]  cmdtree - cmdtree descriptor.
  *
@@ -82,6 +335,21 @@ cmdtree_d cmdtree_create(cmdtree_config_t *config);
  *************************************************************************************/
 void cmdtree_destroy(cmdtree_d cmdtree);
 
+
+/*********************************************************************************//**
+ * @note	Destroy the command tree entry along with its whole subtree, in one pass.
+ * 			Safe while other threads execute cmds, the memory is released
+ * 			once no running cmdtree_exec() may still use it.
+ * 			The descriptors of the subtree entries are invalid once called.
+ *
+ * @param [in]  cmdtree - cmdtree descriptor of the subtree root.
+ *
+ * @return
+ *  - CMD3_SUCCESS on success.
+ *  - CMD3_FAIL on memory allocation failure, the subtree is left in place.
+ *************************************************************************************/
+int 		  cmdtree_destroy_subtree(cmdtree_d cmdtree);
+
 /*********************************************************************************//**
  * @note    Create a command tree entry, wrapping cmdtree_create() for cleaner usage.
  *
@@ -100,32 +368,420 @@ cmdtree_d new_cmdtree_create(const char cmdname[], const char cmdcomment[], cmdt
  * @note	Retrieve the command tree root head.
  * 			In practice, the first root command added.
  *
- * @param   N/A
+ * @param [in]  ctx - The context descriptor (cmdtree_get_root_ctx() only).
  *
  * @return
  *  - Pointer to the root cmdtree descriptor.
  *************************************************************************************/
 cmdtree_d cmdtree_get_root(void);
+cmdtree_d cmdtree_get_root_ctx(cmd3_ctx_d ctx);
 
 
 /*********************************************************************************//**
  * @note	Execute the provided command.
  * 			If the provided entry is a subtree without an implementation, the cmd list of that level is reported.
+ * 			Cmd names may be abbreviated to any unique prefix, an exact name match always wins.
+ * 			An ambiguous prefix reports the matching cmds of that level.
+ * 			A "*" argument broadcasts the rest of the cmd to every child of its level ("port * counters"):
+ * 			the rest is resolved under each child, in name order, the children with no such cmd are skipped.
+ * 			A junction with a cmd function of its own is given the "*" as an argument instead,
+ * 			and a child named "*" is run as any other cmd.
+ * 			The output of each cmd is preceded by a "<child path>:" line. A cmd named by the wildcard itself
+ * 			is given the child name as its first argument (see cmdtree_broadcast_executor_set()).
+ * 			Takes no lock, it may run concurrently with other executions and with tree updates.
  *
- * @param [in]  argc 	 - The number of additional arguments (not including the cmd name itself).
+ * @param [in]  ctx 	 - The context descriptor (cmdtree_exec_ctx() only).
+ * 		  [in]  argc 	 - The number of additional arguments (not including the cmd name itself).
  * 		  [in]	argv	 - The vector of additional arguments (not including the cmd name itself).
  * 		  [out]	buf		 - Buffer to fill the report in.
- * 		  [in]	buf_size - The maximum size of the provided buffer.
+ * 		  [in]	buf_size - The maximum size of the provided buffer, zero runs nothing.
  *
  * @return
- *  - The number of used buffer characters.
+ *  - The number of used buffer characters, 0 for a zero size buffer.
  *************************************************************************************/
 int 		  cmdtree_exec(int argc, const char **argv, char *buf, size_t buf_size);
+int 		  cmdtree_exec_ctx(cmd3_ctx_d ctx, int argc, const char **argv, char *buf, size_t buf_size);
+
+
+/*********************************************************************************//**
+ * @note	Execute the provided command, given as tokens (see cmdtree_tokenize()).
+ * 			The cmd is resolved on the token lengths, without copying the tokens.
+ * 			The handler arguments are copied as terminated strings when the handler is called.
+ *
+ * @param [in]  ctx 	 - The context descriptor (cmdtree_exec_tokens_ctx() only).
+ * 		  [in]  argc 	 - The number of tokens.
+ * 		  [in]	tokens	 - The tokens.
+ * 		  [out]	buf		 - Buffer to fill the report in.
+ * 		  [in]	buf_size - The maximum size of the provided buffer, zero runs nothing.
+ *
+ * @return
+ *  - The number of used buffer characters, 0 for a zero size buffer.
+ *************************************************************************************/
+int 		  cmdtree_exec_tokens(int argc, const cmdtree_token_t *tokens, char *buf, size_t buf_size);
+int 		  cmdtree_exec_tokens_ctx(cmd3_ctx_d ctx, int argc, const cmdtree_token_t *tokens, char *buf, size_t buf_size);
+
+
+/*********************************************************************************//**
+ * @note	Check whether the provided command resolves to a cmd marked independent
+ * 			(see cmdtree_config_t), without executing it.
+ * 			Independent cmds may be dispatched concurrently, e.g. by a parallel script runner.
+ *
+ * @param [in]  ctx 	 - The context descriptor (cmdtree_tokens_independent_ctx() only).
+ * 		  [in]  argc 	 - The number of tokens.
+ * 		  [in]	tokens	 - The tokens.
+ *
+ * @return
+ *  - 1 if the cmd is marked independent.
+ *  - 0 otherwise, including unknown, ambiguous and partial cmds.
+ *************************************************************************************/
+int 		  cmdtree_tokens_independent(int argc, const cmdtree_token_t *tokens);
+int 		  cmdtree_tokens_independent_ctx(cmd3_ctx_d ctx, int argc, const cmdtree_token_t *tokens);
+
+
+/*********************************************************************************//**
+ * @note	Create the built-in stats cmds, reporting the per cmd dispatch counters:
+ * 			"stats calls|time|p99 [count]" list the top cmds (10 by default) by calls,
+ * 			total time or p99 latency, "stats reset" clears the counters.
+ * 			Counters are kept only when the library is built with CMD3_STATS defined,
+ * 			otherwise no dispatch hook is compiled in and the stats cmds are not available.
+ *
+ * @param [in]  ctx - The context descriptor (cmdtree_stats_create_ctx() only).
+ *
+ * @return
+ *  - CMD3_SUCCESS on success.
+ *  - CMD3_FAIL on memory allocation failure, or when built without CMD3_STATS.
+ *************************************************************************************/
+int 		  cmdtree_stats_create(void);
+int 		  cmdtree_stats_create_ctx(cmd3_ctx_d ctx);
+
+
+/*********************************************************************************//**
+ * @note	Get a cmd dispatch counters, the counters are updated concurrently
+ * 			and read one at a time.
+ *
+ * @param [in]  cmdtree - The cmd descriptor.
+ * 		  [out]	stats	- The counters snapshot.
+ *
+ * @return
+ *  - CMD3_SUCCESS on success.
+ *  - CMD3_FAIL if the node has no cmd function, or when built without CMD3_STATS.
+ *************************************************************************************/
+int 		  cmdtree_stats_get(cmdtree_d cmdtree, cmdtree_stats_t *stats);
+
+
+/*********************************************************************************//**
+ * @note	Set the trace hooks, called around the tokenize, lookup, handler, report
+ * 			and output stages of every cmd, from the calling thread.
+ * 			The hooks are shared by all the contexts, with no hooks set a stage costs a single check.
+ * 			The trace and its argument must remain valid while cmds may still be running.
+ * 			Building with CMD3_USDT defined adds static tracepoints as well (provider cmd3,
+ * 			probes stage_begin/stage_end with the stage, the cmd name and the bytes),
+ * 			for use by perf or bpftrace.
+ *
+ * @param [in]  trace - The trace hooks, NULL to disable tracing.
+ *
+ * @return
+ *  - N/A
+ *************************************************************************************/
+void 		  cmdtree_trace_set(const cmdtree_trace_t *trace);
+
+
+/*********************************************************************************//**
+ * @note	Create the slow log and its cmds. Every cmd taking at least the threshold is logged
+ * 			with its cmd line, duration, output length and start time, in a fixed size ring
+ * 			holding the latest ones. Logging takes no lock, the dispatch path never waits.
+ * 			"slowlog get [count]" lists the latest entries (10 by default), newest first,
+ * 			"slowlog len" counts them and "slowlog reset" clears them.
+ * 			The slow log is released by cmdtree_teardown().
+ *
+ * @param [in]  ctx 		 - The context descriptor (cmdtree_slowlog_create_ctx() only).
+ * 		  [in]  threshold_us - The minimal duration logged, in microseconds (0 logs every cmd).
+ * 		  [in]  max_len 	 - The number of entries kept.
+ *
+ * @return
+ *  - CMD3_SUCCESS on success.
+ *  - CMD3_FAIL on memory allocation failure, a 0 max_len or an existing slow log.
+ *************************************************************************************/
+int 		  cmdtree_slowlog_create(unsigned long long threshold_us, size_t max_len);
+int 		  cmdtree_slowlog_create_ctx(cmd3_ctx_d ctx, unsigned long long threshold_us, size_t max_len);
+
+
+/*********************************************************************************//**
+ * @note	Render a cmd path, its name preceded by its parent names, space separated.
+ *
+ * @param [in]  cmdtree  - The cmd descriptor.
+ * 		  [out]	buf		 - Buffer to fill the path in, terminated and truncated to fit.
+ * 		  [in]	buf_size - The buffer size.
+ *
+ * @return
+ *  - The path length, which may exceed the buffer (as with snprintf()).
+ *************************************************************************************/
+size_t 		  cmdtree_path(cmdtree_d cmdtree, char *buf, size_t buf_size);
+
+
+/*********************************************************************************//**
+ * @note	Execute the provided command, streaming its output to a sink.
+ * 			The output is staged in a small buffer and flushed to the sink when full,
+ * 			it is neither truncated nor staged as a whole.
+ * 			Cmd functions writing to a buffer are given the staging buffer (4KB).
+ *
+ * @param [in]  ctx 	- The context descriptor (*_ctx() only).
+ * 		  [in]  argc 	- The number of arguments or tokens.
+ * 		  [in]	argv	- The vector of arguments (cmdtree_exec_sink()).
+ * 		  [in]	tokens	- The tokens (cmdtree_exec_tokens_sink()).
+ * 		  [in]	sink	- The output sink.
+ *
+ * @return
+ *  - CMD3_SUCCESS on success.
+ *  - CMD3_FAIL when the sink failed to write.
+ *************************************************************************************/
+int 		  cmdtree_exec_sink(int argc, const char **argv, const cmdtree_sink_t *sink);
+int 		  cmdtree_exec_sink_ctx(cmd3_ctx_d ctx, int argc, const char **argv, const cmdtree_sink_t *sink);
+int 		  cmdtree_exec_tokens_sink(int argc, const cmdtree_token_t *tokens, const cmdtree_sink_t *sink);
+int 		  cmdtree_exec_tokens_sink_ctx(cmd3_ctx_d ctx, int argc, const cmdtree_token_t *tokens, const cmdtree_sink_t *sink);
+
+
+/*********************************************************************************//**
+ * @note	Output from a cmdtree_cmdfunc_out function.
+ * 			Executed by cmdtree_exec(), the output past the caller buffer is truncated.
+ * 			Data larger than the free staging room is passed to the sink writev() as is,
+ * 			along with the staged output, without being copied.
+ *
+ * @param [in]  out 	- The output descriptor, as passed to the cmd function.
+ * 		  [in]	data	- The data to output (cmdtree_out_write()).
+ * 		  [in]	len		- The data length (cmdtree_out_write()).
+ * 		  [in]	format	- printf() format and arguments (cmdtree_out_printf()).
+ *
+ * @return
+ *  - CMD3_SUCCESS on success.
+ *  - CMD3_FAIL when the sink failed to write, further output is dropped.
+ *************************************************************************************/
+int 		  cmdtree_out_write(cmdtree_out_d out, const void *data, size_t len);
+int 		  cmdtree_out_printf(cmdtree_out_d out, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+
+/*********************************************************************************//**
+ * @note	Initialize a sink writing to a file descriptor (a file, pipe or socket).
+ *
+ * @param [out] sink - The sink.
+ * 		  [in]	fd	 - The file descriptor.
+ *
+ * @return
+ *  - N/A
+ *************************************************************************************/
+void 		  cmdtree_sink_fd_init(cmdtree_sink_t *sink, int fd);
+
+
+/*********************************************************************************//**
+ * @note	Create/Destroy an output chain, holding cmd output in a list of fixed size chunks.
+ * 			Chunks written out return to the chain pool and are reused by the following cmds,
+ * 			a chain is meant to serve one session (not to be used by several threads at once).
+ *
+ * @param [in]  chunk_size - The chunk size, 0 for the default (4KB).
+ * 		  [in]  chain	   - The chain descriptor.
+ *
+ * @return
+ *  - On success, the chain descriptor (create).
+ *  - NULL on memory allocation failure (create).
+ *************************************************************************************/
+cmdtree_chain_d cmdtree_chain_create(size_t chunk_size);
+void 		  cmdtree_chain_destroy(cmdtree_chain_d chain);
+
+
+/*********************************************************************************//**
+ * @note	Execute the provided command, appending its output to a chain.
+ * 			The output is written in place into the chain chunks, it is neither copied
+ * 			through a staging buffer nor truncated.
+ * 			Cmd functions writing to a buffer are given a whole chunk.
+ *
+ * @param [in]  ctx 	- The context descriptor (*_ctx() only).
+ * 		  [in]  argc 	- The number of arguments or tokens.
+ * 		  [in]	argv	- The vector of arguments (cmdtree_exec_chain()).
+ * 		  [in]	tokens	- The tokens (cmdtree_exec_tokens_chain()).
+ * 		  [in]	chain	- The output chain.
+ *
+ * @return
+ *  - CMD3_SUCCESS on success.
+ *  - CMD3_FAIL on memory allocation failure, the output is partial.
+ *************************************************************************************/
+int 		  cmdtree_exec_chain(int argc, const char **argv, cmdtree_chain_d chain);
+int 		  cmdtree_exec_chain_ctx(cmd3_ctx_d ctx, int argc, const char **argv, cmdtree_chain_d chain);
+int 		  cmdtree_exec_tokens_chain(int argc, const cmdtree_token_t *tokens, cmdtree_chain_d chain);
+int 		  cmdtree_exec_tokens_chain_ctx(cmd3_ctx_d ctx, int argc, const cmdtree_token_t *tokens, cmdtree_chain_d chain);
+
+
+/*********************************************************************************//**
+ * @note	Access the output held by a chain, for writev()/sendmsg() without flattening it.
+ * 			cmdtree_chain_iov() fills the chunk fragments, from the oldest output on.
+ * 			cmdtree_chain_consume() drops the output sent, releasing its chunks to the pool.
+ *
+ * @param [in]  chain	- The chain descriptor.
+ * 		  [out]	iov		- The fragments (cmdtree_chain_iov()).
+ * 		  [in]	iov_max	- The iov array size (cmdtree_chain_iov()).
+ * 		  [in]	len		- The number of bytes sent (cmdtree_chain_consume()).
+ *
+ * @return
+ *  - The number of bytes held (cmdtree_chain_len()).
+ *  - The number of fragments filled (cmdtree_chain_iov()).
+ *************************************************************************************/
+size_t 		  cmdtree_chain_len(cmdtree_chain_d chain);
+int 		  cmdtree_chain_iov(cmdtree_chain_d chain, struct iovec *iov, int iov_max);
+void 		  cmdtree_chain_consume(cmdtree_chain_d chain, size_t len);
+
+
+/*********************************************************************************//**
+ * @note	Write the chain output to a file descriptor with writev(), consuming it.
+ *
+ * @param [in]  chain	- The chain descriptor.
+ * 		  [in]	fd		- The file descriptor, may be non blocking.
+ *
+ * @return
+ *  - CMD3_SUCCESS once the whole output is written.
+ *  - CMD3_INCOMPLETE if the descriptor would block, the rest of the output is kept.
+ *  - CMD3_FAIL on write failure.
+ *************************************************************************************/
+int 		  cmdtree_chain_flush(cmdtree_chain_d chain, int fd);
+
+
+/*********************************************************************************//**
+ * @note	Complete the last token of a partial command line.
+ * 			The preceding tokens are resolved as by cmdtree_exec() (prefixes included),
+ * 			the names of their level which start with the last token are reported in sorted order.
+ * 			Past a cmd with an argument schema, the enum values of the argument being typed are reported.
+ * 			Takes no lock, the names are valid during the callback only.
+ *
+ * @param [in]  ctx 		- The context descriptor (cmdtree_complete_ctx() only).
+ * 		  [in]  argc 		- The number of tokens, the last one is completed (may be an empty string).
+ * 		  [in]	argv		- The vector of tokens.
+ * 		  [in]	complete_cb	- Called with each completion candidate name.
+ * 		  [in]	arg			- Opaque argument passed to complete_cb.
+ *
+ * @return
+ *  - The number of completion candidates reported.
+ *************************************************************************************/
+int 		  cmdtree_complete(int argc, const char **argv, cmdtree_complete_cb complete_cb, void *arg);
+int 		  cmdtree_complete_ctx(cmd3_ctx_d ctx, int argc, const char **argv, cmdtree_complete_cb complete_cb, void *arg);
+
+
+/*********************************************************************************//**
+ * @note	List the children of a junction page by page, in the cmdtree_exec() report layout.
+ * 			Each page holds the whole rows which fit the buffer (a single row is truncated
+ * 			if it does not fit on its own), the cursor is advanced past them.
+ * 			The cursor is a row index, it stays meaningful while the junction is unchanged.
+ *
+ * @param [in]  ctx 		- The context descriptor (cmdtree_help_ctx() only).
+ * 		  [in]  argc 		- The number of tokens, zero for the root cmds.
+ * 		  [in]	argv		- The tokens of the junction path, matched as by cmdtree_exec().
+ * 		  [in/out] cursor	- The first row to list, zero for the first page; advanced to the next page.
+ * 		  [out]	buf			- Buffer to fill the page in, terminated.
+ * 		  [in]	buf_size	- The size of the provided buffer.
+ *
+ * @return
+ *  - CMD3_SUCCESS once the last row is listed.
+ *  - CMD3_INCOMPLETE when rows remain, to be listed from the updated cursor.
+ *  - CMD3_FAIL if the path is not a junction, or the buffer size is zero.
+ *************************************************************************************/
+int 		  cmdtree_help(int argc, const char **argv, size_t *cursor, char *buf, size_t buf_size);
+int 		  cmdtree_help_ctx(cmd3_ctx_d ctx, int argc, const char **argv, size_t *cursor, char *buf, size_t buf_size);
+
+
+/*********************************************************************************//**
+ * @note	Set the allocator used for the command tree nodes, hash tables and strings.
+ * 			The allocator may only be changed while the command tree is empty.
+ * 			Applies to the default context, other contexts are given their allocator on creation.
+ *
+ * @param [in]  allocator - The allocator to use, NULL restores the default heap allocator.
+ *
+ * @return
+ *  - CMD3_SUCCESS on success.
+ *  - CMD3_FAIL if the command tree is not empty or the allocator has no alloc function.
+ *************************************************************************************/
+int 		  cmdtree_set_allocator(const cmdtree_allocator_t *allocator);
+
+
+/*********************************************************************************//**
+ * @note	Destroy the whole command tree.
+ * 			When the allocator supports it, the tree memory is dropped by a single release.
+ * 			Must not run concurrently with cmdtree_exec() on the same tree.
+ * 			The async cmds queued on the context run to completion first, hence it must
+ * 			not be called from such a cmd or from its done_cb.
+ *
+ * @param [in]  ctx - The context descriptor (cmdtree_teardown_ctx() only).
+ *
+ * @return
+ *  - N/A
+ *************************************************************************************/
+void 		  cmdtree_teardown(void);
+void 		  cmdtree_teardown_ctx(cmd3_ctx_d ctx);
+
+
+/*********************************************************************************//**
+ * @note	Create an arena, carving allocations from blocks of the given size.
+ * 			Freed allocations are reused by later allocations of the same size class.
+ *
+ * @param [in]  block_size - The arena block size.
+ *
+ * @return
+ *  - On success, the arena descriptor.
+ *  - On failure, returns NULL.
+ *************************************************************************************/
+cmdtree_arena_d cmdtree_arena_create(size_t block_size);
+
+
+/*********************************************************************************//**
+ * @note	Destroy the arena, releasing all its memory.
+ *
+ * @param [in]  arena - The arena descriptor.
+ *
+ * @return
+ *  - N/A
+ *************************************************************************************/
+void 		  cmdtree_arena_destroy(cmdtree_arena_d arena);
+
+
+/*********************************************************************************//**
+ * @note	Fill an allocator structure which allocates from the arena.
+ *
+ * @param [in]  arena 	  - The arena descriptor.
+ * 		  [out]	allocator - The allocator to fill, for cmdtree_set_allocator() or a context configuration.
+ *
+ * @return
+ *  - N/A
+ *************************************************************************************/
+void 		  cmdtree_arena_allocator(cmdtree_arena_d arena, cmdtree_allocator_t *allocator);
+
+
+/*********************************************************************************//**
+ * @note	Freeze the command tree, compiling it into a single read-only image.
+ * 			While frozen, cmdtree_exec() dispatches through the image.
+ * 			Any later cmdtree_create() or cmdtree_destroy() call thaws the tree.
+ *
+ * @param [in]  ctx - The context descriptor (cmdtree_freeze_ctx() only).
+ *
+ * @return
+ *  - CMD3_SUCCESS on success.
+ *  - CMD3_FAIL on memory allocation failure, the tree is left unfrozen.
+ *************************************************************************************/
+int 		  cmdtree_freeze(void);
+int 		  cmdtree_freeze_ctx(cmd3_ctx_d ctx);
+
+
+/*********************************************************************************//**
+ * @note	Thaw the command tree, releasing the frozen image (if any).
+ *
+ * @param [in]  ctx - The context descriptor (cmdtree_thaw_ctx() only).
+ *
+ * @return
+ *  - N/A
+ *************************************************************************************/
+void 		  cmdtree_thaw(void);
+void 		  cmdtree_thaw_ctx(cmd3_ctx_d ctx);
 
 
 /*********************************************************************************//**
  * @note	Execute the provided command.
  * 			If the provided entry is a subtree without an implementation, the cmd list of that level is reported.
+ * 			The string is split in place, see cmdtree_tokenize() for a non modifying split.
  *
  * @param [in]  string 	  - A string, with space delimiters, to be converted.
  * 		  [out]	arg_count - The number of vectors generated.
@@ -136,6 +792,237 @@ int 		  cmdtree_exec(int argc, const char **argv, char *buf, size_t buf_size);
  *************************************************************************************/
 void 		  cmdtree_stov(const char *string, int *arg_count, const char **arg_vec);
 
+
+/*********************************************************************************//**
+ * @note	Split a string into white space (space, tab and new line) delimited tokens, pointing into the string.
+ * 			The string is not modified and needs no terminating char.
+ *
+ * @param [in]  string 	   - The string to split.
+ * 		  [in]  len 	   - The string length.
+ * 		  [out]	tokens	   - The tokens found, up to max_tokens.
+ * 		  [in]	max_tokens - The tokens array size.
+ *
+ * @return
+ *  - The number of tokens in the string, which may exceed max_tokens.
+ *************************************************************************************/
+int 		  cmdtree_tokenize(const char *string, size_t len, cmdtree_token_t *tokens, int max_tokens);
+
+
+/*********************************************************************************//**
+ * @note	Initialize a growable token vector, using its embedded tokens.
+ *
+ * @param [in]  argv - The token vector.
+ *
+ * @return
+ *  - N/A
+ *************************************************************************************/
+void 		  cmdtree_argv_init(cmdtree_argv_t *argv);
+
+
+/*********************************************************************************//**
+ * @note	Split a string into the token vector, with no limit on the number of tokens.
+ * 			The vector grows as needed and keeps its size for the following lines.
+ * 			The tokens are passed on with cmdtree_exec_tokens(argv->argc, argv->tokens, ...).
+ *
+ * @param [in]  argv 	- The token vector.
+ * 		  [in]  string 	- The string to split, not modified.
+ * 		  [in]  len 	- The string length.
+ *
+ * @return
+ *  - CMD3_SUCCESS on success.
+ *  - CMD3_FAIL on memory allocation failure, the vector is left empty.
+ *************************************************************************************/
+int 		  cmdtree_argv_tokenize(cmdtree_argv_t *argv, const char *string, size_t len);
+
+
+/*********************************************************************************//**
+ * @note	Split a string into the token vector, honoring quotes and escapes, in a single pass:
+ * 			- Out of quotes, spaces, tabs and new lines separate the tokens.
+ * 			- Single quotes keep every char as is.
+ * 			- Double quotes keep every char, but a backslash escapes a double quote or a backslash.
+ * 			- Out of quotes, a backslash escapes the following char.
+ * 			- A backslash followed by a new line is removed, joining the lines.
+ * 			Quotes and escapes may appear within a token (a"b c"d is the single token ab cd).
+ * 			The tokens of a line with quotes or escapes are unescaped into the vector buffer,
+ * 			other lines are split as by cmdtree_argv_tokenize(). The string is never modified.
+ *
+ * @param [in]  argv 	- The token vector.
+ * 		  [in]  string 	- The string to split, not modified.
+ * 		  [in]  len 	- The string length.
+ *
+ * @return
+ *  - CMD3_SUCCESS on success.
+ *  - CMD3_INCOMPLETE when the string ends within quotes or with a backslash,
+ *    the line continues, the string is to be split again with the following line appended.
+ *  - CMD3_FAIL on memory allocation failure.
+ *  On CMD3_INCOMPLETE or CMD3_FAIL the vector is left empty.
+ *************************************************************************************/
+int 		  cmdtree_argv_tokenize_quoted(cmdtree_argv_t *argv, const char *string, size_t len);
+
+
+/*********************************************************************************//**
+ * @note	Release the memory of a token vector, which may be initialized again.
+ *
+ * @param [in]  argv - The token vector.
+ *
+ * @return
+ *  - N/A
+ *************************************************************************************/
+void 		  cmdtree_argv_release(cmdtree_argv_t *argv);
+
+
+/*********************************************************************************//**
+ * @note	Execute a batch of cmds, given as new line separated cmd lines (cmdtree_exec_batch())
+ * 			or as argument vectors (cmdtree_exec_batch_argv()).
+ * 			The lines are split as by cmdtree_argv_tokenize_quoted(), a quote left open or a trailing
+ * 			backslash continues the cmd on the next line; blank lines and lines starting with '#' are skipped.
+ * 			A comment line ends at its own newline, whatever quotes or trailing backslash it holds.
+ * 			A cmd still open at the script end fails, reported as an unterminated quote or
+ * 			escape/continuation.
+ * 			The cmds share a tokens vector and a staging buffer, their output is streamed
+ * 			one after the other to the sink. A cmd fails when its function fails (returns no output)
+ * 			or when a usage is reported instead (an unknown, ambiguous or partial cmd).
+ *
+ * @param [in]  ctx 		- The context descriptor (*_ctx() only).
+ * 		  [in]  script 		- The cmd lines (cmdtree_exec_batch()).
+ * 		  [in]	len			- The cmd lines length (cmdtree_exec_batch()).
+ * 		  [in]  cmds 		- The cmd argument vectors (cmdtree_exec_batch_argv()).
+ * 		  [in]	cmd_count	- The number of cmds (cmdtree_exec_batch_argv()).
+ * 		  [in]	flags		- CMDTREE_BATCH_STOP_ON_FAIL or 0.
+ * 		  [in]	sink		- The output sink.
+ * 		  [out]	results		- Optional, the outcome of each cmd run, in order.
+ * 		  [in]	max_results	- The results array size, later cmds are run without outcome (cmdtree_exec_batch()).
+ *
+ * @return
+ *  - The number of cmds run, the last one is the failed one when stopped on failure.
+ *  - CMD3_FAIL on sink write or memory allocation failure.
+ *************************************************************************************/
+int 		  cmdtree_exec_batch(const char *script, size_t len, int flags, const cmdtree_sink_t *sink,
+								 cmdtree_batch_result_t *results, size_t max_results);
+int 		  cmdtree_exec_batch_ctx(cmd3_ctx_d ctx, const char *script, size_t len, int flags, const cmdtree_sink_t *sink,
+									 cmdtree_batch_result_t *results, size_t max_results);
+int 		  cmdtree_exec_batch_argv(const cmdtree_cmdline_t *cmds, size_t cmd_count, int flags,
+									  const cmdtree_sink_t *sink, cmdtree_batch_result_t *results);
+int 		  cmdtree_exec_batch_argv_ctx(cmd3_ctx_d ctx, const cmdtree_cmdline_t *cmds, size_t cmd_count, int flags,
+										  const cmdtree_sink_t *sink, cmdtree_batch_result_t *results);
+
+
+/*********************************************************************************//**
+ * @note	Create/Destroy a parallel batch executor.
+ * 			Each thread (the batch caller included) takes the tasks of its own deque first,
+ * 			then steals from the others, the load is balanced whatever the cmds duration.
+ *
+ * @param [in]  threads  - The number of executor threads, besides the batch caller.
+ * 		  [in]  executor - The executor descriptor.
+ *
+ * @return
+ *  - On success, the executor descriptor (create).
+ *  - NULL on failure (create).
+ *************************************************************************************/
+cmdtree_executor_d cmdtree_executor_create(int threads);
+void 		  cmdtree_executor_destroy(cmdtree_executor_d executor);
+
+
+/*********************************************************************************//**
+ * @note	Execute a batch of cmds as cmdtree_exec_batch()/cmdtree_exec_batch_argv() do,
+ * 			running consecutive independent cmds (see cmdtree_config_t) concurrently on an executor.
+ * 			Such a run is split into tasks of consecutive cmds, each task output is held until
+ * 			the output of the preceding tasks is written: the batch output is the one of a serial run,
+ * 			each cmd output contiguous and in order. Other cmds are run in place, one after the other.
+ * 			When stopped on failure, the cmds of the run past the failed one may be run as well,
+ * 			their output is dropped. An executor runs a single batch at a time, concurrent callers wait.
+ *
+ * @param [in]  ctx 		- The context descriptor (*_ctx() only).
+ * 		  [in]  executor 	- The executor.
+ * 		  [in]  ...			- See cmdtree_exec_batch().
+ *
+ * @return
+ *  - The number of cmds run, the last one is the failed one when stopped on failure.
+ *  - CMD3_FAIL on sink write or memory allocation failure.
+ *************************************************************************************/
+int 		  cmdtree_exec_batch_parallel(cmdtree_executor_d executor, const char *script, size_t len, int flags,
+										  const cmdtree_sink_t *sink, cmdtree_batch_result_t *results, size_t max_results);
+int 		  cmdtree_exec_batch_parallel_ctx(cmd3_ctx_d ctx, cmdtree_executor_d executor, const char *script, size_t len,
+											  int flags, const cmdtree_sink_t *sink, cmdtree_batch_result_t *results,
+											  size_t max_results);
+int 		  cmdtree_exec_batch_argv_parallel(cmdtree_executor_d executor, const cmdtree_cmdline_t *cmds, size_t cmd_count,
+											   int flags, const cmdtree_sink_t *sink, cmdtree_batch_result_t *results);
+int 		  cmdtree_exec_batch_argv_parallel_ctx(cmd3_ctx_d ctx, cmdtree_executor_d executor, const cmdtree_cmdline_t *cmds,
+												   size_t cmd_count, int flags, const cmdtree_sink_t *sink,
+												   cmdtree_batch_result_t *results);
+
+
+/*********************************************************************************//**
+ * @note	Set the executor running the broadcast cmds ("port * counters", see cmdtree_exec()) concurrently.
+ * 			A broadcast whose cmds are all independent is spread over the executor threads,
+ * 			its output is the one of a serial run. While the executor is busy with another batch
+ * 			(a broadcast run from an executor thread included), the broadcast runs in place.
+ * 			The executor must remain valid while cmds may still be running, the context teardown unsets it.
+ *
+ * @param [in]  ctx 	 - The context descriptor (cmdtree_broadcast_executor_set_ctx() only).
+ * 		  [in]  executor - The executor, NULL to run the broadcast cmds in place.
+ *
+ * @return
+ *  - N/A
+ *************************************************************************************/
+void 		  cmdtree_broadcast_executor_set(cmdtree_executor_d executor);
+void 		  cmdtree_broadcast_executor_set_ctx(cmd3_ctx_d ctx, cmdtree_executor_d executor);
+
+
+/*********************************************************************************//**
+ * @note	Create/Destroy a worker pool, running the async cmds (see cmdtree_exec_async()).
+ * 			Destroying the pool runs the cmds still queued and waits for the workers,
+ * 			hence it fails when called from a worker (an async cmd or its done_cb).
+ *
+ * @param [in]  workers   - The number of worker threads.
+ * 		  [in]  queue_max - The maximal number of queued cmds, not yet taken by a worker.
+ * 		  [in]  pool	  - The pool descriptor.
+ *
+ * @return
+ *  - On success, the pool descriptor (create).
+ *  - NULL on failure (create).
+ *  - CMD3_SUCCESS on success (destroy).
+ *  - CMD3_FAIL if called from a worker of the pool, which is left untouched (destroy).
+ *************************************************************************************/
+cmdtree_pool_d cmdtree_pool_create(int workers, size_t queue_max);
+int 		  cmdtree_pool_destroy(cmdtree_pool_d pool);
+
+
+/*********************************************************************************//**
+ * @note	Execute the provided command, streaming its output to a sink, without blocking
+ * 			the caller on cmds flagged async (see cmdtree_config_t): those are queued, along
+ * 			with a copy of the arguments, and run by a pool worker.
+ * 			Other cmds, usage reports included, run inline.
+ * 			The completion is reported through done_cb, from the thread which ran the cmd.
+ * 			The sink is written from that thread as well, it must remain valid until done.
+ * 			As a same done_cb runs inline or on a worker depending on the cmd, it must not call:
+ * 			- cmdtree_pool_destroy() on its pool, which fails from a worker.
+ * 			- cmdtree_teardown()/cmdtree_teardown_ctx()/cmd3_ctx_destroy() on the cmd context,
+ * 			  which wait for the async cmds of the context, the calling one included.
+ * 			Other calls, running or queuing cmds included, are allowed.
+ *
+ * @param [in]  ctx 	- The context descriptor (cmdtree_exec_async_ctx() only).
+ * 		  [in]  pool 	- The worker pool.
+ * 		  [in]  argc 	- The number of arguments.
+ * 		  [in]	argv	- The vector of arguments (or tokens, for the tokens variants).
+ * 		  [in]	sink	- The output sink.
+ * 		  [in]	done_cb	- The completion callback.
+ * 		  [in]	arg		- Opaque argument passed to done_cb.
+ *
+ * @return
+ *  - CMD3_SUCCESS if the cmd ran inline, done_cb was called.
+ *  - CMD3_INCOMPLETE if the cmd was queued, done_cb will be called by a worker.
+ *  - CMD3_FAIL if the queue is full or on memory allocation failure, done_cb is not called.
+ *************************************************************************************/
+int 		  cmdtree_exec_async(cmdtree_pool_d pool, int argc, const char **argv, const cmdtree_sink_t *sink,
+								 cmdtree_done_cb done_cb, void *arg);
+int 		  cmdtree_exec_async_ctx(cmd3_ctx_d ctx, cmdtree_pool_d pool, int argc, const char **argv,
+									 const cmdtree_sink_t *sink, cmdtree_done_cb done_cb, void *arg);
+int 		  cmdtree_exec_tokens_async(cmdtree_pool_d pool, int argc, const cmdtree_token_t *tokens,
+										const cmdtree_sink_t *sink, cmdtree_done_cb done_cb, void *arg);
+int 		  cmdtree_exec_tokens_async_ctx(cmd3_ctx_d ctx, cmdtree_pool_d pool, int argc, const cmdtree_token_t *tokens,
+											const cmdtree_sink_t *sink, cmdtree_done_cb done_cb, void *arg);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,312 @@
+/*
+ *The MIT License (MIT)
+ *
+ *Copyright (c) 2015 EdwardH
+ *
+ *Permission is hereby granted, free of charge, to any person obtaining a copy
+ *of this software and associated documentation files (the "Software"), to deal
+ *in the Software without restriction, including without limitation the rights
+ *to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *copies of the Software, and to permit persons to whom the Software is
+ *furnished to do so, subject to the following conditions:
+ *
+ *The above copyright notice and this permission notice shall be included in all
+ *copies or substantial portions of the Software.
+ *
+ *THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *SOFTWARE.
+ *
+ *
+ *
+ *
+ * cmd3.hpp
+ *
+ *  Created on: Oct 18, 2026
+ */
+
+#ifndef CMD3_HPP_
+#define CMD3_HPP_
+
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+
+#include "cmd3.h"
+
+/*
+ * Compile time command tree, for command sets which are fixed at build time.
+ *
+ * The tree is declared as a constexpr array of cmd3::node entries, each referencing
+ * its parent by index. Parents must be declared before their children and sibling
+ * names must be unique, both are checked at compile time.
+ * The per-level name-sorted lookup tables are computed by the compiler,
+ * leaving no registration work at startup. Computing them is quadratic in the
+ * number of nodes, large trees may need a raised -fconstexpr-ops-limit:
+ *
+ *     constexpr cmd3::node cmds[] = {
+ *         { "show",       "Show information", NULL,    cmd3::no_parent },
+ *         { "interfaces", "Interfaces",       show_if, 0               },
+ *     };
+ *     typedef CMD3_STATIC_TREE(cmds) cmds_tree;
+ *
+ *     cmds_tree::exec(argc, argv, buf, buf_size);
+ */
+
+namespace cmd3
+{
+
+constexpr int no_parent = -1;
+
+// Compile time command tree node
+struct node
+{
+	const char 		*name;		// Command name
+	const char 		*comment;	// Command comment
+	cmdtree_cmdfunc	 cmdfunc;	// Optional command function
+	int 			 parent;	// Parent node index, no_parent for a root level command
+};
+
+namespace detail
+{
+
+template <std::size_t... I> struct index_sequence { typedef index_sequence type; };
+
+template <class A, class B> struct index_concat;
+template <std::size_t... A, std::size_t... B>
+struct index_concat<index_sequence<A...>, index_sequence<B...> > : index_sequence<A..., (sizeof...(A) + B)...> {};
+
+// Logarithmic depth, large trees do not hit the template instantiation depth limit
+template <std::size_t N>
+struct make_index_sequence : index_concat<typename make_index_sequence<N / 2>::type,
+										  typename make_index_sequence<N - N / 2>::type> {};
+template <> struct make_index_sequence<0> : index_sequence<> {};
+template <> struct make_index_sequence<1> : index_sequence<0> {};
+
+constexpr int str_cmp(const char *a, const char *b)
+{
+	return (*a != *b || '\0' == *a) ? (int)(unsigned char)*a - (int)(unsigned char)*b : str_cmp(a + 1, b + 1);
+}
+
+/* Nodes are keyed by (parent, name), which groups each level children together in name order. */
+constexpr bool key_less(const node *nodes, std::size_t a, std::size_t b)
+{
+	return nodes[a].parent < nodes[b].parent ||
+		   (nodes[a].parent == nodes[b].parent && str_cmp(nodes[a].name, nodes[b].name) < 0);
+}
+
+/*
+ * The helpers below split their range in halves, keeping the constexpr
+ * recursion depth logarithmic in the number of nodes.
+ */
+constexpr std::size_t rank(const node *nodes, std::size_t i, std::size_t lo, std::size_t hi)
+{
+	return (hi - lo == 1) ? (key_less(nodes, lo, i) ? 1 : 0)
+						  : rank(nodes, i, lo, lo + (hi - lo) / 2) + rank(nodes, i, lo + (hi - lo) / 2, hi);
+}
+
+/* The node of rank k, (std::size_t)-1 if none (duplicate keys share a rank). */
+constexpr std::size_t find_rank_sum(const std::size_t *ranks, std::size_t k, std::size_t lo, std::size_t hi)
+{
+	return (hi - lo == 1) ? ((ranks[lo] == k) ? lo + 1 : 0)
+						  : find_rank_sum(ranks, k, lo, lo + (hi - lo) / 2) + find_rank_sum(ranks, k, lo + (hi - lo) / 2, hi);
+}
+
+constexpr std::size_t find_rank(const std::size_t *ranks, std::size_t k, std::size_t n)
+{
+	return find_rank_sum(ranks, k, 0, n) - 1;
+}
+
+/* Number of nodes in [lo, hi) whose level (parent index + 1) is below the given level. */
+constexpr std::size_t count_below(const node *nodes, std::size_t level, std::size_t lo, std::size_t hi)
+{
+	return (hi - lo == 1) ? (((std::size_t)(nodes[lo].parent + 1) < level) ? 1 : 0)
+						  : count_below(nodes, level, lo, lo + (hi - lo) / 2) + count_below(nodes, level, lo + (hi - lo) / 2, hi);
+}
+
+constexpr bool parent_valid(const node *nodes, std::size_t i)
+{
+	return no_parent == nodes[i].parent || (nodes[i].parent >= 0 && (std::size_t)nodes[i].parent < i);
+}
+
+constexpr bool parents_valid(const node *nodes, std::size_t lo, std::size_t hi)
+{
+	return (hi - lo == 1) ? parent_valid(nodes, lo)
+						  : parents_valid(nodes, lo, lo + (hi - lo) / 2) && parents_valid(nodes, lo + (hi - lo) / 2, hi);
+}
+
+constexpr bool names_valid(const node *nodes, std::size_t lo, std::size_t hi)
+{
+	return (hi - lo == 1) ? (NULL != nodes[lo].name && '\0' != nodes[lo].name[0] && NULL != nodes[lo].comment)
+						  : names_valid(nodes, lo, lo + (hi - lo) / 2) && names_valid(nodes, lo + (hi - lo) / 2, hi);
+}
+
+/* Duplicate keys share a rank, leaving a sorted table entry without a (single) node. */
+constexpr bool all_ranked(const std::size_t *sorted, std::size_t lo, std::size_t hi)
+{
+	return (hi - lo == 1) ? (sorted[lo] != (std::size_t)-1)
+						  : all_ranked(sorted, lo, lo + (hi - lo) / 2) && all_ranked(sorted, lo + (hi - lo) / 2, hi);
+}
+
+template <const node *Nodes, std::size_t N, class Seq, class LevelSeq> struct tables;
+
+template <const node *Nodes, std::size_t N, std::size_t... I, std::size_t... L>
+struct tables<Nodes, N, index_sequence<I...>, index_sequence<L...> >
+{
+	static constexpr std::size_t ranks[N]     = { rank(Nodes, I, 0, N)... };
+	static constexpr std::size_t sorted[N]    = { find_rank(ranks, I, N)... };
+	static constexpr std::size_t first[N + 2] = { count_below(Nodes, L, 0, N)... };
+};
+
+template <const node *Nodes, std::size_t N, std::size_t... I, std::size_t... L>
+constexpr std::size_t tables<Nodes, N, index_sequence<I...>, index_sequence<L...> >::ranks[N];
+template <const node *Nodes, std::size_t N, std::size_t... I, std::size_t... L>
+constexpr std::size_t tables<Nodes, N, index_sequence<I...>, index_sequence<L...> >::sorted[N];
+template <const node *Nodes, std::size_t N, std::size_t... I, std::size_t... L>
+constexpr std::size_t tables<Nodes, N, index_sequence<I...>, index_sequence<L...> >::first[N + 2];
+
+} // namespace detail
+
+/*
+ * Compile time command tree.
+ * Levels are identified by the parent node index + 1, level 0 being the root level.
+ * The children of a level are sorted[first[level]] .. sorted[first[level + 1] - 1].
+ */
+template <const node *Nodes, std::size_t N>
+class static_tree
+{
+	static_assert(N > 0, "cmd3: the command tree is empty");
+	static_assert(detail::names_valid(Nodes, 0, N), "cmd3: a command has no name or comment");
+	static_assert(detail::parents_valid(Nodes, 0, N), "cmd3: a parent must be declared before its children");
+
+	typedef detail::tables<Nodes, N, typename detail::make_index_sequence<N>::type,
+							   typename detail::make_index_sequence<N + 2>::type> tables;
+
+	static_assert(detail::all_ranked(tables::sorted, 0, N), "cmd3: duplicate command name under the same parent");
+
+	static const node *find(std::size_t level, const char *name)
+	{
+		std::size_t low  = tables::first[level];
+		std::size_t high = tables::first[level + 1];
+
+		while(low < high)
+		{
+			std::size_t mid = low + (high - low) / 2;
+			const node *cmd = &Nodes[tables::sorted[mid]];
+			int cmp = std::strcmp(name, cmd->name);
+
+			if(0 == cmp)
+				return cmd;
+			else if(cmp < 0)
+				high = mid;
+			else
+				low = mid + 1;
+		}
+
+		return NULL;
+	}
+
+	static bool has_children(std::size_t level)
+	{
+		return tables::first[level + 1] > tables::first[level];
+	}
+
+	static std::size_t level_of(const node *cmd)
+	{
+		return (std::size_t)(cmd - Nodes) + 1;
+	}
+
+	/* Bound a printed length to the buffer, a truncated print keeps the terminating char. */
+	static std::size_t fitted(int len, std::size_t buf_size)
+	{
+		if(len < 0 || 0 == buf_size)
+			return 0;
+
+		return (std::size_t)len < buf_size ? (std::size_t)len : buf_size - 1;
+	}
+
+	/* The level cmd list, in declaration order, up to a full buffer. */
+	static int report(std::size_t level, char *buf, std::size_t buf_size)
+	{
+		std::size_t used = 0;
+		std::size_t i;
+
+		for(i = 0; i < N && used + 1 < buf_size; i++)
+		{
+			if((std::size_t)(Nodes[i].parent + 1) == level)
+				used += fitted(std::snprintf(buf + used, buf_size - used, "%-20s  %s\n", Nodes[i].name,
+											 Nodes[i].comment), buf_size - used);
+		}
+
+		return (int)used;
+	}
+
+public:
+	static constexpr std::size_t size = N;
+
+	/*********************************************************************************//**
+	 * @note	Execute the provided command, with the cmdtree_exec() semantics.
+	 *
+	 * @param [in]  argc 	 - The number of arguments, including the cmd names.
+	 * 		  [in]	argv	 - The vector of arguments, including the cmd names.
+	 * 		  [out]	buf		 - Buffer to fill the report in.
+	 * 		  [in]	buf_size - The maximum size of the provided buffer.
+	 *
+	 * @return
+	 *  - The number of used buffer characters.
+	 *************************************************************************************/
+	static int exec(int argc, const char **argv, char *buf, size_t buf_size)
+	{
+		std::size_t level = 0;
+		const node *cmd_tree = NULL;
+		int ret = 0;
+
+		if(0 == argc)
+		{
+			ret = report(level, buf, buf_size);
+		}
+		else
+		{
+			do
+			{
+				cmd_tree = find(level, *argv);
+				if(cmd_tree)
+				{
+					argc--;
+					argv++;
+
+					level = level_of(cmd_tree);
+				}
+			} while (has_children(level) && argc && cmd_tree);
+
+			if(cmd_tree)
+			{
+				if(NULL != cmd_tree->cmdfunc)
+					ret = cmd_tree->cmdfunc(++argc, --argv, buf, buf_size);
+				else if(has_children(level))
+					ret = report(level, buf, buf_size);
+			}
+			else
+			{
+				ret = report(level, buf, buf_size);
+			}
+		}
+
+		if(ret <= 0)
+		{
+			ret = (int)fitted(std::snprintf(buf, buf_size, "Missing parameter or unsupported command.\n"), buf_size);
+		}
+
+		return ret + 1;
+	}
+};
+
+} // namespace cmd3
+
+#define CMD3_STATIC_TREE(nodes) cmd3::static_tree<nodes, sizeof(nodes) / sizeof((nodes)[0])>
+
+#endif /* CMD3_HPP_ */
@@ -0,0 +1,190 @@
+/*
+ *The MIT License (MIT)
+ *
+ *Copyright (c) 2015 EdwardH
+ *
+ *Permission is hereby granted, free of charge, to any person obtaining a copy
+ *of this software and associated documentation files (the "Software"), to deal
+ *in the Software without restriction, including without limitation the rights
+ *to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *copies of the Software, and to permit persons to whom the Software is
+ *furnished to do so, subject to the following conditions:
+ *
+ *The above copyright notice and this permission notice shall be included in all
+ *copies or substantial portions of the Software.
+ *
+ *THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *SOFTWARE.
+ *
+ *
+ *
+ *
+ * cmd3_rcu.c
+ *
+ *  Created on: Oct 18, 2026
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "cmd3_rcu.h"
+
+#define CMD3_RCU_EPOCH_IDLE		0UL		// Reader epoch while outside a critical section
+
+// Per thread reader state
+struct cmd3_rcu_reader
+{
+	unsigned long 			 epoch;			// Global epoch observed when entering, idle when outside
+	unsigned int 			 nesting;		// Critical section nesting depth
+	int 					 registered;	// The reader is linked into the readers list
+	struct cmd3_rcu_reader	*next;			// Next registered reader
+	struct cmd3_rcu_reader	*prev;			// Previous registered reader
+};
+
+static __thread struct cmd3_rcu_reader rcu_reader;
+
+static unsigned long rcu_epoch = 1;					// Global epoch, advanced on every retire
+static struct cmd3_rcu_reader *rcu_readers = NULL;	// Registered readers
+static pthread_mutex_t rcu_readers_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t  rcu_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t   rcu_key;
+
+
+static void cmd3_rcu_reader_unregister(void *arg)
+{
+	struct cmd3_rcu_reader *reader = arg;
+
+	pthread_mutex_lock(&rcu_readers_lock);
+
+	if(reader->prev)
+		reader->prev->next = reader->next;
+	else
+		rcu_readers = reader->next;
+	if(reader->next)
+		reader->next->prev = reader->prev;
+
+	pthread_mutex_unlock(&rcu_readers_lock);
+}
+
+static void cmd3_rcu_key_create(void)
+{
+	pthread_key_create(&rcu_key, cmd3_rcu_reader_unregister);
+}
+
+static void cmd3_rcu_reader_register(void)
+{
+	pthread_once(&rcu_key_once, cmd3_rcu_key_create);
+
+	pthread_mutex_lock(&rcu_readers_lock);
+
+	rcu_reader.prev = NULL;
+	rcu_reader.next = rcu_readers;
+	if(rcu_readers)
+		rcu_readers->prev = &rcu_reader;
+	rcu_readers = &rcu_reader;
+
+	pthread_mutex_unlock(&rcu_readers_lock);
+
+	/* The thread is unregistered by the key destructor, on thread exit. */
+	pthread_setspecific(rcu_key, &rcu_reader);
+	rcu_reader.registered = 1;
+}
+
+void cmd3_rcu_read_lock(void)
+{
+	if(0 != rcu_reader.nesting++)
+		return;
+
+	if(!rcu_reader.registered)
+		cmd3_rcu_reader_register();
+
+	/* Publish the epoch before any protected pointer is loaded. */
+	__atomic_store_n(&rcu_reader.epoch, __atomic_load_n(&rcu_epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+}
+
+void cmd3_rcu_read_unlock(void)
+{
+	if(0 != --rcu_reader.nesting)
+		return;
+
+	__atomic_store_n(&rcu_reader.epoch, CMD3_RCU_EPOCH_IDLE, __ATOMIC_RELEASE);
+}
+
+/* The oldest epoch observed by a reader still inside its critical section. */
+static unsigned long cmd3_rcu_oldest_epoch(void)
+{
+	struct cmd3_rcu_reader *reader;
+	unsigned long oldest = __atomic_load_n(&rcu_epoch, __ATOMIC_SEQ_CST);
+
+	pthread_mutex_lock(&rcu_readers_lock);
+
+	for(reader = rcu_readers; reader; reader = reader->next)
+	{
+		unsigned long epoch = __atomic_load_n(&reader->epoch, __ATOMIC_SEQ_CST);
+
+		if(CMD3_RCU_EPOCH_IDLE != epoch && epoch < oldest)
+			oldest = epoch;
+	}
+
+	pthread_mutex_unlock(&rcu_readers_lock);
+
+	return oldest;
+}
+
+void cmd3_rcu_retire(struct cmd3_rcu_list *list, void *ptr, void (*release)(void *arg, void *ptr), void *arg)
+{
+	struct cmd3_rcu_retired *retired;
+	unsigned long epoch;
+
+	/* Readers which entered up to this epoch may still see the object. */
+	epoch = __atomic_fetch_add(&rcu_epoch, 1, __ATOMIC_SEQ_CST);
+
+	retired = malloc(sizeof(struct cmd3_rcu_retired));
+	if(NULL == retired)
+	{
+		while(cmd3_rcu_oldest_epoch() <= epoch)
+			sched_yield();
+
+		release(arg, ptr);
+		return;
+	}
+
+	retired->epoch   = epoch;
+	retired->release = release;
+	retired->arg     = arg;
+	retired->ptr     = ptr;
+	retired->next    = list->head;
+	list->head       = retired;
+}
+
+void cmd3_rcu_reclaim(struct cmd3_rcu_list *list, int force)
+{
+	struct cmd3_rcu_retired **link = &list->head;
+	struct cmd3_rcu_retired *retired;
+	unsigned long oldest;
+
+	if(NULL == list->head)
+		return;
+
+	oldest = force ? (unsigned long)-1 : cmd3_rcu_oldest_epoch();
+
+	while((retired = *link) != NULL)
+	{
+		if(retired->epoch < oldest)
+		{
+			*link = retired->next;
+			retired->release(retired->arg, retired->ptr);
+			free(retired);
+		}
+		else
+		{
+			link = &retired->next;
+		}
+	}
+}
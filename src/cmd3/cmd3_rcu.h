@@ -0,0 +1,103 @@
+/*
+ *The MIT License (MIT)
+ *
+ *Copyright (c) 2015 EdwardH
+ *
+ *Permission is hereby granted, free of charge, to any person obtaining a copy
+ *of this software and associated documentation files (the "Software"), to deal
+ *in the Software without restriction, including without limitation the rights
+ *to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *copies of the Software, and to permit persons to whom the Software is
+ *furnished to do so, subject to the following conditions:
+ *
+ *The above copyright notice and this permission notice shall be included in all
+ *copies or substantial portions of the Software.
+ *
+ *THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *SOFTWARE.
+ *
+ *
+ *
+ *
+ * cmd3_rcu.h
+ *
+ *  Created on: Oct 18, 2026
+ */
+
+#ifndef CMD3_RCU_H_
+#define CMD3_RCU_H_
+
+/*
+ * Epoch based deferred reclamation, letting command tree readers run without locks.
+ *
+ * Readers mark their critical section with cmd3_rcu_read_lock()/cmd3_rcu_read_unlock().
+ * Writers unpublish an object, then retire it; the object is released only once
+ * every reader which could have seen it has left its critical section.
+ * Writers are expected to serialize retire/reclaim calls on the same list.
+ */
+
+// Retired object, pending release
+struct cmd3_rcu_retired
+{
+	struct cmd3_rcu_retired *next;						// Next retired object in the list
+	unsigned long 			 epoch;						// Epoch the object was retired at
+	void 				   (*release)(void *arg, void *ptr);	// Object release function
+	void 					*arg;						// Release function argument
+	void 					*ptr;						// The retired object
+};
+
+// Retired objects list
+struct cmd3_rcu_list
+{
+	struct cmd3_rcu_retired *head;						// Retired objects, the newest first
+};
+
+
+/*********************************************************************************//**
+ * @note	Enter/Leave a read side critical section.
+ * 			Critical sections may nest, wait-free once the thread is registered
+ * 			(the first critical section of a thread registers it).
+ *
+ * @param   N/A
+ *
+ * @return
+ *  - N/A
+ *************************************************************************************/
+void cmd3_rcu_read_lock(void);
+void cmd3_rcu_read_unlock(void);
+
+
+/*********************************************************************************//**
+ * @note	Retire an object which is no longer reachable by new readers.
+ * 			The object is released by a later cmd3_rcu_reclaim() call.
+ * 			If the retire record can not be allocated, waits for a grace period
+ * 			and releases the object immediately.
+ *
+ * @param [in]  list 	- The retired objects list.
+ * 		  [in]	ptr		- The retired object.
+ * 		  [in]	release - The object release function.
+ * 		  [in]	arg		- The release function argument.
+ *
+ * @return
+ *  - N/A
+ *************************************************************************************/
+void cmd3_rcu_retire(struct cmd3_rcu_list *list, void *ptr, void (*release)(void *arg, void *ptr), void *arg);
+
+
+/*********************************************************************************//**
+ * @note	Release the retired objects no reader can still see.
+ *
+ * @param [in]  list  - The retired objects list.
+ * 		  [in]	force - Release all objects, when it is known there are no readers.
+ *
+ * @return
+ *  - N/A
+ *************************************************************************************/
+void cmd3_rcu_reclaim(struct cmd3_rcu_list *list, int force);
+
+#endif /* CMD3_RCU_H_ */
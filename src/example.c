@@ -31,60 +31,338 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "cmd3/cmd3.h"
 #include "linenoise/linenoise.h"
 
-static int sys_info(int argc, const char **argv, char *buf, size_t buf_size)
+static int sys_info(void *user_data, int argc, const char **argv, cmdtree_out_d out)
 {
-	int bytes_writen;
+	return cmdtree_out_printf(out, "Info: argc=%d, arg[0]=%s""\n", argc, argv[0]);
+}
+
+/* Blocks for argv[1] ms, a stand-in for a cmd waiting on I/O. */
+static int sys_wait(int argc, const char **argv, char *buf, size_t buf_size)
+{
+	int ms = argc > 1 ? atoi(argv[1]) : 1000;
+	struct timespec delay = { ms / 1000, (ms % 1000) * 1000000L };
 
-	bytes_writen = snprintf(buf, buf_size, "Info: argc=%d, arg[0]=%s""\n", argc, argv[0]);
+	nanosleep(&delay, NULL);
 
-	return bytes_writen;
+	return snprintf(buf, buf_size, "\rWaited %d ms.\r\n", ms);
 }
 
 static void register_commands()
 {
-    new_cmdtree_create("info", "System Information", sys_info, CMDTREE_NO_PARENT);
+    cmdtree_config_t cmd_cfg;
+
+    /* Info only reads, script runners may dispatch it concurrently. */
+    memset(&cmd_cfg, 0, sizeof(cmd_cfg));
+    cmd_cfg.name        = "info";
+    cmd_cfg.comment     = "System Information";
+    cmd_cfg.cmdfunc_out = sys_info;
+    cmd_cfg.parent_name = CMDTREE_NO_PARENT;
+    cmd_cfg.independent = 1;
+    cmdtree_create(&cmd_cfg);
+
+    /* Wait blocks, the console runs it on the worker pool. */
+    memset(&cmd_cfg, 0, sizeof(cmd_cfg));
+    cmd_cfg.name        = "wait";
+    cmd_cfg.comment     = "Wait <ms>, in the background";
+    cmd_cfg.cmdfunc     = sys_wait;
+    cmd_cfg.parent_name = CMDTREE_NO_PARENT;
+    cmd_cfg.async       = 1;
+    cmdtree_create(&cmd_cfg);
+
+    /* Available when the library is built with CMD3_STATS. */
+    cmdtree_stats_create();
+
+    /* Cmds taking 10ms or more are kept for "slowlog get". */
+    cmdtree_slowlog_create(10000, 128);
+}
+
+// Chrome trace-event writer, a sample trace hook for offline flame analysis (chrome://tracing, Perfetto)
+struct chrome_trace
+{
+	FILE 			*file;
+	pthread_mutex_t	 lock;
+	unsigned long 	 events;	// Events written, the following ones are comma separated
+};
+
+static struct chrome_trace chrome_trace = { NULL, PTHREAD_MUTEX_INITIALIZER, 0 };
+
+static void chrome_trace_event(struct chrome_trace *trace, char phase, const cmdtree_trace_event_t *event)
+{
+	static const char *stages[] = { "tokenize", "lookup", "handler", "report", "output" };
+	struct timespec now;
+	char path[256] = "";
+	size_t i;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	if(event->cmd)
+		cmdtree_path(event->cmd, path, sizeof(path));
+
+	/* The cmd names are not escaped, chars JSON would need escaped are replaced. */
+	for(i = 0; path[i]; i++)
+		if('"' == path[i] || '\\' == path[i] || (unsigned char)path[i] < ' ')
+			path[i] = '_';
+
+	pthread_mutex_lock(&trace->lock);
+	fprintf(trace->file, "%s{\"name\":\"%s\",\"cat\":\"cmd3\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,\"tid\":%ld,"
+			"\"args\":{\"cmd\":\"%s\",\"bytes\":%zu}}",
+			trace->events++ ? ",\n" : "", stages[event->stage], phase,
+			now.tv_sec * 1e6 + now.tv_nsec / 1e3, (int)getpid(), (long)syscall(SYS_gettid), path, event->bytes);
+	pthread_mutex_unlock(&trace->lock);
+}
+
+static void chrome_trace_begin(void *arg, const cmdtree_trace_event_t *event)
+{
+	chrome_trace_event(arg, 'B', event);
+}
+
+static void chrome_trace_end(void *arg, const cmdtree_trace_event_t *event)
+{
+	chrome_trace_event(arg, 'E', event);
+}
+
+static void chrome_trace_close(void)
+{
+	cmdtree_trace_set(NULL);
+
+	fprintf(chrome_trace.file, "\n]\n");
+	fclose(chrome_trace.file);
+}
+
+static int chrome_trace_open(const char *path)
+{
+	static const cmdtree_trace_t trace = { chrome_trace_begin, chrome_trace_end, &chrome_trace };
+
+	chrome_trace.file = fopen(path, "w");
+	if(NULL == chrome_trace.file)
+		return CMD3_FAIL;
+
+	fprintf(chrome_trace.file, "[\n");
+	atexit(chrome_trace_close);
+
+	cmdtree_trace_set(&trace);
+
+	return CMD3_SUCCESS;
+}
+
+#define SCRIPT_WORKERS_MAX 			64		// Maximal --parallel workers
+
+/*
+ * Replay a script file, one cmd per line, with the output streamed to stdout.
+ * The file is mapped and split into lines in place, no line is copied.
+ * With several workers, consecutive cmds marked independent are executed concurrently.
+ * Returns nonzero when a cmd fails, an unterminated quote included, for use in shell pipelines.
+ */
+static int script_run(const char *path, int workers, const cmdtree_sink_t *sink)
+{
+	cmdtree_executor_d executor;
+	cmdtree_batch_result_t *results;
+	const char *script;
+	const char *line;
+	size_t max_results = 1;
+	struct stat st;
+	int count;
+	int failed;
+	int fd;
+	int i;
+
+	fd = open(path, O_RDONLY);
+	if(fd < 0 || fstat(fd, &st) < 0)
+	{
+		perror(path);
+		if(fd >= 0)
+			close(fd);
+		return 1;
+	}
+
+	if(0 == st.st_size)
+	{
+		close(fd);
+		return 0;
+	}
+
+	script = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(MAP_FAILED == script)
+	{
+		perror(path);
+		return 1;
+	}
+
+	madvise((void *)script, st.st_size, MADV_SEQUENTIAL);
+
+	/* Each cmd takes a line at least, a result per line holds the outcome of every cmd. */
+	for(line = script; (line = memchr(line, '\n', script + st.st_size - line)); line++)
+		max_results++;
+
+	results = malloc(max_results * sizeof(*results));
+	if(NULL == results)
+	{
+		perror(path);
+		munmap((void *)script, st.st_size);
+		return 1;
+	}
+
+	/* The caller runs cmds as well, it is one of the workers. Without an executor the script runs serially. */
+	executor = workers > 1 ? cmdtree_executor_create(workers - 1) : NULL;
+
+	if(executor)
+		count = cmdtree_exec_batch_parallel(executor, script, st.st_size, 0, sink, results, max_results);
+	else
+		count = cmdtree_exec_batch(script, st.st_size, 0, sink, results, max_results);
+
+	failed = CMD3_FAIL == count;
+	for(i = 0; i < count; i++)
+		failed |= CMD3_SUCCESS != results[i].status;
+
+	cmdtree_executor_destroy(executor);
+	free(results);
+	munmap((void *)script, st.st_size);
+
+	return failed;
+}
+
+struct completion_line
+{
+	const char 			 *buf;			// The line being completed
+	size_t 				  prefix_len;	// Length of the line preceding the completed token
+	linenoiseCompletions *lc;
+};
+
+static void completion_add(void *arg, const char *name)
+{
+	struct completion_line *line = arg;
+	char candidate[256];
+
+	snprintf(candidate, sizeof(candidate), "%.*s%s ", (int)line->prefix_len, line->buf, name);
+	linenoiseAddCompletion(line->lc, candidate);
 }
 
 static void completion(const char *buf, linenoiseCompletions *lc)
 {
-//    if (buf[0] == 'h') {
-//        linenoiseAddCompletion(lc,"hello");
-//        linenoiseAddCompletion(lc,"hello there");
-//    }
+	struct completion_line line = { buf, strlen(buf), lc };
+	cmdtree_argv_t prefix;
+	const char **arg_vdata;
+	char *tokens;
+	int   i;
+
+	/* The last token starts past the last white space, the preceding tokens select the tree level. */
+	while(line.prefix_len && buf[line.prefix_len - 1] != ' ' && buf[line.prefix_len - 1] != '\t')
+		line.prefix_len--;
+
+	tokens = strndup(buf, line.prefix_len);
+	if(NULL == tokens)
+		return;
+
+	/* The preceding tokens are not limited in number, each one is terminated in place. */
+	cmdtree_argv_init(&prefix);
+	if(CMD3_SUCCESS == cmdtree_argv_tokenize(&prefix, tokens, line.prefix_len) &&
+	   NULL != (arg_vdata = malloc((prefix.argc + 1) * sizeof(*arg_vdata))))
+	{
+		for(i = 0; i < prefix.argc; i++)
+		{
+			tokens[prefix.tokens[i].str - tokens + prefix.tokens[i].len] = '\0';
+			arg_vdata[i] = prefix.tokens[i].str;
+		}
+		arg_vdata[i] = buf + line.prefix_len;
+
+		cmdtree_complete(prefix.argc + 1, arg_vdata, completion_add, &line);
+
+		free(arg_vdata);
+	}
+
+	cmdtree_argv_release(&prefix);
+	free(tokens);
+}
+
+#define CONSOLE_WORKERS 	2
+#define CONSOLE_QUEUE_MAX 	16
+
+/* Runs inline or on a pool worker, it must not destroy the pool nor tear the tree down (see cmdtree_exec_async()). */
+static void console_done(void *arg, int status)
+{
+	(void)arg;
+	(void)status;
 }
 
 int main(int argc, char **argv)
 {
     char *line;
     char *prgname = argv[0];
-    char report_buf[256];
+    cmdtree_argv_t line_argv;
+    cmdtree_sink_t stdout_sink;
+    cmdtree_pool_d pool;
 
     register_commands();
 
+    /* Cmd output is streamed to the terminal, whatever its size. */
+    cmdtree_sink_fd_init(&stdout_sink, STDOUT_FILENO);
+
+    /* Record the cmd stages as Chrome trace events, written out on exit. */
+    if(argc > 2 && !strcmp(argv[1], "--trace"))
+    {
+    	if(CMD3_SUCCESS != chrome_trace_open(argv[2]))
+    	{
+    		perror(argv[2]);
+    		exit(1);
+    	}
+
+    	argc -= 2;
+    	argv += 2;
+    }
+
     if(argc > 1)
     {
         argc--;
         argv++;
-        if (!strcmp(*argv,"-c"))
+        if (!strcmp(*argv,"-c") && argc > 1)
         {
             argc--;
             argv++;
 
-        	const char *arg_vdata[CMD_TREE_MAX_DEPTH];
-        	const char **arg_vec = arg_vdata;
-        	int   arg_count = 0;
-        	cmdtree_stov(*argv, &arg_count, arg_vec);
+        	/* The cmd is split as a console line, with no limit on the number of tokens. */
+        	cmdtree_argv_init(&line_argv);
+        	switch(cmdtree_argv_tokenize_quoted(&line_argv, *argv, strlen(*argv)))
+        	{
+        	case CMD3_SUCCESS:
+                printf("\r");
+                fflush(stdout);
+                cmdtree_exec_tokens_sink(line_argv.argc, line_argv.tokens, &stdout_sink);
+                break;
+        	case CMD3_INCOMPLETE:
+        		fprintf(stderr, "Unterminated quote or escape: %s\n", *argv);
+        		break;
+        	default:
+        		fprintf(stderr, "Out of memory: %s\n", *argv);
+        		break;
+        	}
+        	cmdtree_argv_release(&line_argv);
+        }
+        else if (!strcmp(*argv,"-f") && argc > 1)
+        {
+        	const char *script = argv[1];
+        	int workers = 1;
 
-            report_buf[0] = '\0';
-            cmdtree_exec(arg_count, arg_vec, report_buf, sizeof(report_buf));
-            printf("\r%s", report_buf);
+        	if(argc > 3 && !strcmp(argv[2], "--parallel"))
+        		workers = atoi(argv[3]);
+        	if(workers > SCRIPT_WORKERS_MAX)
+        		workers = SCRIPT_WORKERS_MAX;
+
+        	exit(script_run(script, workers, &stdout_sink));
         }
         else
         {
-            fprintf(stderr, "Usage: %s [-c \"command\"]\n", prgname);
+            fprintf(stderr, "Usage: %s [--trace file.json] [-c \"command\" | -f script [--parallel N]]\n", prgname);
             exit(1);
         }
     }
@@ -97,6 +375,12 @@ int main(int argc, char **argv)
      * where entries are separated by newlines. */
     linenoiseHistoryLoad("history.txt"); /* Load the history at startup */
 
+    /* The line tokens vector is reused from line to line, growing for long lines only. */
+    cmdtree_argv_init(&line_argv);
+
+    /* Blocking cmds run in the background, keeping the console responsive. */
+    pool = cmdtree_pool_create(CONSOLE_WORKERS, CONSOLE_QUEUE_MAX);
+
     /*
      * The typed string is returned as a malloc() allocated string by
      * linenoise, so the user needs to free() it. */
@@ -105,19 +389,40 @@ int main(int argc, char **argv)
     	printf("\r");
         if (line[0] != '\0' && line[0] != '/')
         {
-            linenoiseHistoryAdd(line); /* Add to the history. */
-
         	/*
-        	 * Split the cmd string using white space delimiters, ending up with an argv/argc format.
+        	 * Split the cmd string using white space delimiters, honoring quotes and escapes.
+        	 * An open quote or a trailing backslash continues the cmd on the next line.
         	 */
-        	const char *arg_vdata[CMD_TREE_MAX_DEPTH];
-        	const char **arg_vec = arg_vdata;
-        	int   arg_count = 0;
-        	cmdtree_stov(line, &arg_count, arg_vec);
+        	while(CMD3_INCOMPLETE == cmdtree_argv_tokenize_quoted(&line_argv, line, strlen(line)))
+        	{
+        		char *next_line = linenoise("\r" "> ");
+        		char *joined_line;
+
+        		if(NULL == next_line)
+        			break;
+
+        		joined_line = malloc(strlen(line) + strlen(next_line) + 2);
+        		if(NULL == joined_line)
+        		{
+        			free(next_line);
+        			break;
+        		}
+
+        		sprintf(joined_line, "%s\n%s", line, next_line);
+        		free(next_line);
+        		free(line);
+        		line = joined_line;
+        	}
+
+            linenoiseHistoryAdd(line); /* Add to the history. */
 
-        	report_buf[0] = '\0';
-        	cmdtree_exec(arg_count, arg_vec, report_buf, sizeof(report_buf));
-            printf("%s\r\n", report_buf);
+        	fflush(stdout);
+        	if(NULL == pool)
+        		cmdtree_exec_tokens_sink(line_argv.argc, line_argv.tokens, &stdout_sink);
+        	else if(CMD3_FAIL == cmdtree_exec_tokens_async(pool, line_argv.argc, line_argv.tokens, &stdout_sink,
+        												   console_done, NULL))
+        		printf("Too many background commands.");
+            printf("\r\n");
 
             linenoiseHistorySave("history.txt"); /* Save the history on disk. */
         }
@@ -125,6 +430,8 @@ int main(int argc, char **argv)
         {
         	printf("Exit console.\r\n");
         	free(line);
+        	cmdtree_pool_destroy(pool);
+        	cmdtree_argv_release(&line_argv);
         	exit(0);
         }
         else if (line[0] == '/')
@@ -133,5 +440,7 @@ int main(int argc, char **argv)
         }
         free(line);
     }
+    cmdtree_pool_destroy(pool);
+    cmdtree_argv_release(&line_argv);
     return 0;
 }
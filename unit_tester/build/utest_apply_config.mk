@@ -65,6 +65,7 @@ ifeq ($(CPPUTEST_USE_EXTENSIONS), Y)
 endif
 
 LD_LIBRARIES += -lstdc++
+LD_LIBRARIES += -lpthread
 ifeq ($(CPPUTEST_USE_GCOV), Y)
 	LD_LIBRARIES += -lgcov
 endif
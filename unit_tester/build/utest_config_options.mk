@@ -27,3 +27,6 @@ ifndef CPPUTEST_WARNINGFLAGS
 	endif 
 	CPPUTEST_CXX_WARNINGFLAGS = -Woverloaded-virtual
 endif
+
+# Optional production features, built in for the tests
+CPPUTEST_CPPFLAGS += -DCMD3_STATS
@@ -0,0 +1,163 @@
+/*
+Copyright (c) 2015, Edward Haas
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of cmd3 nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*
+* cmd3_hpp_tester.cpp
+*
+*  Created on: Oct 18, 2026
+*/
+
+
+
+#include <CppUTest/TestHarness.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include "cmd3.hpp"
+
+#ifndef UNUSED
+#define UNUSED(x) ((void)(x))
+#endif
+
+static int cmdtest1(int argc, const char **argv, char *buf, size_t buf_size)
+{
+	UNUSED(buf_size);
+
+	return sprintf(buf, "cmdtest1: argc=%d, arg[0]=%s""\n", argc, argv[0]);
+}
+
+static int cmdtest2(int argc, const char **argv, char *buf, size_t buf_size)
+{
+	UNUSED(buf_size);
+
+	return sprintf(buf, "cmdtest2: argc=%d, arg[0]=%s""\n", argc, argv[0]);
+}
+
+constexpr cmd3::node static_cmds[] =
+{
+	/* 0 */ { "cmdtest2",     "cmd test 2",     NULL,     cmd3::no_parent },
+	/* 1 */ { "cmdtest1",     "cmd test 1",     cmdtest1, cmd3::no_parent },
+	/* 2 */ { "cmdtest2.2",   "cmd test 2.2",   NULL,     0 },
+	/* 3 */ { "cmdtest2.1",   "cmd test 2.1",   cmdtest2, 0 },
+	/* 4 */ { "cmdtest2.2.1", "cmd test 2.2.1", cmdtest1, 2 },
+	/* 5 */ { "cmdtest2.3",   "cmd test 2.3",   cmdtest2, 0 },
+};
+
+typedef CMD3_STATIC_TREE(static_cmds) static_tree;
+
+
+TEST_GROUP(cmd3_static_tree)
+{
+	char report_buf[256];
+
+    void setup()
+    {
+    	memset(report_buf, 0, sizeof(report_buf));
+    }
+
+    void teardown()
+    {
+
+    }
+};
+
+TEST(cmd3_static_tree, no_args__root_cmds_seen_in_usage)
+{
+	const char *argv[1] = { NULL };
+
+	char report_expected[256] = "cmdtest2              cmd test 2""\n"
+								"cmdtest1              cmd test 1""\n";
+
+	static_tree::exec(0, argv, report_buf, sizeof(report_buf));
+
+	STRCMP_EQUAL(report_expected, report_buf);
+}
+
+TEST(cmd3_static_tree, junction__child_cmds_seen_in_usage)
+{
+	const char *argv[1] = { "cmdtest2" };
+
+	char report_expected[256] = "cmdtest2.2            cmd test 2.2""\n"
+								"cmdtest2.1            cmd test 2.1""\n"
+								"cmdtest2.3            cmd test 2.3""\n";
+
+	static_tree::exec(1, argv, report_buf, sizeof(report_buf));
+
+	STRCMP_EQUAL(report_expected, report_buf);
+}
+
+TEST(cmd3_static_tree, execute_cmd_from_3_level_deep)
+{
+	const char *argv[4] = { "cmdtest2", "cmdtest2.2", "cmdtest2.2.1", "arg0" };
+
+	static_tree::exec(4, argv, report_buf, sizeof(report_buf));
+
+	STRCMP_EQUAL("cmdtest1: argc=2, arg[0]=cmdtest2.2.1""\n", report_buf);
+}
+
+TEST(cmd3_static_tree, execute_each_sibling__matching_cmd_executed)
+{
+	const char *argv1[2] = { "cmdtest2", "cmdtest2.1" };
+	const char *argv3[2] = { "cmdtest2", "cmdtest2.3" };
+
+	static_tree::exec(2, argv1, report_buf, sizeof(report_buf));
+	STRCMP_EQUAL("cmdtest2: argc=1, arg[0]=cmdtest2.1""\n", report_buf);
+
+	static_tree::exec(2, argv3, report_buf, sizeof(report_buf));
+	STRCMP_EQUAL("cmdtest2: argc=1, arg[0]=cmdtest2.3""\n", report_buf);
+}
+
+TEST(cmd3_static_tree, unknown_cmd__error_reported)
+{
+	const char *argv[1] = { "cmdtest9" };
+
+	char report_expected[256] = "cmdtest2              cmd test 2""\n"
+								"cmdtest1              cmd test 1""\n";
+
+	LONGS_EQUAL(strlen(report_expected) + 1, static_tree::exec(1, argv, report_buf, sizeof(report_buf)));
+
+	STRCMP_EQUAL(report_expected, report_buf);
+}
+
+TEST(cmd3_static_tree, small_buffer__report_truncated)
+{
+	const char *argv[1] = { "cmdtest9" };
+	char small_buf[16];
+
+	memset(small_buf, '.', sizeof(small_buf));
+	LONGS_EQUAL(sizeof(small_buf), static_tree::exec(1, argv, small_buf, sizeof(small_buf)));
+	STRCMP_EQUAL("cmdtest2       ", small_buf);
+
+	/* The usage report does not fit a single char, the fallback message is truncated as well. */
+	memset(small_buf, '.', sizeof(small_buf));
+	LONGS_EQUAL(1, static_tree::exec(1, argv, small_buf, 1));
+	STRCMP_EQUAL("", small_buf);
+	LONGS_EQUAL('.', small_buf[1]);
+}
@@ -37,7 +37,10 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <CppUTest/TestHarness.h>
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #include "cmd3.h"
 
@@ -79,6 +82,26 @@ static int cmdtest3(int argc, const char **argv, char *buf, size_t buf_size)
 	return CMD3_FAIL;
 }
 
+static int cmdtest_last(int argc, const char **argv, char *buf, size_t buf_size)
+{
+	UNUSED(buf_size);
+	int bytes_writen;
+
+	bytes_writen = sprintf(buf, "cmdtest_last: argc=%d, arg[%d]=%s""\n", argc, argc - 1, argv[argc - 1]);
+
+	return bytes_writen;
+}
+
+static int cmdtest_ud(void *user_data, int argc, const char **argv, char *buf, size_t buf_size)
+{
+	UNUSED(buf_size);
+	int bytes_writen;
+
+	bytes_writen = sprintf(buf, "cmdtest_ud: %s, argc=%d, arg[0]=%s""\n", (const char *)user_data, argc, argv[0]);
+
+	return bytes_writen;
+}
+
 
 TEST_GROUP(cmd3_creation)
 {
@@ -116,6 +139,81 @@ TEST(cmd3_creation, cmd_tree_get_root)
 	cmdtree_destroy(cmdtree);
 }
 
+TEST(cmd3_creation, destroy_first_root_cmd__next_root_cmd_is_root)
+{
+	cmdtree_d cmdtree1 = new_cmdtree_create("cmdtest1", "cmd test 1", cmdtest1, CMDTREE_NO_PARENT);
+	cmdtree_d cmdtree2 = new_cmdtree_create("cmdtest2", "cmd test 2", cmdtest2, CMDTREE_NO_PARENT);
+
+	cmdtree_destroy(cmdtree1);
+
+	POINTERS_EQUAL(cmdtree2, cmdtree_get_root());
+
+	cmdtree_destroy(cmdtree2);
+}
+
+TEST(cmd3_creation, cmd_tree_teardown__tree_empty)
+{
+	new_cmdtree_create("cmdtest1", "cmd test 1", cmdtest1, CMDTREE_NO_PARENT);
+	new_cmdtree_create("cmdtest2", "cmd test 2", NULL, CMDTREE_NO_PARENT);
+	new_cmdtree_create("cmdtest2.1", "cmd test 2.1", cmdtest2, "cmdtest2");
+
+	cmdtree_teardown();
+
+	POINTERS_EQUAL(NULL, cmdtree_get_root());
+}
+
+TEST(cmd3_creation, destroy_subtree__subtree_gone_siblings_kept)
+{
+	const char *argv[1] = { NULL };
+	char report_buf[256];
+	cmdtree_d cmdtree2, cmdtree3;
+
+	new_cmdtree_create("cmdtest1", "cmd test 1", cmdtest1, CMDTREE_NO_PARENT);
+	cmdtree2 = new_cmdtree_create("cmdtest2", "cmd test 2", NULL, CMDTREE_NO_PARENT);
+	cmdtree3 = new_cmdtree_create("cmdtest3", "cmd test 3", cmdtest3, CMDTREE_NO_PARENT);
+	new_cmdtree_create("cmdtest2.1", "cmd test 2.1", NULL, "cmdtest2");
+	new_cmdtree_create("cmdtest2.2", "cmd test 2.2", cmdtest2, "cmdtest2");
+	new_cmdtree_create("cmdtest2.1.1", "cmd test 2.1.1", cmdtest1, "cmdtest2 cmdtest2.1");
+
+	LONGS_EQUAL(CMD3_SUCCESS, cmdtree_destroy_subtree(cmdtree2));
+
+	memset(report_buf, 0, sizeof(report_buf));
+	cmdtree_exec(0, argv, report_buf, sizeof(report_buf));
+	STRCMP_EQUAL("cmdtest1              cmd test 1""\n"
+				 "cmdtest3              cmd test 3""\n", report_buf);
+
+	LONGS_EQUAL(CMD3_SUCCESS, cmdtree_destroy_subtree(cmdtree_get_root()));
+	POINTERS_EQUAL(cmdtree3, cmdtree_get_root());
+
+	cmdtree_teardown();
+}
+
+TEST(cmd3_creation, create_under_parent_handle__child_executed)
+{
+	const char *argv[3] = { "cmdtest2", "cmdtest2.1", "cmdtest2.1.1" };
+	char report_buf[256];
+	cmdtree_config_t config;
+	cmdtree_d cmdtree2, cmdtree21;
+
+	memset(&config, 0, sizeof(config));
+
+	config.name = "cmdtest2";     config.comment = "cmd test 2";
+	cmdtree2 = cmdtree_create_under(CMDTREE_NO_PARENT, &config);
+	config.name = "cmdtest2.1";   config.comment = "cmd test 2.1";
+	config.parent_name = "ignored";
+	cmdtree21 = cmdtree_create_under(cmdtree2, &config);
+	config.name = "cmdtest2.1.1"; config.comment = "cmd test 2.1.1"; config.cmdfunc = cmdtest1;
+	CHECK(NULL != cmdtree_create_under(cmdtree21, &config));
+
+	POINTERS_EQUAL(cmdtree2, cmdtree_get_root());
+
+	memset(report_buf, 0, sizeof(report_buf));
+	cmdtree_exec(3, argv, report_buf, sizeof(report_buf));
+	STRCMP_EQUAL("cmdtest1: argc=1, arg[0]=cmdtest2.1.1""\n", report_buf);
+
+	cmdtree_teardown();
+}
+
 
 TEST_GROUP(cmd3)
 {
@@ -284,3 +382,2599 @@ TEST(cmd3, execute_cmd_from_3_level_deep)
 	cmdtree_destroy(cmdtree21);
 	cmdtree_destroy(cmdtree2);
 }
+
+
+TEST_GROUP(cmd3_freeze)
+{
+	cmdtree_d cmdtree2;
+	cmdtree_d cmdtree21;
+	cmdtree_d cmdtree22;
+	cmdtree_d cmdtree221;
+
+    void setup()
+    {
+    	new_cmdtree_create("cmdtest1", "cmd test 1", cmdtest1, CMDTREE_NO_PARENT);
+    	cmdtree2   = new_cmdtree_create("cmdtest2",     "cmd test 2",     NULL,     CMDTREE_NO_PARENT);
+    	cmdtree22  = new_cmdtree_create("cmdtest2.2",   "cmd test 2.2",   NULL,     "cmdtest2");
+    	cmdtree21  = new_cmdtree_create("cmdtest2.1",   "cmd test 2.1",   NULL,     "cmdtest2");
+    	cmdtree221 = new_cmdtree_create("cmdtest2.2.1", "cmd test 2.2.1", cmdtest1, "cmdtest2 cmdtest2.2");
+
+    	LONGS_EQUAL(CMD3_SUCCESS, cmdtree_freeze());
+    }
+
+    void teardown()
+    {
+    	cmdtree_destroy(cmdtree221);
+    	cmdtree_destroy(cmdtree21);
+    	cmdtree_destroy(cmdtree22);
+    	cmdtree_destroy(cmdtree2);
+    	cmdtree_destroy(cmdtree_get_root());
+    }
+};
+
+TEST(cmd3_freeze, frozen_usage__reported_in_creation_order)
+{
+	const char *argv[1] = { "cmdtest2" };
+	char report_buf[256];
+
+	char report_expected[256]  = "cmdtest2.2            cmd test 2.2""\n"
+								 "cmdtest2.1            cmd test 2.1""\n";
+
+	memset(report_buf, 0, sizeof(report_buf));
+	cmdtree_exec(1, argv, report_buf, sizeof(report_buf));
+
+	STRCMP_EQUAL(report_expected, report_buf);
+}
+
+TEST(cmd3_freeze, frozen_execute_cmd_from_3_level_deep)
+{
+	const char *argv[4] = { "cmdtest2", "cmdtest2.2", "cmdtest2.2.1", "arg0" };
+	char report_buf[256];
+
+	char report_expected[256]  = "cmdtest1: argc=2, arg[0]=cmdtest2.2.1""\n";
+
+	memset(report_buf, 0, sizeof(report_buf));
+	cmdtree_exec(4, argv, report_buf, sizeof(report_buf));
+
+	STRCMP_EQUAL(report_expected, report_buf);
+}
+
+TEST(cmd3_freeze, frozen_unknown_cmd__level_usage_reported)
+{
+	const char *argv[2] = { "cmdtest2", "cmdtest2.9" };
+	char report_buf[256];
+
+	char report_expected[256]  = "cmdtest2.2            cmd test 2.2""\n"
+								 "cmdtest2.1            cmd test 2.1""\n";
+
+	memset(report_buf, 0, sizeof(report_buf));
+	cmdtree_exec(2, argv, report_buf, sizeof(report_buf));
+
+	STRCMP_EQUAL(report_expected, report_buf);
+}
+
+TEST(cmd3_freeze, create_after_freeze__new_cmd_seen_in_usage)
+{
+	const char *argv[1] = { "cmdtest2" };
+	char report_buf[256];
+
+	char report_expected[256]  = "cmdtest2.2            cmd test 2.2""\n"
+								 "cmdtest2.1            cmd test 2.1""\n"
+								 "cmdtest2.3            cmd test 2.3""\n";
+
+	cmdtree_d cmdtree23 = new_cmdtree_create("cmdtest2.3", "cmd test 2.3", NULL, "cmdtest2");
+
+	memset(report_buf, 0, sizeof(report_buf));
+	cmdtree_exec(1, argv, report_buf, sizeof(report_buf));
+
+	STRCMP_EQUAL(report_expected, report_buf);
+
+	cmdtree_destroy(cmdtree23);
+}
+
+
+TEST_GROUP(cmd3_allocator)
+{
+	cmdtree_arena_d arena;
+
+    void setup()
+    {
+    	cmdtree_allocator_t allocator;
+
+    	arena = cmdtree_arena_create(0);
+    	cmdtree_arena_allocator(arena, &allocator);
+
+    	LONGS_EQUAL(CMD3_SUCCESS, cmdtree_set_allocator(&allocator));
+    }
+
+    void teardown()
+    {
+    	cmdtree_teardown();
+    	LONGS_EQUAL(CMD3_SUCCESS, cmdtree_set_allocator(NULL));
+    	cmdtree_arena_destroy(arena);
+    }
+};
+
+TEST(cmd3_allocator, set_allocator_on_populated_tree__fails)
+{
+	new_cmdtree_create("cmdtest1", "cmd test 1", cmdtest1, CMDTREE_NO_PARENT);
+
+	LONGS_EQUAL(CMD3_FAIL, cmdtree_set_allocator(NULL));
+}
+
+TEST(cmd3_allocator, arena_tree__cmds_executed_and_long_names_kept)
+{
+	const char *argv[3] = { "cmdtest2", "cmdtest2.a.very.long.name.beyond.32.chars", "arg0" };
+	char report_buf[256];
+	char name[32];
+	int i;
+
+	char report_expected[256]  = "cmdtest1: argc=2, arg[0]=cmdtest2.a.very.long.name.beyond.32.chars""\n";
+
+	new_cmdtree_create("cmdtest2", "cmd test 2", NULL, CMDTREE_NO_PARENT);
+	for(i = 0; i < 500; i++)
+	{
+		sprintf(name, "cmdtest2.%d", i);
+		CHECK(NULL != new_cmdtree_create(name, "cmd test 2.x", cmdtest2, "cmdtest2"));
+	}
+	new_cmdtree_create("cmdtest2.a.very.long.name.beyond.32.chars", "cmd test 2.long", cmdtest1, "cmdtest2");
+
+	memset(report_buf, 0, sizeof(report_buf));
+	cmdtree_exec(3, argv, report_buf, sizeof(report_buf));
+
+	STRCMP_EQUAL(report_expected, report_buf);
+}
+
+TEST(cmd3_allocator, destroy_and_create__cmd_seen_in_usage)
+{
+	const char *argv[1] = { NULL };
+	char report_buf[256];
+
+	char report_expected[256]  = "cmdtest1              cmd test 1""\n"
+								 "cmdtest3              cmd test 3""\n";
+
+	new_cmdtree_create("cmdtest1", "cmd test 1", cmdtest1, CMDTREE_NO_PARENT);
+	cmdtree_destroy(new_cmdtree_create("cmdtest2", "cmd test 2", cmdtest2, CMDTREE_NO_PARENT));
+	new_cmdtree_create("cmdtest3", "cmd test 3", cmdtest3, CMDTREE_NO_PARENT);
+
+	memset(report_buf, 0, sizeof(report_buf));
+	cmdtree_exec(0, argv, report_buf, sizeof(report_buf));
+
+	STRCMP_EQUAL(report_expected, report_buf);
+}
+
+
+static void complete_collect(void *arg, const char *name)
+{
+	strcat((char *)arg, name);
+	strcat((char *)arg, " ");
+}
+
+TEST_GROUP(cmd3_prefix)
+{
+    void setup()
+    {
+    	new_cmdtree_create("show",     "show info",      NULL,     CMDTREE_NO_PARENT);
+    	new_cmdtree_create("shutdown", "shutdown",       cmdtest1, CMDTREE_NO_PARENT);
+    	new_cmdtree_create("set",      "set a value",    cmdtest1, CMDTREE_NO_PARENT);
+    	new_cmdtree_create("status",   "show status",    cmdtest1, "show");
+    	new_cmdtree_create("stats",    "show stats",     cmdtest1, "show");
+    	new_cmdtree_create("stat",     "show stat",      cmdtest1, "show");
+    }
+
+    void teardown()
+    {
+    	cmdtree_teardown();
+    }
+};
+
+TEST(cmd3_prefix, unique_prefix__cmd_executed_with_typed_name)
+{
+	const char *argv[3] = { "sho", "statu", "arg0" };
+	char report_buf[256];
+
+	memset(report_buf, 0, sizeof(report_buf));
+	cmdtree_exec(3, argv, report_buf, sizeof(report_buf));
+
+	STRCMP_EQUAL("cmdtest1: argc=2, arg[0]=statu""\n", report_buf);
+}
+
+TEST(cmd3_prefix, exact_name__wins_over_longer_names)
+{
+	const char *argv[2] = { "show", "stat" };
+	char report_buf[256];
+
+	memset(report_buf, 0, sizeof(report_buf));
+	cmdtree_exec(2, argv, report_buf, sizeof(report_buf));
+
+	STRCMP_EQUAL("cmdtest1: argc=1, arg[0]=stat""\n", report_buf);
+}
+
+TEST(cmd3_prefix, ambiguous_prefix__candidates_reported_sorted)
+{
+	const char *argv[1] = { "sh" };
+	char report_buf[256];
+
+	char report_expected[256]  = "Ambiguous command: sh""\n"
+								 "show                  show info""\n"
+								 "shutdown              shutdown""\n";
+
+	memset(report_buf, 0, sizeof(report_buf));
+	cmdtree_exec(1, argv, report_buf, sizeof(report_buf));
+
+	STRCMP_EQUAL(report_expected, report_buf);
+
+	LONGS_EQUAL(CMD3_SUCCESS, cmdtree_freeze());
+
+	memset(report_buf, 0, sizeof(report_buf));
+	cmdtree_exec(1, argv, report_buf, sizeof(report_buf));
+
+	STRCMP_EQUAL(report_expected, report_buf);
+}
+
+TEST(cmd3_prefix, frozen_unique_prefix__cmd_executed)
+{
+	const char *argv[2] = { "sho", "statu" };
+	char report_buf[256];
+
+	LONGS_EQUAL(CMD3_SUCCESS, cmdtree_freeze());
+
+	memset(report_buf, 0, sizeof(report_buf));
+	cmdtree_exec(2, argv, report_buf, sizeof(report_buf));
+
+	STRCMP_EQUAL("cmdtest1: argc=1, arg[0]=statu""\n", report_buf);
+}
+
+TEST(cmd3_prefix, exact_match_context__prefix_not_matched)
+{
+	const char *argv[1] = { "shut" };
+	char report_buf[256];
+	cmd3_ctx_config_t config;
+	cmdtree_config_t cmd_config;
+	cmd3_ctx_d ctx;
+
+	memset(&config, 0, sizeof(config));
+	config.exact_match = 1;
+	ctx = cmd3_ctx_create(&config);
+
+	memset(&cmd_config, 0, sizeof(cmd_config));
+	cmd_config.name        = "shutdown";
+	cmd_config.comment     = "shutdown";
+	cmd_config.cmdfunc     = cmdtest1;
+	cmd_config.parent_name = CMDTREE_NO_PARENT;
+	cmdtree_create_ctx(ctx, &cmd_config);
+
+	memset(report_buf, 0, sizeof(report_buf));
+	cmdtree_exec_ctx(ctx, 1, argv, report_buf, sizeof(report_buf));
+
+	STRCMP_EQUAL("shutdown              shutdown""\n", report_buf);
+
+	cmd3_ctx_destroy(ctx);
+}
+
+TEST(cmd3_prefix, long_names_sharing_leading_bytes__matched)
+{
+	const char *argv_exact[1]     = { "interface" };
+	const char *argv_prefix[1]    = { "interface-ethernet2" };
+	const char *argv_ambiguous[1] = { "interface-eth" };
+	char report_buf[256];
+	int frozen;
+
+	new_cmdtree_create("interface-ethernet10", "eth 10",    cmdtest1, CMDTREE_NO_PARENT);
+	new_cmdtree_create("interface",            "interface", cmdtest1, CMDTREE_NO_PARENT);
+	new_cmdtree_create("interface-ethernet1",  "eth 1",     cmdtest1, CMDTREE_NO_PARENT);
+	new_cmdtree_create("interface-ethernet20", "eth 20",    cmdtest1, CMDTREE_NO_PARENT);
+
+	for(frozen = 0; frozen < 2; frozen++)
+	{
+		if(frozen)
+			LONGS_EQUAL(CMD3_SUCCESS, cmdtree_freeze());
+
+		memset(report_buf, 0, sizeof(report_buf));
+		cmdtree_exec(1, argv_exact, report_buf, sizeof(report_buf));
+		STRCMP_EQUAL("cmdtest1: argc=1, arg[0]=interface""\n", report_buf);
+
+		memset(report_buf, 0, sizeof(report_buf));
+		cmdtree_exec(1, argv_prefix, report_buf, sizeof(report_buf));
+		STRCMP_EQUAL("cmdtest1: argc=1, arg[0]=interface-ethernet2""\n", report_buf);
+
+		memset(report_buf, 0, sizeof(report_buf));
+		cmdtree_exec(1, argv_ambiguous, report_buf, sizeof(report_buf));
+		STRCMP_EQUAL("Ambiguous command: interface-eth""\n"
+					 "interface-ethernet1   eth 1""\n"
+					 "interface-ethernet10  eth 10""\n"
+					 "interface-ethernet20  eth 20""\n", report_buf);
+	}
+}
+
+TEST(cmd3_prefix, complete__level_names_with_prefix_reported)
+{
+	const char *argv_root[1]  = { "s" };
+	const char *argv_show[2]  = { "sho", "st" };
+	const char *argv_none[2]  = { "set", "" };
+	char completions[256];
+
+	memset(completions, 0, sizeof(completions));
+	LONGS_EQUAL(3, cmdtree_complete(1, argv_root, complete_collect, completions));
+	STRCMP_EQUAL("set show shutdown ", completions);
+
+	memset(completions, 0, sizeof(completions));
+	LONGS_EQUAL(3, cmdtree_complete(2, argv_show, complete_collect, completions));
+	STRCMP_EQUAL("stat stats status ", completions);
+
+	memset(completions, 0, sizeof(completions));
+	LONGS_EQUAL(0, cmdtree_complete(2, argv_none, complete_collect, completions));
+	STRCMP_EQUAL("", completions);
+}
+
+
+TEST_GROUP(cmd3_bulk)
+{
+    void setup()
+    {
+    	new_cmdtree_create("cmdtest1", "cmd test 1", cmdtest1, CMDTREE_NO_PARENT);
+    }
+
+    void teardown()
+    {
+    	cmdtree_teardown();
+    }
+};
+
+TEST(cmd3_bulk, create_bulk__parents_from_set_resolved_usage_in_creation_order)
+{
+	cmdtree_config_t bulk[4] = {
+		{ "cmdtest2",     "cmd test 2",     NULL,     CMDTREE_NO_PARENT,     NULL, NULL, 0, NULL, NULL, 0, 0 },
+		{ "cmdtest2.2",   "cmd test 2.2",   NULL,     "cmdtest2",            NULL, NULL, 0, NULL, NULL, 0, 0 },
+		{ "cmdtest2.1",   "cmd test 2.1",   NULL,     "cmdtest2",            NULL, NULL, 0, NULL, NULL, 0, 0 },
+		{ "cmdtest2.2.1", "cmd test 2.2.1", cmdtest1, "cmdtest2 cmdtest2.2", NULL, NULL, 0, NULL, NULL, 0, 0 },
+	};
+	const char *argv_root[1]  = { NULL };
+	const char *argv_level[1] = { "cmdtest2" };
+	const char *argv_cmd[3]   = { "cmdtest2", "cmdtest2.2", "cmdtest2.2.1" };
+	char report_buf[256];
+
+	LONGS_EQUAL(CMD3_SUCCESS, cmdtree_create_bulk(bulk, 4));
+
+	memset(report_buf, 0, sizeof(report_buf));
+	cmdtree_exec(0, argv_root, report_buf, sizeof(report_buf));
+	STRCMP_EQUAL("cmdtest1              cmd test 1""\n"
+				 "cmdtest2              cmd test 2""\n", report_buf);
+
+	memset(report_buf, 0, sizeof(report_buf));
+	cmdtree_exec(1, argv_level, report_buf, sizeof(report_buf));
+	STRCMP_EQUAL("cmdtest2.2            cmd test 2.2""\n"
+				 "cmdtest2.1            cmd test 2.1""\n", report_buf);
+
+	memset(report_buf, 0, sizeof(report_buf));
+	cmdtree_exec(3, argv_cmd, report_buf, sizeof(report_buf));
+	STRCMP_EQUAL("cmdtest1: argc=1, arg[0]=cmdtest2.2.1""\n", report_buf);
+}
+
+TEST(cmd3_bulk, unknown_parent__nothing_created)
+{
+	cmdtree_config_t bulk[3];
+	const char *argv_root[1] = { NULL };
+	char report_buf[256];
+
+	memset(bulk, 0, sizeof(bulk));
+	bulk[0].name = "cmdtest2";   bulk[0].comment = "cmd test 2";
+	bulk[1].name = "cmdtest2.1"; bulk[1].comment = "cmd test 2.1"; bulk[1].parent_name = "cmdtest2";
+	bulk[2].name = "cmdtest3.1"; bulk[2].comment = "cmd test 3.1"; bulk[2].parent_name = "cmdtest3";
+
+	LONGS_EQUAL(CMD3_FAIL, cmdtree_create_bulk(bulk, 3));
+
+	memset(report_buf, 0, sizeof(report_buf));
+	cmdtree_exec(0, argv_root, report_buf, sizeof(report_buf));
+	STRCMP_EQUAL("cmdtest1              cmd test 1""\n", report_buf);
+}
+
+TEST(cmd3_bulk, many_children__each_one_executed)
+{
+	enum { CHILDREN = 1000 };
+	static cmdtree_config_t bulk[CHILDREN + 1];
+	static char names[CHILDREN][16];
+	char report_buf[256];
+	char report_expected[256];
+	int i;
+
+	memset(bulk, 0, sizeof(bulk));
+	bulk[0].name    = "cmdtest2";
+	bulk[0].comment = "cmd test 2";
+	for(i = 0; i < CHILDREN; i++)
+	{
+		sprintf(names[i], "child%04d", (i * 7919) % CHILDREN);
+		bulk[i + 1].name        = names[i];
+		bulk[i + 1].comment     = "child";
+		bulk[i + 1].cmdfunc     = cmdtest1;
+		bulk[i + 1].parent_name = "cmdtest2";
+	}
+
+	LONGS_EQUAL(CMD3_SUCCESS, cmdtree_create_bulk(bulk, CHILDREN + 1));
+
+	for(i = 0; i < CHILDREN; i++)
+	{
+		const char *argv[2] = { "cmdtest2", names[i] };
+
+		memset(report_buf, 0, sizeof(report_buf));
+		cmdtree_exec(2, argv, report_buf, sizeof(report_buf));
+
+		sprintf(report_expected, "cmdtest1: argc=1, arg[0]=%.15s""\n", names[i]);
+		STRCMP_EQUAL(report_expected, report_buf);
+	}
+}
+
+
+static const char * const schema_modes[] = { "fast", "slow", "off", NULL };
+
+static const cmdtree_arg_schema_t schema_args[4] = {
+	{ "port", CMDTREE_ARG_INT,  0, 1, 65535, NULL },
+	{ "mode", CMDTREE_ARG_ENUM, 0, 0, 0,     schema_modes },
+	{ "peer", CMDTREE_ARG_IPV4, 1, 0, 0,     NULL },
+	{ "name", CMDTREE_ARG_STRING, 1, 0, 0,   NULL },
+};
+
+static int cmdtest_typed(void *user_data, const cmdtree_arg_t *args, int arg_count, char *buf, size_t buf_size)
+{
+	UNUSED(user_data);
+	UNUSED(buf_size);
+
+	if(!args[2].present)
+		return sprintf(buf, "cmdtest_typed: %d args, port=%lld, mode=%d""\n", arg_count, args[0].value.i, args[1].value.e);
+
+	return sprintf(buf, "cmdtest_typed: %d args, port=%lld, mode=%d, peer=%u.%u.%u.%u, name=%s""\n",
+				   arg_count, args[0].value.i, args[1].value.e,
+				   args[2].value.ipv4[0], args[2].value.ipv4[1], args[2].value.ipv4[2], args[2].value.ipv4[3],
+				   args[3].present ? args[3].str : "-");
+}
+
+TEST_GROUP(cmd3_schema)
+{
+    void setup()
+    {
+    	cmdtree_config_t config;
+
+    	new_cmdtree_create("port", "port cmds", NULL, CMDTREE_NO_PARENT);
+
+    	memset(&config, 0, sizeof(config));
+    	config.name          = "set";
+    	config.comment       = "set a port";
+    	config.parent_name   = "port";
+    	config.args          = schema_args;
+    	config.arg_count     = 4;
+    	config.cmdfunc_typed = cmdtest_typed;
+    	cmdtree_create(&config);
+    }
+
+    void teardown()
+    {
+    	cmdtree_teardown();
+    }
+};
+
+TEST(cmd3_schema, valid_args__parsed_before_dispatch)
+{
+	const char *argv_required[4] = { "port", "set", "0x50", "sl" };
+	const char *argv_all[6]      = { "port", "set", "8080", "off", "10.0.0.1", "eth0" };
+	char report_buf[256];
+	int frozen;
+
+	for(frozen = 0; frozen < 2; frozen++)
+	{
+		if(frozen)
+			LONGS_EQUAL(CMD3_SUCCESS, cmdtree_freeze());
+
+		memset(report_buf, 0, sizeof(report_buf));
+		cmdtree_exec(4, argv_required, report_buf, sizeof(report_buf));
+		STRCMP_EQUAL("cmdtest_typed: 4 args, port=80, mode=1""\n", report_buf);
+
+		memset(report_buf, 0, sizeof(report_buf));
+		cmdtree_exec(6, argv_all, report_buf, sizeof(report_buf));
+		STRCMP_EQUAL("cmdtest_typed: 4 args, port=8080, mode=2, peer=10.0.0.1, name=eth0""\n", report_buf);
+	}
+}
+
+TEST(cmd3_schema, invalid_args__reported_without_dispatch)
+{
+	const char *argv_range[4]     = { "port", "set", "70000", "fast" };
+	const char *argv_int[4]       = { "port", "set", "80x", "fast" };
+	const char *argv_enum[4]      = { "port", "set", "80", "on" };
+	const char *argv_ip[5]        = { "port", "set", "80", "fast", "10.0.0.256" };
+	const char *argv_missing[3]   = { "port", "set", "80" };
+	const char *argv_extra[7]     = { "port", "set", "80", "fast", "10.0.0.1", "eth0", "more" };
+	char report_buf[256];
+
+	memset(report_buf, 0, sizeof(report_buf));
+	cmdtree_exec(4, argv_range, report_buf, sizeof(report_buf));
+	STRCMP_EQUAL("Invalid argument port: 70000, expected 1..65535""\n", report_buf);
+
+	memset(report_buf, 0, sizeof(report_buf));
+	cmdtree_exec(4, argv_int, report_buf, sizeof(report_buf));
+	STRCMP_EQUAL("Invalid argument port: 80x, expected 1..65535""\n", report_buf);
+
+	memset(report_buf, 0, sizeof(report_buf));
+	cmdtree_exec(4, argv_enum, report_buf, sizeof(report_buf));
+	STRCMP_EQUAL("Invalid argument mode: on""\n", report_buf);
+
+	memset(report_buf, 0, sizeof(report_buf));
+	cmdtree_exec(5, argv_ip, report_buf, sizeof(report_buf));
+	STRCMP_EQUAL("Invalid argument peer: 10.0.0.256""\n", report_buf);
+
+	memset(report_buf, 0, sizeof(report_buf));
+	cmdtree_exec(3, argv_missing, report_buf, sizeof(report_buf));
+	STRCMP_EQUAL("Missing argument: mode""\n", report_buf);
+
+	memset(report_buf, 0, sizeof(report_buf));
+	cmdtree_exec(7, argv_extra, report_buf, sizeof(report_buf));
+	STRCMP_EQUAL("Unexpected argument: more""\n", report_buf);
+}
+
+TEST(cmd3_schema, invalid_schema__entry_not_created)
+{
+	const cmdtree_arg_schema_t args[2] = {
+		{ "peer", CMDTREE_ARG_IPV4, 1, 0, 0, NULL },
+		{ "port", CMDTREE_ARG_INT,  0, 0, 0, NULL },
+	};
+	cmdtree_config_t config;
+
+	memset(&config, 0, sizeof(config));
+	config.name          = "get";
+	config.comment       = "get a port";
+	config.parent_name   = "port";
+	config.args          = args;
+	config.arg_count     = 2;
+	config.cmdfunc_typed = cmdtest_typed;
+
+	POINTERS_EQUAL(NULL, cmdtree_create(&config));
+}
+
+TEST(cmd3_schema, complete__enum_values_reported)
+{
+	const char *argv_mode[4] = { "port", "set", "80", "" };
+	const char *argv_port[3] = { "port", "set", "8" };
+	char completions[256];
+
+	memset(completions, 0, sizeof(completions));
+	LONGS_EQUAL(3, cmdtree_complete(4, argv_mode, complete_collect, completions));
+	STRCMP_EQUAL("fast off slow ", completions);
+
+	memset(completions, 0, sizeof(completions));
+	LONGS_EQUAL(0, cmdtree_complete(3, argv_port, complete_collect, completions));
+	STRCMP_EQUAL("", completions);
+}
+
+
+struct sink_collect
+{
+	char 	data[1 << 20];
+	size_t 	len;
+	int 	writes;
+	int 	writevs;
+	int 	fail;
+};
+
+static struct sink_collect sink_data;
+
+static int sink_collect_write(void *arg, const char *data, size_t len)
+{
+	struct sink_collect *collect = (struct sink_collect *)arg;
+
+	if(collect->fail || collect->len + len > sizeof(collect->data))
+		return CMD3_FAIL;
+
+	memcpy(collect->data + collect->len, data, len);
+	collect->len += len;
+	collect->writes++;
+
+	return CMD3_SUCCESS;
+}
+
+static int sink_collect_writev(void *arg, const struct iovec *iov, int iovcnt)
+{
+	struct sink_collect *collect = (struct sink_collect *)arg;
+	int i;
+
+	for(i = 0; i < iovcnt; i++)
+	{
+		if(CMD3_SUCCESS != sink_collect_write(arg, (const char *)iov[i].iov_base, iov[i].iov_len))
+			return CMD3_FAIL;
+	}
+	collect->writevs++;
+
+	return CMD3_SUCCESS;
+}
+
+static char dump_block[100000];
+
+/* Output argv[1] lines, a large block after each 100 lines. */
+static int cmdtest_dump(void *user_data, int argc, const char **argv, cmdtree_out_d out)
+{
+	int lines = argc > 1 ? atoi(argv[1]) : 0;
+	int i;
+
+	UNUSED(user_data);
+
+	for(i = 0; i < lines; i++)
+	{
+		if(CMD3_SUCCESS != cmdtree_out_printf(out, "line %06d\n", i))
+			return CMD3_FAIL;
+
+		if(99 == i % 100 && CMD3_SUCCESS != cmdtree_out_write(out, dump_block, sizeof(dump_block)))
+			return CMD3_FAIL;
+	}
+
+	return CMD3_SUCCESS;
+}
+
+TEST_GROUP(cmd3_sink)
+{
+	cmdtree_sink_t sink;
+
+    void setup()
+    {
+    	cmdtree_config_t config;
+
+    	memset(&sink_data, 0, sizeof(sink_data));
+    	memset(dump_block, '.', sizeof(dump_block));
+    	dump_block[sizeof(dump_block) - 1] = '\n';
+
+    	sink.write  = sink_collect_write;
+    	sink.writev = sink_collect_writev;
+    	sink.arg    = &sink_data;
+
+    	new_cmdtree_create("cmdtest1", "cmd test 1", cmdtest1, CMDTREE_NO_PARENT);
+
+    	memset(&config, 0, sizeof(config));
+    	config.name        = "dump";
+    	config.comment     = "dump lines";
+    	config.cmdfunc_out = cmdtest_dump;
+    	cmdtree_create(&config);
+    }
+
+    void teardown()
+    {
+    	cmdtree_teardown();
+    }
+};
+
+TEST(cmd3_sink, large_output__streamed_whole)
+{
+	const char *argv[2] = { "dump", "500" };
+	char expected[32];
+	size_t pos = 0;
+	int i;
+
+	LONGS_EQUAL(CMD3_SUCCESS, cmdtree_exec_sink(2, argv, &sink));
+
+	LONGS_EQUAL(500 * 12 + 5 * sizeof(dump_block), sink_data.len);
+	CHECK(sink_data.writevs >= 5);
+
+	for(i = 0; i < 500; i++)
+	{
+		sprintf(expected, "line %06d\n", i);
+		CHECK(0 == memcmp(sink_data.data + pos, expected, 12));
+		pos += 12;
+		if(99 == i % 100)
+			pos += sizeof(dump_block);
+	}
+}
+
+TEST(cmd3_sink, no_writev__streamed_with_write)
+{
+	const char *argv[2] = { "dump", "200" };
+
+	sink.writev = NULL;
+
+	LONGS_EQUAL(CMD3_SUCCESS, cmdtree_exec_sink(2, argv, &sink));
+
+	LONGS_EQUAL(200 * 12 + 2 * sizeof(dump_block), sink_data.len);
+	LONGS_EQUAL(0, sink_data.writevs);
+}
+
+TEST(cmd3_sink, buffer_exec__output_truncated)
+{
+	const char *argv[2] = { "dump", "100" };
+	char report_buf[64];
+
+	memset(report_buf, 'x', sizeof(report_buf));
+	cmdtree_exec(2, argv, report_buf, sizeof(report_buf));
+
+	STRCMP_EQUAL("line 000000\nline 000001\nline 000002\nline 000003\nline 000004\nlin", report_buf);
+}
+
+TEST(cmd3_sink, buffer_cmd_and_reports__streamed)
+{
+	const char *argv_cmd[1]  = { "cmdtest1" };
+	const char *argv_none[1] = { "none" };
+
+	LONGS_EQUAL(CMD3_SUCCESS, cmdtree_exec_sink(1, argv_cmd, &sink));
+	LONGS_EQUAL(CMD3_SUCCESS, cmdtree_exec_sink(0, argv_none, &sink));
+	LONGS_EQUAL(CMD3_SUCCESS, cmdtree_exec_sink(1, argv_none, &sink));
+	sink_data.data[sink_data.len] = '\0';
+
+	STRCMP_EQUAL("cmdtest1: argc=1, arg[0]=cmdtest1""\n"
+				 "cmdtest1              cmd test 1""\n"
+				 "dump                  dump lines""\n"
+				 "cmdtest1              cmd test 1""\n"
+				 "dump                  dump lines""\n", sink_data.data);
+}
+
+TEST(cmd3_sink, sink_failure__reported)
+{
+	const char *argv[2] = { "dump", "1000" };
+
+	sink_data.fail = 1;
+
+	LONGS_EQUAL(CMD3_FAIL, cmdtree_exec_sink(2, argv, &sink));
+	LONGS_EQUAL(0, sink_data.len);
+}
+
+
+static size_t chain_collect(cmdtree_chain_d chain, char *data)
+{
+	struct iovec iov[8];
+	size_t len = 0;
+	int count;
+	int i;
+
+	while((count = cmdtree_chain_iov(chain, iov, 8)) > 0)
+	{
+		size_t chunk_len = 0;
+
+		for(i = 0; i < count; i++)
+		{
+			memcpy(data + len + chunk_len, iov[i].iov_base, iov[i].iov_len);
+			chunk_len += iov[i].iov_len;
+		}
+
+		/* Consume in two steps, splitting a fragment. */
+		cmdtree_chain_consume(chain, chunk_len / 2);
+		cmdtree_chain_consume(chain, chunk_len - chunk_len / 2);
+		len += chunk_len;
+	}
+
+	return len;
+}
+
+TEST(cmd3_sink, chain__output_held_in_chunks)
+{
+	const char *argv_dump[2] = { "dump", "300" };
+	const char *argv_cmd[1]  = { "cmdtest1" };
+	cmdtree_chain_d chain;
+	size_t len;
+
+	chain = cmdtree_chain_create(1000);
+	CHECK(NULL != chain);
+
+	LONGS_EQUAL(CMD3_SUCCESS, cmdtree_exec_chain(2, argv_dump, chain));
+	LONGS_EQUAL(300 * 12 + 3 * sizeof(dump_block), cmdtree_chain_len(chain));
+
+	len = chain_collect(chain, sink_data.data);
+	LONGS_EQUAL(300 * 12 + 3 * sizeof(dump_block), len);
+	CHECK(0 == memcmp(sink_data.data, "line 000000\nline 000001\n", 24));
+	CHECK(0 == memcmp(sink_data.data + 100 * 12, dump_block, sizeof(dump_block)));
+	CHECK(0 == memcmp(sink_data.data + len - sizeof(dump_block) - 12, "line 000299\n", 12));
+	LONGS_EQUAL(0, cmdtree_chain_len(chain));
+
+	/* The chunks are reused by the following cmds. */
+	LONGS_EQUAL(CMD3_SUCCESS, cmdtree_exec_chain(1, argv_cmd, chain));
+	LONGS_EQUAL(CMD3_SUCCESS, cmdtree_exec_chain(0, argv_cmd, chain));
+	len = chain_collect(chain, sink_data.data);
+	sink_data.data[len] = '\0';
+
+	STRCMP_EQUAL("cmdtest1: argc=1, arg[0]=cmdtest1""\n"
+				 "cmdtest1              cmd test 1""\n"
+				 "dump                  dump lines""\n", sink_data.data);
+
+	cmdtree_chain_destroy(chain);
+}
+
+TEST(cmd3_sink, chain_flush__whole_output_written)
+{
+	const char *argv[2] = { "dump", "250" };
+	cmdtree_chain_d chain;
+	FILE *file;
+
+	chain = cmdtree_chain_create(0);
+	file  = tmpfile();
+	CHECK(NULL != file);
+
+	LONGS_EQUAL(CMD3_SUCCESS, cmdtree_exec_chain(2, argv, chain));
+	LONGS_EQUAL(CMD3_SUCCESS, cmdtree_chain_flush(chain, fileno(file)));
+	LONGS_EQUAL(0, cmdtree_chain_len(chain));
+
+	rewind(file);
+	LONGS_EQUAL(250 * 12 + 2 * sizeof(dump_block), fread(sink_data.data, 1, sizeof(sink_data.data), file));
+	CHECK(0 == memcmp(sink_data.data + 200 * 12 + sizeof(dump_block), dump_block, sizeof(dump_block)));
+
+	fclose(file);
+	cmdtree_chain_destroy(chain);
+}
+
+
+TEST(cmd3_sink, batch__comment_quote_and_backslash_end_at_newline)
+{
+	const char script[] = "cmdtest1 a\n"
+						  "# don't run this\n"
+						  "\t# a trailing backslash \\\n"
+						  "cmdtest1 b c\n";
+	cmdtree_batch_result_t results[4];
+
+	LONGS_EQUAL(2, cmdtree_exec_batch(script, strlen(script), 0, &sink, results, 4));
+	sink_data.data[sink_data.len] = '\0';
+
+	STRCMP_EQUAL("cmdtest1: argc=2, arg[0]=cmdtest1""\n"
+				 "cmdtest1: argc=3, arg[0]=cmdtest1""\n", sink_data.data);
+	LONGS_EQUAL(CMD3_SUCCESS, results[0].status);
+	LONGS_EQUAL(CMD3_SUCCESS, results[1].status);
+}
+
+TEST(cmd3_sink, batch__results_locate_each_cmd_output)
+{
+	const char script[] = "cmdtest1 a\n"
+						  "\n"
+						  "# comment\n"
+						  "  dump 2\n"
+						  "none\n"
+						  "cmdtest1 'b\nc'";
+	cmdtree_batch_result_t results[8];
+
+	LONGS_EQUAL(4, cmdtree_exec_batch(script, strlen(script), 0, &sink, results, 8));
+	sink_data.data[sink_data.len] = '\0';
+
+	STRCMP_EQUAL("cmdtest1: argc=2, arg[0]=cmdtest1""\n"
+				 "line 000000\nline 000001\n"
+				 "cmdtest1              cmd test 1""\n"
+				 "dump                  dump lines""\n"
+				 "cmdtest1: argc=2, arg[0]=cmdtest1""\n", sink_data.data);
+
+	LONGS_EQUAL(CMD3_SUCCESS, results[0].status);
+	LONGS_EQUAL(CMD3_SUCCESS, results[1].status);
+	LONGS_EQUAL(CMD3_FAIL,    results[2].status);
+	LONGS_EQUAL(CMD3_SUCCESS, results[3].status);
+
+	LONGS_EQUAL(0,  results[0].offset);
+	LONGS_EQUAL(34, results[0].len);
+	LONGS_EQUAL(34, results[1].offset);
+	LONGS_EQUAL(24, results[1].len);
+	LONGS_EQUAL(58, results[2].offset);
+	LONGS_EQUAL(sink_data.len, results[3].offset + results[3].len);
+}
+
+TEST(cmd3_sink, batch_stop_on_fail__later_cmds_not_run)
+{
+	const char script[] = "cmdtest1\nnone\ncmdtest1\n";
+	const char *argv_ok[1]   = { "cmdtest1" };
+	const char *argv_fail[1] = { "none" };
+	cmdtree_cmdline_t cmds[3] = { { 1, argv_ok }, { 1, argv_fail }, { 1, argv_ok } };
+	cmdtree_batch_result_t results[3];
+
+	LONGS_EQUAL(3, cmdtree_exec_batch(script, strlen(script), 0, &sink, NULL, 0));
+	LONGS_EQUAL(2, cmdtree_exec_batch(script, strlen(script), CMDTREE_BATCH_STOP_ON_FAIL, &sink, NULL, 0));
+
+	LONGS_EQUAL(2, cmdtree_exec_batch_argv(cmds, 3, CMDTREE_BATCH_STOP_ON_FAIL, &sink, results));
+	LONGS_EQUAL(CMD3_SUCCESS, results[0].status);
+	LONGS_EQUAL(CMD3_FAIL,    results[1].status);
+}
+
+TEST(cmd3_sink, batch_unterminated_quote__reported_as_failed)
+{
+	const char script[] = "cmdtest1\ncmdtest1 'open\nmore";
+	cmdtree_batch_result_t results[2];
+
+	LONGS_EQUAL(2, cmdtree_exec_batch(script, strlen(script), 0, &sink, results, 2));
+	sink_data.data[sink_data.len] = '\0';
+
+	LONGS_EQUAL(CMD3_FAIL, results[1].status);
+	STRCMP_EQUAL("Unterminated quote: cmdtest1 'open\nmore""\n", sink_data.data + results[1].offset);
+}
+
+TEST(cmd3_sink, batch_trailing_backslash__reported_as_unterminated_continuation)
+{
+	const char script[] = "cmdtest1\ncmdtest1 a \\";
+	cmdtree_batch_result_t results[2];
+
+	LONGS_EQUAL(2, cmdtree_exec_batch(script, strlen(script), 0, &sink, results, 2));
+	sink_data.data[sink_data.len] = '\0';
+
+	LONGS_EQUAL(CMD3_FAIL, results[1].status);
+	STRCMP_EQUAL("Unterminated escape/continuation: cmdtest1 a \\""\n", sink_data.data + results[1].offset);
+}
+
+static int cmdtest_echo(int argc, const char **argv, char *buf, size_t buf_size)
+{
+	return snprintf(buf, buf_size, "%d [%s] [%s]\n", argc, argv[1], argv[argc - 1]);
+}
+
+TEST(cmd3_sink, batch_cmd_continued_over_many_lines__tokens_kept_across_lines)
+{
+	char script[2048];
+	char expected[1024];
+	size_t len = 0;
+	size_t quoted = 0;
+	char quoted_arg[512];
+	int i;
+
+	new_cmdtree_create("echo", "echo args", cmdtest_echo, CMDTREE_NO_PARENT);
+
+	/* A quoted token over many lines, then many lines joined by a trailing backslash. */
+	len += sprintf(script + len, "echo 'l0");
+	quoted += sprintf(quoted_arg + quoted, "l0");
+	for(i = 1; i < 40; i++)
+	{
+		len += sprintf(script + len, "\nl%d", i);
+		quoted += sprintf(quoted_arg + quoted, "\nl%d", i);
+	}
+	len += sprintf(script + len, "' \\\n");
+	for(i = 0; i < 50; i++)
+		len += sprintf(script + len, "x%d \\\n", i);
+	len += sprintf(script + len, "y\ncmdtest1");
+
+	LONGS_EQUAL(2, cmdtree_exec_batch(script, len, 0, &sink, NULL, 0));
+	sink_data.data[sink_data.len] = '\0';
+
+	sprintf(expected, "53 [%s] [y]\n" "cmdtest1: argc=1, arg[0]=cmdtest1""\n", quoted_arg);
+	STRCMP_EQUAL(expected, sink_data.data);
+}
+
+static int line_independent(const char *line)
+{
+	cmdtree_token_t tokens[CMD_TREE_MAX_DEPTH];
+	int token_count;
+
+	token_count = cmdtree_tokenize(line, strlen(line), tokens, CMD_TREE_MAX_DEPTH);
+
+	return cmdtree_tokens_independent(token_count, tokens);
+}
+
+TEST(cmd3_sink, independent__resolved_as_exec_would)
+{
+	cmdtree_config_t config;
+
+	memset(&config, 0, sizeof(config));
+	config.name        = "show";
+	config.comment     = "show state";
+	config.cmdfunc     = cmdtest1;
+	config.independent = 1;
+	cmdtree_create(&config);
+
+	LONGS_EQUAL(1, line_independent("show"));
+	LONGS_EQUAL(1, line_independent("show a b"));
+	LONGS_EQUAL(0, line_independent("cmdtest1 a"));
+	LONGS_EQUAL(0, line_independent("none"));
+	LONGS_EQUAL(0, line_independent(""));
+
+	LONGS_EQUAL(CMD3_SUCCESS, cmdtree_freeze());
+	LONGS_EQUAL(1, line_independent("show a"));
+	LONGS_EQUAL(0, line_independent("dump"));
+	cmdtree_thaw();
+}
+
+// Async cmds gate, the gated cmd blocks until it is opened
+static struct
+{
+	pthread_mutex_t lock;
+	pthread_cond_t 	cond;
+	int 			started;
+	int 			open;
+	int 			done;
+	int 			failed;
+} async_gate = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, 0, 0 };
+
+static int cmdtest_gated(int argc, const char **argv, char *buf, size_t buf_size)
+{
+	pthread_mutex_lock(&async_gate.lock);
+	async_gate.started++;
+	pthread_cond_broadcast(&async_gate.cond);
+	while(!async_gate.open)
+		pthread_cond_wait(&async_gate.cond, &async_gate.lock);
+	pthread_mutex_unlock(&async_gate.lock);
+
+	return snprintf(buf, buf_size, "%s %s\n", argv[0], argc > 1 ? argv[1] : "");
+}
+
+static void async_done(void *arg, int status)
+{
+	pthread_mutex_lock(&async_gate.lock);
+	async_gate.done++;
+	if(CMD3_SUCCESS != status)
+		async_gate.failed++;
+	*(int *)arg = status;
+	pthread_mutex_unlock(&async_gate.lock);
+}
+
+static void async_gate_reset(void)
+{
+	async_gate.started = 0;
+	async_gate.open    = 0;
+	async_gate.done    = 0;
+	async_gate.failed  = 0;
+}
+
+TEST(cmd3_sink, async_fast_cmds__run_inline)
+{
+	const char *argv[2] = { "cmdtest1", "a" };
+	const char *none[1] = { "none" };
+	cmdtree_pool_d pool = cmdtree_pool_create(1, 1);
+	int status = CMD3_INCOMPLETE;
+
+	CHECK(pool);
+	async_gate_reset();
+
+	LONGS_EQUAL(CMD3_SUCCESS, cmdtree_exec_async(pool, 2, argv, &sink, async_done, &status));
+	LONGS_EQUAL(CMD3_SUCCESS, status);
+	LONGS_EQUAL(1, async_gate.done);
+
+	LONGS_EQUAL(CMD3_SUCCESS, cmdtree_exec_async(pool, 1, none, &sink, async_done, &status));
+	LONGS_EQUAL(CMD3_FAIL, status);
+	LONGS_EQUAL(2, async_gate.done);
+
+	sink_data.data[sink_data.len] = '\0';
+	STRCMP_EQUAL("cmdtest1: argc=2, arg[0]=cmdtest1\n"
+				 "cmdtest1              cmd test 1\n"
+				 "dump                  dump lines\n", sink_data.data);
+
+	cmdtree_pool_destroy(pool);
+}
+
+TEST(cmd3_sink, async_cmds__queued_and_drained_on_destroy)
+{
+	const char *argv1[2] = { "slow", "1" };
+	const char *argv3[2] = { "slow", "3" };
+	cmdtree_pool_d pool = cmdtree_pool_create(1, 1);
+	cmdtree_config_t config;
+	cmdtree_token_t tokens[2];
+	char line[] = "slow 2";
+	int status1 = CMD3_INCOMPLETE;
+	int status2 = CMD3_INCOMPLETE;
+	int status3 = CMD3_INCOMPLETE;
+
+	CHECK(pool);
+	async_gate_reset();
+
+	memset(&config, 0, sizeof(config));
+	config.name    = "slow";
+	config.comment = "slow cmd";
+	config.cmdfunc = cmdtest_gated;
+	config.async   = 1;
+	cmdtree_create(&config);
+
+	/* The worker blocks on the first cmd, the second fills the queue. */
+	LONGS_EQUAL(CMD3_INCOMPLETE, cmdtree_exec_async(pool, 2, argv1, &sink, async_done, &status1));
+
+	pthread_mutex_lock(&async_gate.lock);
+	while(0 == async_gate.started)
+		pthread_cond_wait(&async_gate.cond, &async_gate.lock);
+	pthread_mutex_unlock(&async_gate.lock);
+
+	/* The queued cmd holds a copy of its arguments. */
+	LONGS_EQUAL(2, cmdtree_tokenize(line, strlen(line), tokens, 2));
+	LONGS_EQUAL(CMD3_INCOMPLETE, cmdtree_exec_tokens_async(pool, 2, tokens, &sink, async_done, &status2));
+	memset(line, 'x', strlen(line));
+
+	LONGS_EQUAL(CMD3_FAIL,       cmdtree_exec_async(pool, 2, argv3, &sink, async_done, &status3));
+
+	pthread_mutex_lock(&async_gate.lock);
+	async_gate.open = 1;
+	pthread_cond_broadcast(&async_gate.cond);
+	pthread_mutex_unlock(&async_gate.lock);
+
+	cmdtree_pool_destroy(pool);
+
+	LONGS_EQUAL(2, async_gate.done);
+	LONGS_EQUAL(0, async_gate.failed);
+	LONGS_EQUAL(CMD3_SUCCESS, status1);
+	LONGS_EQUAL(CMD3_SUCCESS, status2);
+	LONGS_EQUAL(CMD3_INCOMPLETE, status3);
+
+	sink_data.data[sink_data.len] = '\0';
+	STRCMP_EQUAL("slow 1\nslow 2\n", sink_data.data);
+}
+
+// The thread a done callback runs on
+static void async_done_thread(void *arg, int status)
+{
+	UNUSED(status);
+	*(pthread_t *)arg = pthread_self();
+}
+
+TEST(cmd3_sink, async_done_cb__inline_or_on_worker)
+{
+	const char *fast[2] = { "cmdtest1", "a" };
+	const char *slow[2] = { "slow", "1" };
+	cmdtree_pool_d pool = cmdtree_pool_create(1, 1);
+	cmdtree_config_t config;
+	pthread_t inline_thread;
+	pthread_t worker_thread;
+
+	CHECK(pool);
+	async_gate_reset();
+	async_gate.open = 1;
+
+	memset(&config, 0, sizeof(config));
+	config.name    = "slow";
+	config.comment = "slow cmd";
+	config.cmdfunc = cmdtest_gated;
+	config.async   = 1;
+	cmdtree_create(&config);
+
+	LONGS_EQUAL(CMD3_SUCCESS, cmdtree_exec_async(pool, 2, fast, &sink, async_done_thread, &inline_thread));
+	CHECK(pthread_equal(pthread_self(), inline_thread));
+
+	LONGS_EQUAL(CMD3_INCOMPLETE, cmdtree_exec_async(pool, 2, slow, &sink, async_done_thread, &worker_thread));
+	LONGS_EQUAL(CMD3_SUCCESS, cmdtree_pool_destroy(pool));
+	CHECK(!pthread_equal(pthread_self(), worker_thread));
+}
+
+// A done callback destroying the pool running it
+static struct
+{
+	cmdtree_pool_d pool;
+	int 		   status;
+} async_self = { NULL, CMD3_INCOMPLETE };
+
+static void async_done_destroy(void *arg, int status)
+{
+	(void)arg;
+	(void)status;
+	async_self.status = cmdtree_pool_destroy(async_self.pool);
+}
+
+TEST(cmd3_sink, async_done_cb__fails_destroying_its_pool)
+{
+	const char *argv[2] = { "slow", "1" };
+	cmdtree_config_t config;
+
+	async_self.pool   = cmdtree_pool_create(1, 1);
+	async_self.status = CMD3_INCOMPLETE;
+	CHECK(async_self.pool);
+	async_gate_reset();
+	async_gate.open = 1;
+
+	memset(&config, 0, sizeof(config));
+	config.name    = "slow";
+	config.comment = "slow cmd";
+	config.cmdfunc = cmdtest_gated;
+	config.async   = 1;
+	cmdtree_create(&config);
+
+	LONGS_EQUAL(CMD3_INCOMPLETE, cmdtree_exec_async(async_self.pool, 2, argv, &sink, async_done_destroy, NULL));
+
+	/* The teardown waits for the cmd, the pool is still there. */
+	cmdtree_teardown();
+	LONGS_EQUAL(CMD3_FAIL, async_self.status);
+	LONGS_EQUAL(CMD3_SUCCESS, cmdtree_pool_destroy(async_self.pool));
+}
+
+static void *async_teardown(void *arg)
+{
+	cmdtree_teardown();
+	*(volatile int *)arg = 1;
+	return NULL;
+}
+
+TEST(cmd3_sink, async_cmds__waited_for_by_teardown)
+{
+	const char *argv[2] = { "slow", "1" };
+	cmdtree_pool_d pool = cmdtree_pool_create(1, 1);
+	cmdtree_config_t config;
+	volatile int torn = 0;
+	int status = CMD3_INCOMPLETE;
+	pthread_t thread;
+
+	CHECK(pool);
+	async_gate_reset();
+
+	memset(&config, 0, sizeof(config));
+	config.name    = "slow";
+	config.comment = "slow cmd";
+	config.cmdfunc = cmdtest_gated;
+	config.async   = 1;
+	cmdtree_create(&config);
+
+	LONGS_EQUAL(CMD3_INCOMPLETE, cmdtree_exec_async(pool, 2, argv, &sink, async_done, &status));
+
+	pthread_mutex_lock(&async_gate.lock);
+	while(0 == async_gate.started)
+		pthread_cond_wait(&async_gate.cond, &async_gate.lock);
+	pthread_mutex_unlock(&async_gate.lock);
+
+	LONGS_EQUAL(0, pthread_create(&thread, NULL, async_teardown, (void *)&torn));
+	usleep(10000);
+	LONGS_EQUAL(0, torn);
+
+	pthread_mutex_lock(&async_gate.lock);
+	async_gate.open = 1;
+	pthread_cond_broadcast(&async_gate.cond);
+	pthread_mutex_unlock(&async_gate.lock);
+
+	pthread_join(thread, NULL);
+	LONGS_EQUAL(1, torn);
+	LONGS_EQUAL(1, async_gate.done);
+	LONGS_EQUAL(CMD3_SUCCESS, status);
+
+	LONGS_EQUAL(CMD3_SUCCESS, cmdtree_pool_destroy(pool));
+
+	sink_data.data[sink_data.len] = '\0';
+	STRCMP_EQUAL("slow 1\n", sink_data.data);
+}
+
+/* Run a batch serially, then on an executor, both outputs and outcomes must be the same. */
+static void parallel_check(cmdtree_executor_d executor, const char *script, const cmdtree_cmdline_t *cmds,
+						   size_t cmd_count, int flags, int expected_count)
+{
+	static cmdtree_batch_result_t serial_results[1000];
+	static cmdtree_batch_result_t results[1000];
+	static char serial[1 << 16];
+	cmdtree_sink_t sink;
+	size_t serial_len;
+	int i;
+
+	sink.write  = sink_collect_write;
+	sink.writev = sink_collect_writev;
+	sink.arg    = &sink_data;
+
+	memset(&sink_data, 0, sizeof(sink_data));
+	if(script)
+		LONGS_EQUAL(expected_count, cmdtree_exec_batch(script, strlen(script), flags, &sink, serial_results, 1000));
+	else
+		LONGS_EQUAL(expected_count, cmdtree_exec_batch_argv(cmds, cmd_count, flags, &sink, serial_results));
+	memcpy(serial, sink_data.data, sink_data.len);
+	serial_len = sink_data.len;
+
+	memset(&sink_data, 0, sizeof(sink_data));
+	if(script)
+		LONGS_EQUAL(expected_count, cmdtree_exec_batch_parallel(executor, script, strlen(script), flags, &sink, results, 1000));
+	else
+		LONGS_EQUAL(expected_count, cmdtree_exec_batch_argv_parallel(executor, cmds, cmd_count, flags, &sink, results));
+
+	LONGS_EQUAL(serial_len, sink_data.len);
+	CHECK(0 == memcmp(serial, sink_data.data, serial_len));
+
+	for(i = 0; i < expected_count; i++)
+	{
+		LONGS_EQUAL(serial_results[i].status, results[i].status);
+		LONGS_EQUAL(serial_results[i].offset, results[i].offset);
+		LONGS_EQUAL(serial_results[i].len,    results[i].len);
+	}
+}
+
+static void show_create(void)
+{
+	cmdtree_config_t config;
+
+	memset(&config, 0, sizeof(config));
+	config.name        = "show";
+	config.comment     = "show state";
+	config.cmdfunc     = cmdtest_last;
+	config.independent = 1;
+	cmdtree_create(&config);
+}
+
+TEST(cmd3_sink, parallel_argv__output_as_serial)
+{
+	static char args[600][2][16];
+	static const char *argv[600][2];
+	static cmdtree_cmdline_t cmds[600];
+	cmdtree_executor_d executor = cmdtree_executor_create(3);
+	int i;
+
+	CHECK(executor);
+	show_create();
+
+	/* Independent runs, split by dependent and failing cmds. */
+	for(i = 0; i < 600; i++)
+	{
+		sprintf(args[i][0], "%s", 0 == i % 97 ? "cmdtest1" : (0 == i % 151 ? "none" : "show"));
+		sprintf(args[i][1], "port%d", i);
+		argv[i][0]   = args[i][0];
+		argv[i][1]   = args[i][1];
+		cmds[i].argc = 2;
+		cmds[i].argv = argv[i];
+	}
+
+	parallel_check(executor, NULL, cmds, 600, 0, 600);
+	parallel_check(executor, NULL, cmds, 600, CMDTREE_BATCH_STOP_ON_FAIL, 152);
+	parallel_check(executor, NULL, cmds, 1, 0, 1);
+
+	cmdtree_executor_destroy(executor);
+}
+
+TEST(cmd3_sink, parallel_script__output_as_serial)
+{
+	static char script[1 << 15];
+	cmdtree_executor_d executor = cmdtree_executor_create(2);
+	size_t len = 0;
+	int i;
+
+	CHECK(executor);
+	show_create();
+
+	for(i = 0; i < 500; i++)
+	{
+		if(0 == i % 50)
+			len += sprintf(script + len, "cmdtest1 %d\n# comment\n\n", i);
+		else if(0 == i % 70)
+			len += sprintf(script + len, "show \"port\n%d\"\n", i);
+		else if(i == 333)
+			len += sprintf(script + len, "dump x y\n");
+		else
+			len += sprintf(script + len, "show port%d\n", i);
+	}
+
+	parallel_check(executor, script, NULL, 0, 0, 500);
+	parallel_check(executor, script, NULL, 0, CMDTREE_BATCH_STOP_ON_FAIL, 334);
+
+	/* An unterminated quote ends the batch, past the independent cmds preceding it. */
+	strcpy(script + len, "show \"port\n");
+	parallel_check(executor, script, NULL, 0, 0, 501);
+
+	cmdtree_executor_destroy(executor);
+}
+
+
+TEST(cmd3_sink, parallel_script__comment_quote_and_backslash_end_at_newline)
+{
+	const char script[] = "show port1\n"
+						  "# don't run this\n"
+						  "\t# a trailing backslash \\\n"
+						  "show port2\n"
+						  "cmdtest1 a\n"
+						  "# it's\n"
+						  "show port3\n";
+	cmdtree_executor_d executor = cmdtree_executor_create(2);
+
+	CHECK(executor);
+	show_create();
+
+	parallel_check(executor, script, NULL, 0, 0, 4);
+
+	sink_data.data[sink_data.len] = '\0';
+	STRCMP_EQUAL("cmdtest_last: argc=2, arg[1]=port1""\n"
+				 "cmdtest_last: argc=2, arg[1]=port2""\n"
+				 "cmdtest1: argc=2, arg[0]=cmdtest1""\n"
+				 "cmdtest_last: argc=2, arg[1]=port3""\n", sink_data.data);
+
+	cmdtree_executor_destroy(executor);
+}
+
+/* Output the cmd arguments, space separated. */
+static int cmdtest_args(void *user_data, int argc, const char **argv, cmdtree_out_d out)
+{
+	int i;
+
+	UNUSED(user_data);
+
+	for(i = 0; i < argc; i++)
+		cmdtree_out_printf(out, "%s%s", i ? " " : "", argv[i]);
+
+	return cmdtree_out_printf(out, "\n") == CMD3_SUCCESS ? 1 : 0;
+}
+
+static void broadcast_create(const char *name, const char *parent, int independent)
+{
+	cmdtree_config_t config;
+
+	memset(&config, 0, sizeof(config));
+	config.name        = name;
+	config.comment     = name;
+	config.cmdfunc_out = cmdtest_args;
+	config.parent_name = parent;
+	config.independent = independent;
+	cmdtree_create(&config);
+}
+
+TEST_GROUP(cmd3_broadcast)
+{
+	cmdtree_sink_t sink;
+
+    void setup()
+    {
+    	memset(&sink_data, 0, sizeof(sink_data));
+    	sink.write  = sink_collect_write;
+    	sink.writev = sink_collect_writev;
+    	sink.arg    = &sink_data;
+
+    	/* Ports with counters, but for the last one, and links which are cmds themselves. */
+    	new_cmdtree_create("port", "ports", NULL, CMDTREE_NO_PARENT);
+    	new_cmdtree_create("eth1", "eth1", NULL, "port");
+    	new_cmdtree_create("eth0", "eth0", NULL, "port");
+    	new_cmdtree_create("eth2", "eth2", NULL, "port");
+    	broadcast_create("counters", "port eth1", 1);
+    	broadcast_create("counters", "port eth0", 1);
+
+    	new_cmdtree_create("link", "links", NULL, CMDTREE_NO_PARENT);
+    	broadcast_create("b", "link", 0);
+    	broadcast_create("a", "link", 0);
+    }
+
+    void teardown()
+    {
+    	cmdtree_teardown();
+    }
+
+    const char *exec(const char *line)
+    {
+    	cmdtree_token_t tokens[CMD_TREE_MAX_DEPTH];
+    	int token_count = cmdtree_tokenize(line, strlen(line), tokens, CMD_TREE_MAX_DEPTH);
+
+    	sink_data.len = 0;
+    	LONGS_EQUAL(CMD3_SUCCESS, cmdtree_exec_tokens_sink(token_count, tokens, &sink));
+    	sink_data.data[sink_data.len] = '\0';
+
+    	return sink_data.data;
+    }
+};
+
+TEST(cmd3_broadcast, children_in_name_order__outputs_with_headers)
+{
+	char buf[256];
+	const char *argv[4] = { "port", "*", "counters", "-v" };
+
+	STRCMP_EQUAL("port eth0:\ncounters\nport eth1:\ncounters\n", exec("port * counters"));
+	STRCMP_EQUAL("port eth0:\ncou -v\nport eth1:\ncou -v\n", exec("po * cou -v"));
+
+	cmdtree_exec(4, argv, buf, sizeof(buf));
+	STRCMP_EQUAL("port eth0:\ncounters -v\nport eth1:\ncounters -v\n", buf);
+}
+
+TEST(cmd3_broadcast, wildcard_cmd__given_child_name)
+{
+	const char *argv[3] = { "link", "*", "up" };
+	char buf[256];
+
+	STRCMP_EQUAL("link a:\na up\nlink b:\nb up\n", exec("link * up"));
+
+	cmdtree_exec(3, argv, buf, sizeof(buf));
+	STRCMP_EQUAL("link a:\na up\nlink b:\nb up\n", buf);
+}
+
+TEST(cmd3_broadcast, no_match__reported)
+{
+	STRCMP_EQUAL("Missing parameter or unsupported command.\n", exec("port * none"));
+	STRCMP_EQUAL("Missing parameter or unsupported command.\n", exec("port * eth0"));
+}
+
+TEST(cmd3_broadcast, long_cmd_line_or_failed_cmd__reported_under_header)
+{
+	const char *argv[CMD_TREE_MAX_DEPTH + 8];
+	char buf[1024];
+	char expected[1024];
+	size_t len = 0;
+	int i;
+	int j;
+
+	argv[0] = "link";
+	argv[1] = "*";
+	for(i = 2; i < CMD_TREE_MAX_DEPTH + 8; i++)
+		argv[i] = "up";
+
+	/* The wildcard cmds are given the child name past the depth limit as well. */
+	for(i = 0; i < 2; i++)
+	{
+		len += sprintf(expected + len, "link %s:\n%s", i ? "b" : "a", i ? "b" : "a");
+		for(j = 2; j < CMD_TREE_MAX_DEPTH + 8; j++)
+			len += sprintf(expected + len, " up");
+		len += sprintf(expected + len, "\n");
+	}
+
+	cmdtree_exec(CMD_TREE_MAX_DEPTH + 8, argv, buf, sizeof(buf));
+	STRCMP_EQUAL(expected, buf);
+
+	new_cmdtree_create("c", "c", cmdtest2, "link");
+	STRCMP_EQUAL("link a:\na up\nlink b:\nb up\nlink c:\nMissing parameter or unsupported command.\n", exec("link * up"));
+}
+
+TEST(cmd3_broadcast, junction_with_cmd_or_star_child__not_broadcast)
+{
+	int frozen;
+
+	/* A junction running a cmd of its own, and a level with a child named "*". */
+	broadcast_create("kill", CMDTREE_NO_PARENT, 0);
+	broadcast_create("all", "kill", 0);
+	new_cmdtree_create("vlan", "vlans", NULL, CMDTREE_NO_PARENT);
+	broadcast_create("*", "vlan", 0);
+	broadcast_create("v1", "vlan", 0);
+
+	for(frozen = 0; frozen < 2; frozen++)
+	{
+		if(frozen)
+			LONGS_EQUAL(CMD3_SUCCESS, cmdtree_freeze());
+
+		STRCMP_EQUAL("kill *\n", exec("kill *"));
+		STRCMP_EQUAL("all\n", exec("kill all"));
+		STRCMP_EQUAL("* up\n", exec("vlan * up"));
+	}
+
+	cmdtree_thaw();
+}
+
+TEST(cmd3_broadcast, frozen__same_output)
+{
+	LONGS_EQUAL(CMD3_SUCCESS, cmdtree_freeze());
+
+	STRCMP_EQUAL("port eth0:\ncounters\nport eth1:\ncounters\n", exec("port * counters"));
+	STRCMP_EQUAL("link a:\na up\nlink b:\nb up\n", exec("link * up"));
+	STRCMP_EQUAL("Missing parameter or unsupported command.\n", exec("port * none"));
+
+	cmdtree_thaw();
+}
+
+TEST(cmd3_broadcast, executor__output_as_serial)
+{
+	static char serial[1 << 16];
+	cmdtree_executor_d executor = cmdtree_executor_create(3);
+	char name[32];
+	char parent[64];
+	size_t serial_len;
+	int i;
+
+	CHECK(executor);
+
+	for(i = 0; i < 200; i++)
+	{
+		sprintf(name, "vlan%03d", i);
+		new_cmdtree_create(name, "vlan", NULL, "port");
+		sprintf(parent, "port %s", name);
+		broadcast_create("counters", parent, 1);
+	}
+
+	exec("port * counters all");
+	memcpy(serial, sink_data.data, sink_data.len);
+	serial_len = sink_data.len;
+
+	cmdtree_broadcast_executor_set(executor);
+	exec("port * counters all");
+	LONGS_EQUAL(serial_len, sink_data.len);
+	CHECK(0 == memcmp(serial, sink_data.data, serial_len));
+
+	/* Dependent cmds are run in place. */
+	STRCMP_EQUAL("link a:\na up\nlink b:\nb up\n", exec("link * up"));
+
+	cmdtree_broadcast_executor_set(NULL);
+	cmdtree_executor_destroy(executor);
+}
+
+
+TEST_GROUP(cmd3_help)
+{
+    void setup()
+    {
+    	char name[32];
+    	int i;
+
+    	new_cmdtree_create("cmdtest1", "cmd test 1", cmdtest1, CMDTREE_NO_PARENT);
+    	new_cmdtree_create("cmdtest2", "cmd test 2", NULL,     CMDTREE_NO_PARENT);
+    	for(i = 0; i < 100; i++)
+    	{
+    		sprintf(name, "child%03d", i);
+    		new_cmdtree_create(name, "child", cmdtest1, "cmdtest2");
+    	}
+    }
+
+    void teardown()
+    {
+    	cmdtree_teardown();
+    }
+};
+
+TEST(cmd3_help, pages__joined_into_full_listing)
+{
+	const char *argv[1] = { "cmdtest2" };
+	static char report_buf[8192];
+	static char pages[8192];
+	char page_buf[100];
+	size_t cursor;
+	int frozen;
+	int ret;
+
+	for(frozen = 0; frozen < 2; frozen++)
+	{
+		int page_count = 0;
+
+		if(frozen)
+			LONGS_EQUAL(CMD3_SUCCESS, cmdtree_freeze());
+
+		memset(report_buf, 0, sizeof(report_buf));
+		cmdtree_exec(1, argv, report_buf, sizeof(report_buf));
+
+		pages[0] = '\0';
+		cursor   = 0;
+		do
+		{
+			ret = cmdtree_help(1, argv, &cursor, page_buf, sizeof(page_buf));
+			CHECK(CMD3_FAIL != ret);
+
+			/* 28 bytes rows, whole rows only. */
+			LONGS_EQUAL(0, strlen(page_buf) % 28);
+			strcat(pages, page_buf);
+			page_count++;
+		} while(CMD3_INCOMPLETE == ret);
+
+		LONGS_EQUAL(100, cursor);
+		LONGS_EQUAL(34, page_count);
+		STRCMP_EQUAL(report_buf, pages);
+	}
+}
+
+TEST(cmd3_help, row_larger_than_page__truncated_and_skipped)
+{
+	const char *argv[1] = { "cmdtest2" };
+	char page_buf[16];
+	size_t cursor = 98;
+
+	LONGS_EQUAL(CMD3_INCOMPLETE, cmdtree_help(1, argv, &cursor, page_buf, sizeof(page_buf)));
+	STRCMP_EQUAL("child098       ", page_buf);
+	LONGS_EQUAL(99, cursor);
+
+	LONGS_EQUAL(CMD3_SUCCESS, cmdtree_help(1, argv, &cursor, page_buf, sizeof(page_buf)));
+	LONGS_EQUAL(100, cursor);
+
+	LONGS_EQUAL(CMD3_SUCCESS, cmdtree_help(1, argv, &cursor, page_buf, sizeof(page_buf)));
+	STRCMP_EQUAL("", page_buf);
+}
+
+TEST(cmd3_help, level_changed__cached_listing_updated)
+{
+	const char *argv_root[1] = { NULL };
+	char report_buf[256];
+
+	memset(report_buf, 0, sizeof(report_buf));
+	cmdtree_exec(0, argv_root, report_buf, sizeof(report_buf));
+	STRCMP_EQUAL("cmdtest1              cmd test 1""\n"
+				 "cmdtest2              cmd test 2""\n", report_buf);
+
+	new_cmdtree_create("cmdtest3-with-a-long-name", "cmd test 3", cmdtest3, CMDTREE_NO_PARENT);
+
+	memset(report_buf, 0, sizeof(report_buf));
+	cmdtree_exec(0, argv_root, report_buf, sizeof(report_buf));
+	STRCMP_EQUAL("cmdtest1              cmd test 1""\n"
+				 "cmdtest2              cmd test 2""\n"
+				 "cmdtest3-with-a-long-name  cmd test 3""\n", report_buf);
+}
+
+TEST(cmd3_help, not_a_junction__fails)
+{
+	const char *argv_leaf[2]  = { "cmdtest2", "child001" };
+	const char *argv_none[1]  = { "none" };
+	char page_buf[64];
+	size_t cursor = 0;
+
+	LONGS_EQUAL(CMD3_FAIL, cmdtree_help(2, argv_leaf, &cursor, page_buf, sizeof(page_buf)));
+	LONGS_EQUAL(CMD3_FAIL, cmdtree_help(1, argv_none, &cursor, page_buf, sizeof(page_buf)));
+	LONGS_EQUAL(0, cursor);
+}
+
+TEST(cmd3_help, zero_size_buffer__nothing_written)
+{
+	const char *argv[1] = { "cmdtest2" };
+	char page_buf[4] = "xyz";
+	size_t cursor = 0;
+
+	LONGS_EQUAL(0, cmdtree_exec(1, argv, page_buf, 0));
+	LONGS_EQUAL(CMD3_FAIL, cmdtree_help(1, argv, &cursor, page_buf, 0));
+	LONGS_EQUAL(0, cursor);
+	STRCMP_EQUAL("xyz", page_buf);
+}
+
+
+static int line_count(const char *text)
+{
+	int count = 0;
+
+	for(; *text; text++)
+		count += '\n' == *text;
+
+	return count;
+}
+
+static size_t failing_alloc_size;
+
+/* Fails the allocations of the given size, e.g. a given cmd name copy. */
+static void *failing_alloc(void *arg, size_t size)
+{
+	(void)arg;
+
+	if(size == failing_alloc_size)
+		return NULL;
+
+	return malloc(size);
+}
+
+static void failing_free(void *arg, void *ptr, size_t size)
+{
+	(void)arg;
+	(void)size;
+
+	free(ptr);
+}
+
+#ifdef CMD3_STATS
+static int cmdtest_fail(int argc, const char **argv, char *buf, size_t buf_size)
+{
+	UNUSED(argc);
+	UNUSED(argv);
+	UNUSED(buf);
+	UNUSED(buf_size);
+
+	return 0;
+}
+
+TEST_GROUP(cmd3_stats)
+{
+	cmdtree_d cmd_ok;
+	cmdtree_d cmd_fail;
+	char report_buf[1024];
+
+    void setup()
+    {
+    	cmd_ok   = new_cmdtree_create("cmdtest1", "cmd test 1", cmdtest1, CMDTREE_NO_PARENT);
+    	cmd_fail = new_cmdtree_create("cmdfail",  "cmd fail",   cmdtest_fail, CMDTREE_NO_PARENT);
+    	LONGS_EQUAL(CMD3_SUCCESS, cmdtree_stats_create());
+    }
+
+    void teardown()
+    {
+    	cmdtree_teardown();
+    }
+
+    void exec(const char *line)
+    {
+    	cmdtree_token_t tokens[CMD_TREE_MAX_DEPTH];
+    	int token_count;
+
+    	token_count = cmdtree_tokenize(line, strlen(line), tokens, CMD_TREE_MAX_DEPTH);
+    	cmdtree_exec_tokens(token_count, tokens, report_buf, sizeof(report_buf));
+    }
+};
+
+TEST(cmd3_stats, cmd_create_failure__no_partial_stats_cmds_left)
+{
+	const char *argv[1] = { "stats" };
+	cmdtree_allocator_t allocator = { failing_alloc, failing_free, NULL, NULL };
+	cmd3_ctx_config_t config;
+	cmd3_ctx_d ctx;
+
+	memset(&config, 0, sizeof(config));
+	config.allocator = &allocator;
+	ctx = cmd3_ctx_create(&config);
+
+	/* The last stats cmd fails, after its siblings were created. */
+	failing_alloc_size = sizeof("Clear the cmd stats");
+	LONGS_EQUAL(CMD3_FAIL, cmdtree_stats_create_ctx(ctx));
+	failing_alloc_size = 0;
+
+	memset(report_buf, 0, sizeof(report_buf));
+	cmdtree_exec_ctx(ctx, 1, argv, report_buf, sizeof(report_buf));
+	CHECK(NULL == strstr(report_buf, "calls"));
+
+	LONGS_EQUAL(CMD3_SUCCESS, cmdtree_stats_create_ctx(ctx));
+
+	cmd3_ctx_destroy(ctx);
+}
+
+TEST(cmd3_stats, calls_and_errors__counted_per_cmd)
+{
+	cmdtree_stats_t stats;
+	int i;
+
+	for(i = 0; i < 3; i++)
+		exec("cmdtest1 a");
+	exec("cmdfail");
+
+	LONGS_EQUAL(CMD3_SUCCESS, cmdtree_stats_get(cmd_ok, &stats));
+	LONGS_EQUAL(3, stats.calls);
+	LONGS_EQUAL(0, stats.errors);
+	CHECK(stats.p99_ns > 0);
+	CHECK(stats.p99_ns >= stats.time_ns / 3);
+
+	LONGS_EQUAL(CMD3_SUCCESS, cmdtree_stats_get(cmd_fail, &stats));
+	LONGS_EQUAL(1, stats.calls);
+	LONGS_EQUAL(1, stats.errors);
+
+	/* Frozen, the calls are still counted on the live cmd. */
+	LONGS_EQUAL(CMD3_SUCCESS, cmdtree_freeze());
+	exec("cmdtest1");
+	cmdtree_thaw();
+
+	LONGS_EQUAL(CMD3_SUCCESS, cmdtree_stats_get(cmd_ok, &stats));
+	LONGS_EQUAL(4, stats.calls);
+}
+
+TEST(cmd3_stats, top_cmds__listed_in_order)
+{
+	int i;
+
+	for(i = 0; i < 3; i++)
+		exec("cmdtest1");
+	exec("cmdfail");
+	exec("cmdfail");
+
+	exec("stats calls 2");
+	STRNCMP_EQUAL("Command ", report_buf, 8);
+	STRNCMP_EQUAL("cmdtest1          ", strchr(report_buf, '\n') + 1, 18);
+	STRNCMP_EQUAL("cmdfail           ", strchr(strchr(report_buf, '\n') + 1, '\n') + 1, 18);
+	LONGS_EQUAL(3, line_count(report_buf));
+
+	/* The stats cmd is counted as well, under its path. */
+	exec("stats calls");
+	CHECK(NULL != strstr(report_buf, "\nstats calls "));
+
+	exec("stats calls 0");
+	STRCMP_EQUAL("Invalid argument count: 0, expected 1..2147483647\n", report_buf);
+}
+
+TEST(cmd3_stats, reset__counters_cleared)
+{
+	cmdtree_stats_t stats;
+
+	exec("cmdtest1");
+	exec("stats reset");
+
+	LONGS_EQUAL(CMD3_SUCCESS, cmdtree_stats_get(cmd_ok, &stats));
+	LONGS_EQUAL(0, stats.calls);
+	LONGS_EQUAL(0, stats.p99_ns);
+}
+
+TEST(cmd3_stats, junction__has_no_counters)
+{
+	cmdtree_d junction = new_cmdtree_create("junction", "junction", NULL, CMDTREE_NO_PARENT);
+	cmdtree_stats_t stats;
+
+	LONGS_EQUAL(CMD3_FAIL, cmdtree_stats_get(junction, &stats));
+}
+#endif
+
+
+#define TRACE_EVENTS_MAX 32
+
+struct trace_record
+{
+	int 				  count;
+	char 				  phase[TRACE_EVENTS_MAX];
+	cmdtree_trace_event_t events[TRACE_EVENTS_MAX];
+};
+
+static void trace_record_event(struct trace_record *record, char phase, const cmdtree_trace_event_t *event)
+{
+	if(record->count < TRACE_EVENTS_MAX)
+	{
+		record->phase[record->count]  = phase;
+		record->events[record->count] = *event;
+	}
+	record->count++;
+}
+
+static void trace_begin(void *arg, const cmdtree_trace_event_t *event)
+{
+	trace_record_event((struct trace_record *)arg, 'B', event);
+}
+
+static void trace_end(void *arg, const cmdtree_trace_event_t *event)
+{
+	trace_record_event((struct trace_record *)arg, 'E', event);
+}
+
+TEST_GROUP(cmd3_trace)
+{
+	struct trace_record record;
+	cmdtree_trace_t trace;
+	cmdtree_d cmd_junction;
+	cmdtree_d cmd_leaf;
+
+    void setup()
+    {
+    	memset(&record, 0, sizeof(record));
+    	trace.begin = trace_begin;
+    	trace.end   = trace_end;
+    	trace.arg   = &record;
+
+    	cmd_junction = new_cmdtree_create("cmdtest2", "cmd test 2", NULL, CMDTREE_NO_PARENT);
+    	new_cmdtree_create("cmdtest2.1", "cmd test 2.1", NULL, "cmdtest2");
+    	cmd_leaf = new_cmdtree_create("leaf", "leaf", cmdtest1, "cmdtest2 cmdtest2.1");
+    }
+
+    void teardown()
+    {
+    	cmdtree_trace_set(NULL);
+    	cmdtree_teardown();
+    }
+
+    void check_event(int i, char phase, cmdtree_trace_stage_t stage, cmdtree_d cmd, size_t bytes)
+    {
+    	BYTES_EQUAL(phase, record.phase[i]);
+    	LONGS_EQUAL(stage, record.events[i].stage);
+    	POINTERS_EQUAL(cmd, record.events[i].cmd);
+    	LONGS_EQUAL(bytes, record.events[i].bytes);
+    }
+};
+
+TEST(cmd3_trace, exec__stages_traced_with_cmd_and_bytes)
+{
+	const char line[] = "cmdtest2 cmdtest2.1 leaf x";
+	cmdtree_token_t tokens[CMD_TREE_MAX_DEPTH];
+	char report_buf[256];
+	int token_count;
+	int len;
+
+	cmdtree_trace_set(&trace);
+
+	token_count = cmdtree_tokenize(line, strlen(line), tokens, CMD_TREE_MAX_DEPTH);
+	len = cmdtree_exec_tokens(token_count, tokens, report_buf, sizeof(report_buf));
+
+	LONGS_EQUAL(6, record.count);
+	check_event(0, 'B', CMDTREE_TRACE_TOKENIZE, NULL, strlen(line));
+	check_event(1, 'E', CMDTREE_TRACE_TOKENIZE, NULL, strlen(line));
+	check_event(2, 'B', CMDTREE_TRACE_LOOKUP, NULL, strlen(line) - 3);
+	check_event(3, 'E', CMDTREE_TRACE_LOOKUP, cmd_leaf, strlen(line) - 3);
+	check_event(4, 'B', CMDTREE_TRACE_HANDLER, cmd_leaf, 5);
+	check_event(5, 'E', CMDTREE_TRACE_HANDLER, cmd_leaf, len - 1);
+
+	/* A frozen image resolves to the live cmds as well. */
+	record.count = 0;
+	LONGS_EQUAL(CMD3_SUCCESS, cmdtree_freeze());
+	cmdtree_exec_tokens(token_count, tokens, report_buf, sizeof(report_buf));
+	cmdtree_thaw();
+
+	LONGS_EQUAL(4, record.count);
+	check_event(1, 'E', CMDTREE_TRACE_LOOKUP, cmd_leaf, strlen(line) - 3);
+	check_event(3, 'E', CMDTREE_TRACE_HANDLER, cmd_leaf, len - 1);
+}
+
+TEST(cmd3_trace, report_and_output__traced)
+{
+	const char *argv[1] = { "cmdtest2" };
+	cmdtree_sink_t sink;
+
+	memset(&sink_data, 0, sizeof(sink_data));
+	sink.write  = sink_collect_write;
+	sink.writev = NULL;
+	sink.arg    = &sink_data;
+
+	cmdtree_trace_set(&trace);
+	cmdtree_exec_sink(1, argv, &sink);
+
+	LONGS_EQUAL(6, record.count);
+	check_event(1, 'E', CMDTREE_TRACE_LOOKUP, cmd_junction, 8);
+	check_event(2, 'B', CMDTREE_TRACE_REPORT, cmd_junction, 0);
+	check_event(3, 'E', CMDTREE_TRACE_REPORT, cmd_junction, sink_data.len);
+	check_event(4, 'B', CMDTREE_TRACE_OUTPUT, cmd_junction, sink_data.len);
+	check_event(5, 'E', CMDTREE_TRACE_OUTPUT, cmd_junction, sink_data.len);
+}
+
+TEST(cmd3_trace, disabled__no_hook_called)
+{
+	const char *argv[3] = { "cmdtest2", "cmdtest2.1", "leaf" };
+	char report_buf[256];
+
+	cmdtree_trace_set(&trace);
+	cmdtree_trace_set(NULL);
+	cmdtree_exec(3, argv, report_buf, sizeof(report_buf));
+
+	LONGS_EQUAL(0, record.count);
+}
+
+TEST(cmd3_trace, path__rendered_and_truncated)
+{
+	char path[32];
+
+	LONGS_EQUAL(24, cmdtree_path(cmd_leaf, path, sizeof(path)));
+	STRCMP_EQUAL("cmdtest2 cmdtest2.1 leaf", path);
+
+	LONGS_EQUAL(24, cmdtree_path(cmd_leaf, path, 12));
+	STRCMP_EQUAL("cmdtest2 cm", path);
+
+	LONGS_EQUAL(24, cmdtree_path(cmd_leaf, path, 0));
+}
+
+
+TEST_GROUP(cmd3_slowlog)
+{
+	char report_buf[1024];
+
+    void setup()
+    {
+    	new_cmdtree_create("cmdtest1", "cmd test 1", cmdtest1, CMDTREE_NO_PARENT);
+    }
+
+    void teardown()
+    {
+    	cmdtree_teardown();
+    }
+
+    void exec(const char *line)
+    {
+    	cmdtree_token_t tokens[CMD_TREE_MAX_DEPTH];
+    	int token_count;
+
+    	token_count = cmdtree_tokenize(line, strlen(line), tokens, CMD_TREE_MAX_DEPTH);
+    	cmdtree_exec_tokens(token_count, tokens, report_buf, sizeof(report_buf));
+    }
+};
+
+TEST(cmd3_slowlog, latest_cmds__kept_newest_first)
+{
+	unsigned long long id, sec, usec, duration, output;
+	char line[64];
+	int i;
+
+	LONGS_EQUAL(CMD3_SUCCESS, cmdtree_slowlog_create(0, 4));
+
+	for(i = 0; i < 6; i++)
+		exec(i % 2 ? "cmdtest1 odd" : "cmdtest1 even");
+
+	/* Every cmd is logged, the ring holds the latest 4 of them. */
+	exec("slowlog len");
+	STRCMP_EQUAL("4\n", report_buf);
+
+	/* The slowlog cmds are logged as well, once done. */
+	exec("slowlog get 2");
+	LONGS_EQUAL(2, line_count(report_buf));
+
+	LONGS_EQUAL(6, sscanf(report_buf, "%llu %llu.%llu %lluus %llub %63[^\n]", &id, &sec, &usec, &duration, &output, line));
+	LONGS_EQUAL(6, id);
+	STRCMP_EQUAL("slowlog len", line);
+	LONGS_EQUAL(2, output);
+
+	LONGS_EQUAL(6, sscanf(strchr(report_buf, '\n') + 1, "%llu %llu.%llu %lluus %llub %63[^\n]", &id, &sec, &usec, &duration, &output, line));
+	LONGS_EQUAL(5, id);
+	STRCMP_EQUAL("cmdtest1 odd", line);
+	CHECK(sec > 0);
+
+	LONGS_EQUAL(CMD3_FAIL, cmdtree_slowlog_create(0, 4));
+}
+
+TEST(cmd3_slowlog, reset__entries_cleared)
+{
+	LONGS_EQUAL(CMD3_SUCCESS, cmdtree_slowlog_create(0, 8));
+
+	exec("cmdtest1");
+	exec("cmdtest1");
+	exec("slowlog reset");
+	STRCMP_EQUAL("Slow log cleared.\n", report_buf);
+
+	/* Only the reset cmd itself is left. */
+	exec("slowlog len");
+	STRCMP_EQUAL("1\n", report_buf);
+}
+
+TEST(cmd3_slowlog, fast_cmds__not_logged)
+{
+	LONGS_EQUAL(CMD3_SUCCESS, cmdtree_slowlog_create(10000000, 8));
+
+	exec("cmdtest1");
+	exec("slowlog get");
+	STRCMP_EQUAL("Slow log is empty.\n", report_buf);
+	exec("slowlog len");
+	STRCMP_EQUAL("0\n", report_buf);
+}
+
+TEST(cmd3_slowlog, huge_threshold__not_wrapped)
+{
+	/* The threshold in nanoseconds would wrap around to 384. */
+	LONGS_EQUAL(CMD3_SUCCESS, cmdtree_slowlog_create(~0ULL / 1000 + 1, 8));
+
+	exec("cmdtest1");
+	exec("slowlog len");
+	STRCMP_EQUAL("0\n", report_buf);
+}
+
+TEST(cmd3_slowlog, long_cmd_line__cut_off)
+{
+	char line[256];
+
+	LONGS_EQUAL(CMD3_SUCCESS, cmdtree_slowlog_create(0, 8));
+
+	memset(line, 'x', sizeof(line) - 1);
+	memcpy(line, "cmdtest1 ", 9);
+	line[sizeof(line) - 1] = '\0';
+	exec(line);
+
+	exec("slowlog get 1");
+	CHECK(NULL != strstr(report_buf, " cmdtest1 xxx"));
+	CHECK(NULL != strstr(report_buf, "xxx... (127 more bytes)\n"));
+}
+
+TEST(cmd3_slowlog, cmd_create_failure__no_partial_slowlog_cmds_left)
+{
+	const char *argv[2] = { "slowlog", "get" };
+	cmdtree_allocator_t allocator = { failing_alloc, failing_free, NULL, NULL };
+	cmd3_ctx_config_t config;
+	cmdtree_config_t cmd_config;
+	cmd3_ctx_d ctx;
+
+	memset(&config, 0, sizeof(config));
+	config.allocator = &allocator;
+	ctx = cmd3_ctx_create(&config);
+
+	memset(&cmd_config, 0, sizeof(cmd_config));
+	cmd_config.name        = "cmdtest1";
+	cmd_config.comment     = "cmd test 1";
+	cmd_config.cmdfunc     = cmdtest1;
+	cmd_config.parent_name = CMDTREE_NO_PARENT;
+	CHECK(NULL != cmdtree_create_ctx(ctx, &cmd_config));
+
+	/* The last slowlog cmd fails, after its siblings were created. */
+	failing_alloc_size = sizeof("reset");
+	LONGS_EQUAL(CMD3_FAIL, cmdtree_slowlog_create_ctx(ctx, 0, 4));
+	failing_alloc_size = 0;
+
+	memset(report_buf, 0, sizeof(report_buf));
+	cmdtree_exec_ctx(ctx, 2, argv, report_buf, sizeof(report_buf));
+	CHECK(NULL == strstr(report_buf, "slowlog"));
+	CHECK(NULL == strstr(report_buf, "Slow log"));
+
+	/* Nothing is left behind to block a later attempt. */
+	LONGS_EQUAL(CMD3_SUCCESS, cmdtree_slowlog_create_ctx(ctx, 0, 4));
+
+	memset(report_buf, 0, sizeof(report_buf));
+	cmdtree_exec_ctx(ctx, 2, argv, report_buf, sizeof(report_buf));
+	STRCMP_EQUAL("Slow log is empty.\n", report_buf);
+
+	cmd3_ctx_destroy(ctx);
+}
+
+TEST_GROUP(cmd3_tokens)
+{
+    void setup()
+    {
+    	new_cmdtree_create("cmdtest1",     "cmd test 1",     cmdtest1, CMDTREE_NO_PARENT);
+    	new_cmdtree_create("cmdtest2",     "cmd test 2",     NULL,     CMDTREE_NO_PARENT);
+    	new_cmdtree_create("cmdtest2.2",   "cmd test 2.2",   NULL,     "cmdtest2");
+    	new_cmdtree_create("cmdtest2.2.1", "cmd test 2.2.1", cmdtest1, "cmdtest2 cmdtest2.2");
+    }
+
+    void teardown()
+    {
+    	cmdtree_teardown();
+    }
+};
+
+TEST(cmd3_tokens, tokenize__slices_returned_string_untouched)
+{
+	const char line[] = "  \tshow   interfaces-with-a-long-name-past-16-chars\t status \t ";
+	cmdtree_token_t tokens[4];
+
+	LONGS_EQUAL(3, cmdtree_tokenize(line, strlen(line), tokens, 4));
+
+	LONGS_EQUAL(4, tokens[0].len);
+	CHECK(0 == strncmp("show", tokens[0].str, tokens[0].len));
+	LONGS_EQUAL(strlen("interfaces-with-a-long-name-past-16-chars"), tokens[1].len);
+	CHECK(0 == strncmp("interfaces-with-a-long-name-past-16-chars", tokens[1].str, tokens[1].len));
+	LONGS_EQUAL(6, tokens[2].len);
+	POINTERS_EQUAL(strstr(line, "status"), tokens[2].str);
+
+	STRCMP_EQUAL("  \tshow   interfaces-with-a-long-name-past-16-chars\t status \t ", line);
+}
+
+TEST(cmd3_tokens, tokenize_more_than_max__count_returned_max_filled)
+{
+	const char line[] = "a b c d e";
+	cmdtree_token_t tokens[2];
+
+	LONGS_EQUAL(5, cmdtree_tokenize(line, strlen(line), tokens, 2));
+	LONGS_EQUAL(0, cmdtree_tokenize(line, 0, tokens, 2));
+	LONGS_EQUAL(1, cmdtree_tokenize(line, 1, tokens, 2));
+}
+
+TEST(cmd3_tokens, exec_tokens_of_unterminated_buffer__cmd_executed)
+{
+	/* The buffer continues past the tokenized length, arg0 is seen as "arg". */
+	const char line[] = "cmdtest2 cmdtest2.2 cmdtest2.2.1 arg0";
+	cmdtree_token_t tokens[CMD_TREE_MAX_DEPTH];
+	char report_buf[256];
+	int count;
+
+	count = cmdtree_tokenize(line, strlen(line) - 1, tokens, CMD_TREE_MAX_DEPTH);
+	LONGS_EQUAL(4, count);
+
+	memset(report_buf, 0, sizeof(report_buf));
+	cmdtree_exec_tokens(count, tokens, report_buf, sizeof(report_buf));
+	STRCMP_EQUAL("cmdtest1: argc=2, arg[0]=cmdtest2.2.1""\n", report_buf);
+
+	count = cmdtree_tokenize(line, strlen("cmdtest2 "), tokens, CMD_TREE_MAX_DEPTH);
+	LONGS_EQUAL(1, count);
+
+	LONGS_EQUAL(CMD3_SUCCESS, cmdtree_freeze());
+
+	memset(report_buf, 0, sizeof(report_buf));
+	cmdtree_exec_tokens(count, tokens, report_buf, sizeof(report_buf));
+	STRCMP_EQUAL("cmdtest2.2            cmd test 2.2""\n", report_buf);
+}
+
+TEST(cmd3_tokens, exec_tokens_with_large_args__args_passed_to_handler)
+{
+	static char line[4096];
+	cmdtree_token_t tokens[CMD_TREE_MAX_DEPTH];
+	char report_buf[256];
+	int count;
+
+	strcpy(line, "cmdtest1 ");
+	memset(line + strlen(line), 'x', 1000);
+
+	count = cmdtree_tokenize(line, strlen(line), tokens, CMD_TREE_MAX_DEPTH);
+	LONGS_EQUAL(2, count);
+
+	memset(report_buf, 0, sizeof(report_buf));
+	cmdtree_exec_tokens(count, tokens, report_buf, sizeof(report_buf));
+	STRCMP_EQUAL("cmdtest1: argc=2, arg[0]=cmdtest1""\n", report_buf);
+}
+
+
+TEST(cmd3_tokens, argv_vector__thousands_of_args_in_one_exec_and_reused)
+{
+	static char line[32 * 1024];
+	cmdtree_argv_t argv;
+	char report_buf[256];
+	size_t len;
+	int i;
+
+	new_cmdtree_create("acl", "acl", NULL, CMDTREE_NO_PARENT);
+	new_cmdtree_create("add", "acl add", cmdtest_last, "acl");
+
+	len = sprintf(line, "acl add");
+	for(i = 0; i < 2000; i++)
+		len += sprintf(line + len, " 10.0.%d.%d", i / 256, i % 256);
+
+	cmdtree_argv_init(&argv);
+
+	LONGS_EQUAL(CMD3_SUCCESS, cmdtree_argv_tokenize(&argv, line, len));
+	LONGS_EQUAL(2002, argv.argc);
+
+	memset(report_buf, 0, sizeof(report_buf));
+	cmdtree_exec_tokens(argv.argc, argv.tokens, report_buf, sizeof(report_buf));
+	STRCMP_EQUAL("cmdtest_last: argc=2001, arg[2000]=10.0.7.207""\n", report_buf);
+
+	LONGS_EQUAL(CMD3_SUCCESS, cmdtree_argv_tokenize(&argv, "acl add 10.1.1.1", strlen("acl add 10.1.1.1")));
+	LONGS_EQUAL(3, argv.argc);
+	CHECK(argv.capacity >= 2002);
+
+	memset(report_buf, 0, sizeof(report_buf));
+	cmdtree_exec_tokens(argv.argc, argv.tokens, report_buf, sizeof(report_buf));
+	STRCMP_EQUAL("cmdtest_last: argc=2, arg[1]=10.1.1.1""\n", report_buf);
+
+	cmdtree_argv_release(&argv);
+	POINTERS_EQUAL(argv.small, argv.tokens);
+}
+
+
+static void check_tokens(const cmdtree_argv_t *argv, int argc, const char * const *expected)
+{
+	int i;
+
+	LONGS_EQUAL(argc, argv->argc);
+	for(i = 0; i < argc; i++)
+	{
+		LONGS_EQUAL(strlen(expected[i]), argv->tokens[i].len);
+		CHECK(0 == memcmp(expected[i], argv->tokens[i].str, argv->tokens[i].len));
+	}
+}
+
+TEST(cmd3_tokens, quoted_tokenize__quotes_and_escapes_removed)
+{
+	const char line[] = "set description \"uplink to  core\" 'C:\\path with space' a\\ b \"\" x\"y\\\"z\"'w' \"keep\\n\"";
+	const char * const expected[] = { "set", "description", "uplink to  core", "C:\\path with space", "a b", "", "xy\"zw", "keep\\n" };
+	cmdtree_argv_t argv;
+
+	cmdtree_argv_init(&argv);
+
+	LONGS_EQUAL(CMD3_SUCCESS, cmdtree_argv_tokenize_quoted(&argv, line, strlen(line)));
+	check_tokens(&argv, 8, expected);
+
+	cmdtree_argv_release(&argv);
+}
+
+TEST(cmd3_tokens, quoted_tokenize_open_quote_or_trailing_backslash__incomplete_until_continued)
+{
+	const char *open_quote = "set description \"two";
+	const char *continued  = "set description \"two\nlines\"";
+	const char *trailing   = "acl add 10.0.0.1 \\";
+	const char *joined     = "acl add 10.0.0.1 \\\n10.0.0.2";
+	const char * const expected_quote[]  = { "set", "description", "two\nlines" };
+	const char * const expected_joined[] = { "acl", "add", "10.0.0.1", "10.0.0.2" };
+	cmdtree_argv_t argv;
+
+	cmdtree_argv_init(&argv);
+
+	LONGS_EQUAL(CMD3_INCOMPLETE, cmdtree_argv_tokenize_quoted(&argv, open_quote, strlen(open_quote)));
+	LONGS_EQUAL(0, argv.argc);
+	LONGS_EQUAL(CMD3_SUCCESS, cmdtree_argv_tokenize_quoted(&argv, continued, strlen(continued)));
+	check_tokens(&argv, 3, expected_quote);
+
+	LONGS_EQUAL(CMD3_INCOMPLETE, cmdtree_argv_tokenize_quoted(&argv, trailing, strlen(trailing)));
+	LONGS_EQUAL(CMD3_SUCCESS, cmdtree_argv_tokenize_quoted(&argv, joined, strlen(joined)));
+	check_tokens(&argv, 4, expected_joined);
+
+	cmdtree_argv_release(&argv);
+}
+
+TEST(cmd3_tokens, quoted_tokenize_unquoted_new_line__tokens_separated)
+{
+	const char *plain  = "a\nb";
+	const char *quoted = "a\n'b c'\nd\\\ne";
+	const char * const expected_plain[]  = { "a", "b" };
+	const char * const expected_quoted[] = { "a", "b c", "de" };
+	cmdtree_argv_t argv;
+
+	cmdtree_argv_init(&argv);
+
+	LONGS_EQUAL(CMD3_SUCCESS, cmdtree_argv_tokenize_quoted(&argv, plain, strlen(plain)));
+	check_tokens(&argv, 2, expected_plain);
+
+	/* A new line escaped within a token joins its parts. */
+	LONGS_EQUAL(CMD3_SUCCESS, cmdtree_argv_tokenize_quoted(&argv, quoted, strlen(quoted)));
+	check_tokens(&argv, 3, expected_quoted);
+
+	cmdtree_argv_release(&argv);
+}
+
+TEST(cmd3_tokens, quoted_tokenize_of_plain_line__tokens_point_into_line)
+{
+	const char line[] = "cmdtest2 cmdtest2.2 cmdtest2.2.1 arg0";
+	cmdtree_argv_t argv;
+	char report_buf[256];
+
+	cmdtree_argv_init(&argv);
+
+	LONGS_EQUAL(CMD3_SUCCESS, cmdtree_argv_tokenize_quoted(&argv, line, strlen(line)));
+	LONGS_EQUAL(4, argv.argc);
+	POINTERS_EQUAL(line, argv.tokens[0].str);
+	POINTERS_EQUAL(NULL, argv.strings);
+
+	memset(report_buf, 0, sizeof(report_buf));
+	cmdtree_exec_tokens(argv.argc, argv.tokens, report_buf, sizeof(report_buf));
+	STRCMP_EQUAL("cmdtest1: argc=2, arg[0]=cmdtest2.2.1""\n", report_buf);
+
+	cmdtree_argv_release(&argv);
+}
+
+
+TEST_GROUP(cmd3_ctx)
+{
+	cmd3_ctx_d ctx1;
+	cmd3_ctx_d ctx2;
+
+    void setup()
+    {
+    	cmd3_ctx_config_t config;
+
+    	memset(&config, 0, sizeof(config));
+
+    	config.user_data = (void *)"session 1";
+    	ctx1 = cmd3_ctx_create(&config);
+    	config.user_data = (void *)"session 2";
+    	ctx2 = cmd3_ctx_create(&config);
+    }
+
+    void teardown()
+    {
+    	cmd3_ctx_destroy(ctx2);
+    	cmd3_ctx_destroy(ctx1);
+    }
+
+    cmdtree_d create(cmd3_ctx_d ctx, const char *name, const char *comment, cmdtree_cmdfunc_ud cmdfunc_ud, const char *parent_name)
+    {
+    	cmdtree_config_t config;
+
+    	memset(&config, 0, sizeof(config));
+    	config.name        = name;
+    	config.comment     = comment;
+    	config.cmdfunc_ud  = cmdfunc_ud;
+    	config.parent_name = parent_name;
+
+    	return cmdtree_create_ctx(ctx, &config);
+    }
+};
+
+TEST(cmd3_ctx, two_contexts__trees_independent)
+{
+	const char *argv[1] = { NULL };
+	char report_buf[256];
+
+	cmdtree_d cmdtree1 = create(ctx1, "cmdtest1", "cmd test 1", cmdtest_ud, CMDTREE_NO_PARENT);
+	cmdtree_d cmdtree2 = create(ctx2, "cmdtest2", "cmd test 2", cmdtest_ud, CMDTREE_NO_PARENT);
+
+	POINTERS_EQUAL(cmdtree1, cmdtree_get_root_ctx(ctx1));
+	POINTERS_EQUAL(cmdtree2, cmdtree_get_root_ctx(ctx2));
+	POINTERS_EQUAL(NULL, cmdtree_get_root());
+
+	memset(report_buf, 0, sizeof(report_buf));
+	cmdtree_exec_ctx(ctx2, 0, argv, report_buf, sizeof(report_buf));
+
+	STRCMP_EQUAL("cmdtest2              cmd test 2""\n", report_buf);
+
+	cmdtree_destroy(cmdtree1);
+	POINTERS_EQUAL(NULL, cmdtree_get_root_ctx(ctx1));
+	POINTERS_EQUAL(cmdtree2, cmdtree_get_root_ctx(ctx2));
+}
+
+TEST(cmd3_ctx, execute_cmd__context_user_data_passed)
+{
+	const char *argv[2] = { "cmdtest", "arg1" };
+	char report_buf[256];
+
+	create(ctx1, "cmdtest", "cmd test", cmdtest_ud, CMDTREE_NO_PARENT);
+	create(ctx2, "cmdtest", "cmd test", cmdtest_ud, CMDTREE_NO_PARENT);
+
+	memset(report_buf, 0, sizeof(report_buf));
+	cmdtree_exec_ctx(ctx1, 2, argv, report_buf, sizeof(report_buf));
+	STRCMP_EQUAL("cmdtest_ud: session 1, argc=2, arg[0]=cmdtest""\n", report_buf);
+
+	LONGS_EQUAL(CMD3_SUCCESS, cmdtree_freeze_ctx(ctx2));
+
+	memset(report_buf, 0, sizeof(report_buf));
+	cmdtree_exec_ctx(ctx2, 2, argv, report_buf, sizeof(report_buf));
+	STRCMP_EQUAL("cmdtest_ud: session 2, argc=2, arg[0]=cmdtest""\n", report_buf);
+}
+
+TEST(cmd3_ctx, create_under_parent_handle__created_in_parent_context)
+{
+	const char *argv[2] = { "cmdtest", "sub" };
+	char report_buf[256];
+	cmdtree_config_t config;
+	cmdtree_d parent = create(ctx2, "cmdtest", "cmd test", NULL, CMDTREE_NO_PARENT);
+
+	memset(&config, 0, sizeof(config));
+	config.name       = "sub";
+	config.comment    = "sub cmd";
+	config.cmdfunc_ud = cmdtest_ud;
+	CHECK(NULL != cmdtree_create_under(parent, &config));
+
+	memset(report_buf, 0, sizeof(report_buf));
+	cmdtree_exec_ctx(ctx2, 2, argv, report_buf, sizeof(report_buf));
+	STRCMP_EQUAL("cmdtest_ud: session 2, argc=1, arg[0]=sub""\n", report_buf);
+	POINTERS_EQUAL(NULL, cmdtree_get_root());
+}
+
+TEST(cmd3_ctx, arena_context__subcmd_executed)
+{
+	const char *argv[3] = { "cmdtest", "cmdtest.1", "arg1" };
+	char report_buf[256];
+	cmdtree_allocator_t allocator;
+	cmd3_ctx_config_t config;
+	cmdtree_arena_d arena;
+	cmd3_ctx_d ctx;
+
+	arena = cmdtree_arena_create(0);
+	cmdtree_arena_allocator(arena, &allocator);
+	memset(&config, 0, sizeof(config));
+	config.allocator = &allocator;
+	config.user_data = (void *)"arena session";
+	ctx = cmd3_ctx_create(&config);
+
+	create(ctx, "cmdtest", "cmd test", NULL, CMDTREE_NO_PARENT);
+	create(ctx, "cmdtest.1", "cmd test 1", cmdtest_ud, "cmdtest");
+
+	memset(report_buf, 0, sizeof(report_buf));
+	cmdtree_exec_ctx(ctx, 3, argv, report_buf, sizeof(report_buf));
+	STRCMP_EQUAL("cmdtest_ud: arena session, argc=2, arg[0]=cmdtest.1""\n", report_buf);
+
+	cmd3_ctx_destroy(ctx);
+	cmdtree_arena_destroy(arena);
+}
+
+
+#define CMD3_RCU_TEST_READERS		4
+#define CMD3_RCU_TEST_ITERATIONS	20000
+
+static int rcu_test_stop;
+
+static void *rcu_test_reader(void *arg)
+{
+	cmd3_ctx_d ctx = (cmd3_ctx_d)arg;
+	const char *argv[3] = { "cmdtest", "cmdtest.static", "arg0" };
+	const char *argv_subtree[4] = { "cmdtest", "subtree", "subtree.1", "leaf" };
+	long failures = 0;
+	char report_buf[1024];
+
+	while(!__atomic_load_n(&rcu_test_stop, __ATOMIC_ACQUIRE))
+	{
+		report_buf[0] = '\0';
+		cmdtree_exec_ctx(ctx, 3, argv, report_buf, sizeof(report_buf));
+
+		if(strcmp(report_buf, "cmdtest1: argc=2, arg[0]=cmdtest.static""\n"))
+			failures++;
+
+		/* Walks a subtree which may be destroyed meanwhile, the result depends on the timing. */
+		cmdtree_exec_ctx(ctx, 4, argv_subtree, report_buf, sizeof(report_buf));
+	}
+
+	return (void *)failures;
+}
+
+TEST(cmd3_ctx, concurrent_exec_while_updating__readers_see_consistent_tree)
+{
+	pthread_t readers[CMD3_RCU_TEST_READERS];
+	cmdtree_config_t config;
+	char name[32];
+	int i;
+
+	memset(&config, 0, sizeof(config));
+	config.name    = "cmdtest";
+	config.comment = "cmd test";
+	cmdtree_create_ctx(ctx1, &config);
+
+	config.name        = "cmdtest.static";
+	config.cmdfunc     = cmdtest1;
+	config.parent_name = "cmdtest";
+	cmdtree_create_ctx(ctx1, &config);
+
+	__atomic_store_n(&rcu_test_stop, 0, __ATOMIC_RELEASE);
+	for(i = 0; i < CMD3_RCU_TEST_READERS; i++)
+		pthread_create(&readers[i], NULL, rcu_test_reader, ctx1);
+
+	for(i = 0; i < CMD3_RCU_TEST_ITERATIONS; i++)
+	{
+		cmdtree_d cmdtree;
+
+		sprintf(name, "cmdtest.%d", i % 64);
+		config.name    = name;
+		config.cmdfunc = cmdtest2;
+		cmdtree = cmdtree_create_ctx(ctx1, &config);
+
+		if(0 == i % 1000)
+			cmdtree_freeze_ctx(ctx1);
+
+		cmdtree_destroy(cmdtree);
+	}
+
+	__atomic_store_n(&rcu_test_stop, 1, __ATOMIC_RELEASE);
+	for(i = 0; i < CMD3_RCU_TEST_READERS; i++)
+	{
+		void *failures;
+
+		pthread_join(readers[i], &failures);
+		LONGS_EQUAL(0, (long)failures);
+	}
+}
+
+TEST(cmd3_ctx, concurrent_exec_while_destroying_subtrees__readers_see_consistent_tree)
+{
+	pthread_t readers[CMD3_RCU_TEST_READERS];
+	cmdtree_config_t config;
+	cmdtree_d cmdtree;
+	int i, j;
+
+	memset(&config, 0, sizeof(config));
+	config.name    = "cmdtest";
+	config.comment = "cmd test";
+	cmdtree = cmdtree_create_ctx(ctx1, &config);
+
+	config.name    = "cmdtest.static";
+	config.cmdfunc = cmdtest1;
+	cmdtree_create_under(cmdtree, &config);
+
+	__atomic_store_n(&rcu_test_stop, 0, __ATOMIC_RELEASE);
+	for(i = 0; i < CMD3_RCU_TEST_READERS; i++)
+		pthread_create(&readers[i], NULL, rcu_test_reader, ctx1);
+
+	for(i = 0; i < CMD3_RCU_TEST_ITERATIONS / 10; i++)
+	{
+		cmdtree_d subtree, subtree1;
+
+		config.name    = "subtree";
+		config.cmdfunc = NULL;
+		subtree = cmdtree_create_under(cmdtree, &config);
+		config.name    = "subtree.1";
+		subtree1 = cmdtree_create_under(subtree, &config);
+
+		config.cmdfunc = cmdtest1;
+		for(j = 0; j < 8; j++)
+		{
+			config.name = j ? "leaf.other" : "leaf";
+			cmdtree_create_under(j < 4 ? subtree1 : subtree, &config);
+		}
+
+		LONGS_EQUAL(CMD3_SUCCESS, cmdtree_destroy_subtree(subtree));
+	}
+
+	__atomic_store_n(&rcu_test_stop, 1, __ATOMIC_RELEASE);
+	for(i = 0; i < CMD3_RCU_TEST_READERS; i++)
+	{
+		void *failures;
+
+		pthread_join(readers[i], &failures);
+		LONGS_EQUAL(0, (long)failures);
+	}
+}
+